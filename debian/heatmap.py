@@ -1,7 +1,7 @@
 #! /usr/bin/env python2
 
 from PIL import Image, ImageDraw, ImageFont
-import sys, gzip, math, colorsys, datetime
+import sys, gzip, math, colorsys, datetime, struct, time
 from collections import defaultdict
 from itertools import *
 
@@ -15,6 +15,42 @@ raw_data = lambda: open(path)
 if path.endswith('.gz'):
     raw_data = lambda: gzip.open(path, 'rb')
 
+def csv_rows():
+    for line in raw_data():
+        line = [s.strip() for s in line.strip().split(',')]
+        yield [line[0], line[1]] + [float(s) for s in line[2:] if s]
+
+def binary_rows():
+    # rtl_power -o f32/i16, see binary_open() in rtl_power.c
+    f = raw_data()
+    header = f.read(88)
+    (magic, version, header_len, record_len, fmt, tune_count, bins,
+        fft_len, interval, peak_hold, reserved, crop, window) = \
+        struct.unpack('<8s10Id32s', header)
+    tunes = [struct.unpack('<dII', f.read(16)) for i in range(tune_count)]
+    rows_at = (8 + 4*tune_count + 7) & ~7
+    kind, scale = ('f', 1.0) if fmt == 1 else ('h', 0.01)
+    size = struct.calcsize(kind)
+    while True:
+        record = f.read(record_len)
+        if len(record) < record_len:
+            break
+        stamp = struct.unpack('<q', record[:8])[0]
+        day, clock = time.strftime('%Y-%m-%d %H:%M:%S', time.localtime(stamp)).split()
+        samples = struct.unpack('<%iI' % tune_count, record[8:8+4*tune_count])
+        for i, (step, low, high) in enumerate(tunes):
+            # not integrated in this record, its levels are nan or the floor
+            if samples[i] == 0:
+                continue
+            at = rows_at + i*bins*size
+            zs = struct.unpack('<%i%s' % (bins, kind), record[at:at+bins*size])
+            yield [day, clock, low, high, step, samples[i]] + [z*scale for z in zs]
+
+def rows():
+    if raw_data().read(8) == 'RTLPOWER':
+        return binary_rows()
+    return csv_rows()
+
 def frange(start, stop, step):
     i = 0
     while (i*step + start <= stop):
@@ -30,10 +66,7 @@ labels = set()
 min_z = 0
 max_z = -100
 start, stop = None, None
-for line in raw_data():
-    line = [s.strip() for s in line.strip().split(',')]
-    line = [line[0], line[1]] + [float(s) for s in line[2:] if s]
-
+for line in rows():
     low = line[2]
     high = line[3]
     step = line[4]
@@ -81,9 +114,7 @@ print("drawing")
 img = Image.new("RGB", (len(freqs), len(times)))
 pix = img.load()
 x_size = img.size[0]
-for line in raw_data():
-    line = [s.strip() for s in line.strip().split(',')]
-    line = [line[0], line[1]] + [float(s) for s in line[2:] if s]
+for line in rows():
     t = line[0] + ' ' + line[1]
     if t not in times:
         continue  # happens with live files
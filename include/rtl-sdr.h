@@ -52,6 +52,14 @@ RTLSDR_API int rtlsdr_get_device_usb_strings(uint32_t index,
 /*!
  * Get device index by USB serial string descriptor.
  *
+ * A serial of the form "file[,fast][,loop]:path" instead gives the index
+ * of a virtual device that replays the 8 bit I/Q capture at path. It is
+ * paced at the sample rate set, or with fast as quickly as it is read,
+ * and with loop it starts over at the end. All tuning calls succeed and
+ * are only recorded. Without loop, the end of the capture ends
+ * rtlsdr_read_async() and makes rtlsdr_read_sync() fail like a lost
+ * device does.
+ *
  * \param serial serial string of the device
  * \return device index of first device where the name matched
  * \return -1 if name is NULL
@@ -144,6 +152,23 @@ RTLSDR_API int rtlsdr_read_eeprom(rtlsdr_dev_t *dev, uint8_t *data,
 
 RTLSDR_API int rtlsdr_set_center_freq(rtlsdr_dev_t *dev, uint32_t freq);
 
+/*!
+ * Make rtlsdr_set_center_freq() cheap enough for scanning. The I2C
+ * repeater stays on between calls and the R820T/R828D driver only sends
+ * tuner registers that change, coalesced into bursts. It also remembers
+ * the mux and PLL settings of every frequency it has locked on, and
+ * replays them on the next visit. Other tuners only get the repeater.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param on 1 to enable, 0 to disable (default) and forget the tunes
+ * \param freqs optional hop list, each one is tuned once now so a
+ *		sweep starts with all of them known, NULL otherwise
+ * \param n number of frequencies in freqs
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_set_fast_hop(rtlsdr_dev_t *dev, int on,
+				   const uint32_t *freqs, uint32_t n);
+
 /*!
  * Get actual frequency the device is tuned to.
  *
@@ -179,6 +204,53 @@ enum rtlsdr_tuner {
 	RTLSDR_TUNER_R828D
 };
 
+/*!
+ * One entry of a device list snapshot.
+ */
+typedef struct rtlsdr_dev_info {
+	uint32_t index;		/* for rtlsdr_open(), valid while the bus is unchanged */
+	uint16_t vid;
+	uint16_t pid;
+	uint8_t bus;
+	uint8_t address;
+	uint8_t port_depth;	/* 0 if libusb can't tell the port path */
+	uint8_t ports[7];	/* port path from the root hub */
+	const char *name;	/* known device name */
+	char manufact[256];
+	char product[256];
+	char serial[256];
+	int usb_error;		/* libusb error opening it for the strings, 0 if none */
+	enum rtlsdr_tuner tuner_type; /* RTLSDR_TUNER_UNKNOWN unless known */
+} rtlsdr_dev_info_t;
+
+/*!
+ * Scan the bus once for every supported device.
+ *
+ * The strings of each device are read on the way. The tuner type is the one
+ * found when this process last opened the dongle in that port, a caller that
+ * remembers it elsewhere may fill it in before rtlsdr_open_info().
+ *
+ * \param list set to an array of entries, free it with rtlsdr_free_device_list()
+ * \return number of entries, or negative on error
+ */
+RTLSDR_API int rtlsdr_get_device_list(rtlsdr_dev_info_t **list);
+
+RTLSDR_API void rtlsdr_free_device_list(rtlsdr_dev_info_t *list);
+
+/*!
+ * Open the device of a list entry.
+ *
+ * The device is looked up by its port, so indices shifting after the
+ * snapshot don't matter. With info->tuner_type set, a single read checks
+ * for that tuner instead of probing for all of them in turn, and the full
+ * probe only runs if that tuner doesn't answer.
+ *
+ * \param dev set to the opened device handle
+ * \param info entry from rtlsdr_get_device_list()
+ * \return 0 on success, -1 if the device is no longer there
+ */
+RTLSDR_API int rtlsdr_open_info(rtlsdr_dev_t **dev, const rtlsdr_dev_info_t *info);
+
 /*!
  * Get the tuner type.
  *
@@ -372,6 +444,125 @@ RTLSDR_API int rtlsdr_read_async(rtlsdr_dev_t *dev,
 				 uint32_t buf_num,
 				 uint32_t buf_len);
 
+/*!
+ * Let the library run the USB events of the following asynchronous reads
+ * in its own high priority thread. A completed transfer is resubmitted at
+ * once with a spare buffer while the filled one waits in a queue for the
+ * callback, which then runs in the thread that called rtlsdr_read_async().
+ * When depth buffers are waiting, new ones are dropped and the next buffer
+ * is flagged RTLSDR_BUF_DISCONTINUITY.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param depth number of spare buffers, 0 (default) runs the callback
+ *		from the event loop
+ * \return 0 on success, -2 while streaming
+ */
+RTLSDR_API int rtlsdr_set_async_queue(rtlsdr_dev_t *dev, uint32_t depth);
+
+/*!
+ * Let the library size the transfers of the following asynchronous reads
+ * from the sample rate instead of buf_num and buf_len, which become upper
+ * bounds. No more than max_us of samples are held in the transfers, about
+ * an eighth of it in each. While streaming, a transfer is added when
+ * completions come late enough that less than one was left to spare, and
+ * one is held back again after ten seconds with two to spare all along.
+ * The buffers of rtlsdr_set_async_queue() come on top of this.
+ *
+ * Transfers are never shorter than 4096 bytes and at least two stay
+ * submitted, so a target below 4096 samples holds that much instead,
+ * about 1.7 ms at 2.4 MS/s.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param max_us buffering latency in microseconds, 0 (default) to use
+ *		buf_num and buf_len as they are
+ * \return 0 on success, -2 while streaming
+ */
+RTLSDR_API int rtlsdr_set_latency_target(rtlsdr_dev_t *dev, uint32_t max_us);
+
+/* flags of rtlsdr_buffer_info_t */
+/* a transfer was lost or completed out of order before this buffer */
+#define RTLSDR_BUF_DISCONTINUITY	0x01
+/* transfers failed or could not be resubmitted since the last buffer */
+#define RTLSDR_BUF_XFER_ERROR		0x02
+/* the transfer returned less than buf_len */
+#define RTLSDR_BUF_SHORT		0x04
+
+/* sample_index counts what the stream should have delivered.  A transfer
+ * that failed, or that the queue had no room for, still counts buf_len/2
+ * samples, so every loss shows up as a gap before the next buffer. */
+typedef struct rtlsdr_buffer_info {
+	uint64_t sample_index;	/* I/Q samples in this stream before this buffer */
+	uint64_t timestamp_ns;	/* host monotonic clock when the transfer completed */
+	uint32_t flags;		/* RTLSDR_BUF_* */
+	uint32_t xfer_errors;	/* failed transfers since the last buffer */
+} rtlsdr_buffer_info_t;
+
+typedef void(*rtlsdr_read_async_ex_cb_t)(unsigned char *buf, uint32_t len,
+					 const rtlsdr_buffer_info_t *info, void *ctx);
+
+/*!
+ * Same as rtlsdr_read_async(), but the callback also receives the position
+ * of the buffer in the stream, its capture time and any sign of lost data.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param cb callback function to return received samples and their metadata
+ * \param ctx user specific context to pass via the callback function
+ * \param buf_num optional buffer count, see rtlsdr_read_async()
+ * \param buf_len optional buffer length, see rtlsdr_read_async()
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_read_async_ex(rtlsdr_dev_t *dev,
+				    rtlsdr_read_async_ex_cb_t cb,
+				    void *ctx,
+				    uint32_t buf_num,
+				    uint32_t buf_len);
+
+typedef struct rtlsdr_stream_stats {
+	uint64_t buffers;	/* buffers handed to the callback */
+	uint64_t samples;	/* I/Q samples handed to the callback */
+	uint64_t xfer_errors;	/* failed or not resubmitted transfers */
+	uint64_t discontinuities; /* buffers flagged RTLSDR_BUF_DISCONTINUITY */
+	uint64_t short_xfers;	/* buffers flagged RTLSDR_BUF_SHORT */
+	uint64_t queue_drops;	/* buffers lost to a full rtlsdr_set_async_queue() */
+	uint32_t queue_high_water; /* most buffers waiting for the callback */
+	uint32_t xfer_len;	/* bytes per transfer of the current stream */
+	uint32_t xfers;		/* transfers submitted, see the latency target */
+	uint64_t xfer_grows;	/* transfers added by the latency target */
+	uint64_t xfer_shrinks;	/* transfers held back by the latency target */
+} rtlsdr_stream_stats_t;
+
+/*!
+ * Get the counters accumulated by the asynchronous reads since the device
+ * was opened. May be called from any thread while streaming.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param stats filled with the current counters
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_get_stream_stats(rtlsdr_dev_t *dev, rtlsdr_stream_stats_t *stats);
+
+#define RTLSDR_CB_HIST_LEN	20
+
+typedef struct rtlsdr_callback_stats {
+	uint64_t calls;		/* callbacks run */
+	uint64_t total_ns;	/* time spent in them */
+	uint64_t max_ns;	/* longest one */
+	/* hist[i] counts callbacks of at most 2^i us, the last one all the
+	 * longer ones */
+	uint64_t hist[RTLSDR_CB_HIST_LEN];
+} rtlsdr_callback_stats_t;
+
+/*!
+ * Get how long the callback of the asynchronous reads took since the
+ * device was opened. A callback slower than a buffer of samples is why
+ * transfers get lost. May be called from any thread while streaming.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param stats filled with the current durations
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_get_callback_stats(rtlsdr_dev_t *dev, rtlsdr_callback_stats_t *stats);
+
 /*!
  * Cancel all pending asynchronous operations on the device.
  *
@@ -0,0 +1,231 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RTL_SDR_DSP_H
+#define __RTL_SDR_DSP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <rtl-sdr_export.h>
+
+/* the fixed point kernels the rtl_* tools are built from.  samples are
+ * interleaved I/Q, int16_t after conversion, and every length counts
+ * int16_t values (or bytes for raw u8 input), not I/Q pairs. */
+
+#ifndef rtlsdr_STATIC
+#	ifdef rtlsdr_dsp_EXPORTS
+#	define RTLSDR_DSP_API __SDR_EXPORT
+#	else
+#	define RTLSDR_DSP_API __SDR_IMPORT
+#	endif
+#else
+#define RTLSDR_DSP_API
+#endif
+
+enum rtlsdr_dsp_isa {
+	RTLSDR_DSP_C = 0,
+	RTLSDR_DSP_SSE2,
+	RTLSDR_DSP_AVX2,
+	RTLSDR_DSP_NEON,
+};
+
+enum rtlsdr_dsp_disc {
+	RTLSDR_DSP_DISC_STD = 0,   /* atan2() */
+	RTLSDR_DSP_DISC_FAST,      /* rtlsdr_dsp_fast_atan2() */
+	RTLSDR_DSP_DISC_LUT,       /* arctangent table */
+};
+
+/* the most halfband passes rtlsdr_dsp_cic_droop() has taps for */
+#define RTLSDR_DSP_CIC_MAX	10
+
+/*!
+ * Pick the instruction set the kernels use. The widest one the cpu
+ * runs is picked without this, it is for comparing them against each
+ * other. Not safe while other threads are inside a kernel.
+ *
+ * \param isa one of enum rtlsdr_dsp_isa, -1 for the widest
+ * \return the isa now in use, -1 if this build or cpu lacks it
+ */
+RTLSDR_DSP_API int rtlsdr_dsp_set_isa(int isa);
+
+RTLSDR_DSP_API int rtlsdr_dsp_get_isa(void);
+
+/*!
+ * \param isa one of enum rtlsdr_dsp_isa
+ * \return a short lowercase name like "avx2", NULL if unknown
+ */
+RTLSDR_DSP_API const char *rtlsdr_dsp_isa_name(int isa);
+
+/*!
+ * Convert raw u8 samples to int16_t, centered on 0.
+ *
+ * \param buf raw I/Q as the dongle delivers it
+ * \param out len values
+ * \param len bytes, even
+ * \param rotate also mix down by fs/4, 1+0j, 0+1j, -1+0j, 0-1j
+ */
+RTLSDR_DSP_API void rtlsdr_dsp_convert(const uint8_t *buf, int16_t *out,
+				       uint32_t len, int rotate);
+
+/*!
+ * Squared magnitude of raw u8 samples, i*i + q*q after centering.
+ *
+ * \param buf raw I/Q as the dongle delivers it
+ * \param mag len/2 values
+ * \param len bytes
+ */
+RTLSDR_DSP_API void rtlsdr_dsp_magnitude(const uint8_t *buf, uint16_t *mag, int len);
+
+/*!
+ * Subtract the mean of I from I and the mean of Q from Q.
+ *
+ * \param iq samples, changed in place
+ * \param len values, even
+ */
+RTLSDR_DSP_API void rtlsdr_dsp_remove_dc(int16_t *iq, int len);
+
+/*!
+ * Fifth order halfband lowpass and decimate by 2, in place. Output m is
+ * the 1 5 10 10 5 1 sum of samples 2m-5 .. 2m, shifted by 4 so that a
+ * little resolution is gained.
+ *
+ * \param iq samples, the first len/2 values are the output
+ * \param len values, a multiple of 4
+ * \param hist 10 values carried between blocks, zeroed before the first,
+ *        or NULL for a single block that holds its first sample before it
+ */
+RTLSDR_DSP_API void rtlsdr_dsp_fifth_order(int16_t *iq, int len, int16_t *hist);
+
+/*!
+ * 9 tap fir that flattens the droop of several rtlsdr_dsp_fifth_order()
+ * passes, in place. Delays by 5 samples.
+ *
+ * \param iq samples
+ * \param len values, even
+ * \param passes halfband passes before, up to RTLSDR_DSP_CIC_MAX
+ * \param hist 18 values carried between blocks, zeroed before the first,
+ *        or NULL for a single block that starts with 9 unfiltered samples
+ * \return 0 on success, -1 if there are no taps for passes
+ */
+RTLSDR_DSP_API int rtlsdr_dsp_cic_droop(int16_t *iq, int len, int passes, int16_t *hist);
+
+/*!
+ * Integer approximation of atan2(), within about 0.07 rad.
+ *
+ * \return the angle, pi is 1<<14
+ */
+RTLSDR_DSP_API int rtlsdr_dsp_fast_atan2(int y, int x);
+
+/*!
+ * Phase of a times the conjugate of b.
+ *
+ * \param mode one of enum rtlsdr_dsp_disc
+ * \return the angle, pi is 1<<14
+ */
+RTLSDR_DSP_API int rtlsdr_dsp_polar_disc(int ar, int aj, int br, int bj, int mode);
+
+/*!
+ * FM demodulate a block, one output per I/Q pair.
+ *
+ * \param iq samples
+ * \param len values, even
+ * \param out len/2 values, may not overlap iq
+ * \param prev the last I/Q pair of the previous block, updated
+ * \param mode one of enum rtlsdr_dsp_disc
+ */
+RTLSDR_DSP_API void rtlsdr_dsp_fm_disc(const int16_t *iq, int len, int16_t *out,
+				       int16_t *prev, int mode);
+
+/*!
+ * Fill an FFT window.
+ *
+ * \param name rectangle, hamming, blackman, blackman-harris,
+ *        hann-poisson, youssef, kaiser or bartlett
+ * \param w len coefficients, NULL to only check the name
+ * \param len window length
+ * \return 0 on success, -1 if name is unknown
+ */
+RTLSDR_DSP_API int rtlsdr_dsp_window(const char *name, double *w, int len);
+
+typedef struct rtlsdr_dsp_fft rtlsdr_dsp_fft_t;
+
+/*!
+ * \param name fixed (16 bit fix_fft) or float
+ * \return 0 if there is a backend of that name, -1 otherwise
+ */
+RTLSDR_DSP_API int rtlsdr_dsp_fft_backend(const char *name);
+
+/*!
+ * Set up a power spectrum of 2^bin_e bins. A plan is used by one thread
+ * at a time.
+ *
+ * \param backend see rtlsdr_dsp_fft_backend()
+ * \param bin_e log2 of the fft size
+ * \return the plan, NULL on error
+ */
+RTLSDR_DSP_API rtlsdr_dsp_fft_t *rtlsdr_dsp_fft_plan(const char *backend, int bin_e);
+
+/*!
+ * Power spectrum |X|^2, scaled by 1/n^2 like fix_fft halving every stage.
+ *
+ * \param p a plan from rtlsdr_dsp_fft_plan()
+ * \param iq 2^bin_e windowed I/Q pairs, clobbered
+ * \param pwr 2^bin_e bins, DC first
+ */
+RTLSDR_DSP_API void rtlsdr_dsp_fft_power(rtlsdr_dsp_fft_t *p, int16_t *iq, int64_t *pwr);
+
+RTLSDR_DSP_API void rtlsdr_dsp_fft_destroy(rtlsdr_dsp_fft_t *p);
+
+typedef struct rtlsdr_dsp_resampler rtlsdr_dsp_resampler_t;
+
+/*!
+ * Set up a polyphase resampler for a real signal, a blackman windowed
+ * sinc at the lower of the two rates. Ratios finer than 1/1024 round
+ * to the nearest phase below.
+ *
+ * \param rate_in input sample rate
+ * \param rate_out output sample rate
+ * \return the resampler, NULL on error
+ */
+RTLSDR_DSP_API rtlsdr_dsp_resampler_t *rtlsdr_dsp_resampler_create(int rate_in, int rate_out);
+
+/*!
+ * Forget the history, the next output lands on the next input.
+ */
+RTLSDR_DSP_API void rtlsdr_dsp_resampler_reset(rtlsdr_dsp_resampler_t *r);
+
+/*!
+ * \param r a resampler from rtlsdr_dsp_resampler_create()
+ * \param in len samples
+ * \param len samples
+ * \param out room for out_max samples, may be in
+ * \param out_max outputs past this are lost
+ * \return outputs written
+ */
+RTLSDR_DSP_API int rtlsdr_dsp_resample(rtlsdr_dsp_resampler_t *r, const int16_t *in,
+				       int len, int16_t *out, int out_max);
+
+RTLSDR_DSP_API void rtlsdr_dsp_resampler_destroy(rtlsdr_dsp_resampler_t *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RTL_SDR_DSP_H */
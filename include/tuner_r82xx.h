@@ -41,6 +41,11 @@
 
 #define VER_NUM			49
 
+/* tunes remembered in fast hop mode without a hop list */
+#define R82XX_HOP_CACHE		64
+/* registers set by the mux and pll programming */
+#define R82XX_HOP_REGS		10
+
 enum r82xx_chip {
 	CHIP_R820T,
 	CHIP_R620D,
@@ -72,6 +77,13 @@ struct r82xx_config {
 	int use_predetect;
 };
 
+struct r82xx_hop {
+	uint32_t	lo_freq;	/* Hz, 0 for an unused slot */
+	uint32_t	xtal;
+	uint8_t		xtal_cap_sel;
+	uint8_t		val[R82XX_HOP_REGS];
+};
+
 struct r82xx_priv {
 	struct r82xx_config		*cfg;
 
@@ -91,6 +103,14 @@ struct r82xx_priv {
 
 	uint32_t			bw;	/* in MHz */
 
+	/* fast hop mode, see r82xx_set_fast_hop() */
+	int				fast_hop;
+	int				batch;	/* writes only go to the shadow */
+	uint32_t			dirty;	/* shadow registers the batch changed */
+	struct r82xx_hop		*hops;
+	unsigned int			hop_count;
+	unsigned int			hop_next;
+
 	void *rtl_dev;
 };
 
@@ -116,5 +136,6 @@ int r82xx_init(struct r82xx_priv *priv);
 int r82xx_set_freq(struct r82xx_priv *priv, uint32_t freq);
 int r82xx_set_gain(struct r82xx_priv *priv, int set_manual_gain, int gain);
 int r82xx_set_bandwidth(struct r82xx_priv *priv, int bandwidth,  uint32_t rate);
+int r82xx_set_fast_hop(struct r82xx_priv *priv, int on, unsigned int hops);
 
 #endif
@@ -0,0 +1,392 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include "getopt/getopt.h"
+#define _USE_MATH_DEFINES
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define BENCH_TSC
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define BENCH_TSC
+#endif
+
+#include "rtl-sdr.h"
+#include "rtl-sdr_dsp.h"
+#include "convenience/convenience.h"
+#include "bench.h"
+
+#define DEFAULT_SECONDS		1.0
+#define DEFAULT_MIN_TIME	0.5
+#define MIN_RUNS		3
+#define GOLDEN_MAX		256
+
+struct golden
+{
+	char name[64];
+	uint32_t digest;
+};
+
+struct bench_input bench_in;
+
+static struct
+{
+	double min_time;
+	double ghz;            /* for cycles without a tsc */
+	char *only;
+	char *check;
+	char *record;
+	struct golden golden[GOLDEN_MAX];
+	int golden_len;
+	struct golden seen[GOLDEN_MAX];
+	int seen_len;
+	int cases;
+	int checks;
+	int failures;
+	uint32_t seed;
+} b;
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"%s, offline benchmark of the rtl-sdr dsp\n\n"
+		"Use:\t%s [-options]\n"
+		"\t[-f capture.cu8 (default: synthetic input)]\n"
+		"\t[-s sample_rate of the capture]\n"
+		"\t[-n seconds of input (default: 1)]\n"
+		"\t[-t seconds to run each case (default: 0.5)]\n"
+		"\t[-k only run cases containing this string]\n"
+		"\t[-g golden_file to check the outputs against]\n"
+		"\t[-w golden_file to record the outputs into]\n"
+		"\t[-c cpu_ghz for cycles/sample without a cycle counter]\n"
+		"\t (on x86 cycles are tsc reference cycles)\n\n"
+		"Golden files only match for the same input and options.\n",
+		name, name);
+	exit(1);
+}
+
+uint32_t bench_random(void)
+/* xorshift, the same sequence everywhere */
+{
+	b.seed ^= b.seed << 13;
+	b.seed ^= b.seed >> 17;
+	b.seed ^= b.seed << 5;
+	return b.seed;
+}
+
+static double noise_sample(void)
+/* sum of four uniforms, close enough to gaussian, unit variance */
+{
+	int i;
+	double sum = 0;
+	for (i=0; i<4; i++) {
+		sum += (double)(bench_random() >> 8) / (double)(1 << 24) - 0.5;}
+	return sum * sqrt(3.0);
+}
+
+static uint8_t quantize(double v)
+{
+	v = floor(v + 127.5 + 0.5);
+	if (v < 0) {
+		return 0;}
+	if (v > 255) {
+		return 255;}
+	return (uint8_t)v;
+}
+
+void bench_tone(uint8_t *iq, int len, uint32_t rate, double freq,
+		double dev, double amp, double noise)
+{
+	int i;
+	double phase = 0, mod = 0;
+	for (i=0; i+1<len; i+=2) {
+		iq[i]   = quantize(amp * cos(phase) + noise * noise_sample());
+		iq[i+1] = quantize(amp * sin(phase) + noise * noise_sample());
+		phase += 2 * M_PI * (freq + dev * sin(mod)) / rate;
+		mod += 2 * M_PI * 1000.0 / rate;
+		phase = fmod(phase, 2 * M_PI);
+		mod = fmod(mod, 2 * M_PI);
+	}
+}
+
+static void load_golden(char *filename)
+{
+	FILE *f;
+	struct golden *g;
+	f = fopen(filename, "r");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s\n", filename);
+		exit(1);
+	}
+	while (b.golden_len < GOLDEN_MAX) {
+		g = &b.golden[b.golden_len];
+		if (fscanf(f, "%63s %x", g->name, &g->digest) != 2) {
+			break;}
+		b.golden_len++;
+	}
+	fclose(f);
+}
+
+static void load_input(char *filename, double seconds)
+{
+	FILE *f;
+	int want;
+	want = (int)(seconds * bench_in.rate) * 2;
+	bench_in.iq = malloc(want);
+	if (!bench_in.iq) {
+		fprintf(stderr, "Error: malloc.\n");
+		exit(1);
+	}
+	f = fopen(filename, "rb");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s\n", filename);
+		exit(1);
+	}
+	bench_in.len = (int)fread(bench_in.iq, 1, want, f) & ~1;
+	fclose(f);
+	if (bench_in.len < (1 << 16)) {
+		fprintf(stderr, "%s is too short to benchmark with.\n", filename);
+		exit(1);
+	}
+}
+
+void bench_init(int argc, char **argv, const char *name, uint32_t rate,
+		void (*synth)(uint8_t *iq, int len, uint32_t rate))
+{
+	int opt;
+	char *filename = NULL;
+	double seconds = DEFAULT_SECONDS;
+	memset(&b, 0, sizeof(b));
+	b.min_time = DEFAULT_MIN_TIME;
+	b.seed = 0x2832;
+	bench_in.rate = rate;
+	while ((opt = getopt(argc, argv, "f:s:n:t:k:g:w:c:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			filename = optarg;
+			break;
+		case 's':
+			bench_in.rate = (uint32_t)atofs(optarg);
+			break;
+		case 'n':
+			seconds = atoft(optarg);
+			break;
+		case 't':
+			b.min_time = atoft(optarg);
+			break;
+		case 'k':
+			b.only = optarg;
+			break;
+		case 'g':
+			b.check = optarg;
+			break;
+		case 'w':
+			b.record = optarg;
+			break;
+		case 'c':
+			b.ghz = atof(optarg);
+			break;
+		case 'h':
+		default:
+			usage(name);
+			break;
+		}
+	}
+	if (b.check) {
+		load_golden(b.check);}
+	if (filename) {
+		load_input(filename, seconds);
+	} else {
+		bench_in.len = (int)(seconds * bench_in.rate) * 2;
+		bench_in.iq = malloc(bench_in.len);
+		if (!bench_in.iq) {
+			fprintf(stderr, "Error: malloc.\n");
+			exit(1);
+		}
+		synth(bench_in.iq, bench_in.len, bench_in.rate);
+		bench_in.synthetic = 1;
+	}
+	fprintf(stderr, "Input: %s, %i samples at %u S/s\n",
+		filename ? filename : "synthetic", bench_in.len / 2, bench_in.rate);
+	fprintf(stderr, "%-28s %6s %10s %10s %12s\n",
+		"case", "runs", "MS/s", "ns/sample", "cycles/sample");
+}
+
+int bench_want(const char *name)
+{
+	return !b.only || strstr(name, b.only) != NULL;
+}
+
+static double now_s(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+static uint64_t cycles(void)
+{
+#ifdef BENCH_TSC
+	return (uint64_t)__rdtsc();
+#else
+	return 0;
+#endif
+}
+
+void bench_time(const char *name, void (*setup)(void *ctx),
+		void (*run)(void *ctx), void *ctx, uint64_t samples)
+{
+	int runs = 0;
+	double t, spent = 0, ns;
+	uint64_t c, ticks = 0;
+	if (!bench_want(name)) {
+		return;}
+	/* warm the caches and any lazy init */
+	if (setup) {
+		setup(ctx);}
+	run(ctx);
+	while (runs < MIN_RUNS || spent < b.min_time) {
+		if (setup) {
+			setup(ctx);}
+		t = now_s();
+		c = cycles();
+		run(ctx);
+		ticks += cycles() - c;
+		spent += now_s() - t;
+		runs++;
+	}
+	ns = spent * 1e9 / ((double)samples * runs);
+	fprintf(stderr, "%-28s %6i %10.2f %10.3f ", name, runs, 1e3 / ns, ns);
+	if (ticks) {
+		fprintf(stderr, "%12.2f\n", (double)ticks / ((double)samples * runs));
+	} else if (b.ghz > 0) {
+		fprintf(stderr, "%12.2f\n", ns * b.ghz);
+	} else {
+		fprintf(stderr, "%12s\n", "-");}
+	b.cases++;
+}
+
+static uint32_t fnv1a(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint32_t h = 0x811c9dc5;
+	size_t i;
+	for (i=0; i<len; i++) {
+		h ^= p[i];
+		h *= 0x01000193;
+	}
+	return h;
+}
+
+void bench_digest(const char *name, const void *data, size_t len)
+{
+	int i;
+	uint32_t h;
+	struct golden *g;
+	if (!bench_want(name)) {
+		return;}
+	h = fnv1a(data, len);
+	if (b.seen_len < GOLDEN_MAX) {
+		g = &b.seen[b.seen_len++];
+		strncpy(g->name, name, sizeof(g->name) - 1);
+		g->digest = h;
+	}
+	if (!b.check) {
+		return;}
+	for (i=0; i<b.golden_len; i++) {
+		if (strcmp(b.golden[i].name, name) != 0) {
+			continue;}
+		b.checks++;
+		if (b.golden[i].digest != h) {
+			fprintf(stderr, "FAIL %s: digest %08x, golden %08x\n",
+				name, h, b.golden[i].digest);
+			b.failures++;
+		}
+		return;
+	}
+	fprintf(stderr, "%s has no golden digest\n", name);
+}
+
+void bench_check(const char *name, int ok, const char *why)
+{
+	if (!bench_want(name)) {
+		return;}
+	b.checks++;
+	if (ok) {
+		return;}
+	fprintf(stderr, "FAIL %s: %s\n", name, why);
+	b.failures++;
+}
+
+void bench_same(const char *name, const void *ref, const void *out, size_t len)
+{
+	bench_check(name, memcmp(ref, out, len) == 0, "differs from the reference");
+}
+
+int bench_next_isa(int isa)
+{
+	for (isa++; isa<=RTLSDR_DSP_NEON; isa++) {
+		if (rtlsdr_dsp_set_isa(isa) == isa) {
+			return isa;}
+	}
+	rtlsdr_dsp_set_isa(-1);
+	return -1;
+}
+
+void bench_close16(const char *name, const int16_t *ref, const int16_t *out,
+		   int len, int tol)
+{
+	int i, worst = 0, d;
+	char why[64];
+	for (i=0; i<len; i++) {
+		d = abs(ref[i] - out[i]);
+		if (d > worst) {
+			worst = d;}
+	}
+	snprintf(why, sizeof(why), "off by %i, allowed %i", worst, tol);
+	bench_check(name, worst <= tol, why);
+}
+
+int bench_finish(void)
+{
+	int i;
+	FILE *f;
+	if (b.record) {
+		f = fopen(b.record, "w");
+		if (!f) {
+			fprintf(stderr, "Failed to open %s\n", b.record);
+			return 1;
+		}
+		for (i=0; i<b.seen_len; i++) {
+			fprintf(f, "%s %08x\n", b.seen[i].name, b.seen[i].digest);}
+		fclose(f);
+	}
+	fprintf(stderr, "%i cases, %i checks, %i failed\n",
+		b.cases, b.checks, b.failures);
+	return b.failures ? 1 : 0;
+}
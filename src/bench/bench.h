@@ -0,0 +1,127 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* offline benchmark harness shared by the rtl_bench_* programs.
+ * each of those includes the tool it measures, so the kernels run
+ * exactly as built into the tool */
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct bench_input
+{
+	uint8_t *iq;       /* raw u8 i/q, as the dongle delivers it */
+	int len;           /* bytes */
+	uint32_t rate;
+	int synthetic;
+};
+
+extern struct bench_input bench_in;
+
+/*!
+ * Parse the common options and load the input, exits on errors
+ *
+ * \param name of the program, for usage
+ * \param rate default sample rate of the input
+ * \param synth fills a synthetic capture when no file is given
+ */
+
+void bench_init(int argc, char **argv, const char *name, uint32_t rate,
+		void (*synth)(uint8_t *iq, int len, uint32_t rate));
+
+/*!
+ * Fill with a tone plus gaussian-ish noise, repeatable across hosts
+ *
+ * \param iq buffer of u8 i/q pairs
+ * \param len bytes
+ * \param rate sample rate
+ * \param freq tone offset in Hz, may be negative
+ * \param dev fm deviation in Hz of a 1 kHz modulating tone, 0 for a carrier
+ * \param amp tone amplitude, 0-127
+ * \param noise noise amplitude, 0-127
+ */
+
+void bench_tone(uint8_t *iq, int len, uint32_t rate, double freq,
+		double dev, double amp, double noise);
+
+/*!
+ * Repeatable random numbers for building synthetic captures
+ */
+
+uint32_t bench_random(void);
+
+/*!
+ * Whether a case selected by -k should run
+ */
+
+int bench_want(const char *name);
+
+/*!
+ * Time a kernel and report its throughput
+ *
+ * \param name case name, also used for the golden digest
+ * \param setup restores the input before every run, not timed, may be NULL
+ * \param run the kernel
+ * \param ctx passed to both
+ * \param samples i/q samples one run consumes
+ */
+
+void bench_time(const char *name, void (*setup)(void *ctx),
+		void (*run)(void *ctx), void *ctx, uint64_t samples);
+
+/*!
+ * Record or check the output of a case against the golden file
+ */
+
+void bench_digest(const char *name, const void *data, size_t len);
+
+/*!
+ * Compare an optimized kernel against its reference, exactly
+ */
+
+void bench_same(const char *name, const void *ref, const void *out, size_t len);
+
+/*!
+ * Compare int16 output against a reference within tol
+ */
+
+void bench_close16(const char *name, const int16_t *ref, const int16_t *out,
+		   int len, int tol);
+
+/*!
+ * Step through the simd builds of the rtlsdr_dsp kernels this cpu runs,
+ * to compare each against the c reference
+ *
+ * \param isa the last one, RTLSDR_DSP_C to start
+ * \return the one now in use, -1 after the last with the widest restored
+ */
+
+int bench_next_isa(int isa);
+
+/*!
+ * Count a self check, and report why when it failed
+ */
+
+void bench_check(const char *name, int ok, const char *why);
+
+/*!
+ * Write the golden file and print the summary
+ *
+ * \return exit status, 0 when every check passed
+ */
+
+int bench_finish(void);
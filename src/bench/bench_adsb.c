@@ -0,0 +1,302 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* rtl_adsb front end kernels and the decoder the way demod_thread_fn()
+ * runs it.  the default input is noise with a DF17 frame every ms or
+ * so, a quarter of them with one bit flipped */
+
+#define main rtl_adsb_main
+#include "../rtl_adsb.c"
+#undef main
+
+#include "bench.h"
+
+#define BLOCK			(DEFAULT_BUF_LENGTH / 2)  /* samples per dongle buffer */
+#define FRAME_SPACING		2000
+#define FRAME_LEN		(preamble_len + 2*long_frame)
+#define PULSE_AMP		50
+#define MAX_FOUND		65536
+#define MISS_RATIO		1000  /* one frame in this many may be lost */
+
+struct front_case
+{
+	int (*find_fn)(uint16_t *buf, int i, int end, uint16_t thr);
+	uint16_t *mag;
+	int mag_len;
+	uint16_t thr;
+	int *found;
+	int found_len;
+	int *floors;       /* one per block */
+	int floors_len;
+};
+
+struct decode_case
+{
+	uint16_t *work;     /* CARRY_LEN of tail, then a block */
+	long out_len;
+};
+
+/* what synth() put in, for the self checks */
+static int injected, flipped;
+
+static void pulse(uint8_t *iq, int k, double phase)
+/* one sample of carrier on top of the noise already there */
+{
+	int v;
+	v = iq[2*k] + (int)lrint(PULSE_AMP * cos(phase));
+	iq[2*k] = (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+	v = iq[2*k+1] + (int)lrint(PULSE_AMP * sin(phase));
+	iq[2*k+1] = (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+static void put_frame(uint8_t *iq, int k, uint8_t *msg)
+/* preamble, then 112 bits of ppm at 2 samples per bit */
+{
+	int i, bit;
+	double phase = (double)(bench_random() % 628) / 100.0;
+	pulse(iq, k, phase);
+	pulse(iq, k + 2, phase);
+	pulse(iq, k + 7, phase);
+	pulse(iq, k + 9, phase);
+	for (i=0; i<long_frame; i++) {
+		bit = (msg[i/8] >> (7 - i%8)) & 1;
+		pulse(iq, k + preamble_len + 2*i + !bit, phase);
+	}
+}
+
+static void synth(uint8_t *iq, int len, uint32_t rate)
+{
+	uint8_t msg[long_frame/8];
+	uint32_t crc;
+	int i, k, n = len / 2 - len / 2 % BLOCK;
+	bench_tone(iq, len, rate, 0, 0, 0, 4);
+	injected = flipped = 0;
+	/* only whole blocks get decoded, and the tail of the last one
+	 * waits for more that never comes */
+	for (k=FRAME_SPACING; k + FRAME_LEN + CARRY_LEN < n; k+=FRAME_SPACING) {
+		k += (int)(bench_random() % 500);
+		msg[0] = (uint8_t)(17 << 3 | 5);
+		for (i=1; i<11; i++) {
+			msg[i] = (uint8_t)bench_random();}
+		msg[11] = msg[12] = msg[13] = 0;
+		crc = modes_crc(msg, long_frame);
+		msg[11] = (uint8_t)(crc >> 16);
+		msg[12] = (uint8_t)(crc >> 8);
+		msg[13] = (uint8_t)crc;
+		if (injected % 4 == 3) {
+			i = 5 + (int)(bench_random() % (long_frame - 5));
+			msg[i/8] ^= (uint8_t)(0x80 >> (i%8));
+			flipped++;
+		}
+		put_frame(iq, k, msg);
+		injected++;
+	}
+}
+
+static void run_magnitude(void *ctx)
+{
+	struct front_case *c = ctx;
+	int i;
+	for (i=0; i+2*BLOCK<=bench_in.len; i+=2*BLOCK) {
+		rtlsdr_dsp_magnitude(bench_in.iq + i, c->mag + i/2, 2*BLOCK);}
+}
+
+static void run_floor(void *ctx)
+{
+	struct front_case *c = ctx;
+	int i;
+	c->floors_len = 0;
+	for (i=0; i+BLOCK<=c->mag_len; i+=BLOCK) {
+		c->floors[c->floors_len++] = noise_floor(c->mag + i, BLOCK);}
+}
+
+static void run_find(void *ctx)
+/* every start index that passes, the decoder would skip some */
+{
+	struct front_case *c = ctx;
+	int i = 0, end = c->mag_len - preamble_len;
+	c->found_len = 0;
+	while (c->found_len < MAX_FOUND) {
+		i = c->find_fn(c->mag, i, end, c->thr);
+		if (i >= end) {
+			break;}
+		c->found[c->found_len++] = i++;
+	}
+}
+
+static void setup_decode(void *ctx)
+{
+	struct decode_case *c = ctx;
+	memset(icao_seen, 0, sizeof(icao_seen));
+	memset(&counts, 0, sizeof(counts));
+	rewind(file);
+	c->out_len = 0;
+}
+
+static void run_decode(void *ctx)
+/* the callback and demod_thread_fn() without the ring between them */
+{
+	struct decode_case *c = ctx;
+	uint16_t carry[CARRY_LEN];
+	uint16_t *mag = c->work + CARRY_LEN;
+	int i, total, start = 0, stop, thr;
+	uint64_t pos = 0;
+	memset(carry, 0, sizeof(carry));
+	total = CARRY_LEN + BLOCK;
+	for (i=0; i+2*BLOCK<=bench_in.len; i+=2*BLOCK) {
+		rtlsdr_dsp_magnitude(bench_in.iq + i, mag, 2*BLOCK);
+		memcpy(c->work, carry, sizeof(carry));
+		memcpy(carry, c->work + total - CARRY_LEN, sizeof(carry));
+		thr = PREAMBLE_SNR * noise_floor(mag, BLOCK);
+		if (thr > 65535) {
+			thr = 65535;}
+		stop = manchester(c->work, start, total - CARRY_LEN, total,
+			(uint16_t)thr, pos - CARRY_LEN);
+		start = stop - (total - CARRY_LEN);
+		if (start < 0) {
+			start = 0;}
+		pos += BLOCK;
+	}
+	c->out_len = ftell(file);
+}
+
+static void bench_magnitude(struct front_case *c, uint16_t *ref_mag)
+/* every simd build of the library kernel against the c one */
+{
+	char name[64];
+	uint16_t *mag = c->mag;
+	int isa = RTLSDR_DSP_C;
+	c->mag = malloc(c->mag_len * sizeof(uint16_t));
+	while ((isa = bench_next_isa(isa)) >= 0) {
+		snprintf(name, sizeof(name), "magnitude/%s", rtlsdr_dsp_isa_name(isa));
+		bench_time(name, NULL, run_magnitude, c, c->mag_len);
+		bench_same(name, ref_mag, c->mag, c->mag_len * sizeof(uint16_t));
+	}
+	free(c->mag);
+	c->mag = mag;
+}
+
+static void bench_find(struct front_case *c, const char *kind,
+			int *ref_found, int ref_len)
+/* the simd flavour set in c against the c reference */
+{
+	char name[64];
+	snprintf(name, sizeof(name), "find_preamble/%s", kind);
+	bench_time(name, NULL, run_find, c, c->mag_len);
+	bench_check(name, c->found_len == ref_len &&
+		memcmp(c->found, ref_found, ref_len * sizeof(int)) == 0,
+		"finds other preambles than c");
+}
+
+static void bench_decode(const char *name, int beast)
+{
+	struct decode_case c;
+	uint8_t *text;
+	char why[96];
+	if (!bench_want(name)) {
+		return;}
+	beast_output = beast;
+	c.work = malloc((CARRY_LEN + BLOCK) * sizeof(uint16_t));
+	bench_time(name, setup_decode, run_decode, &c, bench_in.len / 2);
+	fflush(file);
+	text = malloc(c.out_len + 1);
+	rewind(file);
+	c.out_len = (long)fread(text, 1, c.out_len, file);
+	bench_digest(name, text, c.out_len);
+	if (bench_in.synthetic) {
+		snprintf(why, sizeof(why), "%u accepted (%u corrected), %i sent (%i flipped)",
+			counts.accepted, counts.corrected, injected, flipped);
+		/* noise just ahead of a frame can pass for its preamble now and
+		 * then and take the frame with it, nothing that isn't sent may
+		 * come out though */
+		bench_check(name, counts.accepted <= (uint32_t)injected &&
+			counts.corrected <= (uint32_t)flipped &&
+			counts.accepted >= (uint32_t)(injected - injected / MISS_RATIO), why);
+	}
+	free(text);
+	free(c.work);
+}
+
+int main(int argc, char **argv)
+{
+	struct front_case c;
+	uint16_t *ref_mag;
+	int *ref_found;
+	int ref_len;
+	crc_init();
+	bench_init(argc, argv, "rtl_bench_adsb", ADSB_RATE, synth);
+	memset(&c, 0, sizeof(c));
+	c.mag_len = (bench_in.len / (2*BLOCK)) * BLOCK;
+	if (!c.mag_len) {
+		fprintf(stderr, "Need at least %i samples of input.\n", BLOCK);
+		exit(1);
+	}
+	ref_mag = malloc(c.mag_len * sizeof(uint16_t));
+	ref_found = malloc(MAX_FOUND * sizeof(int));
+	c.floors = malloc(c.mag_len / BLOCK * sizeof(int));
+
+	/* the c kernels are the reference, also when -k skips them */
+	c.mag = ref_mag;
+	rtlsdr_dsp_set_isa(RTLSDR_DSP_C);
+	c.find_fn = find_preamble_c;
+	run_magnitude(&c);
+	run_floor(&c);
+	c.thr = (uint16_t)(PREAMBLE_SNR * c.floors[0]);
+	bench_time("magnitude/c", NULL, run_magnitude, &c, c.mag_len);
+	bench_digest("magnitude", ref_mag, c.mag_len * sizeof(uint16_t));
+	bench_time("noise_floor", NULL, run_floor, &c, c.mag_len);
+	bench_digest("noise_floor", c.floors, c.floors_len * sizeof(int));
+	c.found = ref_found;
+	run_find(&c);
+	ref_len = c.found_len;
+	c.found = malloc(MAX_FOUND * sizeof(int));
+	bench_time("find_preamble/c", NULL, run_find, &c, c.mag_len);
+	bench_digest("find_preamble", ref_found, ref_len * sizeof(int));
+	bench_magnitude(&c, ref_mag);
+#ifdef FRONT_SSE2
+	c.find_fn = find_preamble_sse2;
+	bench_find(&c, "sse2", ref_found, ref_len);
+#endif
+#ifdef FRONT_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		c.find_fn = find_preamble_avx2;
+		bench_find(&c, "avx2", ref_found, ref_len);
+	}
+#endif
+#ifdef FRONT_NEON
+	c.find_fn = find_preamble_neon;
+	bench_find(&c, "neon", ref_found, ref_len);
+#endif
+
+	/* the whole decoder with the kernels rtl_adsb would pick */
+	front_end_init();
+	file = tmpfile();
+	if (!file) {
+		fprintf(stderr, "Failed to open a temporary file\n");
+		exit(1);
+	}
+	bench_decode("decode/text", 0);
+	bench_decode("decode/beast", 1);
+	fclose(file);
+
+	free(ref_mag);
+	free(ref_found);
+	free(c.found);
+	free(c.floors);
+	return bench_finish();
+}
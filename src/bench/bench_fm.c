@@ -0,0 +1,329 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* rtl_fm kernels and the wbfm pipeline, block by block like the dongle
+ * delivers them.  the default input is a 1 kHz tone at 75 kHz deviation
+ * on the carrier rtl_fm would tune to */
+
+#define main rtl_fm_main
+#include "../rtl_fm.c"
+#undef main
+
+#include "bench.h"
+
+#define BLOCK			DEFAULT_BUF_LENGTH  /* bytes per dongle buffer */
+#define SYNTH_RATE		1020000             /* -M wbfm capture rate */
+#define FAST_TOLERANCE		400
+
+struct buffer_case
+/* kernels that work in place on a copy of src */
+{
+	const int16_t *src;
+	int16_t *work;
+	int len;
+	int16_t hist[18];
+	int passes;
+};
+
+struct demod_case
+{
+	struct demod_state *base;
+	struct buffer_case *src;   /* decimated input of the single kernels */
+	int16_t *out;
+	int out_len;
+};
+
+static struct demod_state pristine;
+
+static void synth(uint8_t *iq, int len, uint32_t rate)
+{
+	bench_tone(iq, len, rate, -(double)rate / 4, 75000, 60, 6);
+}
+
+static int blocks(int len, int block)
+{
+	return len - len % block;
+}
+
+static void run_convert(void *ctx)
+{
+	int16_t *out = ctx;
+	int i, len = blocks(bench_in.len, BLOCK);
+	for (i=0; i<len; i+=BLOCK) {
+		rtlsdr_dsp_convert(bench_in.iq + i, out + i, BLOCK, 1);}
+}
+
+static void setup_buffer(void *ctx)
+{
+	struct buffer_case *c = ctx;
+	memcpy(c->work, c->src, c->len * sizeof(int16_t));
+	memset(c->hist, 0, sizeof(c->hist));
+}
+
+static void run_fifth(void *ctx)
+{
+	struct buffer_case *c = ctx;
+	int i, p, n, out = 0;
+	/* each pass halves the block, like full_demod */
+	for (i=0; i<c->len; i+=BLOCK) {
+		n = BLOCK;
+		for (p=0; p<c->passes; p++) {
+			rtlsdr_dsp_fifth_order(c->work + i, n, demod.lp_hist[p]);
+			n >>= 1;
+		}
+		memmove(c->work + out, c->work + i, n * sizeof(int16_t));
+		out += n;
+	}
+}
+
+static void setup_fifth(void *ctx)
+{
+	setup_buffer(ctx);
+	memset(demod.lp_hist, 0, sizeof(demod.lp_hist));
+}
+
+static void run_fir(void *ctx)
+{
+	struct buffer_case *c = ctx;
+	int i, n = BLOCK >> c->passes;
+	for (i=0; i+n<=c->len; i+=n) {
+		rtlsdr_dsp_cic_droop(c->work + i, n, c->passes, c->hist);}
+}
+
+static void setup_demod(void *ctx)
+{
+	struct demod_case *c = ctx;
+	demod = *c->base;
+	if (demod.resample) {
+		rtlsdr_dsp_resampler_reset(demod.resample);}
+	c->out_len = 0;
+}
+
+static void run_disc(void *ctx)
+/* fm_demod over the decimated signal in buffer_case sized blocks */
+{
+	struct demod_case *c = ctx;
+	struct buffer_case *src = c->src;
+	int i, n = BLOCK >> src->passes;
+	for (i=0; i+n<=src->len; i+=n) {
+		demod.lowpassed = src->work + i;
+		demod.lp_len = n;
+		demod.result = c->out + c->out_len;
+		fm_demod(&demod);
+		c->out_len += demod.result_len;
+	}
+}
+
+static void run_resample(void *ctx)
+/* the fm_demod output in the blocks full_demod would have */
+{
+	struct demod_case *c = ctx;
+	struct buffer_case *src = c->src;
+	int i, n = (BLOCK >> src->passes) / 2;
+	for (i=0; i+n<=src->len; i+=n) {
+		c->out_len += rtlsdr_dsp_resample(demod.resample, src->work + i, n,
+			c->out + c->out_len, bench_in.len - c->out_len);
+	}
+}
+
+static void run_pipeline(void *ctx)
+/* what the demod thread does with every dongle buffer */
+{
+	struct demod_case *c = ctx;
+	int i, len = blocks(bench_in.len, BLOCK);
+	int16_t *block = demod.input.data;
+	for (i=0; i<len; i+=BLOCK) {
+		rtlsdr_dsp_convert(bench_in.iq + i, block, BLOCK, 1);
+		demod.lowpassed = block;
+		demod.lp_len = BLOCK;
+		demod.result = c->out + c->out_len;
+		full_demod(&demod);
+		c->out_len += demod.result_len;
+	}
+}
+
+static void wbfm_settings(int passes)
+/* -M wbfm [-F 9] at whatever rate the input has */
+{
+	demod.mode_demod = &fm_demod;
+	demod.custom_atan = RTLSDR_DSP_DISC_FAST;
+	demod.deemph = 1;
+	demod.squelch_level = 0;
+	demod.downsample_passes = passes;
+	demod.comp_fir_size = passes ? 9 : 0;
+	demod.downsample = passes ? 1 << passes : 6;
+	demod.rate_in = demod.rate_out = bench_in.rate / demod.downsample;
+	demod.rate_out2 = 32000;
+	demod.output_scale = 1;
+	demod.deemph_a = (int)round(1.0/((1.0-exp(-1.0/(demod.rate_out * 75e-6)))));
+	rtlsdr_dsp_resampler_destroy(demod.resample);
+	demod.resample = rtlsdr_dsp_resampler_create(demod.rate_out, demod.rate_out2);
+}
+
+static void bench_convert(int16_t *ref)
+{
+	int16_t *out = malloc(bench_in.len * sizeof(int16_t));
+	size_t len = blocks(bench_in.len, BLOCK) * sizeof(int16_t);
+	char name[64];
+	int isa = rtlsdr_dsp_set_isa(RTLSDR_DSP_C);
+	bench_time("convert/c", NULL, run_convert, out, bench_in.len / 2);
+	memcpy(ref, out, bench_in.len * sizeof(int16_t));
+	bench_digest("convert", ref, len);
+	while ((isa = bench_next_isa(isa)) >= 0) {
+		snprintf(name, sizeof(name), "convert/%s", rtlsdr_dsp_isa_name(isa));
+		bench_time(name, NULL, run_convert, out, bench_in.len / 2);
+		bench_same(name, ref, out, len);
+	}
+	free(out);
+}
+
+static void bench_fifth(struct buffer_case *c, int16_t *ref)
+{
+	int n = c->len >> c->passes;
+	char name[64];
+	int isa = rtlsdr_dsp_set_isa(RTLSDR_DSP_C);
+	bench_time("fifth_order/c", setup_fifth, run_fifth, c, c->len / 2);
+	memcpy(ref, c->work, n * sizeof(int16_t));
+	bench_digest("fifth_order", ref, n * sizeof(int16_t));
+	while ((isa = bench_next_isa(isa)) >= 0) {
+		snprintf(name, sizeof(name), "fifth_order/%s", rtlsdr_dsp_isa_name(isa));
+		bench_time(name, setup_fifth, run_fifth, c, c->len / 2);
+		bench_same(name, ref, c->work, n * sizeof(int16_t));
+	}
+	/* fifth_order output is the input of what follows */
+	c->len = n;
+}
+
+static void bench_disc(struct demod_case *c, int mode, const char *kind, int16_t *ref)
+/* the simd products and divisions against the scalar ones, -A kind */
+{
+	int16_t *own = ref ? NULL : malloc(bench_in.len * sizeof(int16_t));
+	char name[64];
+	int isa = rtlsdr_dsp_set_isa(RTLSDR_DSP_C);
+	if (!ref) {
+		ref = own;}
+	c->base->custom_atan = mode;
+	snprintf(name, sizeof(name), "fm_demod/%s/c", kind);
+	bench_time(name, setup_demod, run_disc, c, c->src->len / 2);
+	memcpy(ref, c->out, c->out_len * sizeof(int16_t));
+	snprintf(name, sizeof(name), "fm_demod/%s", kind);
+	bench_digest(name, ref, c->out_len * sizeof(int16_t));
+	while ((isa = bench_next_isa(isa)) >= 0) {
+		snprintf(name, sizeof(name), "fm_demod/%s/%s", kind, rtlsdr_dsp_isa_name(isa));
+		bench_time(name, setup_demod, run_disc, c, c->src->len / 2);
+		bench_same(name, ref, c->out, c->out_len * sizeof(int16_t));
+	}
+	free(own);
+}
+
+static void bench_resample(struct demod_case *c, int rate)
+/* the simd dot products against the c one, they add the same integers */
+{
+	rtlsdr_dsp_resampler_t *audio = pristine.resample;
+	int16_t *ref;
+	int ref_len;
+	char name[64];
+	int isa = rtlsdr_dsp_set_isa(RTLSDR_DSP_C);
+	pristine.resample = rtlsdr_dsp_resampler_create(pristine.rate_out, rate);
+	snprintf(name, sizeof(name), "resample/%i/c", rate);
+	bench_time(name, setup_demod, run_resample, c, c->src->len);
+	ref = malloc(c->out_len * sizeof(int16_t));
+	ref_len = c->out_len;
+	memcpy(ref, c->out, ref_len * sizeof(int16_t));
+	snprintf(name, sizeof(name), "resample/%i", rate);
+	bench_digest(name, ref, ref_len * sizeof(int16_t));
+	while ((isa = bench_next_isa(isa)) >= 0) {
+		snprintf(name, sizeof(name), "resample/%i/%s", rate, rtlsdr_dsp_isa_name(isa));
+		bench_time(name, setup_demod, run_resample, c, c->src->len);
+		bench_same(name, ref, c->out, ref_len * sizeof(int16_t));
+	}
+	rtlsdr_dsp_resampler_destroy(pristine.resample);
+	pristine.resample = audio;
+	free(ref);
+}
+
+int main(int argc, char **argv)
+{
+	struct buffer_case buf;
+	struct demod_case dc;
+	int16_t *conv, *decim, *std;
+	int len;
+	dongle_init(&dongle);
+	demod_init(&demod);
+	output_init(&output);
+	bench_init(argc, argv, "rtl_bench_fm", SYNTH_RATE, synth);
+	len = blocks(bench_in.len, BLOCK);
+
+	conv = malloc(bench_in.len * sizeof(int16_t));
+	decim = malloc(bench_in.len * sizeof(int16_t));
+	std = malloc(bench_in.len * sizeof(int16_t));
+	dc.out = malloc(bench_in.len * sizeof(int16_t));
+	buf.work = malloc(bench_in.len * sizeof(int16_t));
+	bench_convert(conv);
+
+	/* three halfband passes, -F 9 at 8x oversampling */
+	buf.src = conv;
+	buf.len = len;
+	buf.passes = 3;
+	bench_fifth(&buf, decim);
+
+	memcpy(buf.work, decim, buf.len * sizeof(int16_t));
+	buf.src = decim;
+	bench_time("cic_droop", setup_buffer, run_fir, &buf, buf.len / 2);
+	bench_digest("cic_droop", buf.work, buf.len * sizeof(int16_t));
+
+	/* discriminators on the decimated signal */
+	setup_buffer(&buf);
+	wbfm_settings(3);
+	pristine = demod;
+	dc.base = &pristine;
+	dc.src = &buf;
+	bench_disc(&dc, RTLSDR_DSP_DISC_STD, "std", std);
+	bench_disc(&dc, RTLSDR_DSP_DISC_FAST, "fast", NULL);
+	bench_close16("fm_demod/fast", std, dc.out, dc.out_len, FAST_TOLERANCE);
+	/* no tolerance check, -A lut has always answered pi instead of 0
+	 * when |cj| << 8 < |cr|.  the digest pins it */
+	bench_disc(&dc, RTLSDR_DSP_DISC_LUT, "lut", NULL);
+
+	/* audio rate conversion of the std output */
+	memcpy(buf.work, std, dc.out_len * sizeof(int16_t));
+	buf.len = dc.out_len;
+	buf.passes = 0;
+	bench_resample(&dc, 48000);
+	bench_resample(&dc, 44100);
+
+	/* the whole demod thread, boxcar and halfband decimation */
+	demod = pristine;
+	wbfm_settings(0);
+	pristine = demod;
+	bench_time("pipeline/wbfm", setup_demod, run_pipeline, &dc, len / 2);
+	bench_digest("pipeline/wbfm", dc.out, dc.out_len * sizeof(int16_t));
+	demod = pristine;
+	wbfm_settings(3);
+	pristine = demod;
+	bench_time("pipeline/wbfm-F9", setup_demod, run_pipeline, &dc, len / 2);
+	bench_digest("pipeline/wbfm-F9", dc.out, dc.out_len * sizeof(int16_t));
+
+	free(conv);
+	free(decim);
+	free(std);
+	free(dc.out);
+	free(buf.work);
+	demod_cleanup(&demod);
+	output_cleanup(&output);
+	return bench_finish();
+}
@@ -0,0 +1,274 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* rtl_power kernels and whole hops through fft_tune().  the default
+ * input is a carrier 300 kHz above center in noise */
+
+#define main rtl_power_main
+#include "../rtl_power.c"
+#undef main
+
+#include "bench.h"
+
+#define SYNTH_RATE		2000000
+#define FFT_E			10
+#define PEAK_DB			1.0
+
+static const char *windows[] = {"rectangle", "hamming", "blackman",
+	"blackman-harris", "hann-poisson", "youssef", "kaiser", "bartlett", NULL};
+
+struct kernel_case
+{
+	int16_t *src;
+	int16_t *work;
+	int len;
+	int bin_e;
+	rtlsdr_dsp_fft_t *plan;
+	int64_t *pwr;      /* summed over every fft of the input */
+	int64_t *one;
+	const char *window;
+	double *shape;
+	int *coefs;
+};
+
+struct hop_case
+{
+	struct tuning_state *ts;
+	struct fft_worker wk;
+};
+
+static void synth(uint8_t *iq, int len, uint32_t rate)
+{
+	bench_tone(iq, len, rate, 300000, 0, 40, 8);
+}
+
+static void run_window(void *ctx)
+{
+	struct kernel_case *c = ctx;
+	int i, n = 1 << c->bin_e;
+	rtlsdr_dsp_window(c->window, c->shape, n);
+	for (i=0; i<n; i++) {
+		c->coefs[i] = (int)(256*c->shape[i]);}
+}
+
+static void setup_work(void *ctx)
+{
+	struct kernel_case *c = ctx;
+	memcpy(c->work, c->src, c->len * sizeof(int16_t));
+	if (c->pwr) {
+		memset(c->pwr, 0, (1 << c->bin_e) * sizeof(int64_t));}
+}
+
+static void run_fft(void *ctx)
+{
+	struct kernel_case *c = ctx;
+	int i, j, n = 1 << c->bin_e;
+	for (i=0; i+2*n<=c->len; i+=2*n) {
+		rtlsdr_dsp_fft_power(c->plan, c->work + i, c->one);
+		for (j=0; j<n; j++) {
+			c->pwr[j] += c->one[j];}
+	}
+}
+
+static void run_downsample(void *ctx)
+{
+	struct kernel_case *c = ctx;
+	int i, n = DEFAULT_BUF_LENGTH;
+	for (i=0; i+n<=c->len; i+=n) {
+		rtlsdr_dsp_fifth_order(c->work + i, n, NULL);}
+}
+
+static void run_fir(void *ctx)
+{
+	struct kernel_case *c = ctx;
+	int i, n = DEFAULT_BUF_LENGTH;
+	for (i=0; i+n<=c->len; i+=n) {
+		rtlsdr_dsp_cic_droop(c->work + i, n, 3, NULL);}
+}
+
+static void run_dc(void *ctx)
+{
+	struct kernel_case *c = ctx;
+	int i, n = DEFAULT_BUF_LENGTH;
+	for (i=0; i+n<=c->len; i+=n) {
+		rtlsdr_dsp_remove_dc(c->work + i, n);}
+}
+
+static void setup_hop(void *ctx)
+{
+	struct hop_case *c = ctx;
+	memset(c->ts->avg, 0, (1 << c->ts->bin_e) * sizeof(long));
+	c->ts->samples = 0;
+}
+
+static void run_hop(void *ctx)
+/* what a worker does with every hop read from the dongle */
+{
+	struct hop_case *c = ctx;
+	uint8_t *buf8 = c->ts->buf8;
+	int i;
+	for (i=0; i+c->ts->buf_len<=bench_in.len; i+=c->ts->buf_len) {
+		c->ts->buf8 = bench_in.iq + i;
+		fft_tune(c->ts, &c->wk);
+	}
+	c->ts->buf8 = buf8;
+}
+
+static void digest_longs(const char *name, long *v, int n)
+/* as int64, so 32 and 64 bit hosts share golden files */
+{
+	int i;
+	int64_t *w = malloc(n * sizeof(int64_t));
+	for (i=0; i<n; i++) {
+		w[i] = (int64_t)v[i];}
+	bench_digest(name, w, n * sizeof(int64_t));
+	free(w);
+}
+
+static int peak_bin(int64_t *pwr, int n)
+{
+	int i, best = 0;
+	for (i=1; i<n; i++) {
+		if (pwr[i] > pwr[best]) {
+			best = i;}
+	}
+	return best;
+}
+
+static void bench_fft(struct kernel_case *c)
+{
+	int n = 1 << c->bin_e;
+	int fixed_peak;
+	int64_t fixed_level;
+	int64_t *fixed_pwr;
+	double db;
+	char why[64];
+	fixed_pwr = malloc(n * sizeof(int64_t));
+	c->plan = rtlsdr_dsp_fft_plan("fixed", c->bin_e);
+	/* the reference, whichever cases -k picked */
+	setup_work(c);
+	run_fft(c);
+	memcpy(fixed_pwr, c->pwr, n * sizeof(int64_t));
+	bench_time("fft/fixed", setup_work, run_fft, c, c->len / 2);
+	bench_digest("fft/fixed", fixed_pwr, n * sizeof(int64_t));
+	rtlsdr_dsp_fft_destroy(c->plan);
+	/* the float fft rounds differently on every simd target, so it
+	 * is checked against fixed instead of a digest */
+	c->plan = rtlsdr_dsp_fft_plan("float", c->bin_e);
+	bench_time("fft/float", setup_work, run_fft, c, c->len / 2);
+	rtlsdr_dsp_fft_destroy(c->plan);
+	fixed_peak = peak_bin(fixed_pwr, n);
+	fixed_level = fixed_pwr[fixed_peak];
+	if (peak_bin(c->pwr, n) != fixed_peak || fixed_level <= 0) {
+		bench_check("fft/float", 0, "peak is not where fixed has it");
+	} else {
+		db = 10 * log10((double)c->pwr[fixed_peak] / (double)fixed_level);
+		snprintf(why, sizeof(why), "peak %.2f dB off fixed", db);
+		bench_check("fft/float", fabs(db) <= PEAK_DB, why);
+	}
+	free(fixed_pwr);
+}
+
+static void bench_hop(char *name, char *range, char *backend, int fir)
+/* a fresh frequency plan, like rtl_power -f range [-F 9] */
+{
+	struct hop_case c;
+	struct tuning_state *ts;
+	double *shape;
+	int i, n;
+	if (!bench_want(name)) {
+		return;}
+	boxcar = !fir;
+	comp_fir_size = fir;
+	/* frequency_range() parses in place */
+	range = strdup(range);
+	frequency_range(range, 0.0);
+	free(range);
+	ts = &tunes[0];
+	n = 1 << ts->bin_e;
+	fft_backend = backend;
+	free(window_coefs);
+	window_coefs = malloc(n * sizeof(int));
+	shape = malloc(n * sizeof(double));
+	rtlsdr_dsp_window("hamming", shape, n);
+	for (i=0; i<n; i++) {
+		window_coefs[i] = (int)(256*shape[i]);}
+	free(shape);
+	c.ts = ts;
+	c.wk.fft_buf = malloc(ts->buf_len * sizeof(int16_t));
+	c.wk.pwr = malloc(n * sizeof(int64_t));
+	c.wk.plan = rtlsdr_dsp_fft_plan(fft_backend, ts->bin_e);
+	bench_time(name, setup_hop, run_hop, &c, bench_in.len / 2);
+	if (strcmp(backend, "fixed") == 0) {
+		digest_longs(name, ts->avg, n);}
+	rtlsdr_dsp_fft_destroy(c.wk.plan);
+	free(c.wk.fft_buf);
+	free(c.wk.pwr);
+}
+
+int main(int argc, char **argv)
+{
+	struct kernel_case c;
+	char name[64];
+	int i, n;
+	bench_init(argc, argv, "rtl_bench_power", SYNTH_RATE, synth);
+	memset(&c, 0, sizeof(c));
+	c.bin_e = FFT_E;
+	n = 1 << c.bin_e;
+	c.len = bench_in.len;
+	c.src = malloc(c.len * sizeof(int16_t));
+	c.work = malloc(c.len * sizeof(int16_t));
+	c.coefs = malloc(n * sizeof(int));
+	c.shape = malloc(n * sizeof(double));
+	for (i=0; i<c.len; i++) {
+		c.src[i] = (int16_t)bench_in.iq[i] - 127;}
+
+	for (i=0; windows[i]; i++) {
+		c.window = windows[i];
+		snprintf(name, sizeof(name), "window/%s", windows[i]);
+		bench_time(name, NULL, run_window, &c, n);
+		bench_digest(name, c.coefs, n * sizeof(int));
+	}
+
+	c.pwr = malloc(n * sizeof(int64_t));
+	c.one = malloc(n * sizeof(int64_t));
+	bench_fft(&c);
+	free(c.pwr);
+	c.pwr = NULL;
+
+	bench_time("fifth_order", setup_work, run_downsample, &c, c.len / 2);
+	bench_digest("fifth_order", c.work, c.len * sizeof(int16_t));
+	bench_time("cic_droop", setup_work, run_fir, &c, c.len / 2);
+	bench_digest("cic_droop", c.work, c.len * sizeof(int16_t));
+	bench_time("remove_dc", setup_work, run_dc, &c, c.len / 2);
+	bench_digest("remove_dc", c.work, c.len * sizeof(int16_t));
+
+	/* whole hops, full rate and downsampled narrow scans */
+	bench_hop("hop/fixed", "100M:102M:1k", "fixed", 0);
+	bench_hop("hop/float", "100M:102M:1k", "float", 0);
+	bench_hop("hop/boxcar/fixed", "100M:100.2M:100", "fixed", 0);
+	bench_hop("hop/boxcar/float", "100M:100.2M:100", "float", 0);
+	bench_hop("hop/F9/fixed", "100M:100.2M:100", "fixed", 9);
+	bench_hop("hop/F9/float", "100M:100.2M:100", "float", 9);
+
+	free(c.src);
+	free(c.work);
+	free(c.coefs);
+	free(c.shape);
+	free(c.one);
+	return bench_finish();
+}
@@ -0,0 +1,40 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* loads and stores for the indices of the single producer, single
+ * consumer rings in the library and the tools.  each side only ever
+ * writes its own index, so acquire/release on those is enough */
+
+#ifdef _MSC_VER
+#include <windows.h>
+#define ring_load(p)		InterlockedCompareExchange((volatile LONG *)(p), 0, 0)
+#define ring_store(p, v)	InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+#else
+#define ring_load(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ring_store(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+/* 64 bit counters that order nothing, relaxed is enough */
+#ifdef _MSC_VER
+#define counter_add(p, n)	InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(n))
+#define counter_load(p)		((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(p), 0, 0))
+#define counter_store(p, v)	InterlockedExchange64((volatile LONG64 *)(p), (LONG64)(v))
+#else
+#define counter_add(p, n)	__atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+#define counter_load(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#define counter_store(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#endif
@@ -19,12 +19,20 @@
  * todo: use strtol for more flexible int parsing
  * */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #ifndef _WIN32
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #else
 #include <windows.h>
 #include <fcntl.h>
@@ -35,6 +43,24 @@
 #include <math.h>
 
 #include "rtl-sdr.h"
+#include "convenience.h"
+
+#define RT_STAGES		8
+#define RT_STACK_PREFAULT	(64 * 1024)
+
+struct rt_stage
+{
+	const char *name;
+	int cpu_lo, cpu_hi;    /* -1 leaves it to the os */
+	int priority;          /* SCHED_FIFO, 0 stays normal */
+};
+
+static struct
+{
+	int lock;
+	int len;
+	struct rt_stage stage[RT_STAGES];
+} rt;
 
 double atofs(char *s)
 /* standard suffixes */
@@ -245,64 +271,299 @@ int verbose_reset_buffer(rtlsdr_dev_t *dev)
 	return r;
 }
 
+int verbose_async_queue(rtlsdr_dev_t *dev, int depth)
+{
+	int r;
+	if (depth <= 0) {
+		return 0;}
+	r = rtlsdr_set_async_queue(dev, (uint32_t)depth);
+	if (r < 0) {
+		fprintf(stderr, "WARNING: Failed to set async queue.\n");
+	} else {
+		fprintf(stderr, "Queueing up to %i buffers for the callback.\n", depth);
+	}
+	return r;
+}
+
+int verbose_latency_target(rtlsdr_dev_t *dev, double ms)
+{
+	int r;
+	if (ms <= 0) {
+		return 0;}
+	r = rtlsdr_set_latency_target(dev, (uint32_t)(ms * 1000));
+	if (r < 0) {
+		fprintf(stderr, "WARNING: Failed to set latency target.\n");
+	} else {
+		fprintf(stderr, "Holding at most %.1f ms of samples in usb transfers.\n", ms);
+	}
+	return r;
+}
+
+int verbose_fast_hop(rtlsdr_dev_t *dev, uint32_t *freqs, int n)
+{
+	int r;
+	if (n < 2) {
+		return 0;}
+	r = rtlsdr_set_fast_hop(dev, 1, freqs, (uint32_t)n);
+	if (r < 0) {
+		fprintf(stderr, "WARNING: Failed to set fast retuning.\n");
+	} else {
+		fprintf(stderr, "Fast retuning over %i hops.\n", n);
+	}
+	return r;
+}
+
+/* buffers the smallest latency is taken over */
+#define CLOCK_WINDOW		64
+
+void stream_clock_init(struct stream_clock *c)
+{
+	c->zero_ns = UINT64_MAX;
+	c->window_ns = 0;
+	c->window_fill = 0;
+	c->synced = 0;
+}
+
+int stream_clock_update(struct stream_clock *c,
+	const rtlsdr_buffer_info_t *info, uint32_t n, uint32_t rate)
+{
+	uint64_t t, x;
+	/* split so the product stays in range for days of samples */
+	x = info->sample_index + n;
+	t = info->timestamp_ns - (x / rate) * 1000000000ULL -
+		(x % rate) * 1000000000ULL / rate;
+	if (c->window_fill == 0 || t < c->window_ns) {
+		c->window_ns = t;}
+	if (t < c->zero_ns) {
+		c->zero_ns = t;}
+	c->window_fill++;
+	if (c->window_fill < CLOCK_WINDOW) {
+		return 0;}
+	c->zero_ns = c->window_ns;
+	c->window_fill = 0;
+	if (c->synced) {
+		return 0;}
+	c->synced = 1;
+	return 1;
+}
+
+uint64_t stream_clock_index(const struct stream_clock *c, uint64_t ns, uint32_t rate)
+{
+	uint64_t x;
+	if (ns <= c->zero_ns) {
+		return 0;}
+	x = ns - c->zero_ns;
+	return (x / 1000000000ULL) * rate +
+		(x % 1000000000ULL) * rate / 1000000000ULL + 1;
+}
+
+static int match_serial(rtlsdr_dev_info_t *list, int device_count, char *s)
+/* exact, then prefix, then suffix match of a serial */
+{
+	int i, offset;
+	for (i = 0; i < device_count; i++) {
+		if (strcmp(s, list[i].serial) == 0) {
+			return i;}
+	}
+	for (i = 0; i < device_count; i++) {
+		if (strncmp(s, list[i].serial, strlen(s)) == 0) {
+			return i;}
+	}
+	for (i = 0; i < device_count; i++) {
+		offset = strlen(list[i].serial) - strlen(s);
+		if (offset < 0) {
+			continue;}
+		if (strncmp(s, list[i].serial+offset, strlen(s)) == 0) {
+			return i;}
+	}
+	return -1;
+}
+
 int verbose_device_search(char *s)
 {
-	int i, device_count, device, offset;
+	int i, device_count, device;
 	char *s2;
-	char vendor[256], product[256], serial[256];
-	device_count = rtlsdr_get_device_count();
-	if (!device_count) {
+	rtlsdr_dev_info_t *list;
+	if (strncmp(s, "file", 4) == 0) {
+		device = rtlsdr_get_index_by_serial(s);
+		if (device < 0) {
+			fprintf(stderr, "Not a replay, use file[,fast][,loop]:capture.cu8\n");
+			return -1;
+		}
+		fprintf(stderr, "Using %s\n", s);
+		return device;
+	}
+	/* one scan of the bus, the strings of every device come with it */
+	device_count = rtlsdr_get_device_list(&list);
+	if (device_count <= 0) {
+		rtlsdr_free_device_list(list);
 		fprintf(stderr, "No supported devices found.\n");
 		return -1;
 	}
 	fprintf(stderr, "Found %d device(s):\n", device_count);
 	for (i = 0; i < device_count; i++) {
-		rtlsdr_get_device_usb_strings(i, vendor, product, serial);
-		fprintf(stderr, "  %d:  %s, %s, SN: %s\n", i, vendor, product, serial);
+		fprintf(stderr, "  %d:  %s, %s, SN: %s\n", i,
+			list[i].manufact, list[i].product, list[i].serial);
 	}
 	fprintf(stderr, "\n");
 	/* does string look like raw id number */
 	device = (int)strtol(s, &s2, 0);
-	if (s2[0] == '\0' && device >= 0 && device < device_count) {
-		fprintf(stderr, "Using device %d: %s\n",
-			device, rtlsdr_get_device_name((uint32_t)device));
-		return device;
+	if (s2[0] != '\0' || device < 0 || device >= device_count) {
+		device = match_serial(list, device_count, s);}
+	if (device < 0) {
+		rtlsdr_free_device_list(list);
+		fprintf(stderr, "No matching devices found.\n");
+		return -1;
 	}
-	/* does string exact match a serial */
-	for (i = 0; i < device_count; i++) {
-		rtlsdr_get_device_usb_strings(i, vendor, product, serial);
-		if (strcmp(s, serial) != 0) {
-			continue;}
-		device = i;
-		fprintf(stderr, "Using device %d: %s\n",
-			device, rtlsdr_get_device_name((uint32_t)device));
-		return device;
+	fprintf(stderr, "Using device %d: %s\n", device, list[device].name);
+	rtlsdr_free_device_list(list);
+	return device;
+}
+
+static void rt_usage(const char *item, const char **stages)
+{
+	int i;
+	fprintf(stderr, "Bad scheduling option \"%s\", stages are", item);
+	for (i=0; stages[i]; i++) {
+		fprintf(stderr, " %s", stages[i]);}
+	fprintf(stderr, ", or lock.\n");
+}
+
+int rt_parse(char *spec, const char **stages)
+{
+	char *next, *value, *prio, *dash;
+	struct rt_stage *st;
+	int i;
+	for (; spec && *spec; spec = next) {
+		next = strchr(spec, ',');
+		if (next) {
+			*next++ = '\0';}
+		if (strcmp(spec, "lock") == 0) {
+			rt.lock = 1;
+			continue;
+		}
+		value = strchr(spec, '=');
+		if (value) {
+			*value++ = '\0';}
+		for (i=0; stages[i]; i++) {
+			if (strcmp(spec, stages[i]) == 0) {
+				break;}
+		}
+		if (!stages[i] || !value || rt.len >= RT_STAGES) {
+			rt_usage(spec, stages);
+			return -1;
+		}
+		st = &rt.stage[rt.len++];
+		st->name = stages[i];
+		st->cpu_lo = st->cpu_hi = -1;
+		st->priority = 0;
+		prio = strchr(value, ':');
+		if (prio) {
+			*prio++ = '\0';
+			st->priority = atoi(prio);
+		}
+		if (*value) {
+			st->cpu_lo = st->cpu_hi = atoi(value);
+			dash = strchr(value, '-');
+			if (dash) {
+				st->cpu_hi = atoi(dash + 1);}
+		}
+		if (st->cpu_hi < st->cpu_lo || st->priority < 0 || st->priority > 99) {
+			rt_usage(spec, stages);
+			return -1;
+		}
 	}
-	/* does string prefix match a serial */
-	for (i = 0; i < device_count; i++) {
-		rtlsdr_get_device_usb_strings(i, vendor, product, serial);
-		if (strncmp(s, serial, strlen(s)) != 0) {
-			continue;}
-		device = i;
-		fprintf(stderr, "Using device %d: %s\n",
-			device, rtlsdr_get_device_name((uint32_t)device));
-		return device;
+	return 0;
+}
+
+static void rt_prefault_stack(void)
+/* touch the stack this thread will grow into, so it does not page fault later */
+{
+	volatile unsigned char stack[RT_STACK_PREFAULT];
+	int i;
+	for (i=0; i<RT_STACK_PREFAULT; i+=1024) {
+		stack[i] = 0;}
+}
+
+int verbose_rt_lock(void)
+{
+#ifndef _WIN32
+	struct rlimit lim;
+#endif
+	if (!rt.lock) {
+		return 0;}
+#ifdef _WIN32
+	fprintf(stderr, "WARNING: Memory locking is not supported on Windows.\n");
+	return -1;
+#else
+	/* with MCL_FUTURE every allocation past the limit would fail */
+	if (geteuid() != 0 && getrlimit(RLIMIT_MEMLOCK, &lim) == 0 &&
+	    lim.rlim_cur != RLIM_INFINITY) {
+		fprintf(stderr, "WARNING: Not locking memory, the limit of %lu kB is too low"
+			" (ulimit -l unlimited).\n", (unsigned long)(lim.rlim_cur / 1024));
+		return -1;
 	}
-	/* does string suffix match a serial */
-	for (i = 0; i < device_count; i++) {
-		rtlsdr_get_device_usb_strings(i, vendor, product, serial);
-		offset = strlen(serial) - strlen(s);
-		if (offset < 0) {
-			continue;}
-		if (strncmp(s, serial+offset, strlen(s)) != 0) {
-			continue;}
-		device = i;
-		fprintf(stderr, "Using device %d: %s\n",
-			device, rtlsdr_get_device_name((uint32_t)device));
-		return device;
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		fprintf(stderr, "WARNING: Failed to lock memory.\n");
+		return -1;
 	}
-	fprintf(stderr, "No matching devices found.\n");
-	return -1;
+	rt_prefault_stack();
+	fprintf(stderr, "Locked memory.\n");
+	return 0;
+#endif
+}
+
+int verbose_rt_thread(const char *stage, int n)
+{
+	struct rt_stage *st = NULL;
+	int i, cpu, r = 0;
+#ifdef __linux__
+	cpu_set_t set;
+#endif
+#ifndef _WIN32
+	struct sched_param param;
+#endif
+	if (rt.lock) {
+		rt_prefault_stack();}
+	for (i=0; i<rt.len; i++) {
+		if (strcmp(rt.stage[i].name, stage) == 0) {
+			st = &rt.stage[i];}
+	}
+	if (!st) {
+		return 0;}
+	if (st->cpu_lo >= 0) {
+		cpu = st->cpu_lo + n % (st->cpu_hi - st->cpu_lo + 1);
+#if defined(__linux__)
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(_WIN32)
+		r = SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) ? 0 : -1;
+#else
+		r = -1;
+#endif
+		if (r) {
+			fprintf(stderr, "WARNING: Failed to pin %s to cpu %i.\n", stage, cpu);
+		} else {
+			fprintf(stderr, "Pinned %s to cpu %i.\n", stage, cpu);}
+	}
+	if (st->priority > 0) {
+#ifdef _WIN32
+		i = SetThreadPriority(GetCurrentThread(), st->priority >= 50 ?
+			THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_HIGHEST) ? 0 : -1;
+#else
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = st->priority;
+		i = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+#endif
+		if (i) {
+			fprintf(stderr, "WARNING: Failed to run %s at real-time priority %i"
+				" (needs CAP_SYS_NICE).\n", stage, st->priority);
+			r = -1;
+		} else {
+			fprintf(stderr, "Running %s at real-time priority %i.\n", stage, st->priority);}
+	}
+	return r;
 }
 
 // vim: tabstop=8:softtabstop=8:shiftwidth=8:noexpandtab
@@ -131,12 +131,127 @@ int verbose_ppm_set(rtlsdr_dev_t *dev, int ppm_error);
 
 int verbose_reset_buffer(rtlsdr_dev_t *dev);
 
+/*!
+ * Queue buffers between the usb events and the async callback and report
+ * status on stderr.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param depth number of queued buffers, 0 keeps the callback on the usb thread
+ * \return 0 on success
+ */
+
+int verbose_async_queue(rtlsdr_dev_t *dev, int depth);
+
+/*!
+ * Size the usb transfers for a latency target and report status on stderr.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param ms most milliseconds of samples to hold, 0 keeps the tool's sizes
+ * \return 0 on success
+ */
+
+int verbose_latency_target(rtlsdr_dev_t *dev, double ms);
+
+/*!
+ * Enable fast retuning over a hop list and report status on stderr.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param freqs the frequencies that will be hopped between
+ * \param n number of frequencies, fast retuning stays off below 2
+ * \return 0 on success
+ */
+
+int verbose_fast_hop(rtlsdr_dev_t *dev, uint32_t *freqs, int n);
+
+/*!
+ * Capture clock of an async stream, estimated from buffer timestamps.
+ *
+ * Completion times only ever run late, so the smallest latency over a
+ * window of buffers tracks when the samples were captured.
+ */
+
+struct stream_clock
+{
+	uint64_t zero_ns;	/* sample n was captured at zero_ns + n/rate */
+	uint64_t window_ns;
+	int window_fill;
+	int synced;		/* a whole window has been seen */
+};
+
+void stream_clock_init(struct stream_clock *c);
+
+/*!
+ * Feed one buffer of an rtlsdr_read_async_ex() stream to the clock.
+ *
+ * \param c the clock
+ * \param info the buffer's info as given to the callback
+ * \param n samples in the buffer
+ * \param rate sample rate of the stream
+ * \return 1 on the buffer that first completes a window, else 0
+ */
+
+int stream_clock_update(struct stream_clock *c,
+	const rtlsdr_buffer_info_t *info, uint32_t n, uint32_t rate);
+
+/*!
+ * The first sample captured after a point in time.
+ *
+ * \param c the clock
+ * \param ns CLOCK_MONOTONIC nanoseconds, like the buffer timestamps
+ * \param rate sample rate of the stream
+ * \return sample index, 0 for a time before the clock's zero
+ */
+
+uint64_t stream_clock_index(const struct stream_clock *c, uint64_t ns, uint32_t rate);
+
 /*!
  * Find the closest matching device.
  *
+ * A string like file[,fast][,loop]:capture.cu8 replays a capture instead,
+ * at the sample rate or with fast as quickly as it is read.
+ *
  * \param s a string to be parsed
  * \return dev_index int, -1 on error
  */
 
 int verbose_device_search(char *s);
 
+/*!
+ * Parse scheduling options, comma separated stage=[cpu[-cpu]][:priority]
+ * and lock, like usb=1:50,demod=2,lock
+ *
+ * A cpu range spreads the threads of a stage over it, a priority asks
+ * for SCHED_FIFO.  lock keeps all memory resident, see verbose_rt_lock().
+ *
+ * \param spec a string to be parsed, modified in place
+ * \param stages the stage names the tool knows, NULL terminated
+ * \return 0 on success
+ */
+
+int rt_parse(char *spec, const char **stages);
+
+/*!
+ * Lock memory if rt_parse() was asked to, and report status on stderr.
+ *
+ * Call once before the dongle is opened, buffers allocated later are
+ * faulted in as they are mapped.
+ *
+ * \return 0 on success
+ */
+
+int verbose_rt_lock(void);
+
+/*!
+ * Pin and prioritize the calling thread as its stage was asked to be,
+ * and report status on stderr.
+ *
+ * The usb stage is the thread that calls rtlsdr_read_async(), an event
+ * thread the library starts for the async queue inherits from it.
+ *
+ * \param stage one of the names given to rt_parse()
+ * \param n which thread of the stage this is, for cpu ranges
+ * \return 0 on success
+ */
+
+int verbose_rt_thread(const char *stage, int n);
+
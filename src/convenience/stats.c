@@ -0,0 +1,412 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#define closesocket close
+#define SOCKET int
+#define INVALID_SOCKET -1
+#define usleep_ms(x) usleep((x)*1000)
+/* a scraper hanging up must not raise SIGPIPE in the tool */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#else
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#define usleep_ms(x) Sleep(x)
+#define MSG_NOSIGNAL 0
+#endif
+
+#include <pthread.h>
+
+#include "rtl-sdr.h"
+#include "stats.h"
+#include "atomic.h"
+
+#define DEFAULT_INTERVAL	10
+#define RESPONSE_HEADER		"HTTP/1.0 200 OK\r\n" \
+				"Content-Type: text/plain; version=0.0.4\r\n" \
+				"Connection: close\r\n"
+
+struct text
+{
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct
+{
+	struct stats_metric *head;
+	rtlsdr_dev_t *dev;
+	pthread_t thread;
+	int running;
+	volatile int stop;
+	char *path;          /* NULL when serving */
+	int interval;
+	SOCKET listener;
+} st;
+
+void stats_register(struct stats_metric *m)
+{
+	struct stats_metric **p;
+	pthread_mutex_lock(&stats_lock);
+	/* written out in the order they were registered */
+	for (p=&st.head; *p && *p != m; p=&(*p)->next);
+	if (!*p) {
+		m->next = NULL;
+		*p = m;
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_device(rtlsdr_dev_t *dev)
+{
+	pthread_mutex_lock(&stats_lock);
+	st.dev = dev;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_add(struct stats_metric *m, uint64_t n)
+{
+	counter_add(&m->value, n);
+}
+
+void stats_set(struct stats_metric *m, uint64_t v)
+{
+	counter_store(&m->value, v);
+}
+
+void stats_time(struct stats_metric *m, uint64_t us)
+{
+	int b = 0;
+	uint64_t limit = 1;
+	while (b < STATS_HIST_LEN - 1 && us > limit) {
+		limit <<= 1;
+		b++;
+	}
+	counter_add(&m->hist[b], 1);
+	counter_add(&m->sum_us, us);
+}
+
+uint64_t stats_now_us(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000ULL +
+		(uint64_t)(count.QuadPart % freq.QuadPart) * 1000000ULL / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
+static void text_printf(struct text *t, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+	char *grown;
+	while (1) {
+		va_start(ap, fmt);
+		n = vsnprintf(t->buf + t->len, t->size - t->len, fmt, ap);
+		va_end(ap);
+		if (n < 0) {
+			return;}
+		if (t->len + n < t->size) {
+			t->len += n;
+			return;
+		}
+		grown = realloc(t->buf, t->size * 2 + n);
+		if (!grown) {
+			return;}
+		t->buf = grown;
+		t->size = t->size * 2 + n;
+	}
+}
+
+static void render_metric(struct text *t, const char *name, const char *help,
+			  int kind, uint64_t value, uint64_t sum_us,
+			  const uint64_t *hist)
+{
+	int i;
+	uint64_t count = 0;
+	static const char *types[] = {"counter", "gauge", "histogram"};
+	text_printf(t, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, types[kind]);
+	if (kind != STATS_HIST) {
+		text_printf(t, "%s %llu\n", name, (unsigned long long)value);
+		return;
+	}
+	/* prometheus buckets are cumulative */
+	for (i=0; i<STATS_HIST_LEN-1; i++) {
+		count += hist[i];
+		text_printf(t, "%s_bucket{le=\"%g\"} %llu\n", name,
+			(double)(1ULL << i) * 1e-6, (unsigned long long)count);
+	}
+	count += hist[i];
+	text_printf(t, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)count);
+	text_printf(t, "%s_sum %.6f\n", name, (double)sum_us * 1e-6);
+	text_printf(t, "%s_count %llu\n", name, (unsigned long long)count);
+}
+
+static void render_device(struct text *t, rtlsdr_dev_t *dev)
+{
+	rtlsdr_stream_stats_t s;
+	rtlsdr_callback_stats_t c;
+	if (rtlsdr_get_stream_stats(dev, &s) || rtlsdr_get_callback_stats(dev, &c)) {
+		return;}
+	render_metric(t, "rtlsdr_buffers_total", "Buffers handed to the callback",
+		STATS_COUNTER, s.buffers, 0, NULL);
+	render_metric(t, "rtlsdr_bytes_total", "Bytes of i/q handed to the callback",
+		STATS_COUNTER, s.samples * 2, 0, NULL);
+	render_metric(t, "rtlsdr_xfer_errors_total", "USB transfers that failed or were not resubmitted",
+		STATS_COUNTER, s.xfer_errors, 0, NULL);
+	render_metric(t, "rtlsdr_discontinuities_total", "Buffers after lost samples",
+		STATS_COUNTER, s.discontinuities, 0, NULL);
+	render_metric(t, "rtlsdr_short_xfers_total", "USB transfers shorter than a buffer",
+		STATS_COUNTER, s.short_xfers, 0, NULL);
+	render_metric(t, "rtlsdr_queue_drops_total", "Buffers lost to a full library queue",
+		STATS_COUNTER, s.queue_drops, 0, NULL);
+	render_metric(t, "rtlsdr_queue_high_water", "Most buffers waiting in the library queue",
+		STATS_GAUGE, s.queue_high_water, 0, NULL);
+	render_metric(t, "rtlsdr_xfers", "USB transfers kept submitted",
+		STATS_GAUGE, s.xfers, 0, NULL);
+	render_metric(t, "rtlsdr_xfer_bytes", "Bytes per USB transfer",
+		STATS_GAUGE, s.xfer_len, 0, NULL);
+	render_metric(t, "rtlsdr_xfer_grows_total", "USB transfers added by the latency target",
+		STATS_COUNTER, s.xfer_grows, 0, NULL);
+	render_metric(t, "rtlsdr_xfer_shrinks_total", "USB transfers held back by the latency target",
+		STATS_COUNTER, s.xfer_shrinks, 0, NULL);
+	/* the library buckets are the same, only in ns */
+	render_metric(t, "rtlsdr_callback_seconds", "Time spent in the sample callback",
+		STATS_HIST, 0, c.total_ns / 1000, c.hist);
+}
+
+static void render(struct text *t)
+{
+	int i;
+	struct stats_metric *m;
+	uint64_t value, sum_us, hist[STATS_HIST_LEN];
+	t->len = 0;
+	if (t->size) {
+		t->buf[0] = '\0';}
+	pthread_mutex_lock(&stats_lock);
+	for (m=st.head; m; m=m->next) {
+		value = counter_load(&m->value);
+		sum_us = counter_load(&m->sum_us);
+		for (i=0; i<STATS_HIST_LEN; i++) {
+			hist[i] = counter_load(&m->hist[i]);}
+		render_metric(t, m->name, m->help, m->kind, value, sum_us, hist);
+	}
+	if (st.dev) {
+		render_device(t, st.dev);}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void write_file(struct text *t)
+/* renamed into place, so nobody reads half a file */
+{
+	FILE *f;
+	char *tmp;
+	if (strcmp(st.path, "-") == 0) {
+		fwrite(t->buf, 1, t->len, stderr);
+		fflush(stderr);
+		return;
+	}
+	tmp = malloc(strlen(st.path) + 5);
+	if (!tmp) {
+		return;}
+	sprintf(tmp, "%s.tmp", st.path);
+	f = fopen(tmp, "wb");
+	if (!f) {
+		free(tmp);
+		return;
+	}
+	fwrite(t->buf, 1, t->len, f);
+	fclose(f);
+#ifdef _WIN32
+	remove(st.path);
+#endif
+	if (rename(tmp, st.path)) {
+		fprintf(stderr, "Failed to write %s\n", st.path);}
+	free(tmp);
+}
+
+static int wait_readable(SOCKET s, int ms)
+{
+	fd_set fds;
+	struct timeval tv;
+	FD_ZERO(&fds);
+	FD_SET(s, &fds);
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	return select((int)s + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
+static void serve_one(struct text *t, SOCKET c)
+{
+	char req[1024], head[128];
+	int n, sent = 0;
+#ifdef SO_NOSIGPIPE
+	int one = 1;
+	/* no MSG_NOSIGNAL on macos, the socket itself has to say so */
+	setsockopt(c, SOL_SOCKET, SO_NOSIGPIPE, (char *)&one, sizeof(one));
+#endif
+	/* whatever the request, the answer is the same. reading it keeps
+	 * the close from turning into a reset */
+	if (wait_readable(c, 1000)) {
+		recv(c, req, sizeof(req), 0);}
+	render(t);
+	n = snprintf(head, sizeof(head), RESPONSE_HEADER "Content-Length: %lu\r\n\r\n",
+		(unsigned long)t->len);
+	send(c, head, n, MSG_NOSIGNAL);
+	while (sent < (int)t->len) {
+		n = send(c, t->buf + sent, (int)t->len - sent, MSG_NOSIGNAL);
+		if (n <= 0) {
+			break;}
+		sent += n;
+	}
+	closesocket(c);
+}
+
+static void *stats_thread_fn(void *arg)
+{
+	struct text t = {NULL, 0, 0};
+	SOCKET c;
+	int waited;
+	t.size = 4096;
+	t.buf = malloc(t.size);
+	if (!t.buf) {
+		return 0;}
+	while (!st.stop) {
+		if (!st.path) {
+			if (!wait_readable(st.listener, 250)) {
+				continue;}
+			c = accept(st.listener, NULL, NULL);
+			if (c != INVALID_SOCKET) {
+				serve_one(&t, c);}
+			continue;
+		}
+		for (waited=0; waited < st.interval * 1000 && !st.stop; waited+=100) {
+			usleep_ms(100);}
+		render(&t);
+		write_file(&t);
+	}
+	/* the last word, so a short run still leaves its numbers */
+	if (st.path) {
+		render(&t);
+		write_file(&t);
+	}
+	free(t.buf);
+	return 0;
+}
+
+static int open_listener(char *addr)
+{
+	struct sockaddr_in local;
+	char *port = strrchr(addr, ':');
+	int one = 1;
+#ifdef _WIN32
+	WSADATA wsd;
+	WSAStartup(MAKEWORD(2, 2), &wsd);
+#endif
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = inet_addr("127.0.0.1");
+	if (port) {
+		*port = '\0';
+		local.sin_addr.s_addr = inet_addr(addr);
+		port++;
+	} else {
+		port = addr;}
+	local.sin_port = htons((unsigned short)atoi(port));
+	st.listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (st.listener == INVALID_SOCKET) {
+		return -1;}
+	setsockopt(st.listener, SOL_SOCKET, SO_REUSEADDR, (char *)&one, sizeof(one));
+	if (bind(st.listener, (struct sockaddr *)&local, sizeof(local)) ||
+	    listen(st.listener, 4)) {
+		fprintf(stderr, "Stats can't listen on port %s\n", port);
+		closesocket(st.listener);
+		return -1;
+	}
+	fprintf(stderr, "Serving stats on %s:%s\n", inet_ntoa(local.sin_addr), port);
+	return 0;
+}
+
+int stats_start(char *spec)
+{
+	char *comma;
+	if (st.running) {
+		return -1;}
+	st.stop = 0;
+	st.path = NULL;
+	if (strncmp(spec, "tcp:", 4) == 0) {
+		if (open_listener(spec + 4) < 0) {
+			return -1;}
+	} else {
+		st.interval = DEFAULT_INTERVAL;
+		comma = strrchr(spec, ',');
+		if (comma) {
+			*comma = '\0';
+			st.interval = atoi(comma + 1);
+			if (st.interval < 1) {
+				st.interval = 1;}
+		}
+		st.path = spec;
+	}
+	if (pthread_create(&st.thread, NULL, stats_thread_fn, NULL)) {
+		if (!st.path) {
+			closesocket(st.listener);}
+		return -1;
+	}
+	st.running = 1;
+	return 0;
+}
+
+void stats_stop(void)
+{
+	if (!st.running) {
+		return;}
+	st.stop = 1;
+	pthread_join(st.thread, NULL);
+	if (!st.path) {
+		closesocket(st.listener);}
+	st.running = 0;
+	stats_device(NULL);
+}
+
+// vim: tabstop=8:softtabstop=8:shiftwidth=8:noexpandtab
@@ -0,0 +1,95 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* counters and histograms the tools keep about themselves, written out
+ * in the prometheus text format.  updating one is a single atomic add,
+ * so the hot paths pay next to nothing for them */
+
+#include <stdint.h>
+
+#define STATS_COUNTER		0
+#define STATS_GAUGE		1
+#define STATS_HIST		2
+
+/* same buckets as rtlsdr_callback_stats_t, bucket i is at most 2^i us */
+#define STATS_HIST_LEN		20
+
+struct stats_metric
+{
+	const char *name;    /* in prometheus style, rtl_fm_dsp_seconds */
+	const char *help;
+	int kind;            /* STATS_* */
+	uint64_t value;      /* counter or gauge */
+	uint64_t sum_us;     /* histogram */
+	uint64_t hist[STATS_HIST_LEN];
+	struct stats_metric *next;
+};
+
+/* a static initializer, nothing counted yet */
+#define STATS_METRIC(name, help, kind)	{name, help, kind, 0, 0, {0}, NULL}
+
+/*!
+ * Add a metric to what gets written out, once before it is used
+ *
+ * \param m a static struct stats_metric with name, help and kind set
+ */
+
+void stats_register(struct stats_metric *m);
+
+/*!
+ * Also write out the counters librtlsdr keeps for this dongle
+ *
+ * \param dev the device handle, NULL to stop
+ */
+
+void stats_device(rtlsdr_dev_t *dev);
+
+void stats_add(struct stats_metric *m, uint64_t n);
+
+void stats_set(struct stats_metric *m, uint64_t v);
+
+/*!
+ * Count a duration into a histogram
+ *
+ * \param m a STATS_HIST metric
+ * \param us microseconds, see stats_now_us()
+ */
+
+void stats_time(struct stats_metric *m, uint64_t us);
+
+/*!
+ * Monotonic clock for stats_time()
+ */
+
+uint64_t stats_now_us(void);
+
+/*!
+ * Start writing the metrics out from a thread of their own
+ *
+ * \param spec tcp:[addr:]port serves them to anything that connects,
+ *             like a prometheus scrape, addr defaults to 127.0.0.1.
+ *             path[,seconds] rewrites the file every 10 or so seconds,
+ *             for the textfile collector of node_exporter.
+ *             - appends them to stderr instead.
+ * \return 0 on success
+ */
+
+int stats_start(char *spec);
+
+void stats_stop(void);
+
+// vim: tabstop=8:softtabstop=8:shiftwidth=8:noexpandtab
@@ -24,10 +24,18 @@
 #include <stdlib.h>
 #ifndef _WIN32
 #include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 #endif
 
 #include <libusb.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <sched.h>
+#endif
 
 /*
  * All libusb callback functions should be marked with the LIBUSB_CALL macro
@@ -48,6 +56,7 @@
 #include "tuner_fc0013.h"
 #include "tuner_fc2580.h"
 #include "tuner_r82xx.h"
+#include "convenience/atomic.h"
 
 typedef struct rtlsdr_tuner_iface {
 	/* tuner interface */
@@ -66,6 +75,39 @@ enum rtlsdr_async_status {
 	RTLSDR_RUNNING
 };
 
+struct rtlsdr_queued {
+	unsigned char *buf;
+	uint32_t len;
+	rtlsdr_buffer_info_t info;
+};
+
+/* where a dongle is plugged in, stable across reopening it */
+struct rtlsdr_port {
+	uint8_t bus;
+	uint8_t address;
+	uint8_t depth;
+	uint8_t ports[7];
+};
+
+/* a capture replayed in place of a dongle, see rtlsdr_get_index_by_serial() */
+struct rtlsdr_file {
+	const char *spec;
+	const unsigned char *data; /* the whole file, mapped */
+	uint64_t map_len;
+	uint64_t size; /* whole i/q pairs of it */
+	uint64_t pos;
+	int fast; /* as fast as the reader takes it, not at the sample rate */
+	int loop;
+	uint64_t pace_start_ns;
+	uint64_t paced; /* samples delivered since pace_start_ns */
+#ifdef _WIN32
+	HANDLE fh;
+	HANDLE map;
+#else
+	int fd;
+#endif
+};
+
 #define FIR_LEN 16
 
 /*
@@ -94,7 +136,41 @@ struct rtlsdr_dev {
 	struct libusb_transfer **xfer;
 	unsigned char **xfer_buf;
 	rtlsdr_read_async_cb_t cb;
+	rtlsdr_read_async_ex_cb_t cb_ex;
 	void *cb_ctx;
+	/* stream metadata */
+	uint64_t *xfer_seq; /* submission order of each transfer */
+	uint64_t submit_seq;
+	uint64_t complete_seq;
+	uint64_t stream_samples;
+	uint32_t pending_flags;
+	uint32_t pending_errors;
+	rtlsdr_stream_stats_t stats;
+	rtlsdr_callback_stats_t cb_stats;
+	/* latency target, see rtlsdr_set_latency_target() */
+	uint32_t latency_us;
+	uint32_t xfer_active; /* transfers kept submitted */
+	uint32_t *parked; /* the others, not submitted */
+	uint32_t parked_len;
+	uint64_t xfer_ns; /* time to fill one transfer */
+	uint64_t last_complete_ns;
+	uint64_t window_start_ns;
+	int64_t window_slack_ns; /* least slack since window_start_ns */
+	/* queued mode, see rtlsdr_set_async_queue() */
+	uint32_t queue_depth;
+	int queue_active;
+	struct rtlsdr_queued *ready; /* filled, event thread -> caller */
+	uint32_t ready_head;
+	uint32_t ready_tail;
+	unsigned char **spare; /* released, caller -> event thread */
+	uint32_t spare_head;
+	uint32_t spare_tail;
+	pthread_t event_thread;
+	pthread_mutex_t queue_lock;
+	pthread_cond_t queue_cond;
+	int event_done;
+	int event_result;
+	enum rtlsdr_async_status event_status;
 	enum rtlsdr_async_status async_status;
 	int async_cancel;
 	int use_zerocopy;
@@ -115,16 +191,26 @@ struct rtlsdr_dev {
 	struct e4k_state e4k_s;
 	struct r82xx_config r82xx_c;
 	struct r82xx_priv r82xx_p;
+	int fast_hop;
+	int i2c_repeater; /* last state set, -1 for unknown */
 	/* status */
 	int dev_lost;
 	int driver_active;
 	unsigned int xfer_errors;
 	char manufact[256];
 	char product[256];
+	struct rtlsdr_file *file; /* not NULL for a replayed capture */
+	struct rtlsdr_port port;
 };
 
 void rtlsdr_set_gpio_bit(rtlsdr_dev_t *dev, uint8_t gpio, int val);
 static int rtlsdr_set_if_freq(rtlsdr_dev_t *dev, uint32_t freq);
+static uint64_t _rtlsdr_now_ns(void);
+static void _rtlsdr_callback(rtlsdr_dev_t *dev, unsigned char *buf,
+			     uint32_t len, const rtlsdr_buffer_info_t *info);
+static void _rtlsdr_file_strings(const char *spec, char *manufact,
+				 char *product, char *serial);
+static void _rtlsdr_file_repace(rtlsdr_dev_t *dev);
 
 /* generic tuner interface functions, shall be moved to the tuner implementations */
 int e4000_init(void *dev) {
@@ -297,6 +383,18 @@ static rtlsdr_tuner_iface_t tuners[] = {
 	},
 };
 
+/* a replayed capture tunes nothing, the requests are only recorded */
+static int file_tuner_none(void *dev) { return 0; }
+static int file_tuner_freq(void *dev, uint32_t freq) { return 0; }
+static int file_tuner_set(void *dev, int val) { return 0; }
+static int file_tuner_if_gain(void *dev, int stage, int gain) { return 0; }
+
+static rtlsdr_tuner_iface_t file_tuner = {
+	file_tuner_none, file_tuner_none,
+	file_tuner_freq, file_tuner_set, file_tuner_set, file_tuner_if_gain,
+	file_tuner_set
+};
+
 typedef struct rtlsdr_dongle {
 	uint16_t vid;
 	uint16_t pid;
@@ -354,6 +452,13 @@ static rtlsdr_dongle_t known_devices[] = {
 #define DEFAULT_BUF_NUMBER	15
 #define DEFAULT_BUF_LENGTH	(16 * 32 * 512)
 
+/* latency target, see rtlsdr_set_latency_target() */
+#define LATENCY_XFERS		8	/* transfers the budget is cut into */
+#define LATENCY_MIN_XFERS	2
+#define LATENCY_MAX_XFERS	64
+#define LATENCY_MIN_LEN		(8 * 512)
+#define LATENCY_WINDOW_NS	10000000000ULL	/* slack must stay high this long to shrink */
+
 #define DEF_RTL_XTAL_FREQ	28800000
 #define MIN_RTL_XTAL_FREQ	(DEF_RTL_XTAL_FREQ - 1000)
 #define MAX_RTL_XTAL_FREQ	(DEF_RTL_XTAL_FREQ + 1000)
@@ -363,6 +468,10 @@ static rtlsdr_dongle_t known_devices[] = {
 #define CTRL_TIMEOUT	300
 #define BULK_TIMEOUT	0
 
+/* indices rtlsdr_get_index_by_serial() hands out for file: specs */
+#define FILE_INDEX	0x40000000
+#define FILE_SLOTS	16
+
 #define EEPROM_ADDR	0xa0
 
 enum usb_reg {
@@ -402,12 +511,25 @@ enum blocks {
 	IICB			= 6,
 };
 
+static int _rtlsdr_control(rtlsdr_dev_t *dev, uint8_t type, uint16_t addr,
+			   uint16_t index, unsigned char *data, uint16_t len)
+/* every register access, a replayed capture has no registers */
+{
+	if (dev->file) {
+		if (type == CTRL_IN)
+			memset(data, 0, len);
+		return len;
+	}
+
+	return libusb_control_transfer(dev->devh, type, 0, addr, index, data, len, CTRL_TIMEOUT);
+}
+
 int rtlsdr_read_array(rtlsdr_dev_t *dev, uint8_t block, uint16_t addr, uint8_t *array, uint8_t len)
 {
 	int r;
 	uint16_t index = (block << 8);
 
-	r = libusb_control_transfer(dev->devh, CTRL_IN, 0, addr, index, array, len, CTRL_TIMEOUT);
+	r = _rtlsdr_control(dev, CTRL_IN, addr, index, array, len);
 #if 0
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
@@ -420,7 +542,7 @@ int rtlsdr_write_array(rtlsdr_dev_t *dev, uint8_t block, uint16_t addr, uint8_t
 	int r;
 	uint16_t index = (block << 8) | 0x10;
 
-	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0, addr, index, array, len, CTRL_TIMEOUT);
+	r = _rtlsdr_control(dev, CTRL_OUT, addr, index, array, len);
 #if 0
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
@@ -476,7 +598,7 @@ uint16_t rtlsdr_read_reg(rtlsdr_dev_t *dev, uint8_t block, uint16_t addr, uint8_
 	uint16_t index = (block << 8);
 	uint16_t reg;
 
-	r = libusb_control_transfer(dev->devh, CTRL_IN, 0, addr, index, data, len, CTRL_TIMEOUT);
+	r = _rtlsdr_control(dev, CTRL_IN, addr, index, data, len);
 
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
@@ -500,7 +622,7 @@ int rtlsdr_write_reg(rtlsdr_dev_t *dev, uint8_t block, uint16_t addr, uint16_t v
 
 	data[1] = val & 0xff;
 
-	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0, addr, index, data, len, CTRL_TIMEOUT);
+	r = _rtlsdr_control(dev, CTRL_OUT, addr, index, data, len);
 
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
@@ -517,7 +639,7 @@ uint16_t rtlsdr_demod_read_reg(rtlsdr_dev_t *dev, uint8_t page, uint16_t addr, u
 	uint16_t reg;
 	addr = (addr << 8) | 0x20;
 
-	r = libusb_control_transfer(dev->devh, CTRL_IN, 0, addr, index, data, len, CTRL_TIMEOUT);
+	r = _rtlsdr_control(dev, CTRL_IN, addr, index, data, len);
 
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
@@ -541,7 +663,7 @@ int rtlsdr_demod_write_reg(rtlsdr_dev_t *dev, uint8_t page, uint16_t addr, uint1
 
 	data[1] = val & 0xff;
 
-	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0, addr, index, data, len, CTRL_TIMEOUT);
+	r = _rtlsdr_control(dev, CTRL_OUT, addr, index, data, len);
 
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
@@ -574,7 +696,14 @@ void rtlsdr_set_gpio_output(rtlsdr_dev_t *dev, uint8_t gpio)
 
 void rtlsdr_set_i2c_repeater(rtlsdr_dev_t *dev, int on)
 {
+	/* fast hop leaves it on, see rtlsdr_set_fast_hop() */
+	if (dev->fast_hop) {
+		if (dev->i2c_repeater == 1)
+			return;
+		on = 1;
+	}
 	rtlsdr_demod_write_reg(dev, 1, 0x01, on ? 0x18 : 0x10, 1);
+	dev->i2c_repeater = on;
 }
 
 int rtlsdr_set_fir(rtlsdr_dev_t *dev)
@@ -785,6 +914,11 @@ int rtlsdr_get_usb_strings(rtlsdr_dev_t *dev, char *manufact, char *product,
 	const int buf_max = 256;
 	int r = 0;
 
+	if (dev && dev->file) {
+		_rtlsdr_file_strings(dev->file->spec, manufact, product, serial);
+		return 0;
+	}
+
 	if (!dev || !dev->devh)
 		return -1;
 
@@ -904,6 +1038,40 @@ int rtlsdr_set_center_freq(rtlsdr_dev_t *dev, uint32_t freq)
 	return r;
 }
 
+int rtlsdr_set_fast_hop(rtlsdr_dev_t *dev, int on, const uint32_t *freqs, uint32_t n)
+{
+	uint32_t i, freq, hops = R82XX_HOP_CACHE;
+	int r = 0;
+
+	if (!dev)
+		return -1;
+
+	if (freqs && n > hops)
+		hops = n;
+	if ((dev->tuner_type == RTLSDR_TUNER_R820T) ||
+	    (dev->tuner_type == RTLSDR_TUNER_R828D))
+		r = r82xx_set_fast_hop(&dev->r82xx_p, on, hops);
+	if (r < 0)
+		return r;
+
+	dev->fast_hop = on;
+	if (!on) {
+		rtlsdr_set_i2c_repeater(dev, 0);
+		return 0;
+	}
+	if (!freqs || dev->direct_sampling)
+		return 0;
+
+	/* one pass over the hops so the tuner remembers them all */
+	freq = dev->freq;
+	for (i = 0; i < n; i++)
+		rtlsdr_set_center_freq(dev, freqs[i]);
+	if (freq)
+		r = rtlsdr_set_center_freq(dev, freq);
+
+	return r;
+}
+
 uint32_t rtlsdr_get_center_freq(rtlsdr_dev_t *dev)
 {
 	if (!dev)
@@ -1113,6 +1281,7 @@ int rtlsdr_set_sample_rate(rtlsdr_dev_t *dev, uint32_t samp_rate)
 		fprintf(stderr, "Exact sample rate is: %f Hz\n", real_rate);
 
 	dev->rate = (uint32_t)real_rate;
+	_rtlsdr_file_repace(dev);
 
 	if (dev->tuner && dev->tuner->set_bw) {
 		rtlsdr_set_i2c_repeater(dev, 1);
@@ -1294,17 +1463,427 @@ static rtlsdr_dongle_t *find_known_device(uint16_t vid, uint16_t pid)
 	return device;
 }
 
+/* one context for every scan, libusb_init() alone can take a while */
+static libusb_context *enum_ctx;
+static pthread_mutex_t enum_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static libusb_context *_rtlsdr_enum_ctx(void)
+{
+	libusb_context *ctx;
+
+	pthread_mutex_lock(&enum_lock);
+	if (!enum_ctx && libusb_init(&enum_ctx) < 0)
+		enum_ctx = NULL;
+	ctx = enum_ctx;
+	pthread_mutex_unlock(&enum_lock);
+
+	return ctx;
+}
+
+static void _rtlsdr_port_of(libusb_device *device, struct rtlsdr_port *port)
+{
+	int r = 0;
+
+	memset(port, 0, sizeof(*port));
+	port->bus = libusb_get_bus_number(device);
+	port->address = libusb_get_device_address(device);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+	r = libusb_get_port_numbers(device, port->ports, sizeof(port->ports));
+#endif
+	port->depth = r > 0 ? r : 0;
+}
+
+/* the port path survives replugging, the address only if libusb has no path */
+static int _rtlsdr_port_same(const struct rtlsdr_port *a,
+			     const struct rtlsdr_port *b)
+{
+	if (a->bus != b->bus)
+		return 0;
+
+	if (a->depth && b->depth)
+		return a->depth == b->depth &&
+		       !memcmp(a->ports, b->ports, a->depth);
+
+	return a->address == b->address;
+}
+
+/* tuners found by this process, keyed by port, so reopening skips the probe */
+#define TUNER_CACHE_LEN		16
+
+static struct {
+	struct rtlsdr_port port;
+	enum rtlsdr_tuner type;
+} tuner_cache[TUNER_CACHE_LEN];
+static int tuner_cache_next;
+
+static void _rtlsdr_cache_tuner(const struct rtlsdr_port *port,
+				enum rtlsdr_tuner type)
+{
+	int i;
+
+	if (type == RTLSDR_TUNER_UNKNOWN)
+		return;
+
+	pthread_mutex_lock(&enum_lock);
+	for (i = 0; i < TUNER_CACHE_LEN; i++) {
+		if (tuner_cache[i].type != RTLSDR_TUNER_UNKNOWN &&
+		    _rtlsdr_port_same(&tuner_cache[i].port, port))
+			break;
+	}
+	if (i == TUNER_CACHE_LEN) {
+		i = tuner_cache_next;
+		tuner_cache_next = (tuner_cache_next + 1) % TUNER_CACHE_LEN;
+	}
+	tuner_cache[i].port = *port;
+	tuner_cache[i].type = type;
+	pthread_mutex_unlock(&enum_lock);
+}
+
+static enum rtlsdr_tuner _rtlsdr_cached_tuner(const struct rtlsdr_port *port)
+{
+	enum rtlsdr_tuner type = RTLSDR_TUNER_UNKNOWN;
+	int i;
+
+	pthread_mutex_lock(&enum_lock);
+	for (i = 0; i < TUNER_CACHE_LEN; i++) {
+		if (tuner_cache[i].type != RTLSDR_TUNER_UNKNOWN &&
+		    _rtlsdr_port_same(&tuner_cache[i].port, port)) {
+			type = tuner_cache[i].type;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&enum_lock);
+
+	return type;
+}
+
+/* replayed captures.  rtlsdr_get_index_by_serial() takes a spec like
+ * "file,fast,loop:/tmp/capture.cu8", keeps it in a slot and returns an
+ * index rtlsdr_open() recognizes.  the device maps the file and feeds
+ * it to read_sync/read_async, every register access is a no-op */
+
+static char *file_specs[FILE_SLOTS];
+
+static int _rtlsdr_file_options(const char *spec, int *fast, int *loop,
+				const char **path)
+/* "file[,fast][,loop]:path", -1 for anything else */
+{
+	const char *p = spec;
+	size_t n;
+
+	*fast = *loop = 0;
+	if (strncmp(p, "file", 4))
+		return -1;
+
+	for (p += 4; *p == ','; p += n) {
+		p++;
+		n = strcspn(p, ",:");
+		if (n == 4 && !strncmp(p, "fast", 4))
+			*fast = 1;
+		else if (n == 4 && !strncmp(p, "loop", 4))
+			*loop = 1;
+		else
+			return -1;
+	}
+
+	if (*p != ':' || !p[1])
+		return -1;
+
+	*path = p + 1;
+	return 0;
+}
+
+static int _rtlsdr_file_index(const char *spec)
+{
+	int i, fast, loop;
+	const char *path;
+
+	if (_rtlsdr_file_options(spec, &fast, &loop, &path) < 0)
+		return -3;
+
+	for (i = 0; i < FILE_SLOTS; i++) {
+		if (!file_specs[i]) {
+			file_specs[i] = strdup(spec);
+			if (!file_specs[i])
+				return -ENOMEM;
+		}
+		if (!strcmp(file_specs[i], spec))
+			return FILE_INDEX + i;
+	}
+
+	return -3;
+}
+
+static const char *_rtlsdr_file_spec(uint32_t index)
+{
+	if (index < FILE_INDEX || index >= FILE_INDEX + FILE_SLOTS)
+		return NULL;
+
+	return file_specs[index - FILE_INDEX];
+}
+
+static void _rtlsdr_file_strings(const char *spec, char *manufact,
+				 char *product, char *serial)
+{
+	if (manufact)
+		strcpy(manufact, "librtlsdr");
+	if (product)
+		strcpy(product, "file replay");
+	if (serial) {
+		strncpy(serial, spec, 255);
+		serial[255] = '\0';
+	}
+}
+
+static int _rtlsdr_file_map(struct rtlsdr_file *f, const char *path)
+{
+#ifdef _WIN32
+	LARGE_INTEGER size;
+
+	f->fh = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+			    OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (f->fh == INVALID_HANDLE_VALUE)
+		return -1;
+
+	if (!GetFileSizeEx(f->fh, &size) || size.QuadPart < 2) {
+		CloseHandle(f->fh);
+		return -1;
+	}
+	f->map_len = (uint64_t)size.QuadPart;
+
+	f->map = CreateFileMappingA(f->fh, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!f->map) {
+		CloseHandle(f->fh);
+		return -1;
+	}
+
+	f->data = MapViewOfFile(f->map, FILE_MAP_READ, 0, 0, 0);
+	if (!f->data) {
+		CloseHandle(f->map);
+		CloseHandle(f->fh);
+		return -1;
+	}
+#else
+	struct stat st;
+	void *p;
+
+	f->fd = open(path, O_RDONLY);
+	if (f->fd < 0)
+		return -1;
+
+	if (fstat(f->fd, &st) < 0 || st.st_size < 2) {
+		close(f->fd);
+		return -1;
+	}
+	f->map_len = (uint64_t)st.st_size;
+
+	p = mmap(NULL, (size_t)f->map_len, PROT_READ, MAP_PRIVATE, f->fd, 0);
+	if (p == MAP_FAILED) {
+		close(f->fd);
+		return -1;
+	}
+	posix_madvise(p, (size_t)f->map_len, POSIX_MADV_SEQUENTIAL);
+	f->data = p;
+#endif
+
+	f->size = f->map_len & ~1ULL;
+	return 0;
+}
+
+static void _rtlsdr_file_unmap(struct rtlsdr_file *f)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(f->data);
+	CloseHandle(f->map);
+	CloseHandle(f->fh);
+#else
+	munmap((void *)f->data, (size_t)f->map_len);
+	close(f->fd);
+#endif
+}
+
+static int _rtlsdr_file_open(rtlsdr_dev_t **out_dev, const char *spec)
+{
+	rtlsdr_dev_t *dev;
+	struct rtlsdr_file *f;
+	const char *path;
+
+	dev = calloc(1, sizeof(rtlsdr_dev_t));
+	f = calloc(1, sizeof(struct rtlsdr_file));
+	if (!dev || !f) {
+		free(dev);
+		free(f);
+		return -ENOMEM;
+	}
+
+	_rtlsdr_file_options(spec, &f->fast, &f->loop, &path);
+	if (_rtlsdr_file_map(f, path) < 0) {
+		fprintf(stderr, "Failed to open %s for replay\n", path);
+		free(dev);
+		free(f);
+		return -1;
+	}
+	f->spec = spec;
+
+	memcpy(dev->fir, fir_default, sizeof(fir_default));
+	dev->i2c_repeater = -1;
+	dev->file = f;
+	dev->rtl_xtal = DEF_RTL_XTAL_FREQ;
+	dev->tun_xtal = DEF_RTL_XTAL_FREQ;
+	dev->tuner_type = RTLSDR_TUNER_UNKNOWN;
+	dev->tuner = &file_tuner;
+	_rtlsdr_file_strings(spec, dev->manufact, dev->product, NULL);
+
+	fprintf(stderr, "Replaying %s, %llu samples%s%s\n", path,
+		(unsigned long long)(f->size / 2),
+		f->fast ? ", as fast as they are read" : "",
+		f->loop ? ", looped" : "");
+
+	*out_dev = dev;
+	return 0;
+}
+
+static uint32_t _rtlsdr_file_fill(struct rtlsdr_file *f, unsigned char *buf,
+				  uint32_t len, int *wrapped)
+/* the next len bytes, around the end when looped, fewer at the end */
+{
+	uint64_t left;
+	uint32_t n, done = 0;
+
+	*wrapped = 0;
+	len &= ~1U;
+	while (done < len) {
+		if (f->pos >= f->size) {
+			if (!f->loop)
+				break;
+			f->pos = 0;
+			*wrapped = 1;
+		}
+		left = f->size - f->pos;
+		n = len - done;
+		if (left < n)
+			n = (uint32_t)left;
+		memcpy(buf + done, f->data + f->pos, n);
+		f->pos += n;
+		done += n;
+	}
+
+	return done;
+}
+
+static void _rtlsdr_file_repace(rtlsdr_dev_t *dev)
+{
+	if (!dev->file)
+		return;
+
+	dev->file->pace_start_ns = 0;
+	dev->file->paced = 0;
+}
+
+static void _rtlsdr_file_pace(rtlsdr_dev_t *dev, uint32_t samples)
+/* holds a buffer back until a dongle at dev->rate would have it.
+ * a reader that fell behind catches up, nothing is dropped */
+{
+	struct rtlsdr_file *f = dev->file;
+	uint64_t due, now;
+#ifndef _WIN32
+	struct timespec ts;
+#endif
+
+	if (f->fast || !dev->rate)
+		return;
+
+	now = _rtlsdr_now_ns();
+	if (!f->pace_start_ns)
+		f->pace_start_ns = now;
+	f->paced += samples;
+	due = f->pace_start_ns + (f->paced / dev->rate) * 1000000000ULL +
+		(f->paced % dev->rate) * 1000000000ULL / dev->rate;
+	if (due <= now)
+		return;
+
+#ifdef _WIN32
+	Sleep((DWORD)((due - now) / 1000000));
+#else
+	ts.tv_sec = (time_t)((due - now) / 1000000000ULL);
+	ts.tv_nsec = (long)((due - now) % 1000000000ULL);
+	nanosleep(&ts, NULL);
+#endif
+}
+
+static int _rtlsdr_file_read_sync(rtlsdr_dev_t *dev, void *buf, int len,
+				  int *n_read)
+{
+	uint32_t n;
+	int wrapped;
+
+	n = _rtlsdr_file_fill(dev->file, buf, (uint32_t)len, &wrapped);
+	if (n_read)
+		*n_read = (int)n;
+
+	/* the end of the capture is where the dongle got unplugged */
+	if (!n)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	_rtlsdr_file_pace(dev, n / 2);
+	return 0;
+}
+
+static int _rtlsdr_file_stream(rtlsdr_dev_t *dev)
+/* read_async of a replay, the callback runs on the calling thread */
+{
+	rtlsdr_buffer_info_t info;
+	unsigned char *buf;
+	uint32_t len;
+	int wrapped;
+
+	buf = malloc(dev->xfer_buf_len);
+	if (!buf)
+		return -ENOMEM;
+
+	while (RTLSDR_RUNNING == dev->async_status) {
+		len = _rtlsdr_file_fill(dev->file, buf, dev->xfer_buf_len, &wrapped);
+		if (!len)
+			break;
+
+		_rtlsdr_file_pace(dev, len / 2);
+
+		info.timestamp_ns = _rtlsdr_now_ns();
+		info.sample_index = dev->stream_samples;
+		info.flags = 0;
+		info.xfer_errors = 0;
+		/* a looped capture jumps back to its start */
+		if (wrapped)
+			info.flags |= RTLSDR_BUF_DISCONTINUITY;
+		if (len < dev->xfer_buf_len)
+			info.flags |= RTLSDR_BUF_SHORT;
+
+		dev->stream_samples += len / 2;
+		dev->stats.buffers++;
+		dev->stats.samples += len / 2;
+		if (info.flags & RTLSDR_BUF_DISCONTINUITY)
+			dev->stats.discontinuities++;
+		if (info.flags & RTLSDR_BUF_SHORT)
+			dev->stats.short_xfers++;
+
+		_rtlsdr_callback(dev, buf, len, &info);
+	}
+
+	free(buf);
+	return 0;
+}
+
 uint32_t rtlsdr_get_device_count(void)
 {
-	int i,r;
+	int i;
 	libusb_context *ctx;
 	libusb_device **list;
 	uint32_t device_count = 0;
 	struct libusb_device_descriptor dd;
 	ssize_t cnt;
 
-	r = libusb_init(&ctx);
-	if(r < 0)
+	ctx = _rtlsdr_enum_ctx();
+	if (!ctx)
 		return 0;
 
 	cnt = libusb_get_device_list(ctx, &list);
@@ -1316,16 +1895,15 @@ uint32_t rtlsdr_get_device_count(void)
 			device_count++;
 	}
 
-	libusb_free_device_list(list, 1);
-
-	libusb_exit(ctx);
+	if (cnt >= 0)
+		libusb_free_device_list(list, 1);
 
 	return device_count;
 }
 
 const char *rtlsdr_get_device_name(uint32_t index)
 {
-	int i,r;
+	int i;
 	libusb_context *ctx;
 	libusb_device **list;
 	struct libusb_device_descriptor dd;
@@ -1333,8 +1911,11 @@ const char *rtlsdr_get_device_name(uint32_t index)
 	uint32_t device_count = 0;
 	ssize_t cnt;
 
-	r = libusb_init(&ctx);
-	if(r < 0)
+	if (_rtlsdr_file_spec(index))
+		return "File replay";
+
+	ctx = _rtlsdr_enum_ctx();
+	if (!ctx)
 		return "";
 
 	cnt = libusb_get_device_list(ctx, &list);
@@ -1352,9 +1933,8 @@ const char *rtlsdr_get_device_name(uint32_t index)
 		}
 	}
 
-	libusb_free_device_list(list, 1);
-
-	libusb_exit(ctx);
+	if (cnt >= 0)
+		libusb_free_device_list(list, 1);
 
 	if (device)
 		return device->name;
@@ -1374,11 +1954,18 @@ int rtlsdr_get_device_usb_strings(uint32_t index, char *manufact,
 	rtlsdr_dev_t devt;
 	uint32_t device_count = 0;
 	ssize_t cnt;
+	const char *spec = _rtlsdr_file_spec(index);
 
-	r = libusb_init(&ctx);
-	if(r < 0)
-		return r;
+	if (spec) {
+		_rtlsdr_file_strings(spec, manufact, product, serial);
+		return 0;
+	}
+
+	ctx = _rtlsdr_enum_ctx();
+	if (!ctx)
+		return -1;
 
+	memset(&devt, 0, sizeof(devt));
 	cnt = libusb_get_device_list(ctx, &list);
 
 	for (i = 0; i < cnt; i++) {
@@ -1403,36 +1990,116 @@ int rtlsdr_get_device_usb_strings(uint32_t index, char *manufact,
 		}
 	}
 
-	libusb_free_device_list(list, 1);
-
-	libusb_exit(ctx);
+	if (cnt >= 0)
+		libusb_free_device_list(list, 1);
 
 	return r;
 }
 
-int rtlsdr_get_index_by_serial(const char *serial)
+int rtlsdr_get_device_list(rtlsdr_dev_info_t **out)
 {
-	int i, cnt, r;
-	char str[256];
+	int i, r, n = 0;
+	libusb_context *ctx;
+	libusb_device **list;
+	struct libusb_device_descriptor dd;
+	rtlsdr_dongle_t *device;
+	rtlsdr_dev_info_t *info;
+	rtlsdr_dev_t devt;
+	struct rtlsdr_port port;
+	ssize_t cnt;
 
-	if (!serial)
+	if (!out)
 		return -1;
 
-	cnt = rtlsdr_get_device_count();
+	*out = NULL;
 
-	if (!cnt)
-		return -2;
+	ctx = _rtlsdr_enum_ctx();
+	if (!ctx)
+		return -1;
+
+	cnt = libusb_get_device_list(ctx, &list);
+	if (cnt < 0)
+		return (int)cnt;
+
+	/* one spare, so an empty list is still something to free */
+	*out = calloc(cnt + 1, sizeof(rtlsdr_dev_info_t));
+	if (!*out) {
+		libusb_free_device_list(list, 1);
+		return -ENOMEM;
+	}
+
+	memset(&devt, 0, sizeof(devt));
 
 	for (i = 0; i < cnt; i++) {
-		r = rtlsdr_get_device_usb_strings(i, NULL, NULL, str);
-		if (!r && !strcmp(serial, str))
-			return i;
+		libusb_get_device_descriptor(list[i], &dd);
+
+		device = find_known_device(dd.idVendor, dd.idProduct);
+		if (!device)
+			continue;
+
+		info = &(*out)[n];
+		info->index = n++;
+		info->vid = dd.idVendor;
+		info->pid = dd.idProduct;
+		info->name = device->name;
+
+		_rtlsdr_port_of(list[i], &port);
+		info->bus = port.bus;
+		info->address = port.address;
+		info->port_depth = port.depth;
+		memcpy(info->ports, port.ports, sizeof(info->ports));
+		info->tuner_type = _rtlsdr_cached_tuner(&port);
+
+		r = libusb_open(list[i], &devt.devh);
+		if (!r) {
+			rtlsdr_get_usb_strings(&devt, info->manufact,
+					       info->product, info->serial);
+			libusb_close(devt.devh);
+		}
+		info->usb_error = r;
 	}
 
-	return -3;
+	libusb_free_device_list(list, 1);
+
+	return n;
 }
 
-/* Returns true if the manufact_check and product_check strings match what is in the dongles EEPROM */
+void rtlsdr_free_device_list(rtlsdr_dev_info_t *list)
+{
+	free(list);
+}
+
+int rtlsdr_get_index_by_serial(const char *serial)
+{
+	int i, cnt, r = -3;
+	rtlsdr_dev_info_t *list;
+
+	if (!serial)
+		return -1;
+
+	if (!strncmp(serial, "file", 4))
+		return _rtlsdr_file_index(serial);
+
+	cnt = rtlsdr_get_device_list(&list);
+
+	if (cnt <= 0) {
+		rtlsdr_free_device_list(list);
+		return -2;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (!list[i].usb_error && !strcmp(serial, list[i].serial)) {
+			r = i;
+			break;
+		}
+	}
+
+	rtlsdr_free_device_list(list);
+
+	return r;
+}
+
+/* Returns true if the manufact_check and product_check strings match what is in the dongles EEPROM */
 int rtlsdr_check_dongle_model(void *dev, char *manufact_check, char *product_check)
 {
 	if ((strcmp(((rtlsdr_dev_t *)dev)->manufact, manufact_check) == 0&& strcmp(((rtlsdr_dev_t *)dev)->product, product_check) == 0))
@@ -1442,7 +2109,113 @@ int rtlsdr_check_dongle_model(void *dev, char *manufact_check, char *product_che
 }
 
 
-int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
+/* the order the tuners have always been probed in */
+static const enum rtlsdr_tuner probe_order[] = {
+	RTLSDR_TUNER_E4000,
+	RTLSDR_TUNER_FC0013,
+	RTLSDR_TUNER_R820T,
+	RTLSDR_TUNER_R828D,
+	RTLSDR_TUNER_FC2580,
+	RTLSDR_TUNER_FC0012,
+};
+
+/* a single read of the check register, the i2c repeater must be on */
+static int _rtlsdr_tuner_answers(rtlsdr_dev_t *dev, enum rtlsdr_tuner type,
+				 int *gpio_reset)
+{
+	uint8_t reg;
+
+	switch (type) {
+	case RTLSDR_TUNER_E4000:
+		reg = rtlsdr_i2c_read_reg(dev, E4K_I2C_ADDR, E4K_CHECK_ADDR);
+		return reg == E4K_CHECK_VAL;
+	case RTLSDR_TUNER_FC0013:
+		reg = rtlsdr_i2c_read_reg(dev, FC0013_I2C_ADDR, FC0013_CHECK_ADDR);
+		return reg == FC0013_CHECK_VAL;
+	case RTLSDR_TUNER_R820T:
+		reg = rtlsdr_i2c_read_reg(dev, R820T_I2C_ADDR, R82XX_CHECK_ADDR);
+		return reg == R82XX_CHECK_VAL;
+	case RTLSDR_TUNER_R828D:
+		reg = rtlsdr_i2c_read_reg(dev, R828D_I2C_ADDR, R82XX_CHECK_ADDR);
+		return reg == R82XX_CHECK_VAL;
+	case RTLSDR_TUNER_FC2580:
+	case RTLSDR_TUNER_FC0012:
+		if (!*gpio_reset) {
+			/* initialise GPIOs */
+			rtlsdr_set_gpio_output(dev, 4);
+
+			/* reset tuner before probing */
+			rtlsdr_set_gpio_bit(dev, 4, 1);
+			rtlsdr_set_gpio_bit(dev, 4, 0);
+			*gpio_reset = 1;
+		}
+
+		if (type == RTLSDR_TUNER_FC2580) {
+			reg = rtlsdr_i2c_read_reg(dev, FC2580_I2C_ADDR, FC2580_CHECK_ADDR);
+			return (reg & 0x7f) == FC2580_CHECK_VAL;
+		}
+
+		reg = rtlsdr_i2c_read_reg(dev, FC0012_I2C_ADDR, FC0012_CHECK_ADDR);
+		return reg == FC0012_CHECK_VAL;
+	default:
+		return 0;
+	}
+}
+
+/* the hinted tuner is checked first, the others only if it doesn't answer */
+static enum rtlsdr_tuner _rtlsdr_probe_tuner(rtlsdr_dev_t *dev,
+					     enum rtlsdr_tuner hint)
+{
+	unsigned int i;
+	int gpio_reset = 0;
+
+	if (hint != RTLSDR_TUNER_UNKNOWN &&
+	    _rtlsdr_tuner_answers(dev, hint, &gpio_reset))
+		return hint;
+
+	for (i = 0; i < sizeof(probe_order)/sizeof(probe_order[0]); i++) {
+		if (probe_order[i] == hint)
+			continue;
+
+		if (_rtlsdr_tuner_answers(dev, probe_order[i], &gpio_reset))
+			return probe_order[i];
+	}
+
+	return RTLSDR_TUNER_UNKNOWN;
+}
+
+static void _rtlsdr_tuner_found(rtlsdr_dev_t *dev)
+{
+	switch (dev->tuner_type) {
+	case RTLSDR_TUNER_E4000:
+		fprintf(stderr, "Found Elonics E4000 tuner\n");
+		break;
+	case RTLSDR_TUNER_FC0013:
+		fprintf(stderr, "Found Fitipower FC0013 tuner\n");
+		break;
+	case RTLSDR_TUNER_R820T:
+		fprintf(stderr, "Found Rafael Micro R820T tuner\n");
+		break;
+	case RTLSDR_TUNER_R828D:
+		fprintf(stderr, "Found Rafael Micro R828D tuner\n");
+
+		if (rtlsdr_check_dongle_model(dev, "RTLSDRBlog", "Blog V4"))
+			fprintf(stderr, "RTL-SDR Blog V4 Detected\n");
+		break;
+	case RTLSDR_TUNER_FC2580:
+		fprintf(stderr, "Found FCI 2580 tuner\n");
+		break;
+	case RTLSDR_TUNER_FC0012:
+		fprintf(stderr, "Found Fitipower FC0012 tuner\n");
+		rtlsdr_set_gpio_output(dev, 6);
+		break;
+	default:
+		break;
+	}
+}
+
+static int _rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index,
+			const rtlsdr_dev_info_t *info)
 {
 	int r;
 	int i;
@@ -1451,15 +2224,26 @@ int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
 	libusb_device *device = NULL;
 	uint32_t device_count = 0;
 	struct libusb_device_descriptor dd;
-	uint8_t reg;
+	struct rtlsdr_port want;
+	enum rtlsdr_tuner hint = RTLSDR_TUNER_UNKNOWN;
 	ssize_t cnt;
 
+	if (info) {
+		memset(&want, 0, sizeof(want));
+		want.bus = info->bus;
+		want.address = info->address;
+		want.depth = info->port_depth;
+		memcpy(want.ports, info->ports, sizeof(want.ports));
+		hint = info->tuner_type;
+	}
+
 	dev = malloc(sizeof(rtlsdr_dev_t));
 	if (NULL == dev)
 		return -ENOMEM;
 
 	memset(dev, 0, sizeof(rtlsdr_dev_t));
 	memcpy(dev->fir, fir_default, sizeof(fir_default));
+	dev->i2c_repeater = -1;
 
 	r = libusb_init(&dev->ctx);
 	if(r < 0){
@@ -1476,6 +2260,17 @@ int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
 
 		libusb_get_device_descriptor(list[i], &dd);
 
+		if (info) {
+			if (dd.idVendor == info->vid && dd.idProduct == info->pid) {
+				_rtlsdr_port_of(device, &dev->port);
+				if (_rtlsdr_port_same(&dev->port, &want))
+					break;
+			}
+
+			device = NULL;
+			continue;
+		}
+
 		if (find_known_device(dd.idVendor, dd.idProduct)) {
 			device_count++;
 		}
@@ -1487,10 +2282,15 @@ int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
 	}
 
 	if (!device) {
+		libusb_free_device_list(list, 1);
 		r = -1;
 		goto err;
 	}
 
+	_rtlsdr_port_of(device, &dev->port);
+	if (hint == RTLSDR_TUNER_UNKNOWN)
+		hint = _rtlsdr_cached_tuner(&dev->port);
+
 	r = libusb_open(device, &dev->devh);
 	if (r < 0) {
 		libusb_free_device_list(list, 1);
@@ -1543,64 +2343,13 @@ int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
 	/* Get device manufacturer and product id */
 	r = rtlsdr_get_usb_strings(dev, dev->manufact, dev->product, NULL);
 
-	/* Probe tuners */
+	/* Probe tuners, the hinted one first */
 	rtlsdr_set_i2c_repeater(dev, 1);
 
-	reg = rtlsdr_i2c_read_reg(dev, E4K_I2C_ADDR, E4K_CHECK_ADDR);
-	if (reg == E4K_CHECK_VAL) {
-		fprintf(stderr, "Found Elonics E4000 tuner\n");
-		dev->tuner_type = RTLSDR_TUNER_E4000;
-		goto found;
-	}
-
-	reg = rtlsdr_i2c_read_reg(dev, FC0013_I2C_ADDR, FC0013_CHECK_ADDR);
-	if (reg == FC0013_CHECK_VAL) {
-		fprintf(stderr, "Found Fitipower FC0013 tuner\n");
-		dev->tuner_type = RTLSDR_TUNER_FC0013;
-		goto found;
-	}
-
-	reg = rtlsdr_i2c_read_reg(dev, R820T_I2C_ADDR, R82XX_CHECK_ADDR);
-	if (reg == R82XX_CHECK_VAL) {
-		fprintf(stderr, "Found Rafael Micro R820T tuner\n");
-		dev->tuner_type = RTLSDR_TUNER_R820T;
-		goto found;
-	}
-
-	reg = rtlsdr_i2c_read_reg(dev, R828D_I2C_ADDR, R82XX_CHECK_ADDR);
-	if (reg == R82XX_CHECK_VAL) {
-		fprintf(stderr, "Found Rafael Micro R828D tuner\n");
-
-		if (rtlsdr_check_dongle_model(dev, "RTLSDRBlog", "Blog V4"))
-			fprintf(stderr, "RTL-SDR Blog V4 Detected\n");
-
-		dev->tuner_type = RTLSDR_TUNER_R828D;
-		goto found;
-	}
-
-	/* initialise GPIOs */
-	rtlsdr_set_gpio_output(dev, 4);
-
-	/* reset tuner before probing */
-	rtlsdr_set_gpio_bit(dev, 4, 1);
-	rtlsdr_set_gpio_bit(dev, 4, 0);
-
-	reg = rtlsdr_i2c_read_reg(dev, FC2580_I2C_ADDR, FC2580_CHECK_ADDR);
-	if ((reg & 0x7f) == FC2580_CHECK_VAL) {
-		fprintf(stderr, "Found FCI 2580 tuner\n");
-		dev->tuner_type = RTLSDR_TUNER_FC2580;
-		goto found;
-	}
-
-	reg = rtlsdr_i2c_read_reg(dev, FC0012_I2C_ADDR, FC0012_CHECK_ADDR);
-	if (reg == FC0012_CHECK_VAL) {
-		fprintf(stderr, "Found Fitipower FC0012 tuner\n");
-		rtlsdr_set_gpio_output(dev, 6);
-		dev->tuner_type = RTLSDR_TUNER_FC0012;
-		goto found;
-	}
+	dev->tuner_type = _rtlsdr_probe_tuner(dev, hint);
+	_rtlsdr_tuner_found(dev);
+	_rtlsdr_cache_tuner(&dev->port, dev->tuner_type);
 
-found:
 	/* use the rtl clock value by default */
 	dev->tun_xtal = dev->rtl_xtal;
 	dev->tuner = &tuners[dev->tuner_type];
@@ -1656,11 +2405,44 @@ err:
 	return r;
 }
 
+int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
+{
+	const char *spec = _rtlsdr_file_spec(index);
+
+	if (spec)
+		return _rtlsdr_file_open(out_dev, spec);
+
+	return _rtlsdr_open(out_dev, index, NULL);
+}
+
+int rtlsdr_open_info(rtlsdr_dev_t **out_dev, const rtlsdr_dev_info_t *info)
+{
+	if (!info)
+		return -1;
+
+	return _rtlsdr_open(out_dev, 0, info);
+}
+
 int rtlsdr_close(rtlsdr_dev_t *dev)
 {
 	if (!dev)
 		return -1;
 
+	if (dev->file) {
+		while (RTLSDR_INACTIVE != dev->async_status) {
+#ifdef _WIN32
+			Sleep(1);
+#else
+			usleep(1000);
+#endif
+		}
+
+		_rtlsdr_file_unmap(dev->file);
+		free(dev->file);
+		free(dev);
+		return 0;
+	}
+
 	if(!dev->dev_lost) {
 		/* block until all async operations have been completed (if any) */
 		while (RTLSDR_INACTIVE != dev->async_status) {
@@ -1689,6 +2471,7 @@ int rtlsdr_close(rtlsdr_dev_t *dev)
 
 	libusb_exit(dev->ctx);
 
+	r82xx_set_fast_hop(&dev->r82xx_p, 0, 0);
 	free(dev);
 
 	return 0;
@@ -1701,6 +2484,7 @@ int rtlsdr_reset_buffer(rtlsdr_dev_t *dev)
 
 	rtlsdr_write_reg(dev, USBB, USB_EPA_CTL, 0x1002, 2);
 	rtlsdr_write_reg(dev, USBB, USB_EPA_CTL, 0x0000, 2);
+	_rtlsdr_file_repace(dev);
 
 	return 0;
 }
@@ -1710,25 +2494,272 @@ int rtlsdr_read_sync(rtlsdr_dev_t *dev, void *buf, int len, int *n_read)
 	if (!dev)
 		return -1;
 
+	if (dev->file)
+		return _rtlsdr_file_read_sync(dev, buf, len, n_read);
+
 	return libusb_bulk_transfer(dev->devh, 0x81, buf, len, n_read, BULK_TIMEOUT);
 }
 
+static uint64_t _rtlsdr_now_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000ULL +
+		(uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* every callback goes through here, to time it */
+static void _rtlsdr_callback(rtlsdr_dev_t *dev, unsigned char *buf,
+			     uint32_t len, const rtlsdr_buffer_info_t *info)
+{
+	rtlsdr_callback_stats_t *st = &dev->cb_stats;
+	uint64_t t, limit = 1000;
+	int b = 0;
+
+	t = _rtlsdr_now_ns();
+	if (dev->cb_ex)
+		dev->cb_ex(buf, len, info, dev->cb_ctx);
+	else if (dev->cb)
+		dev->cb(buf, len, dev->cb_ctx);
+	t = _rtlsdr_now_ns() - t;
+
+	while (b < RTLSDR_CB_HIST_LEN - 1 && t > limit) {
+		limit <<= 1;
+		b++;
+	}
+	st->hist[b]++;
+	st->total_ns += t;
+	if (t > st->max_ns)
+		st->max_ns = t;
+	st->calls++;
+}
+
+static int _rtlsdr_submit(rtlsdr_dev_t *dev, unsigned int i)
+{
+	int r;
+
+	dev->xfer_seq[i] = dev->submit_seq++;
+	r = libusb_submit_transfer(dev->xfer[i]);
+	if (r < 0) {
+		/* this transfer is gone for the rest of the stream, but no sample
+		 * went missing with it, so don't leave a hole in the sequence */
+		dev->submit_seq--;
+		dev->stats.xfer_errors++;
+		dev->pending_errors++;
+		dev->pending_flags |= RTLSDR_BUF_XFER_ERROR;
+	}
+	return r;
+}
+
+/*
+ * Latency target: how many parked transfers to add after the one that just
+ * completed is resubmitted, or -1 to park it instead. The slack is how much
+ * longer the transfers still out could have waited for this resubmit.
+ */
+static int _rtlsdr_adapt(rtlsdr_dev_t *dev)
+{
+	uint64_t now = _rtlsdr_now_ns();
+	uint64_t gap = dev->last_complete_ns ? now - dev->last_complete_ns : dev->xfer_ns;
+	int64_t xfer_ns = (int64_t)dev->xfer_ns;
+	int64_t slack;
+	int n = 0;
+
+	dev->last_complete_ns = now;
+	if (RTLSDR_RUNNING != dev->async_status)
+		return 0;
+
+	slack = (int64_t)dev->xfer_active * xfer_ns - (int64_t)gap;
+	if (slack < dev->window_slack_ns)
+		dev->window_slack_ns = slack;
+
+	if (slack < xfer_ns) {
+		/* less than a transfer to spare, add enough to have one */
+		n = (int)((xfer_ns - slack + xfer_ns - 1) / xfer_ns);
+		if (n > (int)dev->parked_len)
+			n = (int)dev->parked_len;
+	} else if (now - dev->window_start_ns < LATENCY_WINDOW_NS) {
+		return 0;
+	} else if (dev->window_slack_ns > 2 * xfer_ns &&
+		   dev->xfer_active > LATENCY_MIN_XFERS) {
+		/* two to spare all along, one fewer still leaves one */
+		n = -1;
+	}
+
+	dev->window_start_ns = now;
+	dev->window_slack_ns = INT64_MAX;
+	return n;
+}
+
+static int _rtlsdr_parked(rtlsdr_dev_t *dev, unsigned int i)
+{
+	uint32_t j;
+
+	for (j = 0; j < dev->parked_len; j++)
+		if (dev->parked[j] == i)
+			return 1;
+	return 0;
+}
+
+static void _rtlsdr_park(rtlsdr_dev_t *dev, unsigned int i)
+{
+	dev->parked[dev->parked_len++] = i;
+	dev->xfer_active--;
+}
+
+static void _rtlsdr_resubmit(rtlsdr_dev_t *dev, struct libusb_transfer *xfer,
+			     unsigned int i)
+{
+	unsigned int j;
+	int n = 0;
+
+	if (dev->latency_us && i < dev->xfer_buf_num)
+		n = _rtlsdr_adapt(dev);
+
+	if (n < 0) {
+		_rtlsdr_park(dev, i);
+		dev->stats.xfer_shrinks++;
+	} else if (i < dev->xfer_buf_num) {
+		/* a transfer that can't go back can come out of the parked
+		 * ones again later */
+		if (_rtlsdr_submit(dev, i) < 0 && dev->latency_us)
+			_rtlsdr_park(dev, i);
+	} else {
+		libusb_submit_transfer(xfer);
+	}
+
+	for (; n > 0; n--) {
+		j = dev->parked[--dev->parked_len];
+		dev->xfer_seq[j] = dev->submit_seq++;
+		if (libusb_submit_transfer(dev->xfer[j]) < 0) {
+			/* most likely out of usbfs memory, no sample is lost */
+			dev->submit_seq--;
+			dev->parked_len++;
+			break;
+		}
+		dev->xfer_active++;
+		dev->stats.xfer_grows++;
+	}
+	dev->stats.xfers = dev->xfer_active;
+	dev->xfer_errors = 0;
+}
+
+static unsigned char *_rtlsdr_queue_swap(rtlsdr_dev_t *dev,
+					 struct libusb_transfer *xfer)
+/* event thread, returns the filled buffer or NULL when nothing is spare */
+{
+	unsigned char *filled = xfer->buffer;
+	uint32_t tail = dev->spare_tail;
+
+	if (ring_load(&dev->spare_head) == tail)
+		return NULL;
+	xfer->buffer = dev->spare[tail % dev->queue_depth];
+	ring_store(&dev->spare_tail, tail + 1);
+	return filled;
+}
+
+static void _rtlsdr_queue_publish(rtlsdr_dev_t *dev, unsigned char *buf,
+				  uint32_t len, rtlsdr_buffer_info_t *info)
+{
+	struct rtlsdr_queued *q;
+	uint32_t head = dev->ready_head;
+	uint32_t depth;
+
+	/* there are only queue_depth buffers out of the transfers, this fits */
+	q = &dev->ready[head % dev->queue_depth];
+	q->buf = buf;
+	q->len = len;
+	q->info = *info;
+	ring_store(&dev->ready_head, head + 1);
+
+	depth = head + 1 - ring_load(&dev->ready_tail);
+	if (depth > dev->stats.queue_high_water)
+		dev->stats.queue_high_water = depth;
+
+	pthread_mutex_lock(&dev->queue_lock);
+	pthread_cond_signal(&dev->queue_cond);
+	pthread_mutex_unlock(&dev->queue_lock);
+}
+
 static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer)
 {
 	rtlsdr_dev_t *dev = (rtlsdr_dev_t *)xfer->user_data;
+	rtlsdr_buffer_info_t info;
+	unsigned char *buf;
+	unsigned int i;
+	uint32_t len;
+
+	for (i = 0; i < dev->xfer_buf_num; i++)
+		if (dev->xfer[i] == xfer)
+			break;
 
 	if (LIBUSB_TRANSFER_COMPLETED == xfer->status) {
-		if (dev->cb)
-			dev->cb(xfer->buffer, xfer->actual_length, dev->cb_ctx);
+		len = (uint32_t)xfer->actual_length;
+		info.timestamp_ns = _rtlsdr_now_ns();
+		info.sample_index = dev->stream_samples;
+		info.flags = dev->pending_flags;
+		info.xfer_errors = dev->pending_errors;
+
+		/* transfers complete in submission order unless one was lost */
+		if (i < dev->xfer_buf_num) {
+			if (dev->xfer_seq[i] != dev->complete_seq)
+				info.flags |= RTLSDR_BUF_DISCONTINUITY;
+			if (dev->xfer_seq[i] >= dev->complete_seq)
+				dev->complete_seq = dev->xfer_seq[i] + 1;
+		}
+		if (len < dev->xfer_buf_len)
+			info.flags |= RTLSDR_BUF_SHORT;
+
+		dev->stream_samples += len / 2;
+
+		if (dev->queue_active) {
+			/* swap in a spare buffer so the transfer goes straight back */
+			buf = _rtlsdr_queue_swap(dev, xfer);
+			if (!buf) {
+				/* the callback is a whole queue behind, this one is lost */
+				dev->stats.queue_drops++;
+				dev->pending_flags |= RTLSDR_BUF_DISCONTINUITY;
+				_rtlsdr_resubmit(dev, xfer, i);
+				return;
+			}
+		}
+
+		dev->pending_flags = 0;
+		dev->pending_errors = 0;
+		dev->stats.buffers++;
+		dev->stats.samples += len / 2;
+		if (info.flags & RTLSDR_BUF_DISCONTINUITY)
+			dev->stats.discontinuities++;
+		if (info.flags & RTLSDR_BUF_SHORT)
+			dev->stats.short_xfers++;
+
+		if (dev->queue_active) {
+			_rtlsdr_resubmit(dev, xfer, i);
+			_rtlsdr_queue_publish(dev, buf, len, &info);
+			return;
+		}
 
-		libusb_submit_transfer(xfer); /* resubmit transfer */
+		_rtlsdr_callback(dev, xfer->buffer, len, &info);
+
+		_rtlsdr_resubmit(dev, xfer, i);
 		dev->xfer_errors = 0;
 	} else if (LIBUSB_TRANSFER_CANCELLED != xfer->status) {
+		dev->stats.xfer_errors++;
+		dev->pending_errors++;
+		dev->pending_flags |= RTLSDR_BUF_XFER_ERROR;
+		/* whatever it held is gone, leave a gap in sample_index */
+		dev->stream_samples += dev->xfer_buf_len / 2;
 #ifndef _WIN32
 		if (LIBUSB_TRANSFER_ERROR == xfer->status)
 			dev->xfer_errors++;
 
-		if (dev->xfer_errors >= dev->xfer_buf_num ||
+		if (dev->xfer_errors >= dev->xfer_active ||
 		    LIBUSB_TRANSFER_NO_DEVICE == xfer->status) {
 #endif
 			dev->dev_lost = 1;
@@ -1749,6 +2780,8 @@ int rtlsdr_wait_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx)
 static int _rtlsdr_alloc_async_buffers(rtlsdr_dev_t *dev)
 {
 	unsigned int i;
+	/* queued mode keeps queue_depth spare buffers next to the transfers */
+	unsigned int n = dev ? dev->xfer_buf_num + dev->queue_depth : 0;
 
 	if (!dev)
 		return -1;
@@ -1759,19 +2792,29 @@ static int _rtlsdr_alloc_async_buffers(rtlsdr_dev_t *dev)
 
 		for(i = 0; i < dev->xfer_buf_num; ++i)
 			dev->xfer[i] = libusb_alloc_transfer(0);
+
+		dev->xfer_seq = calloc(dev->xfer_buf_num, sizeof(uint64_t));
+		dev->parked = calloc(dev->xfer_buf_num, sizeof(uint32_t));
 	}
 
 	if (dev->xfer_buf)
 		return -2;
 
-	dev->xfer_buf = malloc(dev->xfer_buf_num * sizeof(unsigned char *));
-	memset(dev->xfer_buf, 0, dev->xfer_buf_num * sizeof(unsigned char *));
+	dev->xfer_buf = malloc(n * sizeof(unsigned char *));
+	memset(dev->xfer_buf, 0, n * sizeof(unsigned char *));
+
+	if (dev->queue_depth) {
+		dev->ready = calloc(dev->queue_depth, sizeof(struct rtlsdr_queued));
+		dev->spare = calloc(dev->queue_depth, sizeof(unsigned char *));
+		if (!dev->ready || !dev->spare)
+			return -ENOMEM;
+	}
 
 #if defined(ENABLE_ZEROCOPY) && defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
-	fprintf(stderr, "Allocating %d zero-copy buffers\n", dev->xfer_buf_num);
+	fprintf(stderr, "Allocating %d zero-copy buffers\n", n);
 
 	dev->use_zerocopy = 1;
-	for (i = 0; i < dev->xfer_buf_num; ++i) {
+	for (i = 0; i < n; ++i) {
 		dev->xfer_buf[i] = libusb_dev_mem_alloc(dev->devh, dev->xfer_buf_len);
 
 		if (dev->xfer_buf[i]) {
@@ -1802,7 +2845,7 @@ static int _rtlsdr_alloc_async_buffers(rtlsdr_dev_t *dev)
 	/* zero-copy buffer allocation failed (partially or completely)
 	 * we need to free the buffers again if already allocated */
 	if (!dev->use_zerocopy) {
-		for (i = 0; i < dev->xfer_buf_num; ++i) {
+		for (i = 0; i < n; ++i) {
 			if (dev->xfer_buf[i])
 				libusb_dev_mem_free(dev->devh,
 						    dev->xfer_buf[i],
@@ -1813,7 +2856,7 @@ static int _rtlsdr_alloc_async_buffers(rtlsdr_dev_t *dev)
 
 	/* no zero-copy available, allocate buffers in userspace */
 	if (!dev->use_zerocopy) {
-		for (i = 0; i < dev->xfer_buf_num; ++i) {
+		for (i = 0; i < n; ++i) {
 			dev->xfer_buf[i] = malloc(dev->xfer_buf_len);
 
 			if (!dev->xfer_buf[i])
@@ -1840,10 +2883,14 @@ static int _rtlsdr_free_async_buffers(rtlsdr_dev_t *dev)
 
 		free(dev->xfer);
 		dev->xfer = NULL;
+		free(dev->xfer_seq);
+		dev->xfer_seq = NULL;
+		free(dev->parked);
+		dev->parked = NULL;
 	}
 
 	if (dev->xfer_buf) {
-		for (i = 0; i < dev->xfer_buf_num; ++i) {
+		for (i = 0; i < dev->xfer_buf_num + dev->queue_depth; ++i) {
 			if (dev->xfer_buf[i]) {
 				if (dev->use_zerocopy) {
 #if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
@@ -1861,11 +2908,16 @@ static int _rtlsdr_free_async_buffers(rtlsdr_dev_t *dev)
 		dev->xfer_buf = NULL;
 	}
 
+	free(dev->ready);
+	dev->ready = NULL;
+	free(dev->spare);
+	dev->spare = NULL;
+
 	return 0;
 }
 
-int rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx,
-			  uint32_t buf_num, uint32_t buf_len)
+static int _rtlsdr_event_loop(rtlsdr_dev_t *dev,
+			      enum rtlsdr_async_status *status)
 {
 	unsigned int i;
 	int r = 0;
@@ -1873,53 +2925,6 @@ int rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx,
 	struct timeval zerotv = { 0, 0 };
 	enum rtlsdr_async_status next_status = RTLSDR_INACTIVE;
 
-	if (!dev)
-		return -1;
-
-	if (RTLSDR_INACTIVE != dev->async_status)
-		return -2;
-
-	dev->async_status = RTLSDR_RUNNING;
-	dev->async_cancel = 0;
-
-	dev->cb = cb;
-	dev->cb_ctx = ctx;
-
-	if (buf_num > 0)
-		dev->xfer_buf_num = buf_num;
-	else
-		dev->xfer_buf_num = DEFAULT_BUF_NUMBER;
-
-	if (buf_len > 0 && buf_len % 512 == 0) /* len must be multiple of 512 */
-		dev->xfer_buf_len = buf_len;
-	else
-		dev->xfer_buf_len = DEFAULT_BUF_LENGTH;
-
-	_rtlsdr_alloc_async_buffers(dev);
-
-	for(i = 0; i < dev->xfer_buf_num; ++i) {
-		libusb_fill_bulk_transfer(dev->xfer[i],
-					  dev->devh,
-					  0x81,
-					  dev->xfer_buf[i],
-					  dev->xfer_buf_len,
-					  _libusb_callback,
-					  (void *)dev,
-					  BULK_TIMEOUT);
-
-		r = libusb_submit_transfer(dev->xfer[i]);
-		if (r < 0) {
-			fprintf(stderr, "Failed to submit transfer %i\n"
-					"Please increase your allowed " 
-					"usbfs buffer size with the "
-					"following command:\n"
-					"echo 0 > /sys/module/usbcore"
-					"/parameters/usbfs_memory_mb\n", i);
-			dev->async_status = RTLSDR_CANCELING;
-			break;
-		}
-	}
-
 	while (RTLSDR_INACTIVE != dev->async_status) {
 		r = libusb_handle_events_timeout_completed(dev->ctx, &tv,
 							   &dev->async_cancel);
@@ -1937,7 +2942,8 @@ int rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx,
 				break;
 
 			for(i = 0; i < dev->xfer_buf_num; ++i) {
-				if (!dev->xfer[i])
+				/* parked ones were never submitted */
+				if (!dev->xfer[i] || _rtlsdr_parked(dev, i))
 					continue;
 
 				if (LIBUSB_TRANSFER_CANCELLED !=
@@ -1969,6 +2975,225 @@ int rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx,
 		}
 	}
 
+	*status = next_status;
+	return r;
+}
+
+static void *_rtlsdr_event_thread(void *arg)
+{
+	rtlsdr_dev_t *dev = (rtlsdr_dev_t *)arg;
+	enum rtlsdr_async_status status;
+#ifdef _WIN32
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+#else
+	struct sched_param param;
+	int policy;
+
+	/* keep what a real-time caller handed down, otherwise best effort,
+	 * without the privilege this stays a normal thread */
+	if (pthread_getschedparam(pthread_self(), &policy, &param) ||
+	    (policy != SCHED_FIFO && policy != SCHED_RR)) {
+		param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+		pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	}
+#endif
+
+	dev->event_result = _rtlsdr_event_loop(dev, &status);
+
+	pthread_mutex_lock(&dev->queue_lock);
+	dev->event_status = status;
+	dev->event_done = 1;
+	pthread_cond_signal(&dev->queue_cond);
+	pthread_mutex_unlock(&dev->queue_lock);
+	return NULL;
+}
+
+static int _rtlsdr_run_queued(rtlsdr_dev_t *dev,
+			      enum rtlsdr_async_status *status)
+/* events in a thread of ours, the callback runs here off the queue */
+{
+	struct rtlsdr_queued *q;
+	uint32_t i, tail;
+	int done;
+
+	for (i = 0; i < dev->queue_depth; i++)
+		dev->spare[i] = dev->xfer_buf[dev->xfer_buf_num + i];
+	dev->spare_head = dev->queue_depth;
+	dev->spare_tail = 0;
+	dev->ready_head = 0;
+	dev->ready_tail = 0;
+	dev->event_done = 0;
+
+	pthread_mutex_init(&dev->queue_lock, NULL);
+	pthread_cond_init(&dev->queue_cond, NULL);
+	dev->queue_active = 1;
+	if (pthread_create(&dev->event_thread, NULL, _rtlsdr_event_thread, dev)) {
+		/* no thread, run the callback inline like the plain mode */
+		dev->queue_active = 0;
+		pthread_mutex_destroy(&dev->queue_lock);
+		pthread_cond_destroy(&dev->queue_cond);
+		return _rtlsdr_event_loop(dev, status);
+	}
+
+	while (1) {
+		pthread_mutex_lock(&dev->queue_lock);
+		while (ring_load(&dev->ready_head) == dev->ready_tail &&
+		       !dev->event_done)
+			pthread_cond_wait(&dev->queue_cond, &dev->queue_lock);
+		done = dev->event_done;
+		pthread_mutex_unlock(&dev->queue_lock);
+
+		tail = dev->ready_tail;
+		if (ring_load(&dev->ready_head) == tail) {
+			if (done)
+				break;
+			continue;
+		}
+
+		q = &dev->ready[tail % dev->queue_depth];
+		_rtlsdr_callback(dev, q->buf, q->len, &q->info);
+
+		/* hand the buffer back for the next completed transfer */
+		dev->spare[dev->spare_head % dev->queue_depth] = q->buf;
+		ring_store(&dev->spare_head, dev->spare_head + 1);
+		ring_store(&dev->ready_tail, tail + 1);
+	}
+
+	pthread_join(dev->event_thread, NULL);
+	dev->queue_active = 0;
+	pthread_mutex_destroy(&dev->queue_lock);
+	pthread_cond_destroy(&dev->queue_cond);
+	*status = dev->event_status;
+	return dev->event_result;
+}
+
+/*
+ * Latency target: no sample may wait in the transfers longer than the
+ * target, which is cut into LATENCY_XFERS so the count has room to grow
+ * and to shrink. buf_num and buf_len, when given, are upper bounds.
+ * LATENCY_MIN_LEN and LATENCY_MIN_XFERS win over a target too small
+ * for them, rtl-sdr.h documents what that holds.
+ */
+static void _rtlsdr_latency_sizes(rtlsdr_dev_t *dev, uint32_t buf_num,
+				  uint32_t buf_len)
+{
+	uint64_t budget = (uint64_t)dev->rate * 2 * dev->latency_us / 1000000;
+	uint64_t len = budget / LATENCY_XFERS;
+	uint64_t max_len = buf_len > 0 ? buf_len : DEFAULT_BUF_LENGTH;
+	uint64_t num;
+
+	if (len > max_len)
+		len = max_len;
+	len -= len % 512;
+	if (len < LATENCY_MIN_LEN)
+		len = LATENCY_MIN_LEN;
+
+	num = budget / len;
+	if (buf_num > 0 && num > buf_num)
+		num = buf_num;
+	if (num > LATENCY_MAX_XFERS)
+		num = LATENCY_MAX_XFERS;
+	if (num < LATENCY_MIN_XFERS)
+		num = LATENCY_MIN_XFERS;
+
+	dev->xfer_buf_len = (uint32_t)len;
+	dev->xfer_buf_num = (uint32_t)num;
+	dev->xfer_active = (uint32_t)(num + 1) / 2;
+	if (dev->xfer_active < LATENCY_MIN_XFERS)
+		dev->xfer_active = LATENCY_MIN_XFERS;
+	dev->xfer_ns = len / 2 * 1000000000ULL / dev->rate;
+}
+
+static int _rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb,
+			      rtlsdr_read_async_ex_cb_t cb_ex, void *ctx,
+			      uint32_t buf_num, uint32_t buf_len)
+{
+	unsigned int i;
+	int r = 0;
+	enum rtlsdr_async_status next_status = RTLSDR_INACTIVE;
+
+	if (!dev)
+		return -1;
+
+	if (RTLSDR_INACTIVE != dev->async_status)
+		return -2;
+
+	dev->async_status = RTLSDR_RUNNING;
+	dev->async_cancel = 0;
+
+	dev->cb = cb;
+	dev->cb_ex = cb_ex;
+	dev->cb_ctx = ctx;
+
+	dev->submit_seq = 0;
+	dev->complete_seq = 0;
+	dev->stream_samples = 0;
+	dev->pending_flags = 0;
+	dev->pending_errors = 0;
+
+	if (dev->latency_us && dev->rate) {
+		_rtlsdr_latency_sizes(dev, buf_num, buf_len);
+	} else {
+		if (buf_num > 0)
+			dev->xfer_buf_num = buf_num;
+		else
+			dev->xfer_buf_num = DEFAULT_BUF_NUMBER;
+
+		if (buf_len > 0 && buf_len % 512 == 0) /* len must be multiple of 512 */
+			dev->xfer_buf_len = buf_len;
+		else
+			dev->xfer_buf_len = DEFAULT_BUF_LENGTH;
+		dev->xfer_active = dev->xfer_buf_num;
+	}
+	dev->parked_len = 0;
+	dev->last_complete_ns = 0;
+	dev->window_start_ns = _rtlsdr_now_ns();
+	dev->window_slack_ns = INT64_MAX;
+	dev->stats.xfer_len = dev->xfer_buf_len;
+	dev->stats.xfers = dev->xfer_active;
+
+	if (dev->file) {
+		r = _rtlsdr_file_stream(dev);
+		dev->async_status = RTLSDR_INACTIVE;
+		return r;
+	}
+
+	_rtlsdr_alloc_async_buffers(dev);
+
+	for(i = 0; i < dev->xfer_buf_num; ++i) {
+		libusb_fill_bulk_transfer(dev->xfer[i],
+					  dev->devh,
+					  0x81,
+					  dev->xfer_buf[i],
+					  dev->xfer_buf_len,
+					  _libusb_callback,
+					  (void *)dev,
+					  BULK_TIMEOUT);
+
+		/* the latency target starts with some of them held back */
+		if (i >= dev->xfer_active) {
+			dev->parked[dev->parked_len++] = i;
+			continue;
+		}
+
+		r = _rtlsdr_submit(dev, i);
+		if (r < 0) {
+			fprintf(stderr, "Failed to submit transfer %i\n"
+					"Please increase your allowed " 
+					"usbfs buffer size with the "
+					"following command:\n"
+					"echo 0 > /sys/module/usbcore"
+					"/parameters/usbfs_memory_mb\n", i);
+			dev->async_status = RTLSDR_CANCELING;
+			break;
+		}
+	}
+
+	if (dev->queue_depth && RTLSDR_RUNNING == dev->async_status)
+		r = _rtlsdr_run_queued(dev, &next_status);
+	else
+		r = _rtlsdr_event_loop(dev, &next_status);
+
 	_rtlsdr_free_async_buffers(dev);
 
 	dev->async_status = next_status;
@@ -1976,6 +3201,60 @@ int rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx,
 	return r;
 }
 
+int rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx,
+			  uint32_t buf_num, uint32_t buf_len)
+{
+	return _rtlsdr_read_async(dev, cb, NULL, ctx, buf_num, buf_len);
+}
+
+int rtlsdr_read_async_ex(rtlsdr_dev_t *dev, rtlsdr_read_async_ex_cb_t cb,
+			 void *ctx, uint32_t buf_num, uint32_t buf_len)
+{
+	return _rtlsdr_read_async(dev, NULL, cb, ctx, buf_num, buf_len);
+}
+
+int rtlsdr_set_async_queue(rtlsdr_dev_t *dev, uint32_t depth)
+{
+	if (!dev)
+		return -1;
+
+	if (RTLSDR_INACTIVE != dev->async_status)
+		return -2;
+
+	dev->queue_depth = depth;
+	return 0;
+}
+
+int rtlsdr_set_latency_target(rtlsdr_dev_t *dev, uint32_t max_us)
+{
+	if (!dev)
+		return -1;
+
+	if (RTLSDR_INACTIVE != dev->async_status)
+		return -2;
+
+	dev->latency_us = max_us;
+	return 0;
+}
+
+int rtlsdr_get_stream_stats(rtlsdr_dev_t *dev, rtlsdr_stream_stats_t *stats)
+{
+	if (!dev || !stats)
+		return -1;
+
+	*stats = dev->stats;
+	return 0;
+}
+
+int rtlsdr_get_callback_stats(rtlsdr_dev_t *dev, rtlsdr_callback_stats_t *stats)
+{
+	if (!dev || !stats)
+		return -1;
+
+	*stats = dev->cb_stats;
+	return 0;
+}
+
 int rtlsdr_cancel_async(rtlsdr_dev_t *dev)
 {
 	if (!dev)
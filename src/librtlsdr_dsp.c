@@ -0,0 +1,1699 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ * Copyright (C) 2012 by Steve Markgraf <steve@steve-m.de>
+ * Copyright (C) 2012 by Hoernchen <la@tfc-server.de>
+ * Copyright (C) 2012 by Kyle Keen <keenerd@gmail.com>
+ * Copyright (C) 2013 by Elias Oenal <EliasOenal@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * the dsp kernels of rtl_fm, rtl_power and rtl_adsb, each written once
+ * and picked at runtime for the widest simd the cpu has
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#if defined(_MSC_VER) && (_MSC_VER < 1800)
+#define round(x) (x > 0.0 ? floor(x + 0.5): ceil(x - 0.5))
+#endif
+#define _USE_MATH_DEFINES
+#endif
+
+#include <math.h>
+#include <pthread.h>
+
+#include "rtl-sdr_dsp.h"
+#include "convenience/simd.h"
+
+/* let gcc/ifunc pick an AVX2 build of the float FFT at runtime */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define FFT_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define FFT_TARGETS
+#endif
+
+#define RESAMPLE_ZEROS			16	/* sinc lobes each side at the lower rate */
+#define RESAMPLE_CUTOFF			0.85	/* of the lower nyquist */
+#define RESAMPLE_PHASES			1024	/* finer ratios round to the nearest below */
+#define RESAMPLE_TAPS			1024
+
+#define ATAN_LUT_SIZE			131072
+#define ATAN_LUT_COEF			8
+#define ATAN_LUT_DIRECT			4096	/* every entry below, a step per 8 above */
+
+#define DISC_BLOCK			256	/* I/Q pairs per pass of the kernels */
+
+/* {length, coef, coef, coef}  and scaled by 2^15
+   for now, only length 9, optimal way to get +85% bandwidth */
+static const int cic_9_tables[][10] = {
+	{0,},
+	{9, -156,  -97, 2798, -15489, 61019, -15489, 2798,  -97, -156},
+	{9, -128, -568, 5593, -24125, 74126, -24125, 5593, -568, -128},
+	{9, -129, -639, 6187, -26281, 77511, -26281, 6187, -639, -129},
+	{9, -122, -612, 6082, -26353, 77818, -26353, 6082, -612, -122},
+	{9, -120, -602, 6015, -26269, 77757, -26269, 6015, -602, -120},
+	{9, -120, -582, 5951, -26128, 77542, -26128, 5951, -582, -120},
+	{9, -119, -580, 5931, -26094, 77505, -26094, 5931, -580, -119},
+	{9, -119, -578, 5921, -26077, 77484, -26077, 5921, -578, -119},
+	{9, -119, -577, 5917, -26067, 77473, -26067, 5917, -577, -119},
+	{9, -199, -362, 5303, -25505, 77489, -25505, 5303, -362, -199},
+};
+
+/* 90 rotation is 1+0j, 0+1j, -1+0j, 0-1j
+   or [0, 1, -3, 2, -4, -5, 7, -6]
+   uint8_t negation = 255 - x = x ^ 0xff, so the whole thing is a
+   byte swap inside words 1 and 3 plus an xor mask, folded into the
+   u8 -> int16 conversion */
+static const unsigned char rot_swap[16] = {0,0,0xff,0xff,0,0,0xff,0xff, 0,0,0xff,0xff,0,0,0xff,0xff};
+static const unsigned char rot_neg[16]  = {0,0,0xff,0,0xff,0xff,0,0xff, 0,0,0xff,0,0xff,0xff,0,0xff};
+
+static void rotate_convert_tail(const unsigned char *buf, int16_t *out, uint32_t i, uint32_t len, int rotate)
+/* len must be even, rotation never crosses an I/Q pair */
+{
+	int k;
+	for (; i<len; i++) {
+		k = rotate ? (int)(i & 7) : 8;
+		if (k < 8) {
+			out[i] = (int16_t)(buf[i ^ (rot_swap[k] & 1)] ^ rot_neg[k]) - 127;
+		} else {
+			out[i] = (int16_t)buf[i] - 127;}
+	}
+}
+
+static void rotate_convert_c(const unsigned char *buf, int16_t *out, uint32_t len, int rotate)
+{
+	rotate_convert_tail(buf, out, 0, len, rotate);
+}
+
+#ifdef FRONT_SSE2
+static void rotate_convert_sse2(const unsigned char *buf, int16_t *out, uint32_t len, int rotate)
+{
+	uint32_t i;
+	__m128i v, s, swap, neg;
+	__m128i zero = _mm_setzero_si128();
+	__m128i bias = _mm_set1_epi16(127);
+	swap = zero;
+	neg = zero;
+	if (rotate) {
+		swap = _mm_loadu_si128((const __m128i *)rot_swap);
+		neg  = _mm_loadu_si128((const __m128i *)rot_neg);
+	}
+	for (i=0; i+16<=len; i+=16) {
+		v = _mm_loadu_si128((const __m128i *)(buf + i));
+		s = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		v = _mm_or_si128(_mm_and_si128(swap, s), _mm_andnot_si128(swap, v));
+		v = _mm_xor_si128(v, neg);
+		_mm_storeu_si128((__m128i *)(out + i),
+			_mm_sub_epi16(_mm_unpacklo_epi8(v, zero), bias));
+		_mm_storeu_si128((__m128i *)(out + i + 8),
+			_mm_sub_epi16(_mm_unpackhi_epi8(v, zero), bias));
+	}
+	rotate_convert_tail(buf, out, i, len, rotate);
+}
+#endif
+
+#ifdef FRONT_AVX2
+__attribute__((target("avx2")))
+static void rotate_convert_avx2(const unsigned char *buf, int16_t *out, uint32_t len, int rotate)
+{
+	uint32_t i;
+	__m256i v, s, swap, neg;
+	__m256i bias = _mm256_set1_epi16(127);
+	swap = _mm256_setzero_si256();
+	neg = swap;
+	if (rotate) {
+		swap = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)rot_swap));
+		neg  = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)rot_neg));
+	}
+	for (i=0; i+32<=len; i+=32) {
+		v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		s = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+		v = _mm256_blendv_epi8(v, s, swap);
+		v = _mm256_xor_si256(v, neg);
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_sub_epi16(
+			_mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)), bias));
+		_mm256_storeu_si256((__m256i *)(out + i + 16), _mm256_sub_epi16(
+			_mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)), bias));
+	}
+	rotate_convert_tail(buf, out, i, len, rotate);
+}
+#endif
+
+#ifdef FRONT_NEON
+static void rotate_convert_neon(const unsigned char *buf, int16_t *out, uint32_t len, int rotate)
+{
+	uint32_t i;
+	uint8x16_t v, swap, neg;
+	int16x8_t bias = vdupq_n_s16(127);
+	swap = vdupq_n_u8(0);
+	neg = swap;
+	if (rotate) {
+		swap = vld1q_u8(rot_swap);
+		neg  = vld1q_u8(rot_neg);
+	}
+	for (i=0; i+16<=len; i+=16) {
+		v = vld1q_u8(buf + i);
+		v = vbslq_u8(swap, vrev16q_u8(v), v);
+		v = veorq_u8(v, neg);
+		vst1q_s16(out + i, vsubq_s16(
+			vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v))), bias));
+		vst1q_s16(out + i + 8, vsubq_s16(
+			vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v))), bias));
+	}
+	rotate_convert_tail(buf, out, i, len, rotate);
+}
+#endif
+
+/* do not subtract 127 from the raw iq before these, they handle it.
+ * (i-127)^2 + (q-127)^2 is at most 32768, so it fits a uint16_t */
+
+static void magnitude_c(const uint8_t *buf, uint16_t *mag, int i, int len)
+/* takes i/q bytes from index i on */
+{
+	int a, b;
+	for (; i+1<len; i+=2) {
+		a = buf[i] - 127;
+		b = buf[i+1] - 127;
+		mag[i/2] = (uint16_t)(a*a + b*b);
+	}
+}
+
+#ifdef FRONT_SSE2
+static void magnitude_sse2(const uint8_t *buf, uint16_t *mag, int i, int len)
+{
+	__m128i v, lo, hi;
+	__m128i zero = _mm_setzero_si128();
+	__m128i bias = _mm_set1_epi16(127);
+	__m128i half = _mm_set1_epi32(32768);
+	__m128i flip = _mm_set1_epi16((short)0x8000);
+	for (; i+16<=len; i+=16) {
+		v = _mm_loadu_si128((const __m128i *)(buf + i));
+		lo = _mm_sub_epi16(_mm_unpacklo_epi8(v, zero), bias);
+		hi = _mm_sub_epi16(_mm_unpackhi_epi8(v, zero), bias);
+		/* i*i + q*q per pair in one go */
+		lo = _mm_sub_epi32(_mm_madd_epi16(lo, lo), half);
+		hi = _mm_sub_epi32(_mm_madd_epi16(hi, hi), half);
+		/* shifted into int16 range so the pack can't saturate */
+		v = _mm_xor_si128(_mm_packs_epi32(lo, hi), flip);
+		_mm_storeu_si128((__m128i *)(mag + i/2), v);
+	}
+	magnitude_c(buf, mag, i, len);
+}
+#endif
+
+#ifdef FRONT_AVX2
+__attribute__((target("avx2")))
+static void magnitude_avx2(const uint8_t *buf, uint16_t *mag, int i, int len)
+{
+	__m256i v, lo, hi;
+	__m256i bias = _mm256_set1_epi16(127);
+	__m256i half = _mm256_set1_epi32(32768);
+	__m256i flip = _mm256_set1_epi16((short)0x8000);
+	for (; i+32<=len; i+=32) {
+		v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		lo = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)), bias);
+		hi = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)), bias);
+		lo = _mm256_sub_epi32(_mm256_madd_epi16(lo, lo), half);
+		hi = _mm256_sub_epi32(_mm256_madd_epi16(hi, hi), half);
+		/* packs works per lane, put the quarters back in order */
+		v = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), _MM_SHUFFLE(3,1,2,0));
+		_mm256_storeu_si256((__m256i *)(mag + i/2), _mm256_xor_si256(v, flip));
+	}
+	magnitude_c(buf, mag, i, len);
+}
+#endif
+
+#ifdef FRONT_NEON
+static void magnitude_neon(const uint8_t *buf, uint16_t *mag, int i, int len)
+{
+	uint8x16x2_t v;
+	int16x8_t di, dq;
+	uint8x8_t bias = vdup_n_u8(127);
+	for (; i+32<=len; i+=32) {
+		v = vld2q_u8(buf + i);
+		di = vreinterpretq_s16_u16(vsubl_u8(vget_low_u8(v.val[0]), bias));
+		dq = vreinterpretq_s16_u16(vsubl_u8(vget_low_u8(v.val[1]), bias));
+		vst1q_u16(mag + i/2, vaddq_u16(vreinterpretq_u16_s16(vmulq_s16(di, di)),
+			vreinterpretq_u16_s16(vmulq_s16(dq, dq))));
+		di = vreinterpretq_s16_u16(vsubl_u8(vget_high_u8(v.val[0]), bias));
+		dq = vreinterpretq_s16_u16(vsubl_u8(vget_high_u8(v.val[1]), bias));
+		vst1q_u16(mag + i/2 + 8, vaddq_u16(vreinterpretq_u16_s16(vmulq_s16(di, di)),
+			vreinterpretq_u16_s16(vmulq_s16(dq, dq))));
+	}
+	magnitude_c(buf, mag, i, len);
+}
+#endif
+
+/* fifth order halfband + decimate, both halves of interleaved data
+ * in one pass.  Output m is the 1 5 10 10 5 1 sum of complex samples
+ * 2m-5 .. 2m, samples before the block come from hist[10] which holds
+ * the last five I/Q pairs of the previous block.
+ * a downsample should improve resolution, so don't fully shift */
+
+static int iq_at(const int16_t *data, const int16_t *hist, int k)
+{
+	return k < 0 ? hist[k + 10] : data[k];
+}
+
+static void fifth_order_run(int16_t *data, const int16_t *hist, int m, int end)
+/* outputs m .. end-1, the window slides through registers so it is
+ * safe in place as long as nothing past 2m has been written */
+{
+	int k, ai, bi, ci, di, ei, fi, aq, bq, cq, dq, eq, fq;
+	k = 4*m;
+	ai = iq_at(data, hist, k-10); aq = iq_at(data, hist, k-9);
+	bi = iq_at(data, hist, k-8);  bq = iq_at(data, hist, k-7);
+	ci = iq_at(data, hist, k-6);  cq = iq_at(data, hist, k-5);
+	di = iq_at(data, hist, k-4);  dq = iq_at(data, hist, k-3);
+	for (; m<end; m++, k+=4) {
+		ei = iq_at(data, hist, k-2);
+		eq = iq_at(data, hist, k-1);
+		fi = data[k];
+		fq = data[k+1];
+		data[2*m]   = (int16_t)((ai + (bi+ei)*5 + (ci+di)*10 + fi) >> 4);
+		data[2*m+1] = (int16_t)((aq + (bq+eq)*5 + (cq+dq)*10 + fq) >> 4);
+		ai = ci; bi = di; ci = ei; di = fi;
+		aq = cq; bq = dq; cq = eq; dq = fq;
+	}
+}
+
+/* vector bodies start at output 6 (reads never reach back into
+ * written data from there) and return the first output they skipped */
+
+#ifdef FRONT_SSE2
+static __m128i fifth_pair_sse2(const int16_t *p)
+/* outputs m, m+1 as int32 I Q I Q, p is complex sample 2m-5 */
+{
+	__m128i a, b, c;
+	a = _mm_loadu_si128((const __m128i *)p);
+	b = _mm_loadu_si128((const __m128i *)(p + 4));
+	c = _mm_loadu_si128((const __m128i *)(p + 8));
+	/* I I Q Q per pair of samples, then madd does two taps at once */
+	a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(a, _MM_SHUFFLE(3,1,2,0)), _MM_SHUFFLE(3,1,2,0));
+	b = _mm_shufflehi_epi16(_mm_shufflelo_epi16(b, _MM_SHUFFLE(3,1,2,0)), _MM_SHUFFLE(3,1,2,0));
+	c = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c, _MM_SHUFFLE(3,1,2,0)), _MM_SHUFFLE(3,1,2,0));
+	a = _mm_madd_epi16(a, _mm_set_epi16(5, 1, 5, 1, 5, 1, 5, 1));
+	b = _mm_madd_epi16(b, _mm_set1_epi16(10));
+	c = _mm_madd_epi16(c, _mm_set_epi16(1, 5, 1, 5, 1, 5, 1, 5));
+	a = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(a, b), c), 4);
+	/* wrap like the int16_t store would, so the pack never saturates */
+	return _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+}
+
+static int fifth_body_sse2(int16_t *data, int m, int end)
+{
+	__m128i r0, r1;
+	for (; m+4<=end; m+=4) {
+		r0 = fifth_pair_sse2(data + 4*m - 10);
+		r1 = fifth_pair_sse2(data + 4*m - 2);
+		_mm_storeu_si128((__m128i *)(data + 2*m), _mm_packs_epi32(r0, r1));
+	}
+	return m;
+}
+#endif
+
+#ifdef FRONT_AVX2
+__attribute__((target("avx2")))
+static __m256i fifth_quad_avx2(const int16_t *p)
+/* outputs m .. m+3, same layout as the sse2 version per lane */
+{
+	__m256i a, b, c;
+	a = _mm256_loadu_si256((const __m256i *)p);
+	b = _mm256_loadu_si256((const __m256i *)(p + 4));
+	c = _mm256_loadu_si256((const __m256i *)(p + 8));
+	a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(a, _MM_SHUFFLE(3,1,2,0)), _MM_SHUFFLE(3,1,2,0));
+	b = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(b, _MM_SHUFFLE(3,1,2,0)), _MM_SHUFFLE(3,1,2,0));
+	c = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(c, _MM_SHUFFLE(3,1,2,0)), _MM_SHUFFLE(3,1,2,0));
+	a = _mm256_madd_epi16(a, _mm256_set_epi16(5,1,5,1,5,1,5,1, 5,1,5,1,5,1,5,1));
+	b = _mm256_madd_epi16(b, _mm256_set1_epi16(10));
+	c = _mm256_madd_epi16(c, _mm256_set_epi16(1,5,1,5,1,5,1,5, 1,5,1,5,1,5,1,5));
+	a = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(a, b), c), 4);
+	return _mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16);
+}
+
+__attribute__((target("avx2")))
+static int fifth_body_avx2(int16_t *data, int m, int end)
+{
+	__m256i r0, r1;
+	for (; m+8<=end; m+=8) {
+		r0 = fifth_quad_avx2(data + 4*m - 10);
+		r1 = fifth_quad_avx2(data + 4*m + 6);
+		/* packs works per lane, put the four pairs back in order */
+		r0 = _mm256_permute4x64_epi64(_mm256_packs_epi32(r0, r1), _MM_SHUFFLE(3,1,2,0));
+		_mm256_storeu_si256((__m256i *)(data + 2*m), r0);
+	}
+	return m;
+}
+#endif
+
+#ifdef FRONT_NEON
+static int16x8_t fifth_lanes_neon(int16x8_t e0, int16x8_t e1, int16x8_t e2,
+	int16x8_t o1, int16x8_t o2, int16x8_t o3)
+/* polyphase form, E(m) = sample 2m, O(m) = sample 2m+1
+ * out(m) = E(m) + 10 E(m-1) + 5 E(m-2) + 5 O(m-1) + 10 O(m-2) + O(m-3) */
+{
+	int32x4_t lo, hi;
+	lo = vmovl_s16(vget_low_s16(e0));
+	lo = vmlal_n_s16(lo, vget_low_s16(e1), 10);
+	lo = vmlal_n_s16(lo, vget_low_s16(e2), 5);
+	lo = vmlal_n_s16(lo, vget_low_s16(o1), 5);
+	lo = vmlal_n_s16(lo, vget_low_s16(o2), 10);
+	lo = vaddw_s16(lo, vget_low_s16(o3));
+	hi = vmovl_s16(vget_high_s16(e0));
+	hi = vmlal_n_s16(hi, vget_high_s16(e1), 10);
+	hi = vmlal_n_s16(hi, vget_high_s16(e2), 5);
+	hi = vmlal_n_s16(hi, vget_high_s16(o1), 5);
+	hi = vmlal_n_s16(hi, vget_high_s16(o2), 10);
+	hi = vaddw_s16(hi, vget_high_s16(o3));
+	/* vshrn truncates, same as the int16_t store */
+	return vcombine_s16(vshrn_n_s32(lo, 4), vshrn_n_s32(hi, 4));
+}
+
+static int fifth_body_neon(int16_t *data, int m, int end)
+{
+	int16x8x4_t l0, l1, l2, l3;
+	int16x8x2_t r;
+	/* l0 has P(2m+15) as the last sample, still inside the block */
+	for (; m+8<=end; m+=8) {
+		l0 = vld4q_s16(data + 4*m);
+		l1 = vld4q_s16(data + 4*m - 4);
+		l2 = vld4q_s16(data + 4*m - 8);
+		l3 = vld4q_s16(data + 4*m - 12);
+		r.val[0] = fifth_lanes_neon(l0.val[0], l1.val[0], l2.val[0],
+			l1.val[2], l2.val[2], l3.val[2]);
+		r.val[1] = fifth_lanes_neon(l0.val[1], l1.val[1], l2.val[1],
+			l1.val[3], l2.val[3], l3.val[3]);
+		vst2q_s16(data + 2*m, r);
+	}
+	return m;
+}
+#endif
+
+/* dot product for the resampler, taps is a multiple of 16 */
+
+static int resample_dot_c(const int16_t *x, const int16_t *h, int taps)
+{
+	int i, sum = 0;
+	for (i=0; i<taps; i++) {
+		sum += (int)x[i] * (int)h[i];}
+	return sum;
+}
+
+#ifdef FRONT_SSE2
+static int resample_dot_sse2(const int16_t *x, const int16_t *h, int taps)
+{
+	int i;
+	__m128i acc = _mm_setzero_si128();
+	for (i=0; i<taps; i+=8) {
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(
+			_mm_loadu_si128((const __m128i *)(x + i)),
+			_mm_loadu_si128((const __m128i *)(h + i))));
+	}
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1,0,3,2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2,3,0,1)));
+	return _mm_cvtsi128_si32(acc);
+}
+#endif
+
+#ifdef FRONT_AVX2
+__attribute__((target("avx2")))
+static int resample_dot_avx2(const int16_t *x, const int16_t *h, int taps)
+{
+	int i;
+	__m128i s;
+	__m256i acc = _mm256_setzero_si256();
+	for (i=0; i<taps; i+=16) {
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(
+			_mm256_loadu_si256((const __m256i *)(x + i)),
+			_mm256_loadu_si256((const __m256i *)(h + i))));
+	}
+	s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1,0,3,2)));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2,3,0,1)));
+	return _mm_cvtsi128_si32(s);
+}
+#endif
+
+#ifdef FRONT_NEON
+static int resample_dot_neon(const int16_t *x, const int16_t *h, int taps)
+{
+	int i;
+	int16x8_t a, b;
+	int32x2_t s;
+	int32x4_t acc = vdupq_n_s32(0);
+	for (i=0; i<taps; i+=8) {
+		a = vld1q_s16(x + i);
+		b = vld1q_s16(h + i);
+		acc = vmlal_s16(acc, vget_low_s16(a), vget_low_s16(b));
+		acc = vmlal_s16(acc, vget_high_s16(a), vget_high_s16(b));
+	}
+	s = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+	s = vpadd_s32(s, s);
+	return vget_lane_s32(s, 0);
+}
+#endif
+
+/* define our own complex math ops
+   because ARMv5 has no hardware float */
+
+static void multiply(int ar, int aj, int br, int bj, int *cr, int *cj)
+{
+	*cr = ar*br - aj*bj;
+	*cj = aj*br + ar*bj;
+}
+
+int rtlsdr_dsp_fast_atan2(int y, int x)
+/* pre scaled for int16 */
+{
+	int yabs, angle;
+	int pi4=(1<<12), pi34=3*(1<<12);  // note pi = 1<<14
+	if (x==0 && y==0) {
+		return 0;
+	}
+	yabs = y;
+	if (yabs < 0) {
+		yabs = -yabs;
+	}
+	if (x >= 0) {
+		angle = pi4  - pi4 * (x-yabs) / (x+yabs);
+	} else {
+		angle = pi34 - pi4 * (x+yabs) / (yabs-x);
+	}
+	if (y < 0) {
+		return -angle;
+	}
+	return angle;
+}
+
+/* the atan table for x = 0 .. ATAN_LUT_SIZE-1 in 40 KB instead of 512,
+ * so that it stays in cache.  past ATAN_LUT_DIRECT it rises by less than
+ * one over 8 entries, those keep the first value and where one is added */
+/* one more entry each, a 32 bit gather of the last one stays inside */
+static int16_t atan_direct[ATAN_LUT_DIRECT + 1];
+static uint16_t atan_steps[(ATAN_LUT_SIZE - ATAN_LUT_DIRECT) / 8 + 1];
+static int atan_steps_base;
+static int atan_compact;  /* 0 if the steps did not hold, atan() it is then */
+static pthread_once_t atan_lut_once = PTHREAD_ONCE_INIT;
+
+static int atan_exact(int i)
+{
+	return (int) (atan((double) i / (1<<ATAN_LUT_COEF)) / 3.14159 * (1<<14));
+}
+
+static void atan_lut_init(void)
+{
+	int i, k, v, base, step;
+
+	for (i = 0; i < ATAN_LUT_DIRECT; i++) {
+		atan_direct[i] = (int16_t)atan_exact(i);
+	}
+	atan_steps_base = atan_exact(ATAN_LUT_DIRECT);
+	atan_compact = 1;
+	for (i = ATAN_LUT_DIRECT; i < ATAN_LUT_SIZE; i += 8) {
+		base = atan_exact(i);
+		step = 8;
+		for (k = 1; k < 8; k++) {
+			v = atan_exact(i + k);
+			if (v != base && step == 8) {
+				step = k;}
+			if (v != base + (k >= step)) {
+				atan_compact = 0;}
+		}
+		if (base - atan_steps_base >= 1<<12) {
+			atan_compact = 0;}
+		atan_steps[(i - ATAN_LUT_DIRECT) / 8] = (uint16_t)((base - atan_steps_base) << 4 | step);
+	}
+}
+
+static int atan_lut(int x)
+{
+	int e;
+	if (x < ATAN_LUT_DIRECT) {
+		return atan_direct[x];}
+	if (!atan_compact) {
+		return atan_exact(x);}
+	e = atan_steps[(x - ATAN_LUT_DIRECT) >> 3];
+	return atan_steps_base + (e >> 4) + ((x & 7) >= (e & 15));
+}
+
+static int lut_angle(int cr, int cj, int x)
+/* x is (cj << ATAN_LUT_COEF) / cr, anything if cr == 0 */
+{
+	/* special cases */
+	if (cr == 0 || cj == 0) {
+		if (cr == 0 && cj == 0)
+			{return 0;}
+		if (cr == 0 && cj > 0)
+			{return 1 << 13;}
+		if (cr == 0 && cj < 0)
+			{return -(1 << 13);}
+		if (cj == 0 && cr > 0)
+			{return 0;}
+		if (cj == 0 && cr < 0)
+			{return 1 << 14;}
+	}
+
+	/* real range -32768 - 32768 use 64x range -> absolute maximum: 2097152 */
+	if (abs(x) >= ATAN_LUT_SIZE) {
+		/* we can use linear range, but it is not necessary */
+		return (cj > 0) ? 1<<13 : -(1<<13);
+	}
+
+	if (x > 0) {
+		return (cj > 0) ? atan_lut(x) : atan_lut(x) - (1<<14);
+	} else {
+		return (cj > 0) ? (1<<14) - atan_lut(-x) : -atan_lut(-x);
+	}
+}
+
+/* pair k+1 times the conjugate of pair k for n pairs, the discriminators
+ * then take the angle of a whole block.  int32 wraps the way the scalar
+ * math does, and the divisions go through double, which is exact for
+ * every int32 quotient, so each isa answers alike */
+
+static void conj_c(const int16_t *iq, int n, int *cr, int *cj)
+{
+	int k;
+	for (k=0; k<n; k++) {
+		multiply(iq[2*k+2], iq[2*k+3], iq[2*k], -iq[2*k+1], cr + k, cj + k);}
+}
+
+static void fast_c(const int *cr, const int *cj, int n, int16_t *out)
+{
+	int k;
+	for (k=0; k<n; k++) {
+		out[k] = (int16_t)rtlsdr_dsp_fast_atan2(cj[k], cr[k]);}
+}
+
+static void lut_c(const int *cr, const int *cj, int n, int16_t *out)
+{
+	int k;
+	for (k=0; k<n; k++) {
+		out[k] = (int16_t)lut_angle(cr[k], cj[k],
+			cr[k] ? (cj[k] << ATAN_LUT_COEF) / cr[k] : 0);
+	}
+}
+
+#ifdef FRONT_SSE2
+static __m128i div_sse2(__m128i n, __m128i d)
+{
+	__m128d lo = _mm_div_pd(_mm_cvtepi32_pd(n), _mm_cvtepi32_pd(d));
+	__m128d hi = _mm_div_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(n, _MM_SHUFFLE(3,2,3,2))),
+		_mm_cvtepi32_pd(_mm_shuffle_epi32(d, _MM_SHUFFLE(3,2,3,2))));
+	return _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi));
+}
+
+static __m128i select_sse2(__m128i m, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+static void conj_sse2(const int16_t *iq, int n, int *cr, int *cj)
+{
+	const __m128i jmask = _mm_set1_epi32((int)0xffff0000);
+	__m128i a, b, bs;
+	int k;
+	for (k=0; k+4<=n; k+=4) {
+		a = _mm_loadu_si128((const __m128i *)(iq + 2*k + 2));
+		b = _mm_loadu_si128((const __m128i *)(iq + 2*k));
+		bs = _mm_shufflehi_epi16(_mm_shufflelo_epi16(b, _MM_SHUFFLE(2,3,0,1)), _MM_SHUFFLE(2,3,0,1));
+		_mm_storeu_si128((__m128i *)(cr + k), _mm_madd_epi16(a, b));
+		/* aj*br - ar*bj, two madds so that -bj never wraps */
+		_mm_storeu_si128((__m128i *)(cj + k), _mm_sub_epi32(
+			_mm_madd_epi16(_mm_and_si128(a, jmask), bs),
+			_mm_madd_epi16(_mm_andnot_si128(jmask, a), bs)));
+	}
+	conj_c(iq + 2*k, n - k, cr + k, cj + k);
+}
+
+static void fast_sse2(const int *cr, const int *cj, int n, int16_t *out)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i x, y, sy, yabs, xneg, q, angle;
+	int k;
+	for (k=0; k+4<=n; k+=4) {
+		x = _mm_loadu_si128((const __m128i *)(cr + k));
+		y = _mm_loadu_si128((const __m128i *)(cj + k));
+		sy = _mm_srai_epi32(y, 31);
+		yabs = _mm_sub_epi32(_mm_xor_si128(y, sy), sy);
+		xneg = _mm_cmpgt_epi32(zero, x);
+		q = div_sse2(_mm_slli_epi32(select_sse2(xneg, _mm_add_epi32(x, yabs),
+			_mm_sub_epi32(x, yabs)), 12), select_sse2(xneg,
+			_mm_sub_epi32(yabs, x), _mm_add_epi32(x, yabs)));
+		angle = _mm_sub_epi32(select_sse2(xneg, _mm_set1_epi32(3*(1<<12)),
+			_mm_set1_epi32(1<<12)), q);
+		angle = _mm_sub_epi32(_mm_xor_si128(angle, sy), sy);
+		angle = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_or_si128(x, y), zero), angle);
+		/* (int16_t) truncates, packs would saturate */
+		angle = _mm_srai_epi32(_mm_slli_epi32(angle, 16), 16);
+		_mm_storel_epi64((__m128i *)(out + k), _mm_packs_epi32(angle, angle));
+	}
+	fast_c(cr + k, cj + k, n - k, out + k);
+}
+
+static void lut_sse2(const int *cr, const int *cj, int n, int16_t *out)
+/* no gather, only the divisions are vectors */
+{
+	int x[4];
+	__m128i r;
+	int k, j;
+	for (k=0; k+4<=n; k+=4) {
+		r = _mm_loadu_si128((const __m128i *)(cr + k));
+		r = div_sse2(_mm_slli_epi32(_mm_loadu_si128((const __m128i *)(cj + k)),
+			ATAN_LUT_COEF), r);
+		_mm_storeu_si128((__m128i *)x, r);
+		for (j=0; j<4; j++) {
+			out[k+j] = (int16_t)lut_angle(cr[k+j], cj[k+j], x[j]);}
+	}
+	lut_c(cr + k, cj + k, n - k, out + k);
+}
+#endif
+
+#ifdef FRONT_AVX2
+__attribute__((target("avx2")))
+static __m256i div_avx2(__m256i n, __m256i d)
+{
+	__m256d lo = _mm256_div_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(n)),
+		_mm256_cvtepi32_pd(_mm256_castsi256_si128(d)));
+	__m256d hi = _mm256_div_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(n, 1)),
+		_mm256_cvtepi32_pd(_mm256_extracti128_si256(d, 1)));
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm256_cvttpd_epi32(lo)),
+		_mm256_cvttpd_epi32(hi), 1);
+}
+
+__attribute__((target("avx2")))
+static void conj_avx2(const int16_t *iq, int n, int *cr, int *cj)
+{
+	const __m256i jmask = _mm256_set1_epi32((int)0xffff0000);
+	__m256i a, b, bs;
+	int k;
+	for (k=0; k+8<=n; k+=8) {
+		a = _mm256_loadu_si256((const __m256i *)(iq + 2*k + 2));
+		b = _mm256_loadu_si256((const __m256i *)(iq + 2*k));
+		bs = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(b, _MM_SHUFFLE(2,3,0,1)), _MM_SHUFFLE(2,3,0,1));
+		_mm256_storeu_si256((__m256i *)(cr + k), _mm256_madd_epi16(a, b));
+		_mm256_storeu_si256((__m256i *)(cj + k), _mm256_sub_epi32(
+			_mm256_madd_epi16(_mm256_and_si256(a, jmask), bs),
+			_mm256_madd_epi16(_mm256_andnot_si256(jmask, a), bs)));
+	}
+	conj_c(iq + 2*k, n - k, cr + k, cj + k);
+}
+
+__attribute__((target("avx2")))
+static void fast_avx2(const int *cr, const int *cj, int n, int16_t *out)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i x, y, yabs, xneg, q, angle;
+	int k;
+	for (k=0; k+8<=n; k+=8) {
+		x = _mm256_loadu_si256((const __m256i *)(cr + k));
+		y = _mm256_loadu_si256((const __m256i *)(cj + k));
+		yabs = _mm256_abs_epi32(y);
+		xneg = _mm256_cmpgt_epi32(zero, x);
+		q = div_avx2(_mm256_slli_epi32(_mm256_blendv_epi8(_mm256_sub_epi32(x, yabs),
+			_mm256_add_epi32(x, yabs), xneg), 12), _mm256_blendv_epi8(
+			_mm256_add_epi32(x, yabs), _mm256_sub_epi32(yabs, x), xneg));
+		angle = _mm256_sub_epi32(_mm256_blendv_epi8(_mm256_set1_epi32(1<<12),
+			_mm256_set1_epi32(3*(1<<12)), xneg), q);
+		angle = _mm256_sign_epi32(angle, _mm256_or_si256(y, _mm256_set1_epi32(1)));
+		angle = _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_or_si256(x, y), zero), angle);
+		angle = _mm256_srai_epi32(_mm256_slli_epi32(angle, 16), 16);
+		_mm_storeu_si128((__m128i *)(out + k), _mm_packs_epi32(
+			_mm256_castsi256_si128(angle), _mm256_extracti128_si256(angle, 1)));
+	}
+	fast_c(cr + k, cj + k, n - k, out + k);
+}
+
+__attribute__((target("avx2")))
+static __m256i atan_lut_avx2(__m256i x)
+/* atan_lut() of 0 <= x < ATAN_LUT_SIZE, gathered */
+{
+	const __m256i low = _mm256_set1_epi32(0xffff);
+	__m256i d, e, v, direct;
+	direct = _mm256_cmpgt_epi32(_mm256_set1_epi32(ATAN_LUT_DIRECT), x);
+	d = _mm256_i32gather_epi32((const int *)atan_direct,
+		_mm256_min_epi32(x, _mm256_set1_epi32(ATAN_LUT_DIRECT - 1)), 2);
+	e = _mm256_i32gather_epi32((const int *)atan_steps, _mm256_srli_epi32(_mm256_max_epi32(
+		_mm256_sub_epi32(x, _mm256_set1_epi32(ATAN_LUT_DIRECT)), _mm256_setzero_si256()), 3), 2);
+	e = _mm256_and_si256(e, low);
+	/* base + (e >> 4), and one more from (x & 7) >= (e & 15) */
+	v = _mm256_add_epi32(_mm256_set1_epi32(atan_steps_base), _mm256_srli_epi32(e, 4));
+	v = _mm256_sub_epi32(v, _mm256_cmpgt_epi32(_mm256_and_si256(x, _mm256_set1_epi32(7)),
+		_mm256_sub_epi32(_mm256_and_si256(e, _mm256_set1_epi32(15)), _mm256_set1_epi32(1))));
+	d = _mm256_srai_epi32(_mm256_slli_epi32(d, 16), 16);
+	return _mm256_blendv_epi8(v, d, direct);
+}
+
+__attribute__((target("avx2")))
+static void lut_avx2(const int *cr, const int *cj, int n, int16_t *out)
+/* lut_angle() in lanes, the special cases last so they win */
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i pi = _mm256_set1_epi32(1<<14), pi2 = _mm256_set1_epi32(1<<13);
+	__m256i r, j, x, ax, t, a, jpos, m;
+	int k = 0;
+	if (!atan_compact) {
+		lut_c(cr, cj, n, out);
+		return;
+	}
+	for (; k+8<=n; k+=8) {
+		r = _mm256_loadu_si256((const __m256i *)(cr + k));
+		j = _mm256_loadu_si256((const __m256i *)(cj + k));
+		x = div_avx2(_mm256_slli_epi32(j, ATAN_LUT_COEF), r);
+		ax = _mm256_abs_epi32(x);
+		t = atan_lut_avx2(_mm256_min_epu32(ax, _mm256_set1_epi32(ATAN_LUT_SIZE - 1)));
+		jpos = _mm256_cmpgt_epi32(j, zero);
+		/* x > 0: t or t - pi, else pi - t or -t */
+		a = _mm256_blendv_epi8(_mm256_sub_epi32(zero, t), _mm256_sub_epi32(pi, t), jpos);
+		a = _mm256_blendv_epi8(a, _mm256_blendv_epi8(_mm256_sub_epi32(t, pi), t, jpos),
+			_mm256_cmpgt_epi32(x, zero));
+		m = _mm256_cmpgt_epi32(ax, _mm256_set1_epi32(ATAN_LUT_SIZE - 1));
+		a = _mm256_blendv_epi8(a, _mm256_blendv_epi8(_mm256_sub_epi32(zero, pi2), pi2, jpos), m);
+		/* cj == 0: 0 or pi by the sign of cr, cr == 0: +-pi/2 by cj */
+		m = _mm256_cmpeq_epi32(j, zero);
+		a = _mm256_blendv_epi8(a, _mm256_and_si256(_mm256_cmpgt_epi32(zero, r), pi), m);
+		m = _mm256_cmpeq_epi32(r, zero);
+		a = _mm256_blendv_epi8(a, _mm256_sign_epi32(pi2, j), m);
+		a = _mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16);
+		_mm_storeu_si128((__m128i *)(out + k), _mm_packs_epi32(
+			_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1)));
+	}
+	lut_c(cr + k, cj + k, n - k, out + k);
+}
+#endif
+
+#ifdef FRONT_NEON
+/* armv7 has no vector division, the angles stay scalar */
+static void conj_neon(const int16_t *iq, int n, int *cr, int *cj)
+{
+	int16x4x2_t a, b;
+	int k;
+	for (k=0; k+4<=n; k+=4) {
+		a = vld2_s16(iq + 2*k + 2);
+		b = vld2_s16(iq + 2*k);
+		vst1q_s32(cr + k, vmlal_s16(vmull_s16(a.val[0], b.val[0]), a.val[1], b.val[1]));
+		vst1q_s32(cj + k, vmlsl_s16(vmull_s16(a.val[1], b.val[0]), a.val[0], b.val[1]));
+	}
+	conj_c(iq + 2*k, n - k, cr + k, cj + k);
+}
+#endif
+
+struct dsp_kernels
+/* one set per instruction set */
+{
+	int isa;
+	void (*convert)(const unsigned char *buf, int16_t *out, uint32_t len, int rotate);
+	void (*magnitude)(const uint8_t *buf, uint16_t *mag, int i, int len);
+	int (*fifth_body)(int16_t *data, int m, int end);
+	int (*dot)(const int16_t *x, const int16_t *h, int taps);
+	void (*conj)(const int16_t *iq, int n, int *cr, int *cj);
+	void (*fast)(const int *cr, const int *cj, int n, int16_t *out);
+	void (*lut)(const int *cr, const int *cj, int n, int16_t *out);
+};
+
+static const struct dsp_kernels kernels_c = {RTLSDR_DSP_C,
+	rotate_convert_c, magnitude_c, NULL, resample_dot_c,
+	conj_c, fast_c, lut_c};
+#ifdef FRONT_SSE2
+static const struct dsp_kernels kernels_sse2 = {RTLSDR_DSP_SSE2,
+	rotate_convert_sse2, magnitude_sse2, fifth_body_sse2, resample_dot_sse2,
+	conj_sse2, fast_sse2, lut_sse2};
+#endif
+#ifdef FRONT_AVX2
+static const struct dsp_kernels kernels_avx2 = {RTLSDR_DSP_AVX2,
+	rotate_convert_avx2, magnitude_avx2, fifth_body_avx2, resample_dot_avx2,
+	conj_avx2, fast_avx2, lut_avx2};
+#endif
+#ifdef FRONT_NEON
+static const struct dsp_kernels kernels_neon = {RTLSDR_DSP_NEON,
+	rotate_convert_neon, magnitude_neon, fifth_body_neon, resample_dot_neon,
+	conj_neon, fast_c, lut_c};
+#endif
+
+static const char *isa_names[] = {"c", "sse2", "avx2", "neon"};
+
+static const struct dsp_kernels *kernels = &kernels_c;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static const struct dsp_kernels *find_kernels(int isa)
+/* NULL if this build or cpu lacks them */
+{
+	switch (isa) {
+	case RTLSDR_DSP_C:
+		return &kernels_c;
+#ifdef FRONT_SSE2
+	case RTLSDR_DSP_SSE2:
+		return &kernels_sse2;
+#endif
+#ifdef FRONT_AVX2
+	case RTLSDR_DSP_AVX2:
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			return &kernels_avx2;}
+		break;
+#endif
+#ifdef FRONT_NEON
+	case RTLSDR_DSP_NEON:
+		return &kernels_neon;
+#endif
+	}
+	return NULL;
+}
+
+static void kernels_init(void)
+/* pick the widest kernels this cpu runs */
+{
+	int isa;
+	for (isa=RTLSDR_DSP_NEON; isa>RTLSDR_DSP_C; isa--) {
+		if (find_kernels(isa)) {
+			break;}
+	}
+	kernels = find_kernels(isa);
+}
+
+static const struct dsp_kernels *dsp(void)
+{
+	pthread_once(&kernels_once, kernels_init);
+	return kernels;
+}
+
+int rtlsdr_dsp_set_isa(int isa)
+{
+	const struct dsp_kernels *k;
+	pthread_once(&kernels_once, kernels_init);
+	if (isa < 0) {
+		kernels_init();
+		return kernels->isa;
+	}
+	k = find_kernels(isa);
+	if (!k) {
+		return -1;}
+	kernels = k;
+	return k->isa;
+}
+
+int rtlsdr_dsp_get_isa(void)
+{
+	return dsp()->isa;
+}
+
+const char *rtlsdr_dsp_isa_name(int isa)
+{
+	if (isa < RTLSDR_DSP_C || isa > RTLSDR_DSP_NEON) {
+		return NULL;}
+	return isa_names[isa];
+}
+
+/* conversion and decimation */
+
+void rtlsdr_dsp_convert(const uint8_t *buf, int16_t *out, uint32_t len, int rotate)
+{
+	dsp()->convert(buf, out, len, rotate);
+}
+
+void rtlsdr_dsp_magnitude(const uint8_t *buf, uint16_t *mag, int len)
+{
+	dsp()->magnitude(buf, mag, 0, len);
+}
+
+void rtlsdr_dsp_remove_dc(int16_t *iq, int len)
+{
+	int i;
+	int16_t ave_i, ave_q;
+	int64_t sum_i = 0, sum_q = 0;
+	if (len < 2) {
+		return;}
+	for (i=0; i+1<len; i+=2) {
+		sum_i += iq[i];
+		sum_q += iq[i+1];
+	}
+	ave_i = (int16_t)(sum_i / (len / 2));
+	ave_q = (int16_t)(sum_q / (len / 2));
+	if (ave_i == 0 && ave_q == 0) {
+		return;}
+	for (i=0; i+1<len; i+=2) {
+		iq[i]   -= ave_i;
+		iq[i+1] -= ave_q;
+	}
+}
+
+void rtlsdr_dsp_fifth_order(int16_t *iq, int len, int16_t *hist)
+{
+	int m, end = len / 4;
+	int16_t tail[10], held[10];
+	int (*body)(int16_t *data, int m, int end) = dsp()->fifth_body;
+	if (end < 1) {
+		return;}
+	if (!hist) {
+		for (m=0; m<10; m++) {
+			held[m] = iq[m & 1];}
+		hist = held;
+	}
+	/* the last five I/Q pairs, reaching back into hist for short blocks */
+	if (len >= 10) {
+		memcpy(tail, iq + len - 10, sizeof(tail));
+	} else {
+		memcpy(tail, hist + len, (10 - len) * sizeof(int16_t));
+		memcpy(tail + 10 - len, iq, len * sizeof(int16_t));
+	}
+	m = end < 6 ? end : 6;
+	fifth_order_run(iq, hist, 0, m);
+	if (body) {
+		m = body(iq, m, end);}
+	fifth_order_run(iq, hist, m, end);
+	memcpy(hist, tail, sizeof(tail));
+}
+
+static void droop_run(int16_t *data, int d, int length, const int *fir, int16_t *hist)
+/* one half of interleaved data from d on, 9 taps and symmetric */
+{
+	int temp, sum;
+	for (; d<length; d+=2) {
+		temp = data[d];
+		sum = 0;
+		sum += (hist[0] + hist[8]) * fir[1];
+		sum += (hist[1] + hist[7]) * fir[2];
+		sum += (hist[2] + hist[6]) * fir[3];
+		sum += (hist[3] + hist[5]) * fir[4];
+		sum +=            hist[4]  * fir[5];
+		data[d] = (int16_t)(sum >> 15);
+		hist[0] = hist[1];
+		hist[1] = hist[2];
+		hist[2] = hist[3];
+		hist[3] = hist[4];
+		hist[4] = hist[5];
+		hist[5] = hist[6];
+		hist[6] = hist[7];
+		hist[7] = hist[8];
+		hist[8] = temp;
+	}
+}
+
+int rtlsdr_dsp_cic_droop(int16_t *iq, int len, int passes, int16_t *hist)
+{
+	int d;
+	int16_t held[18];
+	if (passes < 1 || passes > RTLSDR_DSP_CIC_MAX) {
+		return -1;}
+	if (hist) {
+		droop_run(iq, 0, len, cic_9_tables[passes], hist);
+		droop_run(iq + 1, 0, len - 1, cic_9_tables[passes], hist + 9);
+		return 0;
+	}
+	/* cheat on the beginning, let it go unfiltered */
+	if (len < 18) {
+		return 0;}
+	for (d=0; d<18; d+=2) {
+		held[d/2]     = iq[d];
+		held[9 + d/2] = iq[d+1];
+	}
+	droop_run(iq, 18, len, cic_9_tables[passes], held);
+	droop_run(iq + 1, 18, len - 1, cic_9_tables[passes], held + 9);
+	return 0;
+}
+
+/* fm discriminators */
+
+static int std_angle(int cr, int cj)
+{
+	double angle = atan2((double)cj, (double)cr);
+	return (int)(angle / 3.14159 * (1<<14));
+}
+
+static int polar_discriminant(int ar, int aj, int br, int bj)
+{
+	int cr, cj;
+	multiply(ar, aj, br, -bj, &cr, &cj);
+	return std_angle(cr, cj);
+}
+
+static int polar_disc_fast(int ar, int aj, int br, int bj)
+{
+	int cr, cj;
+	multiply(ar, aj, br, -bj, &cr, &cj);
+	return rtlsdr_dsp_fast_atan2(cj, cr);
+}
+
+static int polar_disc_lut(int ar, int aj, int br, int bj)
+{
+	int cr, cj;
+	multiply(ar, aj, br, -bj, &cr, &cj);
+	return lut_angle(cr, cj, cr ? (cj << ATAN_LUT_COEF) / cr : 0);
+}
+
+int rtlsdr_dsp_polar_disc(int ar, int aj, int br, int bj, int mode)
+{
+	switch (mode) {
+	case RTLSDR_DSP_DISC_FAST:
+		return polar_disc_fast(ar, aj, br, bj);
+	case RTLSDR_DSP_DISC_LUT:
+		pthread_once(&atan_lut_once, atan_lut_init);
+		return polar_disc_lut(ar, aj, br, bj);
+	}
+	return polar_discriminant(ar, aj, br, bj);
+}
+
+void rtlsdr_dsp_fm_disc(const int16_t *iq, int len, int16_t *out, int16_t *prev, int mode)
+{
+	const struct dsp_kernels *k = dsp();
+	int cr[DISC_BLOCK], cj[DISC_BLOCK];
+	int i, j, n, pairs = len / 2;
+	if (len < 2) {
+		return;}
+	out[0] = (int16_t)rtlsdr_dsp_polar_disc(iq[0], iq[1], prev[0], prev[1], mode);
+	/* the products of a block first, then its angles */
+	for (i = 1; i < pairs; i += n) {
+		n = pairs - i < DISC_BLOCK ? pairs - i : DISC_BLOCK;
+		k->conj(iq + 2*i - 2, n, cr, cj);
+		switch (mode) {
+		case RTLSDR_DSP_DISC_FAST:
+			k->fast(cr, cj, n, out + i);
+			break;
+		case RTLSDR_DSP_DISC_LUT:
+			k->lut(cr, cj, n, out + i);
+			break;
+		default:
+			for (j = 0; j < n; j++) {
+				out[i+j] = (int16_t)std_angle(cr[j], cj[j]);}
+			break;
+		}
+	}
+	prev[0] = iq[len - 2];
+	prev[1] = iq[len - 1];
+}
+
+/* fft windows */
+
+static double rectangle(int i, int length)
+{
+	return 1.0;
+}
+
+static double hamming(int i, int length)
+{
+	double a, b, w, N1;
+	a = 25.0/46.0;
+	b = 21.0/46.0;
+	N1 = (double)(length-1);
+	w = a - b*cos(2*i*M_PI/N1);
+	return w;
+}
+
+static double blackman(int i, int length)
+{
+	double a0, a1, a2, w, N1;
+	a0 = 7938.0/18608.0;
+	a1 = 9240.0/18608.0;
+	a2 = 1430.0/18608.0;
+	N1 = (double)(length-1);
+	w = a0 - a1*cos(2*i*M_PI/N1) + a2*cos(4*i*M_PI/N1);
+	return w;
+}
+
+static double blackman_harris(int i, int length)
+{
+	double a0, a1, a2, a3, w, N1;
+	a0 = 0.35875;
+	a1 = 0.48829;
+	a2 = 0.14128;
+	a3 = 0.01168;
+	N1 = (double)(length-1);
+	w = a0 - a1*cos(2*i*M_PI/N1) + a2*cos(4*i*M_PI/N1) - a3*cos(6*i*M_PI/N1);
+	return w;
+}
+
+static double hann_poisson(int i, int length)
+{
+	double a, N1, w;
+	a = 2.0;
+	N1 = (double)(length-1);
+	w = 0.5 * (1 - cos(2*M_PI*i/N1)) * \
+	    pow(M_E, (-a*(double)abs((int)(N1-1-2*i)))/N1);
+	return w;
+}
+
+static double youssef(int i, int length)
+/* really a blackman-harris-poisson window, but that is a mouthful */
+{
+	double a, a0, a1, a2, a3, w, N1;
+	a0 = 0.35875;
+	a1 = 0.48829;
+	a2 = 0.14128;
+	a3 = 0.01168;
+	N1 = (double)(length-1);
+	w = a0 - a1*cos(2*i*M_PI/N1) + a2*cos(4*i*M_PI/N1) - a3*cos(6*i*M_PI/N1);
+	a = 0.0025;
+	w *= pow(M_E, (-a*(double)abs((int)(N1-1-2*i)))/N1);
+	return w;
+}
+
+static double kaiser(int i, int length)
+// todo, become more smart
+{
+	return 1.0;
+}
+
+static double bartlett(int i, int length)
+{
+	double N1, L, w;
+	L = (double)length;
+	N1 = L - 1;
+	w = (i - N1/2) / (L/2);
+	if (w < 0) {
+		w = -w;}
+	w = 1 - w;
+	return w;
+}
+
+struct window_fn
+{
+	const char *name;
+	double (*fn)(int i, int length);
+};
+
+static const struct window_fn windows[] = {
+	{"rectangle", rectangle},
+	{"hamming", hamming},
+	{"blackman", blackman},
+	{"blackman-harris", blackman_harris},
+	{"hann-poisson", hann_poisson},
+	{"youssef", youssef},
+	{"kaiser", kaiser},
+	{"bartlett", bartlett},
+	{NULL, NULL},
+};
+
+int rtlsdr_dsp_window(const char *name, double *w, int len)
+{
+	const struct window_fn *f;
+	int i;
+	for (f=windows; f->name; f++) {
+		if (strcmp(f->name, name) == 0) {
+			break;}
+	}
+	if (!f->name) {
+		return -1;}
+	for (i=0; w && i<len; i++) {
+		w[i] = f->fn(i, len);}
+	return 0;
+}
+
+/* FFT based on fix_fft.c by Roberts, Slaney and Bouras
+   http://www.jjj.de/fft/fftpage.html
+   16 bit ints for everything
+   -32768..+32768 maps to -1.0..+1.0
+*/
+
+static int16_t *sine_table(int size)
+/* the first 3/4 of a period of 2^size samples */
+{
+	int i, n = 1 << size;
+	double d;
+	int16_t *sine = malloc(sizeof(int16_t) * n*3/4);
+	if (!sine) {
+		return NULL;}
+	for (i=0; i<n*3/4; i++)
+	{
+		d = (double)i * 2.0 * M_PI / n;
+		sine[i] = (int16_t)round(32767*sin(d));
+	}
+	return sine;
+}
+
+static inline int16_t FIX_MPY(int16_t a, int16_t b)
+/* fixed point multiply and scale */
+{
+	int c = ((int)a * (int)b) >> 14;
+	b = c & 0x01;
+	return (c >> 1) + b;
+}
+
+static void fix_fft(int16_t iq[], int m, const int16_t *sine)
+/* interleaved iq[], 0 <= n < 2**m, changes in place */
+{
+	int mr, nn, i, j, l, k, istep, n, shift;
+	int16_t qr, qi, tr, ti, wr, wi;
+	n = 1 << m;
+	k = m-1;
+	mr = 0;
+	nn = n - 1;
+	/* decimation in time - re-order data */
+	for (m=1; m<=nn; ++m) {
+		l = n;
+		do
+			{l >>= 1;}
+		while (mr+l > nn);
+		mr = (mr & (l-1)) + l;
+		if (mr <= m)
+			{continue;}
+		// real = 2*m, imag = 2*m+1
+		tr = iq[2*m];
+		iq[2*m] = iq[2*mr];
+		iq[2*mr] = tr;
+		ti = iq[2*m+1];
+		iq[2*m+1] = iq[2*mr+1];
+		iq[2*mr+1] = ti;
+	}
+	l = 1;
+	while (l < n) {
+		shift = 1;
+		istep = l << 1;
+		for (m=0; m<l; ++m) {
+			j = m << k;
+			wr =  sine[j+n/4];
+			wi = -sine[j];
+			if (shift) {
+				wr >>= 1; wi >>= 1;}
+			for (i=m; i<n; i+=istep) {
+				j = i + l;
+				tr = FIX_MPY(wr,iq[2*j]) - FIX_MPY(wi,iq[2*j+1]);
+				ti = FIX_MPY(wr,iq[2*j+1]) + FIX_MPY(wi,iq[2*j]);
+				qr = iq[2*i];
+				qi = iq[2*i+1];
+				if (shift) {
+					qr >>= 1; qi >>= 1;}
+				iq[2*j] = qr - tr;
+				iq[2*j+1] = qi - ti;
+				iq[2*i] = qr + tr;
+				iq[2*i+1] = qi + ti;
+			}
+		}
+		--k;
+		l = istep;
+	}
+}
+
+static int64_t real_conj(int16_t real, int16_t imag)
+/* real(n * conj(n)) */
+{
+	return ((int64_t)real*(int64_t)real + (int64_t)imag*(int64_t)imag);
+}
+
+/* fft backends */
+
+struct fixed_plan
+{
+	int bin_e;
+	int16_t *sine;
+};
+
+static void *fixed_plan(int bin_e)
+{
+	struct fixed_plan *p;
+	p = malloc(sizeof(struct fixed_plan));
+	if (!p) {
+		return NULL;}
+	p->bin_e = bin_e;
+	p->sine = sine_table(bin_e);
+	if (!p->sine) {
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+static void fixed_execute(void *plan, int16_t *iq, int64_t *pwr)
+{
+	struct fixed_plan *p = plan;
+	int j, n = 1 << p->bin_e;
+	fix_fft(iq, p->bin_e, p->sine);
+	for (j=0; j<n; j++) {
+		pwr[j] = real_conj(iq[j*2], iq[j*2+1]);
+	}
+}
+
+static void fixed_destroy(void *plan)
+{
+	struct fixed_plan *p = plan;
+	free(p->sine);
+	free(p);
+}
+
+struct float_plan
+/* split real/imag so the butterflies are plain unit stride loops */
+{
+	int bin_e;
+	float *xr, *xi, *yr, *yi;
+	float *tw;  /* w1r, w1i, w2r, w2i, w3r, w3i for each radix-4 stage */
+};
+
+static void *float_plan(int bin_e)
+{
+	int i, n, n1, p, t;
+	double theta;
+	float *tw;
+	struct float_plan *fp;
+	n = 1 << bin_e;
+	fp = calloc(1, sizeof(struct float_plan));
+	if (!fp) {
+		return NULL;}
+	fp->bin_e = bin_e;
+	fp->xr = malloc(4 * n * sizeof(float));
+	fp->tw = malloc((2 * n + 1) * sizeof(float));
+	if (!fp->xr || !fp->tw) {
+		free(fp->xr);
+		free(fp->tw);
+		free(fp);
+		return NULL;
+	}
+	fp->xi = fp->xr + n;
+	fp->yr = fp->xi + n;
+	fp->yi = fp->yr + n;
+	tw = fp->tw;
+	for (i=n; i>=4; i/=4) {
+		n1 = i / 4;
+		theta = 2.0 * M_PI / (double)i;
+		for (p=0; p<n1; p++) {
+			for (t=1; t<=3; t++) {
+				tw[(t-1)*2*n1 + p]      = (float) cos(t * p * theta);
+				tw[(t-1)*2*n1 + n1 + p] = (float)-sin(t * p * theta);
+			}
+		}
+		tw += 6 * n1;
+	}
+	return fp;
+}
+
+static FFT_TARGETS void radix4_pass(int n, int s, const float *xr, const float *xi,
+	float *yr, float *yi, const float *tw)
+/* one Stockham decimation in frequency stage, no bit reversal needed */
+{
+	int p, q, n1, a, b, c, d, o;
+	float w1r, w1i, w2r, w2i, w3r, w3i;
+	float apcr, apci, amcr, amci, bpdr, bpdi, jbmdr, jbmdi;
+	float t1r, t1i, t2r, t2i, t3r, t3i;
+	n1 = n / 4;
+	for (p=0; p<n1; p++) {
+		w1r = tw[p];        w1i = tw[n1+p];
+		w2r = tw[2*n1+p];   w2i = tw[3*n1+p];
+		w3r = tw[4*n1+p];   w3i = tw[5*n1+p];
+		for (q=0; q<s; q++) {
+			a = q + s*p;
+			b = a + s*n1;
+			c = b + s*n1;
+			d = c + s*n1;
+			o = q + s*4*p;
+			apcr = xr[a] + xr[c];  apci = xi[a] + xi[c];
+			amcr = xr[a] - xr[c];  amci = xi[a] - xi[c];
+			bpdr = xr[b] + xr[d];  bpdi = xi[b] + xi[d];
+			/* j * (b - d) */
+			jbmdr = xi[d] - xi[b];  jbmdi = xr[b] - xr[d];
+			yr[o] = apcr + bpdr;
+			yi[o] = apci + bpdi;
+			t1r = amcr - jbmdr;  t1i = amci - jbmdi;
+			t2r = apcr - bpdr;   t2i = apci - bpdi;
+			t3r = amcr + jbmdr;  t3i = amci + jbmdi;
+			yr[o+s]   = w1r*t1r - w1i*t1i;
+			yi[o+s]   = w1r*t1i + w1i*t1r;
+			yr[o+2*s] = w2r*t2r - w2i*t2i;
+			yi[o+2*s] = w2r*t2i + w2i*t2r;
+			yr[o+3*s] = w3r*t3r - w3i*t3i;
+			yi[o+3*s] = w3r*t3i + w3i*t3r;
+		}
+	}
+}
+
+static FFT_TARGETS void radix2_pass(int s, const float *xr, const float *xi,
+	float *yr, float *yi)
+/* leftover stage for odd bin_e */
+{
+	int q;
+	for (q=0; q<s; q++) {
+		yr[q]   = xr[q] + xr[q+s];
+		yi[q]   = xi[q] + xi[q+s];
+		yr[q+s] = xr[q] - xr[q+s];
+		yi[q+s] = xi[q] - xi[q+s];
+	}
+}
+
+static FFT_TARGETS void float_load(int n, const int16_t *iq, float *xr, float *xi)
+{
+	int j;
+	for (j=0; j<n; j++) {
+		xr[j] = (float)iq[j*2];
+		xi[j] = (float)iq[j*2+1];
+	}
+}
+
+static FFT_TARGETS void float_power(int n, const float *xr, const float *xi, int64_t *pwr)
+{
+	int j;
+	/* fix_fft halves every stage, match its scale */
+	float scale = 1.0f / ((float)n * (float)n);
+	for (j=0; j<n; j++) {
+		pwr[j] = (int64_t)((xr[j]*xr[j] + xi[j]*xi[j]) * scale + 0.5f);
+	}
+}
+
+static void float_execute(void *plan, int16_t *iq, int64_t *pwr)
+{
+	struct float_plan *fp = plan;
+	int n, len, s;
+	float *xr, *xi, *yr, *yi, *tmp;
+	const float *tw;
+	n = 1 << fp->bin_e;
+	xr = fp->xr;  xi = fp->xi;
+	yr = fp->yr;  yi = fp->yi;
+	tw = fp->tw;
+	float_load(n, iq, xr, xi);
+	s = 1;
+	for (len=n; len>=4; len/=4) {
+		radix4_pass(len, s, xr, xi, yr, yi, tw);
+		tw += 6 * (len / 4);
+		s *= 4;
+		tmp = xr; xr = yr; yr = tmp;
+		tmp = xi; xi = yi; yi = tmp;
+	}
+	if (len == 2) {
+		radix2_pass(s, xr, xi, yr, yi);
+		xr = yr;
+		xi = yi;
+	}
+	float_power(n, xr, xi, pwr);
+}
+
+static void float_destroy(void *plan)
+{
+	struct float_plan *fp = plan;
+	free(fp->xr);
+	free(fp->tw);
+	free(fp);
+}
+
+struct fft_backend
+/* plan once per bin_e, execute on windowed interleaved iq[] */
+{
+	const char *name;
+	void *(*plan)(int bin_e);
+	void (*execute)(void *plan, int16_t *iq, int64_t *pwr);
+	void (*destroy)(void *plan);
+};
+
+static const struct fft_backend fft_backends[] = {
+	{"fixed", fixed_plan, fixed_execute, fixed_destroy},
+	{"float", float_plan, float_execute, float_destroy},
+	{NULL, NULL, NULL, NULL},
+};
+
+struct rtlsdr_dsp_fft
+{
+	const struct fft_backend *backend;
+	void *plan;
+};
+
+static const struct fft_backend *find_fft_backend(const char *name)
+{
+	const struct fft_backend *b;
+	for (b=fft_backends; b->name; b++) {
+		if (strcmp(b->name, name) == 0) {
+			return b;}
+	}
+	return NULL;
+}
+
+int rtlsdr_dsp_fft_backend(const char *name)
+{
+	return find_fft_backend(name) ? 0 : -1;
+}
+
+rtlsdr_dsp_fft_t *rtlsdr_dsp_fft_plan(const char *backend, int bin_e)
+{
+	const struct fft_backend *b = find_fft_backend(backend);
+	rtlsdr_dsp_fft_t *p;
+	if (!b || bin_e < 1 || bin_e > 24) {
+		return NULL;}
+	p = malloc(sizeof(rtlsdr_dsp_fft_t));
+	if (!p) {
+		return NULL;}
+	p->backend = b;
+	p->plan = b->plan(bin_e);
+	if (!p->plan) {
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+void rtlsdr_dsp_fft_power(rtlsdr_dsp_fft_t *p, int16_t *iq, int64_t *pwr)
+{
+	p->backend->execute(p->plan, iq, pwr);
+}
+
+void rtlsdr_dsp_fft_destroy(rtlsdr_dsp_fft_t *p)
+{
+	if (!p) {
+		return;}
+	p->backend->destroy(p->plan);
+	free(p);
+}
+
+/* audio rate conversion */
+
+struct rtlsdr_dsp_resampler
+/* polyphase fir from one rate to rate * up / down */
+{
+	int      up, down;     /* the reduced ratio */
+	int      phases;       /* rows of coefs, up or fewer */
+	int      taps;         /* per row, a multiple of 16 */
+	int16_t  *coefs;       /* Q14, each row reversed */
+	int16_t  *work;        /* taps-1 of history, then the block */
+	int      work_len;     /* block room in work */
+	int      index;        /* newest input of the next output, in work */
+	int      frac;         /* how far the output is past it, in 1/up */
+};
+
+static int gcd(int a, int b)
+{
+	int t;
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+void rtlsdr_dsp_resampler_reset(rtlsdr_dsp_resampler_t *r)
+{
+	memset(r->work, 0, (r->taps - 1) * sizeof(int16_t));
+	r->index = r->taps - 1;
+	r->frac = 0;
+}
+
+void rtlsdr_dsp_resampler_destroy(rtlsdr_dsp_resampler_t *r)
+{
+	if (!r) {
+		return;}
+	free(r->coefs);
+	free(r->work);
+	free(r);
+}
+
+rtlsdr_dsp_resampler_t *rtlsdr_dsp_resampler_create(int rate_in, int rate_out)
+/* one row per output phase and each row scaled to unity gain */
+{
+	int p, k, g, taps;
+	double ratio, cutoff, mu, x, w, h, sum, *row;
+	rtlsdr_dsp_resampler_t *r;
+	if (rate_in <= 0 || rate_out <= 0) {
+		return NULL;}
+	r = calloc(1, sizeof(rtlsdr_dsp_resampler_t));
+	if (!r) {
+		return NULL;}
+	g = gcd(rate_in, rate_out);
+	r->up = rate_out / g;
+	r->down = rate_in / g;
+	r->phases = r->up < RESAMPLE_PHASES ? r->up : RESAMPLE_PHASES;
+	ratio = (double)r->down / (double)r->up;
+	if (ratio < 1.0) {
+		ratio = 1.0;}
+	taps = (int)ceil(2 * RESAMPLE_ZEROS * ratio);
+	taps = (taps + 15) & ~15;
+	if (taps > RESAMPLE_TAPS) {
+		taps = RESAMPLE_TAPS;}
+	r->taps = taps;
+	/* cycles per input sample */
+	cutoff = 0.5 * RESAMPLE_CUTOFF / ratio;
+	r->coefs = malloc(r->phases * taps * sizeof(int16_t));
+	r->work = malloc((taps - 1) * sizeof(int16_t));
+	row = malloc(taps * sizeof(double));
+	if (!r->coefs || !r->work || !row) {
+		free(row);
+		rtlsdr_dsp_resampler_destroy(r);
+		return NULL;
+	}
+	for (p=0; p<r->phases; p++) {
+		/* tap k weighs input newest-k, mu + k - taps/2 samples back
+		 * from the output after a group delay of taps/2 */
+		mu = (double)p / (double)r->phases;
+		sum = 0.0;
+		for (k=0; k<taps; k++) {
+			x = mu + k - taps / 2;
+			h = 2.0 * cutoff;
+			if (x != 0.0) {
+				h = sin(2.0 * M_PI * cutoff * x) / (M_PI * x);}
+			w = (x + taps / 2) / taps;
+			h *= 0.42 - 0.5 * cos(2.0 * M_PI * w) + 0.08 * cos(4.0 * M_PI * w);
+			row[k] = h;
+			sum += h;
+		}
+		for (k=0; k<taps; k++) {
+			r->coefs[p*taps + taps-1-k] = (int16_t)lrint(row[k] * 16384.0 / sum);}
+	}
+	free(row);
+	rtlsdr_dsp_resampler_reset(r);
+	return r;
+}
+
+int rtlsdr_dsp_resample(rtlsdr_dsp_resampler_t *r, const int16_t *in, int len,
+			int16_t *out, int out_max)
+{
+	int n = 0, p, v, h = r->taps - 1;
+	int16_t *work;
+	int (*dot)(const int16_t *x, const int16_t *h, int taps) = dsp()->dot;
+	if (len > r->work_len) {
+		/* grown once to the longest block, then reused */
+		work = realloc(r->work, (h + len) * sizeof(int16_t));
+		if (!work) {
+			return 0;}
+		r->work = work;
+		r->work_len = len;
+	}
+	memcpy(r->work + h, in, len * sizeof(int16_t));
+	while (r->index < h + len && n < out_max) {
+		p = r->frac;
+		if (r->phases < r->up) {
+			p = (int)((int64_t)r->frac * r->phases / r->up);}
+		v = dot(r->work + r->index - h, r->coefs + p * r->taps, r->taps);
+		v = (v + (1 << 13)) >> 14;
+		if (v > 32767) {
+			v = 32767;}
+		if (v < -32768) {
+			v = -32768;}
+		out[n++] = (int16_t)v;
+		r->frac += r->down;
+		r->index += r->frac / r->up;
+		r->frac %= r->up;
+	}
+	/* the newest taps-1 inputs are the next history */
+	memmove(r->work, r->work + len, h * sizeof(int16_t));
+	r->index -= len;
+	return n;
+}
+
+// vim: tabstop=8:softtabstop=8:shiftwidth=8:noexpandtab
@@ -41,7 +41,11 @@
 #include <libusb.h>
 
 #include "rtl-sdr.h"
+#include "rtl-sdr_dsp.h"
 #include "convenience/convenience.h"
+#include "convenience/stats.h"
+#include "convenience/atomic.h"
+#include "convenience/simd.h"
 
 #ifdef _WIN32
 #define sleep Sleep
@@ -60,43 +64,170 @@
 #define OVERWRITE    254
 #define BADSAMPLE    255
 
+#define RING_BLOCKS			8
+
 static pthread_t demod_thread;
-static pthread_cond_t ready;
-static pthread_mutex_t ready_m;
 static volatile int do_exit = 0;
 static rtlsdr_dev_t *dev = NULL;
 
-uint16_t squares[256];
-
 /* todo, bundle these up in a struct */
-uint8_t *buffer;  /* also abused for uint16_t */
 int verbose_output = 0;
 int short_output = 0;
 int quality = 10;
 int allowed_errors = 5;
+int beast_output = 0;
+int frame_stats = 0;
 FILE *file;
-int adsb_frame[14];
 #define preamble_len		16
 #define long_frame		112
 #define short_frame		56
+/* magnitudes kept from the end of each block, a whole long frame */
+#define CARRY_LEN		(preamble_len + 2*long_frame + 16)
+
+struct block_ring
+/* single producer, single consumer, every block has CARRY_LEN
+ * spare samples in front for the tail of the one before it */
+{
+	uint16_t *data;
+	int      lens[RING_BLOCKS];
+	uint64_t pos[RING_BLOCKS];  /* stream sample index of each block */
+	int      block_len;
+	uint32_t head;        /* only written by the producer */
+	uint32_t tail;        /* only written by the consumer */
+	uint32_t overruns;    /* blocks the producer had to drop */
+	uint32_t high_water;  /* deepest the ring has been */
+	pthread_cond_t ready;
+	pthread_mutex_t ready_m;
+};
+
+struct block_ring ring;
+
+static struct stats_metric stat_depth = STATS_METRIC("rtl_adsb_queue_depth",
+	"Blocks waiting for the decoder", STATS_GAUGE);
+static struct stats_metric stat_dropped = STATS_METRIC("rtl_adsb_dropped_total",
+	"Blocks dropped because the decoder was behind", STATS_COUNTER);
+static struct stats_metric stat_dsp = STATS_METRIC("rtl_adsb_dsp_seconds",
+	"Decoding time per block", STATS_HIST);
+static struct stats_metric stat_accepted = STATS_METRIC("rtl_adsb_frames_accepted_total",
+	"Frames that passed the crc, repaired ones included", STATS_COUNTER);
+static struct stats_metric stat_corrected = STATS_METRIC("rtl_adsb_frames_corrected_total",
+	"Frames accepted after repairing a bit", STATS_COUNTER);
+static struct stats_metric stat_rejected = STATS_METRIC("rtl_adsb_frames_rejected_total",
+	"Frames that failed the crc", STATS_COUNTER);
+static struct stats_metric stat_output = STATS_METRIC("rtl_adsb_frames_output_total",
+	"Frames written out", STATS_COUNTER);
+
+/* the threads -Y can place */
+static const char *rt_stages[] = {"usb", "demod", NULL};
 
 /* signals are not threadsafe by default */
 #define safe_cond_signal(n, m) pthread_mutex_lock(m); pthread_cond_signal(n); pthread_mutex_unlock(m)
 #define safe_cond_wait(n, m) pthread_mutex_lock(m); pthread_cond_wait(n, m); pthread_mutex_unlock(m)
 
+int ring_init(struct block_ring *r, int block_len)
+{
+	r->data = calloc(RING_BLOCKS * (CARRY_LEN + block_len), sizeof(uint16_t));
+	if (!r->data) {
+		return -1;}
+	r->block_len = block_len;
+	r->head = r->tail = 0;
+	r->overruns = r->high_water = 0;
+	pthread_cond_init(&r->ready, NULL);
+	pthread_mutex_init(&r->ready_m, NULL);
+	return 0;
+}
+
+void ring_cleanup(struct block_ring *r)
+{
+	free(r->data);
+	r->data = NULL;
+	pthread_cond_destroy(&r->ready);
+	pthread_mutex_destroy(&r->ready_m);
+}
+
+static uint16_t *ring_block(struct block_ring *r, uint32_t n)
+{
+	return r->data + (n % RING_BLOCKS) * (CARRY_LEN + r->block_len) + CARRY_LEN;
+}
+
+uint16_t *ring_write_slot(struct block_ring *r)
+/* producer side, NULL (and an overrun) if the consumer is behind */
+{
+	uint32_t head = r->head;
+	if (head - ring_load(&r->tail) >= RING_BLOCKS) {
+		r->overruns++;
+		stats_add(&stat_dropped, 1);
+		return NULL;
+	}
+	return ring_block(r, head);
+}
+
+void ring_commit(struct block_ring *r, int len, uint64_t pos)
+{
+	uint32_t depth, head = r->head;
+	r->lens[head % RING_BLOCKS] = len;
+	r->pos[head % RING_BLOCKS] = pos;
+	ring_store(&r->head, head + 1);
+	depth = head + 1 - ring_load(&r->tail);
+	if (depth > r->high_water) {
+		r->high_water = depth;}
+	stats_set(&stat_depth, depth);
+	safe_cond_signal(&r->ready, &r->ready_m);
+}
+
+uint16_t *ring_read_slot(struct block_ring *r, int *len, uint64_t *pos)
+/* consumer side, blocks until there is data or we are exiting */
+{
+	uint32_t tail = r->tail;
+	pthread_mutex_lock(&r->ready_m);
+	while (ring_load(&r->head) == tail && !do_exit) {
+		pthread_cond_wait(&r->ready, &r->ready_m);}
+	pthread_mutex_unlock(&r->ready_m);
+	if (ring_load(&r->head) == tail) {
+		return NULL;}
+	*len = r->lens[tail % RING_BLOCKS];
+	*pos = r->pos[tail % RING_BLOCKS];
+	return ring_block(r, tail);
+}
+
+void ring_release(struct block_ring *r)
+{
+	ring_store(&r->tail, r->tail + 1);
+	stats_set(&stat_depth, ring_load(&r->head) - r->tail);
+}
+
+void ring_wake(struct block_ring *r)
+{
+	safe_cond_signal(&r->ready, &r->ready_m);
+}
+
 void usage(void)
 {
 	fprintf(stderr,
 		"rtl_adsb, a simple ADS-B decoder\n\n"
-		"Use:\trtl_adsb [-R] [-g gain] [-p ppm] [output file]\n"
+		"Use:\trtl_adsb [-R] [-B] [-g gain] [-p ppm] [output file]\n"
 		"\t[-d device_index (default: 0)]\n"
 		"\t[-V verbove output (default: off)]\n"
 		"\t[-S show short frames (default: off)]\n"
 		"\t[-Q quality (0: no sanity checks, 0.5: half bit, 1: one bit (default), 2: two bits)]\n"
+		"\t    above 0 preambles also have to clear the noise floor\n"
 		"\t[-e allowed_errors (default: 5)]\n"
 		"\t[-g tuner_gain (default: automatic)]\n"
 		"\t[-p ppm_error (default: 0)]\n"
 		"\t[-T enable bias-T on GPIO PIN 0 (works for rtl-sdr.com v3 dongles)]\n"
+		"\t[-q queue depth between usb and the callback (default: 0, off)]\n"
+		"\t[-L latency_ms, size the usb transfers to hold at most this (default: off)]\n"
+		"\t[-B binary output, beast format with timestamp and signal level]\n"
+		"\t[-c print accepted/rejected frame counts every second]\n"
+		"\t    above quality 0 frames have to pass the crc, DF17 may\n"
+		"\t    have one bit fixed and DF0/4/5/16/20/21 need an address\n"
+		"\t    seen in a clean DF11/17/18 within the last minute\n"
+		"\t[-X stats (default: off)]\n"
+		"\t    tcp:[addr:]port serves counters to prometheus\n"
+		"\t    filename[,seconds] rewrites a file with them, - for stderr\n"
+		"\t[-Y scheduling (default: off)]\n"
+		"\t    stage=[cpu[-cpu]][:fifo_priority],... and lock to mlock\n"
+		"\t    stages: usb, demod\n"
 		"\tfilename (a '-' dumps samples to stdout)\n"
 		"\t (omitting the filename also uses stdout)\n\n"
 		"Streaming with netcat:\n"
@@ -130,14 +261,163 @@ static void sighandler(int signum)
 }
 #endif
 
-void display(int *frame, int len)
+/* Mode S parity is a 24 bit crc (ICAO Annex 10 vol IV), DF11/17/18
+ * carry it in the clear and the rest overlay it with the address */
+#define MODES_POLY		0xfff409
+#define ICAO_SLOTS		4096
+#define ICAO_PROBES		8
+#define ICAO_TTL		(60 * (uint64_t)ADSB_RATE)
+#define BEAST_ESC		0x1a
+
+uint32_t crc_table[256];
+uint32_t long_syndromes[long_frame];
+
+struct icao_slot
 {
-	int i, df;
-	if (!short_output && len <= short_frame) {
+	uint32_t addr;
+	uint64_t seen;  /* sample index of its last clean frame */
+};
+
+struct icao_slot icao_seen[ICAO_SLOTS];
+
+struct frame_counts
+{
+	uint32_t accepted;
+	uint32_t corrected;
+	uint32_t rejected;
+};
+
+struct frame_counts counts, counts_total;
+
+static uint32_t modes_crc(const uint8_t *msg, int len)
+/* syndrome of a len bit frame, 0 when the parity matches */
+{
+	uint32_t crc = 0;
+	int i, bytes = len / 8;
+	for (i=0; i<bytes-3; i++) {
+		crc = ((crc << 8) ^ crc_table[((crc >> 16) ^ msg[i]) & 0xff]) & 0xffffff;}
+	return crc ^ (uint32_t)(msg[bytes-3] << 16 | msg[bytes-2] << 8 | msg[bytes-1]);
+}
+
+void crc_init(void)
+/* byte table, plus the syndrome each single bit error leaves */
+{
+	uint8_t msg[long_frame/8];
+	uint32_t c;
+	int i, k;
+	for (i=0; i<256; i++) {
+		c = (uint32_t)i << 16;
+		for (k=0; k<8; k++) {
+			c = (c & 0x800000) ? (c << 1) ^ MODES_POLY : c << 1;}
+		crc_table[i] = c & 0xffffff;
+	}
+	for (k=0; k<long_frame; k++) {
+		memset(msg, 0, sizeof(msg));
+		msg[k/8] = (uint8_t)(0x80 >> (k%8));
+		long_syndromes[k] = modes_crc(msg, long_frame);
+	}
+}
+
+static int fix_single_bit(uint8_t *msg, uint32_t syndrome)
+/* DF17 only, the 5 DF bits are left alone so a fix can't change the type */
+{
+	int k;
+	for (k=5; k<long_frame; k++) {
+		if (long_syndromes[k] != syndrome) {
+			continue;}
+		msg[k/8] ^= (uint8_t)(0x80 >> (k%8));
+		return 1;
+	}
+	return 0;
+}
+
+static uint32_t icao_hash(uint32_t addr)
+{
+	return (addr ^ (addr >> 12)) % ICAO_SLOTS;
+}
+
+static void icao_add(uint32_t addr, uint64_t t)
+/* refreshes addr, or takes an empty, expired or else the oldest slot */
+{
+	struct icao_slot *s, *oldest = NULL;
+	uint32_t h = icao_hash(addr);
+	int i;
+	if (!addr) {
 		return;}
+	for (i=0; i<ICAO_PROBES; i++) {
+		s = &icao_seen[(h + i) % ICAO_SLOTS];
+		if (s->addr == addr) {
+			s->seen = t;
+			return;
+		}
+		if (!oldest || s->seen < oldest->seen || !s->addr) {
+			oldest = s;}
+	}
+	oldest->addr = addr;
+	oldest->seen = t;
+}
+
+static int icao_live(uint32_t addr, uint64_t t)
+{
+	struct icao_slot *s;
+	uint32_t h = icao_hash(addr);
+	int i;
+	if (!addr) {
+		return 0;}
+	for (i=0; i<ICAO_PROBES; i++) {
+		s = &icao_seen[(h + i) % ICAO_SLOTS];
+		if (s->addr == addr) {
+			return t - s->seen < ICAO_TTL;}
+	}
+	return 0;
+}
+
+int check_frame(uint8_t *msg, int len, uint64_t t)
+/* 0: reject, 1: parity ok, 2: ok after fixing one bit
+ * address/parity types pass if a clean frame came from them lately */
+{
+	uint32_t syndrome, addr;
+	int df;
+	df = (msg[0] >> 3) & 0x1f;
+	syndrome = modes_crc(msg, len);
+	addr = (uint32_t)(msg[1] << 16 | msg[2] << 8 | msg[3]);
+	switch (df) {
+	case 11:
+		/* the interrogator code may sit in the low 7 bits */
+		if (syndrome & ~0x7fu) {
+			return 0;}
+		icao_add(addr, t);
+		return 1;
+	case 17:
+	case 18:
+		if (syndrome) {
+			if (df == 18 || !fix_single_bit(msg, syndrome)) {
+				return 0;}
+			addr = (uint32_t)(msg[1] << 16 | msg[2] << 8 | msg[3]);
+			icao_add(addr, t);
+			return 2;
+		}
+		icao_add(addr, t);
+		return 1;
+	case 0:
+	case 4:
+	case 5:
+	case 16:
+	case 20:
+	case 21:
+		return icao_live(syndrome, t);
+	default:
+		/* comm-d, DF24 and up */
+		if (df >= 24) {
+			return icao_live(syndrome, t);}
+	}
+	return 0;
+}
+
+void display(uint8_t *frame, int len)
+{
+	int i, df;
 	df = (frame[0] >> 3) & 0x1f;
-	if (quality == 0 && !(df==11 || df==17 || df==18 || df==19)) {
-		return;}
 	fprintf(file, "*");
 	for (i=0; i<((len+7)/8); i++) {
 		fprintf(file, "%02x", frame[i]);}
@@ -153,35 +433,34 @@ void display(int *frame, int len)
 	fprintf(file, "--------------\n");
 }
 
-int abs8(int x)
-/* do not subtract 127 from the raw iq, this handles it */
+static void beast_put(uint8_t *out, int *n, uint8_t c)
 {
-	if (x >= 127) {
-		return x - 127;}
-	return 127 - x;
+	out[(*n)++] = c;
+	if (c == BEAST_ESC) {
+		out[(*n)++] = c;}
 }
 
-void squares_precompute(void)
-/* equiv to abs(x-128) ^ 2 */
+void beast_display(uint8_t *frame, int len, uint64_t t, int level)
+/* <esc> '2' or '3', 48 bit 12 MHz clock, signal, frame
+ * and any <esc> after the type byte is doubled */
 {
-	int i, j;
-	// todo, check if this LUT is actually any faster
-	for (i=0; i<256; i++) {
-		j = abs8(i);
-		squares[i] = (uint16_t)(j*j);
-	}
+	uint8_t out[2 + 2 * (6 + 1 + long_frame/8)];
+	uint64_t clock = t * (12000000 / ADSB_RATE);
+	int i, n = 0;
+	out[n++] = BEAST_ESC;
+	out[n++] = len > short_frame ? '3' : '2';
+	for (i=5; i>=0; i--) {
+		beast_put(out, &n, (uint8_t)(clock >> (8*i)));}
+	beast_put(out, &n, (uint8_t)level);
+	for (i=0; i<len/8; i++) {
+		beast_put(out, &n, frame[i]);}
+	fwrite(out, 1, (size_t)n, file);
 }
 
-int magnitute(uint8_t *buf, int len)
-/* takes i/q, changes buf in place (16 bit), returns new len (16 bit) */
+void print_counts(struct frame_counts *c, const char *what)
 {
-	int i;
-	uint16_t *m;
-	for (i=0; i<len; i+=2) {
-		m = (uint16_t*)(&buf[i]);
-		*m = squares[buf[i]] + squares[buf[i+1]];
-	}
-	return len/2;
+	fprintf(stderr, "%s%u frames accepted (%u corrected), %u rejected\n",
+		what, c->accepted, c->corrected, c->rejected);
 }
 
 static inline uint16_t single_manchester(uint16_t a, uint16_t b, uint16_t c, uint16_t d)
@@ -261,32 +540,275 @@ static inline int preamble(uint16_t *buf, int i)
 	return 1;
 }
 
-void manchester(uint16_t *buf, int len)
-/* overwrites magnitude buffer with valid bits (BADSAMPLE on errors) */
+/* the same test as preamble(), pulses at 0 2 7 9 have to beat their
+ * neighbours: 0>1, 2>1, 2>3..6, 7>6, 7>8, 9>8, 9>10..15
+ * and all four have to clear thr, a few times the noise floor.
+ * noise passes the ordering every few hundred samples and the false
+ * frame then swallows the real one, the threshold is what stops that.
+ * vector versions test one lane per start index, the threshold goes
+ * first so quiet stretches cost one compare per sample */
+
+#define PREAMBLE_SNR		4
+#define FLOOR_WINDOW		256
+
+static int noise_floor(uint16_t *mag, int len)
+/* a low percentile of short window means, so bursts don't count */
+{
+	int i, j, n, v;
+	uint32_t sum;
+	int means[DEFAULT_BUF_LENGTH / 2 / FLOOR_WINDOW];
+	n = 0;
+	for (i=0; i+FLOOR_WINDOW<=len && n<(int)(sizeof(means)/sizeof(int)); i+=FLOOR_WINDOW) {
+		sum = 0;
+		for (j=0; j<FLOOR_WINDOW; j++) {
+			sum += mag[i+j];}
+		/* insertion, keeps it sorted */
+		v = (int)(sum / FLOOR_WINDOW);
+		for (j=n; j>0 && means[j-1]>v; j--) {
+			means[j] = means[j-1];}
+		means[j] = v;
+		n++;
+	}
+	if (!n) {
+		return 0;}
+	return means[n/8];
+}
+
+static int find_preamble_c(uint16_t *buf, int i, int end, uint16_t thr)
+/* first start index in [i, end) with a preamble, or end */
+{
+	for (; i<end; i++) {
+		if (buf[i] <= thr || buf[i+2] <= thr || buf[i+7] <= thr || buf[i+9] <= thr) {
+			continue;}
+		if (preamble(buf, i)) {
+			return i;}
+	}
+	return end;
+}
+
+#ifdef FRONT_SSE2
+/* a <= b for unsigned 16 bit lanes */
+#define le_sse2(a, b) _mm_cmpeq_epi16(_mm_subs_epu16(a, b), zero)
+#define at_sse2(k) _mm_loadu_si128((const __m128i *)(buf + i + k))
+
+static int find_preamble_sse2(uint16_t *buf, int i, int end, uint16_t thr)
+{
+	int mask, k;
+	__m128i zero = _mm_setzero_si128();
+	__m128i t = _mm_set1_epi16((short)thr);
+	__m128i p0, p2, p7, p9, bad;
+	for (; i+8<=end; i+=8) {
+		p0 = at_sse2(0);
+		bad = le_sse2(p0, t);
+		if (_mm_movemask_epi8(bad) == 0xffff) {
+			continue;}
+		p2 = at_sse2(2);
+		p7 = at_sse2(7);
+		p9 = at_sse2(9);
+		bad = _mm_or_si128(bad, _mm_or_si128(le_sse2(p2, t), _mm_or_si128(le_sse2(p7, t), le_sse2(p9, t))));
+		bad = _mm_or_si128(bad, _mm_or_si128(le_sse2(p0, at_sse2(1)), le_sse2(p2, at_sse2(1))));
+		bad = _mm_or_si128(bad, _mm_or_si128(le_sse2(p7, at_sse2(8)), le_sse2(p9, at_sse2(8))));
+		if (_mm_movemask_epi8(bad) == 0xffff) {
+			continue;}
+		for (k=3; k<=6; k++) {
+			bad = _mm_or_si128(bad, le_sse2(p2, at_sse2(k)));}
+		bad = _mm_or_si128(bad, le_sse2(p7, at_sse2(6)));
+		for (k=10; k<preamble_len; k++) {
+			bad = _mm_or_si128(bad, le_sse2(p9, at_sse2(k)));}
+		mask = ~_mm_movemask_epi8(bad) & 0xffff;
+		if (!mask) {
+			continue;}
+		for (k=0; !(mask & 1); k++) {
+			mask >>= 2;}
+		return i + k;
+	}
+	return find_preamble_c(buf, i, end, thr);
+}
+#endif
+
+#ifdef FRONT_AVX2
+#define le_avx2(a, b) _mm256_cmpeq_epi16(_mm256_subs_epu16(a, b), zero)
+#define at_avx2(k) _mm256_loadu_si256((const __m256i *)(buf + i + k))
+
+__attribute__((target("avx2")))
+static int find_preamble_avx2(uint16_t *buf, int i, int end, uint16_t thr)
+{
+	int k;
+	unsigned int mask;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i t = _mm256_set1_epi16((short)thr);
+	__m256i p0, p2, p7, p9, bad;
+	for (; i+16<=end; i+=16) {
+		p0 = at_avx2(0);
+		bad = le_avx2(p0, t);
+		if ((unsigned int)_mm256_movemask_epi8(bad) == 0xffffffffu) {
+			continue;}
+		p2 = at_avx2(2);
+		p7 = at_avx2(7);
+		p9 = at_avx2(9);
+		bad = _mm256_or_si256(bad, _mm256_or_si256(le_avx2(p2, t), _mm256_or_si256(le_avx2(p7, t), le_avx2(p9, t))));
+		bad = _mm256_or_si256(bad, _mm256_or_si256(le_avx2(p0, at_avx2(1)), le_avx2(p2, at_avx2(1))));
+		bad = _mm256_or_si256(bad, _mm256_or_si256(le_avx2(p7, at_avx2(8)), le_avx2(p9, at_avx2(8))));
+		if ((unsigned int)_mm256_movemask_epi8(bad) == 0xffffffffu) {
+			continue;}
+		for (k=3; k<=6; k++) {
+			bad = _mm256_or_si256(bad, le_avx2(p2, at_avx2(k)));}
+		bad = _mm256_or_si256(bad, le_avx2(p7, at_avx2(6)));
+		for (k=10; k<preamble_len; k++) {
+			bad = _mm256_or_si256(bad, le_avx2(p9, at_avx2(k)));}
+		mask = ~(unsigned int)_mm256_movemask_epi8(bad);
+		if (!mask) {
+			continue;}
+		for (k=0; !(mask & 1); k++) {
+			mask >>= 2;}
+		return i + k;
+	}
+	return find_preamble_c(buf, i, end, thr);
+}
+#endif
+
+#ifdef FRONT_NEON
+#define at_neon(k) vld1q_u16(buf + i + k)
+
+static int all_set_neon(uint16x8_t v)
+{
+	uint16x4_t all;
+	all = vand_u16(vget_low_u16(v), vget_high_u16(v));
+	all = vpmin_u16(all, all);
+	all = vpmin_u16(all, all);
+	return vget_lane_u16(all, 0) == 0xffff;
+}
+
+static int find_preamble_neon(uint16_t *buf, int i, int end, uint16_t thr)
+{
+	int k;
+	uint16_t lanes[8];
+	uint16x8_t t = vdupq_n_u16(thr);
+	uint16x8_t p0, p2, p7, p9, bad;
+	for (; i+8<=end; i+=8) {
+		p0 = at_neon(0);
+		bad = vcleq_u16(p0, t);
+		if (all_set_neon(bad)) {
+			continue;}
+		p2 = at_neon(2);
+		p7 = at_neon(7);
+		p9 = at_neon(9);
+		bad = vorrq_u16(bad, vorrq_u16(vcleq_u16(p2, t), vorrq_u16(vcleq_u16(p7, t), vcleq_u16(p9, t))));
+		bad = vorrq_u16(bad, vorrq_u16(vcleq_u16(p0, at_neon(1)), vcleq_u16(p2, at_neon(1))));
+		bad = vorrq_u16(bad, vorrq_u16(vcleq_u16(p7, at_neon(8)), vcleq_u16(p9, at_neon(8))));
+		if (all_set_neon(bad)) {
+			continue;}
+		for (k=3; k<=6; k++) {
+			bad = vorrq_u16(bad, vcleq_u16(p2, at_neon(k)));}
+		bad = vorrq_u16(bad, vcleq_u16(p7, at_neon(6)));
+		for (k=10; k<preamble_len; k++) {
+			bad = vorrq_u16(bad, vcleq_u16(p9, at_neon(k)));}
+		vst1q_u16(lanes, bad);
+		for (k=0; k<8; k++) {
+			if (!lanes[k]) {
+				return i + k;}
+		}
+	}
+	return find_preamble_c(buf, i, end, thr);
+}
+#endif
+
+static int (*find_preamble)(uint16_t *buf, int i, int end, uint16_t thr) = find_preamble_c;
+
+static void front_end_init(void)
+/* pick the widest kernels this cpu runs */
+{
+#ifdef FRONT_SSE2
+	find_preamble = find_preamble_sse2;
+#endif
+#ifdef FRONT_NEON
+	find_preamble = find_preamble_neon;
+#endif
+#ifdef FRONT_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		find_preamble = find_preamble_avx2;
+	}
+#endif
+}
+
+void decode_frame(uint16_t *bits, int n, uint64_t t, int level)
+/* packs the bits manchester() marked, the last one may be missing */
+{
+	uint8_t frame[long_frame/8];
+	int i, df, len, r;
+	if (n < short_frame - 1) {
+		return;}
+	len = bits[0] ? long_frame : short_frame;
+	if (n < len - 1) {
+		return;}
+	if (n > len) {
+		n = len;}
+	memset(frame, 0, sizeof(frame));
+	for (i=0; i<n; i++) {
+		if (bits[i]) {
+			frame[i/8] |= (uint8_t)(0x80 >> (i%8));}
+	}
+	df = (frame[0] >> 3) & 0x1f;
+	if (quality) {
+		r = check_frame(frame, len, t);
+		if (!r) {
+			counts.rejected++;
+			stats_add(&stat_rejected, 1);
+			return;
+		}
+		counts.accepted++;
+		stats_add(&stat_accepted, 1);
+		if (r == 2) {
+			counts.corrected++;
+			stats_add(&stat_corrected, 1);
+		}
+	} else if (!(df==11 || df==17 || df==18 || df==19)) {
+		return;}
+	if (!short_output && len <= short_frame) {
+		return;}
+	stats_add(&stat_output, 1);
+	if (beast_output) {
+		beast_display(frame, len, t, level);
+	} else {
+		display(frame, len);}
+}
+
+static int signal_level(uint16_t *buf, int i)
+/* mean of the preamble pulses as an amplitude, 0-255 */
+{
+	int m = (buf[i] + buf[i+2] + buf[i+7] + buf[i+9]) / 4;
+	return (int)(sqrt((double)m) * 255.0 / 182.0);
+}
+
+int manchester(uint16_t *buf, int i, int scan_end, int len, uint16_t thr, uint64_t pos)
+/* overwrites magnitude buffer with valid bits (BADSAMPLE on errors)
+ * looks for preambles in [i, scan_end), a frame may run on past
+ * scan_end but never past one long frame.  buf[0] is sample pos,
+ * every frame is decoded as it ends.  returns where it stopped */
 {
 	/* a and b hold old values to verify local manchester */
 	uint16_t a=0, b=0;
 	uint16_t bit;
-	int i, i2, start, errors;
+	int i2, start, errors, level;
+	uint64_t t;
 	int maximum_i = len - 1;        // len-1 since we look at i and i+1
-	// todo, allow wrap across buffers
-	i = 0;
-	while (i < maximum_i) {
+	while (i < scan_end) {
 		/* find preamble */
-		for ( ; i < (len - preamble_len); i++) {
-			if (!preamble(buf, i)) {
-				continue;}
-			a = buf[i];
-			b = buf[i+1];
-			for (i2=0; i2<preamble_len; i2++) {
-				buf[i+i2] = MESSAGEGO;}
-			i += preamble_len;
-			break;
-		}
+		i = find_preamble(buf, i, scan_end, thr);
+		if (i >= scan_end) {
+			break;}
+		t = pos + (uint64_t)i;
+		level = signal_level(buf, i);
+		a = buf[i];
+		b = buf[i+1];
+		for (i2=0; i2<preamble_len; i2++) {
+			buf[i+i2] = MESSAGEGO;}
+		i += preamble_len;
 		i2 = start = i;
 		errors = 0;
 		/* mark bits until encoding breaks */
-		for ( ; i < maximum_i; i+=2, i2++) {
+		for ( ; i < maximum_i && i2 - start < long_frame; i+=2, i2++) {
 			bit = single_manchester(a, b, buf[i], buf[i+1]);
 			a = buf[i];
 			b = buf[i+1];
@@ -305,58 +827,78 @@ void manchester(uint16_t *buf, int len)
 			buf[i] = buf[i+1] = OVERWRITE;
 			buf[i2] = bit;
 		}
+		decode_frame(buf + start, i2 - start, t, level);
 	}
+	fflush(file);
+	return i;
 }
 
-void messages(uint16_t *buf, int len)
-{
-	int i, data_i, index, shift, frame_len;
-	// todo, allow wrap across buffers
-	for (i=0; i<len; i++) {
-		if (buf[i] > 1) {
-			continue;}
-		frame_len = long_frame;
-		data_i = 0;
-		for (index=0; index<14; index++) {
-			adsb_frame[index] = 0;}
-		for(; i<len && buf[i]<=1 && data_i<frame_len; i++, data_i++) {
-			if (buf[i]) {
-				index = data_i / 8;
-				shift = 7 - (data_i % 8);
-				adsb_frame[index] |= (uint8_t)(1<<shift);
-			}
-			if (data_i == 7) {
-				if (adsb_frame[0] == 0) {
-				    break;}
-				if (adsb_frame[0] & 0x80) {
-					frame_len = long_frame;}
-				else {
-					frame_len = short_frame;}
-			}
-		}
-		if (data_i < (frame_len-1)) {
-			continue;}
-		display(adsb_frame, frame_len);
-		fflush(file);
-	}
-}
-
-static void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
+static void rtlsdr_callback(unsigned char *buf, uint32_t len,
+			    const rtlsdr_buffer_info_t *info, void *ctx)
 {
+	uint16_t *mag;
 	if (do_exit) {
 		return;}
-	memcpy(buffer, buf, len);
-	safe_cond_signal(&ready, &ready_m);
+	mag = ring_write_slot(&ring);
+	if (!mag) {
+		return;}
+	if (len > 2 * (uint32_t)ring.block_len) {
+		len = 2 * (uint32_t)ring.block_len;}
+	rtlsdr_dsp_magnitude(buf, mag, (int)len);
+	ring_commit(&ring, (int)len / 2, info->sample_index);
 }
 
 static void *demod_thread_fn(void *arg)
+/* each block is decoded with the tail of the previous one in front,
+ * preambles in the last CARRY_LEN samples wait for the next block */
 {
-	int len;
+	uint16_t carry[CARRY_LEN];
+	uint16_t *mag, *work;
+	int len, total, start, stop, thr;
+	uint64_t pos, next_pos = 0, next_report = ADSB_RATE;
+	uint64_t t;
+	verbose_rt_thread("demod", 0);
+	memset(carry, 0, sizeof(carry));
+	start = 0;
 	while (!do_exit) {
-		safe_cond_wait(&ready, &ready_m);
-		len = magnitute(buffer, DEFAULT_BUF_LENGTH);
-		manchester((uint16_t*)buffer, len);
-		messages((uint16_t*)buffer, len);
+		mag = ring_read_slot(&ring, &len, &pos);
+		if (!mag) {
+			continue;}
+		if (pos != next_pos) {
+			/* samples were lost, the old tail doesn't lead into this */
+			memset(carry, 0, sizeof(carry));
+			start = 0;
+		}
+		next_pos = pos + (uint64_t)len;
+		t = stats_now_us();
+		work = mag - CARRY_LEN;
+		memcpy(work, carry, sizeof(carry));
+		total = CARRY_LEN + len;
+		/* decoding marks the buffer, keep the raw tail first */
+		memcpy(carry, work + total - CARRY_LEN, sizeof(carry));
+		thr = 0;
+		if (quality) {
+			thr = PREAMBLE_SNR * noise_floor(mag, len);}
+		if (thr > 65535) {
+			thr = 65535;}
+		stop = manchester(work, start, total - CARRY_LEN, total,
+			(uint16_t)thr, pos - CARRY_LEN);
+		stats_time(&stat_dsp, stats_now_us() - t);
+		ring_release(&ring);
+		/* don't look for preambles inside a frame we already took */
+		start = stop - (total - CARRY_LEN);
+		if (start < 0) {
+			start = 0;}
+		if (next_pos < next_report) {
+			continue;}
+		/* once a second of samples */
+		next_report = next_pos + ADSB_RATE;
+		if (frame_stats && quality) {
+			print_counts(&counts, "");}
+		counts_total.accepted += counts.accepted;
+		counts_total.corrected += counts.corrected;
+		counts_total.rejected += counts.rejected;
+		memset(&counts, 0, sizeof(counts));
 	}
 	rtlsdr_cancel_async(dev);
 	return 0;
@@ -374,11 +916,13 @@ int main(int argc, char **argv)
 	int dev_given = 0;
 	int ppm_error = 0;
 	int enable_biastee = 0;
-	pthread_cond_init(&ready, NULL);
-	pthread_mutex_init(&ready_m, NULL);
-	squares_precompute();
+	int async_queue = 0;
+	double latency_ms = 0;
+	char *stats_spec = NULL;
+	front_end_init();
+	crc_init();
 
-	while ((opt = getopt(argc, argv, "d:g:p:e:Q:VST")) != -1)
+	while ((opt = getopt(argc, argv, "d:g:p:e:Q:q:L:X:Y:VSTBc")) != -1)
 	{
 		switch (opt) {
 		case 'd':
@@ -406,6 +950,25 @@ int main(int argc, char **argv)
 		case 'T':
 			enable_biastee = 1;
 			break;
+		case 'q':
+			async_queue = atoi(optarg);
+			break;
+		case 'L':
+			latency_ms = atof(optarg);
+			break;
+		case 'B':
+			beast_output = 1;
+			break;
+		case 'c':
+			frame_stats = 1;
+			break;
+		case 'X':
+			stats_spec = optarg;
+			break;
+		case 'Y':
+			if (rt_parse(optarg, rt_stages) < 0) {
+				exit(1);}
+			break;
 		default:
 			usage();
 			return 0;
@@ -418,7 +981,10 @@ int main(int argc, char **argv)
 		filename = argv[optind];
 	}
 
-	buffer = malloc(DEFAULT_BUF_LENGTH * sizeof(uint8_t));
+	if (ring_init(&ring, DEFAULT_BUF_LENGTH / 2) < 0) {
+		fprintf(stderr, "Failed to allocate demod ring.\n");
+		exit(1);
+	}
 
 	if (!dev_given) {
 		dev_index = verbose_device_search("0");
@@ -428,6 +994,7 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	verbose_rt_lock();
 	r = rtlsdr_open(&dev, (uint32_t)dev_index);
 	if (r < 0) {
 		fprintf(stderr, "Failed to open rtlsdr device #%d.\n", dev_index);
@@ -482,9 +1049,26 @@ int main(int argc, char **argv)
 
 	/* Reset endpoint before we start reading from it (mandatory) */
 	verbose_reset_buffer(dev);
+	verbose_async_queue(dev, async_queue);
+	verbose_latency_target(dev, latency_ms);
+
+	if (stats_spec) {
+		stats_register(&stat_depth);
+		stats_register(&stat_dropped);
+		stats_register(&stat_dsp);
+		stats_register(&stat_accepted);
+		stats_register(&stat_corrected);
+		stats_register(&stat_rejected);
+		stats_register(&stat_output);
+		stats_device(dev);
+		if (stats_start(stats_spec) < 0) {
+			fprintf(stderr, "Failed to start the stats, continuing without\n");}
+	}
 
 	pthread_create(&demod_thread, NULL, demod_thread_fn, (void *)(NULL));
-	rtlsdr_read_async(dev, rtlsdr_callback, (void *)(NULL),
+	/* after the demod thread, which would inherit it otherwise */
+	verbose_rt_thread("usb", 0);
+	rtlsdr_read_async_ex(dev, rtlsdr_callback, (void *)(NULL),
 			      DEFAULT_ASYNC_BUF_NUMBER,
 			      DEFAULT_BUF_LENGTH);
 
@@ -493,16 +1077,24 @@ int main(int argc, char **argv)
 	else {
 		fprintf(stderr, "\nLibrary error %d, exiting...\n", r);}
 	rtlsdr_cancel_async(dev);
-	pthread_cancel(demod_thread);
+	do_exit = 1;
+	ring_wake(&ring);
 	pthread_join(demod_thread, NULL);
-	pthread_cond_destroy(&ready);
-	pthread_mutex_destroy(&ready_m);
+	fprintf(stderr, "Dongle to demod: %u blocks dropped, %u/%i blocks deep at most\n",
+		ring.overruns, ring.high_water, RING_BLOCKS);
+	if (quality) {
+		counts_total.accepted += counts.accepted;
+		counts_total.corrected += counts.corrected;
+		counts_total.rejected += counts.rejected;
+		print_counts(&counts_total, "In total: ");
+	}
 
 	if (file != stdout) {
 		fclose(file);}
 
+	stats_stop();
 	rtlsdr_close(dev);
-	free(buffer);
+	ring_cleanup(&ring);
 	return r >= 0 ? r : -r;
 }
 
@@ -25,7 +25,7 @@
  * FM demod on Atom hardware with GNU radio
  * based on rtl_sdr.c and rtl_tcp.c
  *
- * lots of locks, but that is okay
+ * threads hand blocks down single producer/consumer rings
  * (no many-to-many locks)
  *
  * todo:
@@ -43,7 +43,6 @@
  *       merge stereo patch
  *       merge soft agc patch
  *       merge udp patch
- *       testmode to detect overruns
  *       watchdog to reset bad dongle
  *       fix oversampling
  */
@@ -56,6 +55,7 @@
 
 #ifndef _WIN32
 #include <unistd.h>
+#include <sys/time.h>
 #else
 #include <windows.h>
 #include <fcntl.h>
@@ -73,24 +73,71 @@
 #include <libusb.h>
 
 #include "rtl-sdr.h"
+#include "rtl-sdr_dsp.h"
 #include "convenience/convenience.h"
+#include "convenience/stats.h"
+#include "convenience/atomic.h"
 
 #define DEFAULT_SAMPLE_RATE		24000
 #define DEFAULT_BUF_LENGTH		(1 * 16384)
 #define MAXIMUM_OVERSAMPLE		16
 #define MAXIMUM_BUF_LENGTH		(MAXIMUM_OVERSAMPLE * DEFAULT_BUF_LENGTH)
 #define AUTO_GAIN			-100
-#define BUFFER_DUMP			4096
+#define SETTLE_GUARD_NS			200000ULL
 
 #define FREQUENCIES_LIMIT		1000
 
+/* scanning */
+#define SQUELCH_EARLY			256	/* decimated I/Q pairs a first look takes */
+#define PRIORITY_MS			500	/* default most time between priority visits */
+#define ACTIVE_HOLD_US			10000000	/* how long a channel counts as busy */
+#define ACTIVE_WEIGHT			4	/* busy channels are visited this much more */
+
+#define RING_BLOCKS			8
+
+#define CHANNELS_LIMIT			64
+#define CHANNEL_WORKERS_LIMIT		16
+#define CHANNEL_TAPS			12	/* prototype taps per fft bin */
+#define CHANNEL_GAIN			32.0f
+
 static volatile int do_exit = 0;
 static int lcm_post[17] = {1,1,1,3,1,5,3,7,1,9,5,11,3,13,7,15,1};
 static int ACTUAL_BUF_LENGTH;
 
-static int *atan_lut = NULL;
-static int atan_lut_size = 131072; /* 512 KB */
-static int atan_lut_coef = 8;
+static struct stats_metric stat_in_depth = STATS_METRIC("rtl_fm_input_queue_depth",
+	"Blocks waiting for the demodulator", STATS_GAUGE);
+static struct stats_metric stat_in_drops = STATS_METRIC("rtl_fm_input_dropped_total",
+	"Blocks dropped because the demodulator was behind", STATS_COUNTER);
+static struct stats_metric stat_out_depth = STATS_METRIC("rtl_fm_output_queue_depth",
+	"Blocks waiting for the output", STATS_GAUGE);
+static struct stats_metric stat_out_drops = STATS_METRIC("rtl_fm_output_dropped_total",
+	"Blocks dropped because the output was behind", STATS_COUNTER);
+static struct stats_metric stat_dsp = STATS_METRIC("rtl_fm_dsp_seconds",
+	"Demodulation time per block", STATS_HIST);
+static struct stats_metric stat_hops = STATS_METRIC("rtl_fm_hops_total",
+	"Retunes while scanning", STATS_COUNTER);
+static struct stats_metric stat_stale = STATS_METRIC("rtl_fm_stale_blocks_total",
+	"Blocks dropped because they were from before a retune", STATS_COUNTER);
+
+/* the threads -Y can place */
+static const char *rt_stages[] = {"usb", "demod", "chan", "output", "controller", NULL};
+
+struct block_ring
+/* single producer, single consumer, preallocated blocks */
+{
+	int16_t  *data;
+	int      lens[RING_BLOCKS];
+	uint32_t tags[RING_BLOCKS];  /* the producer's retune epoch per block */
+	int      block_len;
+	uint32_t head;        /* only written by the producer */
+	uint32_t tail;        /* only written by the consumer */
+	uint32_t overruns;    /* blocks the producer had to drop */
+	uint32_t high_water;  /* deepest the ring has been */
+	struct stats_metric *depth_stat;  /* exported with -X, may be NULL */
+	struct stats_metric *drop_stat;
+	pthread_cond_t ready;
+	pthread_mutex_t ready_m;
+};
 
 struct dongle_state
 {
@@ -101,12 +148,20 @@ struct dongle_state
 	uint32_t freq;
 	uint32_t rate;
 	int      gain;
-	uint16_t buf16[MAXIMUM_BUF_LENGTH];
 	uint32_t buf_len;
 	int      ppm_error;
 	int      offset_tuning;
 	int      direct_sampling;
-	int      mute;
+	/* retunes, the epoch is bumped as one starts and settle_ns is set
+	 * when it is done.  both are only changed with retune_lock held */
+	pthread_mutex_t retune_lock;
+	uint32_t epoch;
+	uint64_t settle_ns;   /* UINT64_MAX while the tuner moves */
+	/* the callback's own */
+	struct stream_clock clock;
+	uint32_t seen_epoch;
+	int      settled;
+	uint64_t start_index; /* the first sample of seen_epoch to keep */
 	struct demod_state *demod_target;
 };
 
@@ -114,35 +169,34 @@ struct demod_state
 {
 	int      exit_flag;
 	pthread_t thread;
-	int16_t  lowpassed[MAXIMUM_BUF_LENGTH];
+	struct block_ring input;
+	int16_t  *lowpassed;  /* points into the input ring */
 	int      lp_len;
-	int16_t  lp_i_hist[10][6];
-	int16_t  lp_q_hist[10][6];
-	int16_t  result[MAXIMUM_BUF_LENGTH];
-	int16_t  droop_i_hist[9];
-	int16_t  droop_q_hist[9];
+	int16_t  lp_hist[10][10];
+	int16_t  *result;     /* points into the output ring */
+	int16_t  result_spare[MAXIMUM_BUF_LENGTH];  /* when the output ring is full */
+	int16_t  droop_hist[18];
 	int      result_len;
 	int      rate_in;
 	int      rate_out;
 	int      rate_out2;
 	int      now_r, now_j;
-	int      pre_r, pre_j;
+	int16_t  pre_iq[2];    /* the last I/Q pair fm_demod saw */
 	int      prev_index;
 	int      downsample;    /* min 1, max 256 */
 	int      post_downsample;
 	int      output_scale;
 	int      squelch_level, conseq_squelch, squelch_hits, terminate_on_squelch;
+	int      squelch_early;  /* the block is a first look at a channel */
+	int      squelch_heard;  /* something broke the squelch since the retune */
+	uint32_t epoch;          /* of the blocks being demodulated */
 	int      downsample_passes;
 	int      comp_fir_size;
 	int      custom_atan;
-	int      deemph, deemph_a;
-	int      now_lpr;
-	int      prev_lpr_index;
+	int      deemph, deemph_a, deemph_avg;
+	rtlsdr_dsp_resampler_t *resample;  /* to rate_out2 */
 	int      dc_block, dc_avg;
 	void     (*mode_demod)(struct demod_state*);
-	pthread_rwlock_t rw;
-	pthread_cond_t ready;
-	pthread_mutex_t ready_m;
 	struct output_state *output_target;
 };
 
@@ -152,12 +206,16 @@ struct output_state
 	pthread_t thread;
 	FILE     *file;
 	char     *filename;
-	int16_t  result[MAXIMUM_BUF_LENGTH];
-	int      result_len;
+	struct block_ring results;
 	int      rate;
-	pthread_rwlock_t rw;
-	pthread_cond_t ready;
-	pthread_mutex_t ready_m;
+};
+
+struct scan_channel
+/* what the scheduler knows about one frequency */
+{
+	int      priority;     /* most ms between visits, 0 for none */
+	uint64_t visited_us;   /* last time it was tuned away from */
+	uint64_t active_us;    /* last time it broke the squelch */
 };
 
 struct controller_state
@@ -165,19 +223,67 @@ struct controller_state
 	int      exit_flag;
 	pthread_t thread;
 	uint32_t freqs[FREQUENCIES_LIMIT];
+	struct scan_channel chans[FREQUENCIES_LIMIT];
 	int      freq_len;
 	int      freq_now;
 	int      edge;
 	int      wb_mode;
+	int      hop_asked;    /* under hop_m, with the two below */
+	int      hop_heard;
+	uint32_t hop_from;     /* the epoch the demodulator wants to leave */
 	pthread_cond_t hop;
 	pthread_mutex_t hop_m;
 };
 
+struct channel_state
+{
+	uint32_t freq;
+	int      bin;
+	float    rot_r, rot_j;    /* fine tune and the (-1)^(bin*frame) term */
+	float    step_r, step_j;
+	struct demod_state *demod;
+	FILE     *file;
+	char     filename[1024];
+};
+
+struct chan_worker
+/* owns every workers'th channel, starting at index */
+{
+	pthread_t thread;
+	int      index;
+};
+
+struct channelizer_state
+/* 2x oversampled polyphase filter bank, one fft bin per channel */
+{
+	int      enabled;
+	int      count;
+	int      fft_size;        /* bins are rate / fft_size apart */
+	int      hop;             /* fft_size / 2 */
+	int      taps;            /* fft_size * CHANNEL_TAPS */
+	uint32_t center;
+	uint32_t rate;
+	uint32_t spacing;
+	float    *proto;          /* each tap twice, for I and Q */
+	float    *window;         /* I/Q history plus the newest block */
+	int      fill;            /* floats in window */
+	float    *acc;
+	float    *twiddle;
+	int      *bitrev;
+	int      workers;
+	struct chan_worker worker[CHANNEL_WORKERS_LIMIT];
+	struct channel_state chans[CHANNELS_LIMIT];
+	uint32_t batch;           /* bumped after every block */
+	pthread_cond_t batch_ready;
+	pthread_mutex_t batch_m;
+};
+
 // multiple of these, eventually
 struct dongle_state dongle;
 struct demod_state demod;
 struct output_state output;
 struct controller_state controller;
+struct channelizer_state channelizer;
 
 void usage(void)
 {
@@ -187,6 +293,8 @@ void usage(void)
 		"\t-f frequency_to_tune_to [Hz]\n"
 		"\t    use multiple -f for scanning (requires squelch)\n"
 		"\t    ranges supported, -f 118M:137M:25k\n"
+		"\t[-P priority_frequency[,max_ms] (default: none, %i ms)]\n"
+		"\t    scanned as -f, but checked at least every max_ms\n"
 		"\t[-M modulation (default: fm)]\n"
 		"\t    fm, wbfm, raw, am, usb, lsb\n"
 		"\t    wbfm == -M fm -s 170k -o 4 -A fast -r 32k -l 0 -E deemp\n"
@@ -207,16 +315,29 @@ void usage(void)
 		"\t    direct:  enable direct sampling 1 (usually I)\n"
 		"\t    direct2: enable direct sampling 2 (usually Q)\n"
 		"\t    offset:  enable offset tuning\n"
+		"\t    chan:    demodulate every -f at once, no scanning\n"
+		"\t             writes filename.freq, or expands a %%u in filename\n"
+		"\t[-w channel_workers (default: 1)]\n"
 		"\tfilename ('-' means stdout)\n"
 		"\t    omitting the filename also uses stdout\n\n"
 		"Experimental options:\n"
 		"\t[-r resample_rate (default: none / same as -s)]\n"
 		"\t[-t squelch_delay (default: 10)]\n"
 		"\t    +values will mute/scan, -values will exit\n"
+		"\t    a scan leaves quiet channels after the first look,\n"
+		"\t    busy ones after squelch_delay quiet blocks\n"
 		"\t[-F fir_size (default: off)]\n"
 		"\t    enables low-leakage downsample filter\n"
 		"\t    size can be 0 or 9.  0 has bad roll off\n"
 		"\t[-A std/fast/lut choose atan math (default: std)]\n"
+		"\t[-q queue depth between usb and the callback (default: 0, off)]\n"
+		"\t[-L latency_ms, size the usb transfers to hold at most this (default: off)]\n"
+		"\t[-X stats (default: off)]\n"
+		"\t    tcp:[addr:]port serves counters to prometheus\n"
+		"\t    filename[,seconds] rewrites a file with them, - for stderr\n"
+		"\t[-Y scheduling (default: off)]\n"
+		"\t    stage=[cpu[-cpu]][:fifo_priority],... and lock to mlock\n"
+		"\t    stages: usb, demod, chan, output, controller\n"
 		//"\t[-C clip_path (default: off)\n"
 		//"\t (create time stamped raw clips, requires squelch)\n"
 		//"\t (path must have '\%s' and will expand to date_time_freq)\n"
@@ -227,7 +348,7 @@ void usage(void)
 		"\trtl_fm ... | play -t raw -r 24k -es -b 16 -c 1 -V1 -\n"
 		"\t           | aplay -r 24k -f S16_LE -t raw -c 1\n"
 		"\t  -M wbfm  | play -r 32k ... \n"
-		"\t  -s 22050 | multimon -t raw /dev/stdin\n\n");
+		"\t  -s 22050 | multimon -t raw /dev/stdin\n\n", PRIORITY_MS);
 	exit(1);
 }
 
@@ -257,51 +378,109 @@ static void sighandler(int signum)
 #define safe_cond_signal(n, m) pthread_mutex_lock(m); pthread_cond_signal(n); pthread_mutex_unlock(m)
 #define safe_cond_wait(n, m) pthread_mutex_lock(m); pthread_cond_wait(n, m); pthread_mutex_unlock(m)
 
-/* {length, coef, coef, coef}  and scaled by 2^15
-   for now, only length 9, optimal way to get +85% bandwidth */
-#define CIC_TABLE_MAX 10
-int cic_9_tables[][10] = {
-	{0,},
-	{9, -156,  -97, 2798, -15489, 61019, -15489, 2798,  -97, -156},
-	{9, -128, -568, 5593, -24125, 74126, -24125, 5593, -568, -128},
-	{9, -129, -639, 6187, -26281, 77511, -26281, 6187, -639, -129},
-	{9, -122, -612, 6082, -26353, 77818, -26353, 6082, -612, -122},
-	{9, -120, -602, 6015, -26269, 77757, -26269, 6015, -602, -120},
-	{9, -120, -582, 5951, -26128, 77542, -26128, 5951, -582, -120},
-	{9, -119, -580, 5931, -26094, 77505, -26094, 5931, -580, -119},
-	{9, -119, -578, 5921, -26077, 77484, -26077, 5921, -578, -119},
-	{9, -119, -577, 5917, -26067, 77473, -26067, 5917, -577, -119},
-	{9, -199, -362, 5303, -25505, 77489, -25505, 5303, -362, -199},
-};
+int ring_init(struct block_ring *r, int block_len)
+{
+	r->data = malloc(RING_BLOCKS * block_len * sizeof(int16_t));
+	if (!r->data) {
+		return -1;}
+	r->block_len = block_len;
+	r->head = r->tail = 0;
+	r->overruns = r->high_water = 0;
+	r->depth_stat = r->drop_stat = NULL;
+	pthread_cond_init(&r->ready, NULL);
+	pthread_mutex_init(&r->ready_m, NULL);
+	return 0;
+}
 
-#if defined(_MSC_VER) && (_MSC_VER < 1800)
-double log2(double n)
+void ring_cleanup(struct block_ring *r)
 {
-	return log(n) / log(2.0);
+	free(r->data);
+	r->data = NULL;
+	pthread_cond_destroy(&r->ready);
+	pthread_mutex_destroy(&r->ready_m);
 }
-#endif
 
-void rotate_90(unsigned char *buf, uint32_t len)
-/* 90 rotation is 1+0j, 0+1j, -1+0j, 0-1j
-   or [0, 1, -3, 2, -4, -5, 7, -6] */
+int16_t *ring_write_slot(struct block_ring *r)
+/* producer side, NULL (and an overrun) if the consumer is behind */
 {
-	uint32_t i;
-	unsigned char tmp;
-	for (i=0; i<len; i+=8) {
-		/* uint8_t negation = 255 - x */
-		tmp = 255 - buf[i+3];
-		buf[i+3] = buf[i+2];
-		buf[i+2] = tmp;
+	uint32_t head = r->head;
+	if (head - ring_load(&r->tail) >= RING_BLOCKS) {
+		r->overruns++;
+		if (r->drop_stat) {
+			stats_add(r->drop_stat, 1);}
+		return NULL;
+	}
+	return r->data + (head % RING_BLOCKS) * r->block_len;
+}
 
-		buf[i+4] = 255 - buf[i+4];
-		buf[i+5] = 255 - buf[i+5];
+void ring_commit(struct block_ring *r, int len)
+{
+	uint32_t depth, head = r->head;
+	r->lens[head % RING_BLOCKS] = len;
+	ring_store(&r->head, head + 1);
+	depth = head + 1 - ring_load(&r->tail);
+	if (depth > r->high_water) {
+		r->high_water = depth;}
+	if (r->depth_stat) {
+		stats_set(r->depth_stat, depth);}
+	safe_cond_signal(&r->ready, &r->ready_m);
+}
 
-		tmp = 255 - buf[i+6];
-		buf[i+6] = buf[i+7];
-		buf[i+7] = tmp;
-	}
+int16_t *ring_read_slot(struct block_ring *r, int *len)
+/* consumer side, blocks until there is data or we are exiting */
+{
+	uint32_t tail = r->tail;
+	pthread_mutex_lock(&r->ready_m);
+	while (ring_load(&r->head) == tail && !do_exit) {
+		pthread_cond_wait(&r->ready, &r->ready_m);}
+	pthread_mutex_unlock(&r->ready_m);
+	if (ring_load(&r->head) == tail) {
+		return NULL;}
+	*len = r->lens[tail % RING_BLOCKS];
+	return r->data + (tail % RING_BLOCKS) * r->block_len;
+}
+
+int16_t *ring_peek(struct block_ring *r, int *len)
+/* consumer side, NULL right away if nothing is waiting */
+{
+	uint32_t tail = r->tail;
+	if (ring_load(&r->head) == tail) {
+		return NULL;}
+	*len = r->lens[tail % RING_BLOCKS];
+	return r->data + (tail % RING_BLOCKS) * r->block_len;
+}
+
+void ring_tag(struct block_ring *r, uint32_t tag)
+/* producer side, for the slot ring_write_slot() gave out */
+{
+	r->tags[r->head % RING_BLOCKS] = tag;
+}
+
+uint32_t ring_read_tag(struct block_ring *r)
+/* consumer side, for the slot ring_read_slot() gave out */
+{
+	return r->tags[r->tail % RING_BLOCKS];
+}
+
+void ring_release(struct block_ring *r)
+{
+	ring_store(&r->tail, r->tail + 1);
+	if (r->depth_stat) {
+		stats_set(r->depth_stat, ring_load(&r->head) - r->tail);}
 }
 
+void ring_wake(struct block_ring *r)
+{
+	safe_cond_signal(&r->ready, &r->ready_m);
+}
+
+#if defined(_MSC_VER) && (_MSC_VER < 1800)
+double log2(double n)
+{
+	return log(n) / log(2.0);
+}
+#endif
+
 void low_pass(struct demod_state *d)
 /* simple square window FIR */
 {
@@ -340,209 +519,10 @@ int low_pass_simple(int16_t *signal2, int len, int step)
 	return len / step;
 }
 
-void low_pass_real(struct demod_state *s)
-/* simple square window FIR */
-// add support for upsampling?
-{
-	int i=0, i2=0;
-	int fast = (int)s->rate_out;
-	int slow = s->rate_out2;
-	while (i < s->result_len) {
-		s->now_lpr += s->result[i];
-		i++;
-		s->prev_lpr_index += slow;
-		if (s->prev_lpr_index < fast) {
-			continue;
-		}
-		s->result[i2] = (int16_t)(s->now_lpr / (fast/slow));
-		s->prev_lpr_index -= fast;
-		s->now_lpr = 0;
-		i2 += 1;
-	}
-	s->result_len = i2;
-}
-
-void fifth_order(int16_t *data, int length, int16_t *hist)
-/* for half of interleaved data */
-{
-	int i;
-	int16_t a, b, c, d, e, f;
-	a = hist[1];
-	b = hist[2];
-	c = hist[3];
-	d = hist[4];
-	e = hist[5];
-	f = data[0];
-	/* a downsample should improve resolution, so don't fully shift */
-	data[0] = (a + (b+e)*5 + (c+d)*10 + f) >> 4;
-	for (i=4; i<length; i+=4) {
-		a = c;
-		b = d;
-		c = e;
-		d = f;
-		e = data[i-2];
-		f = data[i];
-		data[i/2] = (a + (b+e)*5 + (c+d)*10 + f) >> 4;
-	}
-	/* archive */
-	hist[0] = a;
-	hist[1] = b;
-	hist[2] = c;
-	hist[3] = d;
-	hist[4] = e;
-	hist[5] = f;
-}
-
-void generic_fir(int16_t *data, int length, int *fir, int16_t *hist)
-/* Okay, not at all generic.  Assumes length 9, fix that eventually. */
-{
-	int d, temp, sum;
-	for (d=0; d<length; d+=2) {
-		temp = data[d];
-		sum = 0;
-		sum += (hist[0] + hist[8]) * fir[1];
-		sum += (hist[1] + hist[7]) * fir[2];
-		sum += (hist[2] + hist[6]) * fir[3];
-		sum += (hist[3] + hist[5]) * fir[4];
-		sum +=            hist[4]  * fir[5];
-		data[d] = sum >> 15 ;
-		hist[0] = hist[1];
-		hist[1] = hist[2];
-		hist[2] = hist[3];
-		hist[3] = hist[4];
-		hist[4] = hist[5];
-		hist[5] = hist[6];
-		hist[6] = hist[7];
-		hist[7] = hist[8];
-		hist[8] = temp;
-	}
-}
-
-/* define our own complex math ops
-   because ARMv5 has no hardware float */
-
-void multiply(int ar, int aj, int br, int bj, int *cr, int *cj)
-{
-	*cr = ar*br - aj*bj;
-	*cj = aj*br + ar*bj;
-}
-
-int polar_discriminant(int ar, int aj, int br, int bj)
-{
-	int cr, cj;
-	double angle;
-	multiply(ar, aj, br, -bj, &cr, &cj);
-	angle = atan2((double)cj, (double)cr);
-	return (int)(angle / 3.14159 * (1<<14));
-}
-
-int fast_atan2(int y, int x)
-/* pre scaled for int16 */
-{
-	int yabs, angle;
-	int pi4=(1<<12), pi34=3*(1<<12);  // note pi = 1<<14
-	if (x==0 && y==0) {
-		return 0;
-	}
-	yabs = y;
-	if (yabs < 0) {
-		yabs = -yabs;
-	}
-	if (x >= 0) {
-		angle = pi4  - pi4 * (x-yabs) / (x+yabs);
-	} else {
-		angle = pi34 - pi4 * (x+yabs) / (yabs-x);
-	}
-	if (y < 0) {
-		return -angle;
-	}
-	return angle;
-}
-
-int polar_disc_fast(int ar, int aj, int br, int bj)
-{
-	int cr, cj;
-	multiply(ar, aj, br, -bj, &cr, &cj);
-	return fast_atan2(cj, cr);
-}
-
-int atan_lut_init(void)
-{
-	int i = 0;
-
-	atan_lut = malloc(atan_lut_size * sizeof(int));
-
-	for (i = 0; i < atan_lut_size; i++) {
-		atan_lut[i] = (int) (atan((double) i / (1<<atan_lut_coef)) / 3.14159 * (1<<14));
-	}
-
-	return 0;
-}
-
-int polar_disc_lut(int ar, int aj, int br, int bj)
-{
-	int cr, cj, x, x_abs;
-
-	multiply(ar, aj, br, -bj, &cr, &cj);
-
-	/* special cases */
-	if (cr == 0 || cj == 0) {
-		if (cr == 0 && cj == 0)
-			{return 0;}
-		if (cr == 0 && cj > 0)
-			{return 1 << 13;}
-		if (cr == 0 && cj < 0)
-			{return -(1 << 13);}
-		if (cj == 0 && cr > 0)
-			{return 0;}
-		if (cj == 0 && cr < 0)
-			{return 1 << 14;}
-	}
-
-	/* real range -32768 - 32768 use 64x range -> absolute maximum: 2097152 */
-	x = (cj << atan_lut_coef) / cr;
-	x_abs = abs(x);
-
-	if (x_abs >= atan_lut_size) {
-		/* we can use linear range, but it is not necessary */
-		return (cj > 0) ? 1<<13 : -(1<<13);
-	}
-
-	if (x > 0) {
-		return (cj > 0) ? atan_lut[x] : atan_lut[x] - (1<<14);
-	} else {
-		return (cj > 0) ? (1<<14) - atan_lut[-x] : -atan_lut[-x];
-	}
-
-	return 0;
-}
-
 void fm_demod(struct demod_state *fm)
 {
-	int i, pcm;
-	int16_t *lp = fm->lowpassed;
-	pcm = polar_discriminant(lp[0], lp[1],
-		fm->pre_r, fm->pre_j);
-	fm->result[0] = (int16_t)pcm;
-	for (i = 2; i < (fm->lp_len-1); i += 2) {
-		switch (fm->custom_atan) {
-		case 0:
-			pcm = polar_discriminant(lp[i], lp[i+1],
-				lp[i-2], lp[i-1]);
-			break;
-		case 1:
-			pcm = polar_disc_fast(lp[i], lp[i+1],
-				lp[i-2], lp[i-1]);
-			break;
-		case 2:
-			pcm = polar_disc_lut(lp[i], lp[i+1],
-				lp[i-2], lp[i-1]);
-			break;
-		}
-		fm->result[i/2] = (int16_t)pcm;
-	}
-	fm->pre_r = lp[fm->lp_len - 2];
-	fm->pre_j = lp[fm->lp_len - 1];
+	rtlsdr_dsp_fm_disc(fm->lowpassed, fm->lp_len, fm->result,
+		fm->pre_iq, fm->custom_atan);
 	fm->result_len = fm->lp_len/2;
 }
 
@@ -598,8 +578,8 @@ void raw_demod(struct demod_state *fm)
 
 void deemph_filter(struct demod_state *fm)
 {
-	static int avg;  // cheating...
 	int i, d;
+	int avg = fm->deemph_avg;
 	// de-emph IIR
 	// avg = avg * (1 - alpha) + sample * alpha;
 	for (i = 0; i < fm->result_len; i++) {
@@ -611,6 +591,7 @@ void deemph_filter(struct demod_state *fm)
 		}
 		fm->result[i] = (int16_t)avg;
 	}
+	fm->deemph_avg = avg;
 }
 
 void dc_block_filter(struct demod_state *fm)
@@ -665,102 +646,45 @@ int rms(int16_t *samples, int len, int step)
 	return (int)sqrt((p-err) / len);
 }
 
-void arbitrary_upsample(int16_t *buf1, int16_t *buf2, int len1, int len2)
-/* linear interpolation, len1 < len2 */
-{
-	int i = 1;
-	int j = 0;
-	int tick = 0;
-	double frac;  // use integers...
-	while (j < len2) {
-		frac = (double)tick / (double)len2;
-		buf2[j] = (int16_t)(buf1[i-1]*(1-frac) + buf1[i]*frac);
-		j++;
-		tick += len1;
-		if (tick > len2) {
-			tick -= len2;
-			i++;
-		}
-		if (i >= len1) {
-			i = len1 - 1;
-			tick = len2;
-		}
-	}
-}
-
-void arbitrary_downsample(int16_t *buf1, int16_t *buf2, int len1, int len2)
-/* fractional boxcar lowpass, len1 > len2 */
-{
-	int i = 1;
-	int j = 0;
-	int tick = 0;
-	double remainder = 0;
-	double frac;  // use integers...
-	buf2[0] = 0;
-	while (j < len2) {
-		frac = 1.0;
-		if ((tick + len2) > len1) {
-			frac = (double)(len1 - tick) / (double)len2;}
-		buf2[j] += (int16_t)((double)buf1[i] * frac + remainder);
-		remainder = (double)buf1[i] * (1.0-frac);
-		tick += len2;
-		i++;
-		if (tick > len1) {
-			j++;
-			buf2[j] = 0;
-			tick -= len1;
-		}
-		if (i >= len1) {
-			i = len1 - 1;
-			tick = len1;
-		}
-	}
-	for (j=0; j<len2; j++) {
-		buf2[j] = buf2[j] * len2 / len1;}
-}
-
-void arbitrary_resample(int16_t *buf1, int16_t *buf2, int len1, int len2)
-/* up to you to calculate lengths and make sure it does not go OOB
- * okay for buffers to overlap, if you are downsampling */
-{
-	if (len1 < len2) {
-		arbitrary_upsample(buf1, buf2, len1, len2);
-	} else {
-		arbitrary_downsample(buf1, buf2, len1, len2);
-	}
-}
-
 void full_demod(struct demod_state *d)
 {
-	int i, ds_p;
+	int i, ds_p, n;
 	int sr = 0;
 	ds_p = d->downsample_passes;
 	if (ds_p) {
 		for (i=0; i < ds_p; i++) {
-			fifth_order(d->lowpassed,   (d->lp_len >> i), d->lp_i_hist[i]);
-			fifth_order(d->lowpassed+1, (d->lp_len >> i) - 1, d->lp_q_hist[i]);
+			rtlsdr_dsp_fifth_order(d->lowpassed, d->lp_len >> i, d->lp_hist[i]);
 		}
 		d->lp_len = d->lp_len >> ds_p;
 		/* droop compensation */
-		if (d->comp_fir_size == 9 && ds_p <= CIC_TABLE_MAX) {
-			generic_fir(d->lowpassed, d->lp_len,
-				cic_9_tables[ds_p], d->droop_i_hist);
-			generic_fir(d->lowpassed+1, d->lp_len-1,
-				cic_9_tables[ds_p], d->droop_q_hist);
+		if (d->comp_fir_size == 9 && ds_p <= RTLSDR_DSP_CIC_MAX) {
+			rtlsdr_dsp_cic_droop(d->lowpassed, d->lp_len, ds_p, d->droop_hist);
 		}
 	} else {
 		low_pass(d);
 	}
 	/* power squelch */
 	if (d->squelch_level) {
-		sr = rms(d->lowpassed, d->lp_len, 1);
+		n = d->lp_len;
+		if (d->squelch_early && n > 2*SQUELCH_EARLY) {
+			n = 2*SQUELCH_EARLY;}
+		sr = rms(d->lowpassed, n, 1);
+		if (sr < d->squelch_level && d->squelch_early) {
+			/* nothing on a fresh channel, don't bother with the rest */
+			d->squelch_early = 0;
+			d->squelch_hits = d->conseq_squelch + 1;
+			d->result_len = 0;
+			return;
+		}
+		d->squelch_early = 0;
 		if (sr < d->squelch_level) {
 			d->squelch_hits++;
 			for (i=0; i<d->lp_len; i++) {
 				d->lowpassed[i] = 0;
 			}
 		} else {
-			d->squelch_hits = 0;}
+			d->squelch_hits = 0;
+			d->squelch_heard = 1;}
 	}
 	d->mode_demod(d);  /* lowpassed -> result */
 	if (d->mode_demod == &raw_demod) {
@@ -775,41 +699,72 @@ void full_demod(struct demod_state *d)
 	if (d->dc_block) {
 		dc_block_filter(d);}
 	if (d->rate_out2 > 0) {
-		low_pass_real(d);
-		//arbitrary_resample(d->result, d->result, d->result_len, d->result_len * d->rate_out2 / d->rate_out);
-	}
+		d->result_len = rtlsdr_dsp_resample(d->resample, d->result, d->result_len,
+			d->result, MAXIMUM_BUF_LENGTH);}
 }
 
-static void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
+static void rtlsdr_callback(unsigned char *buf, uint32_t len,
+			    const rtlsdr_buffer_info_t *info, void *ctx)
 {
-	int i;
+	uint32_t n, epoch;
+	uint64_t index, skip, settle_ns;
+	int16_t *block;
 	struct dongle_state *s = ctx;
-	struct demod_state *d = s->demod_target;
+	struct demod_state *d;
 
 	if (do_exit) {
 		return;}
 	if (!ctx) {
 		return;}
-	if (s->mute) {
-		for (i=0; i<s->mute; i++) {
-			buf[i] = 127;}
-		s->mute = 0;
-	}
-	if (!s->offset_tuning) {
-		rotate_90(buf, len);}
-	for (i=0; i<(int)len; i++) {
-		s->buf16[i] = (int16_t)buf[i] - 127;}
-	pthread_rwlock_wrlock(&d->rw);
-	memcpy(d->lowpassed, s->buf16, 2*len);
-	d->lp_len = len;
-	pthread_rwlock_unlock(&d->rw);
-	safe_cond_signal(&d->ready, &d->ready_m);
+	d = s->demod_target;
+	n = len / 2;
+	index = info->sample_index;
+	stream_clock_update(&s->clock, info, n, s->rate);
+	pthread_mutex_lock(&s->retune_lock);
+	epoch = s->epoch;
+	settle_ns = s->settle_ns;
+	pthread_mutex_unlock(&s->retune_lock);
+	if (epoch != s->seen_epoch) {
+		s->seen_epoch = epoch;
+		s->settled = 0;
+	}
+	if (!s->settled) {
+		/* transfers in flight or queued during the retune carry samples
+		 * of the old frequency and the transient, keep only those
+		 * captured after the tuner settled */
+		if (settle_ns == UINT64_MAX) {
+			return;}
+		s->start_index = stream_clock_index(&s->clock, settle_ns, s->rate);
+		s->settled = 1;
+	}
+	skip = 0;
+	if (s->start_index > index) {
+		skip = s->start_index - index;}
+	if (skip >= n) {
+		return;}
+	buf += skip * 2;
+	len -= (uint32_t)skip * 2;
+	block = ring_write_slot(&d->input);
+	if (!block) {
+		return;}
+	if (len > (uint32_t)d->input.block_len) {
+		len = (uint32_t)d->input.block_len;}
+	rtlsdr_dsp_convert(buf, block, len, !s->offset_tuning);
+	ring_tag(&d->input, epoch);
+	ring_commit(&d->input, (int)len);
 }
 
 static void *dongle_thread_fn(void *arg)
 {
 	struct dongle_state *s = arg;
-	rtlsdr_read_async(s->dev, rtlsdr_callback, s, 0, s->buf_len);
+	int r;
+	verbose_rt_thread("usb", 0);
+	r = rtlsdr_read_async_ex(s->dev, rtlsdr_callback, s, 0, s->buf_len);
+	/* the dongle went away, or a replayed capture ended */
+	if (!do_exit) {
+		fprintf(stderr, "\nLibrary error %d, exiting...\n", r);
+		do_exit = 1;
+	}
 	return 0;
 }
 
@@ -817,24 +772,49 @@ static void *demod_thread_fn(void *arg)
 {
 	struct demod_state *d = arg;
 	struct output_state *o = d->output_target;
+	struct controller_state *c = &controller;
+	uint64_t t;
+	uint32_t epoch;
+	verbose_rt_thread("demod", 0);
 	while (!do_exit) {
-		safe_cond_wait(&d->ready, &d->ready_m);
-		pthread_rwlock_wrlock(&d->rw);
+		d->lowpassed = ring_read_slot(&d->input, &d->lp_len);
+		if (!d->lowpassed) {
+			continue;}
+		epoch = ring_read_tag(&d->input);
+		if (epoch != ring_load(&dongle.epoch)) {
+			/* queued up before the last retune, another channel's */
+			ring_release(&d->input);
+			stats_add(&stat_stale, 1);
+			continue;
+		}
+		if (epoch != d->epoch) {
+			d->epoch = epoch;
+			d->squelch_early = 1;
+			d->squelch_heard = 0;
+		}
+		/* demod straight into the next output block */
+		d->result = ring_write_slot(&o->results);
+		if (!d->result) {
+			d->result = d->result_spare;}
+		t = stats_now_us();
 		full_demod(d);
-		pthread_rwlock_unlock(&d->rw);
+		stats_time(&stat_dsp, stats_now_us() - t);
+		ring_release(&d->input);
 		if (d->exit_flag) {
 			do_exit = 1;
 		}
 		if (d->squelch_level && d->squelch_hits > d->conseq_squelch) {
 			d->squelch_hits = d->conseq_squelch + 1;  /* hair trigger */
-			safe_cond_signal(&controller.hop, &controller.hop_m);
+			pthread_mutex_lock(&c->hop_m);
+			c->hop_asked = 1;
+			c->hop_heard = d->squelch_heard;
+			c->hop_from = epoch;
+			pthread_cond_signal(&c->hop);
+			pthread_mutex_unlock(&c->hop_m);
 			continue;
 		}
-		pthread_rwlock_wrlock(&o->rw);
-		memcpy(o->result, d->result, 2*d->result_len);
-		o->result_len = d->result_len;
-		pthread_rwlock_unlock(&o->rw);
-		safe_cond_signal(&o->ready, &o->ready_m);
+		if (d->result != d->result_spare) {
+			ring_commit(&o->results, d->result_len);}
 	}
 	return 0;
 }
@@ -842,12 +822,181 @@ static void *demod_thread_fn(void *arg)
 static void *output_thread_fn(void *arg)
 {
 	struct output_state *s = arg;
+	int16_t *result;
+	int result_len;
+	verbose_rt_thread("output", 0);
 	while (!do_exit) {
 		// use timedwait and pad out under runs
-		safe_cond_wait(&s->ready, &s->ready_m);
-		pthread_rwlock_rdlock(&s->rw);
-		fwrite(s->result, 2, s->result_len, s->file);
-		pthread_rwlock_unlock(&s->rw);
+		result = ring_read_slot(&s->results, &result_len);
+		if (!result) {
+			continue;}
+		fwrite(result, 2, result_len, s->file);
+		ring_release(&s->results);
+	}
+	return 0;
+}
+
+static void chan_fft(struct channelizer_state *c, float *x)
+/* in place radix 2, forward, interleaved I/Q */
+{
+	int i, j, k, a, b, len, half, step, m = c->fft_size;
+	float tr, ti, wr, wi;
+	for (i=0; i<m; i++) {
+		j = c->bitrev[i];
+		if (j <= i) {
+			continue;}
+		tr = x[2*i];   x[2*i]   = x[2*j];   x[2*j]   = tr;
+		ti = x[2*i+1]; x[2*i+1] = x[2*j+1]; x[2*j+1] = ti;
+	}
+	for (len=2; len<=m; len<<=1) {
+		half = len >> 1;
+		step = m / len;
+		for (i=0; i<m; i+=len) {
+			for (k=0; k<half; k++) {
+				a = i + k;
+				b = a + half;
+				wr = c->twiddle[2*k*step];
+				wi = c->twiddle[2*k*step+1];
+				tr = x[2*b]*wr - x[2*b+1]*wi;
+				ti = x[2*b]*wi + x[2*b+1]*wr;
+				x[2*b]   = x[2*a]   - tr;
+				x[2*b+1] = x[2*a+1] - ti;
+				x[2*a]   += tr;
+				x[2*a+1] += ti;
+			}
+		}
+	}
+}
+
+static int16_t chan_clip(float x)
+{
+	if (x > 32767.0f) {
+		return 32767;}
+	if (x < -32768.0f) {
+		return -32768;}
+	return (int16_t)floorf(x + 0.5f);
+}
+
+static void channelize(struct channelizer_state *c, int16_t *block, int len)
+/* block -> every channel's input ring, frames come in fours so the
+ * fifth order passes always see whole groups */
+{
+	int i, f, k, l, frames, m2 = 2 * c->fft_size;
+	float ar, ai, yr, yi, mag;
+	float *w, *p;
+	struct channel_state *ch;
+	int16_t *slot[CHANNELS_LIMIT];
+	for (i=0; i<len; i++) {
+		c->window[c->fill + i] = (float)block[i];}
+	c->fill += len;
+	frames = 0;
+	if (c->fill >= 2 * c->taps) {
+		frames = (c->fill/2 - c->taps) / c->hop + 1;}
+	frames &= ~3;
+	if (!frames) {
+		return;}
+	for (i=0; i<c->count; i++) {
+		slot[i] = ring_write_slot(&c->chans[i].demod->input);}
+	for (f=0; f<frames; f++) {
+		/* polyphase sum, the prototype is symmetric so no reversal */
+		w = c->window + 2 * f * c->hop;
+		for (k=0; k<m2; k++) {
+			c->acc[k] = 0.0f;}
+		for (l=0; l<c->taps*2; l+=m2) {
+			p = c->proto + l;
+			for (k=0; k<m2; k++) {
+				c->acc[k] += p[k] * w[l+k];}
+		}
+		chan_fft(c, c->acc);
+		for (i=0; i<c->count; i++) {
+			ch = &c->chans[i];
+			ar = c->acc[2*ch->bin];
+			ai = c->acc[2*ch->bin+1];
+			yr = ar*ch->rot_r - ai*ch->rot_j;
+			yi = ar*ch->rot_j + ai*ch->rot_r;
+			ar = ch->rot_r*ch->step_r - ch->rot_j*ch->step_j;
+			ch->rot_j = ch->rot_r*ch->step_j + ch->rot_j*ch->step_r;
+			ch->rot_r = ar;
+			if (!slot[i]) {
+				continue;}
+			slot[i][2*f]   = chan_clip(yr);
+			slot[i][2*f+1] = chan_clip(yi);
+		}
+	}
+	for (i=0; i<c->count; i++) {
+		ch = &c->chans[i];
+		mag = sqrtf(ch->rot_r*ch->rot_r + ch->rot_j*ch->rot_j);
+		ch->rot_r /= mag;
+		ch->rot_j /= mag;
+		if (slot[i]) {
+			ring_commit(&ch->demod->input, 2 * frames);}
+	}
+	i = 2 * frames * c->hop;
+	memmove(c->window, c->window + i, (c->fill - i) * sizeof(float));
+	c->fill -= i;
+}
+
+static int channel_demod(struct channel_state *ch)
+/* one block if there is one, 0 when idle */
+{
+	struct demod_state *d = ch->demod;
+	uint64_t t;
+	d->lowpassed = ring_peek(&d->input, &d->lp_len);
+	if (!d->lowpassed) {
+		return 0;}
+	d->result = d->result_spare;
+	t = stats_now_us();
+	full_demod(d);
+	stats_time(&stat_dsp, stats_now_us() - t);
+	ring_release(&d->input);
+	if (d->squelch_level && d->squelch_hits > d->conseq_squelch) {
+		d->squelch_hits = d->conseq_squelch + 1;
+		return 1;
+	}
+	fwrite(d->result, 2, d->result_len, ch->file);
+	return 1;
+}
+
+static void *chan_worker_fn(void *arg)
+{
+	struct chan_worker *w = arg;
+	struct channelizer_state *c = &channelizer;
+	uint32_t seen;
+	int i, busy;
+	verbose_rt_thread("chan", w->index);
+	while (!do_exit) {
+		pthread_mutex_lock(&c->batch_m);
+		seen = c->batch;
+		pthread_mutex_unlock(&c->batch_m);
+		busy = 0;
+		for (i=w->index; i<c->count; i+=c->workers) {
+			busy += channel_demod(&c->chans[i]);}
+		if (busy) {
+			continue;}
+		pthread_mutex_lock(&c->batch_m);
+		while (c->batch == seen && !do_exit) {
+			pthread_cond_wait(&c->batch_ready, &c->batch_m);}
+		pthread_mutex_unlock(&c->batch_m);
+	}
+	return 0;
+}
+
+static void *channelizer_thread_fn(void *arg)
+{
+	struct channelizer_state *c = arg;
+	int16_t *block;
+	int len;
+	verbose_rt_thread("demod", 0);
+	while (!do_exit) {
+		block = ring_read_slot(&demod.input, &len);
+		if (!block) {
+			continue;}
+		channelize(c, block, len);
+		ring_release(&demod.input);
+		pthread_mutex_lock(&c->batch_m);
+		c->batch++;
+		pthread_cond_broadcast(&c->batch_ready);
+		pthread_mutex_unlock(&c->batch_m);
 	}
 	return 0;
 }
@@ -879,20 +1028,137 @@ static void optimal_settings(int freq, int rate)
 	d->rate = (uint32_t)capture_rate;
 }
 
+static void channel_settings(void)
+/* one fixed tuning that covers every channel */
+{
+	struct channelizer_state *c = &channelizer;
+	dongle.freq = c->center;
+	if (!dongle.offset_tuning) {
+		dongle.freq = c->center + c->rate/4;}
+	dongle.rate = c->rate;
+}
+
+#ifdef _WIN32
+static int gettimeofday(struct timeval *tv, void* ignored)
+{
+	FILETIME ft;
+	unsigned __int64 tmp = 0;
+	if (NULL != tv) {
+		GetSystemTimeAsFileTime(&ft);
+		tmp |= ft.dwHighDateTime;
+		tmp <<= 32;
+		tmp |= ft.dwLowDateTime;
+		tmp /= 10;
+#ifdef _MSC_VER
+		tmp -= 11644473600000000Ui64;
+#else
+		tmp -= 11644473600000000ULL;
+#endif
+		tv->tv_sec = (long)(tmp / 1000000UL);
+		tv->tv_usec = (long)(tmp % 1000000UL);
+	}
+	return 0;
+}
+#endif
+
+static int scan_next(struct controller_state *s, uint64_t now)
+/* any overdue priority channel first, then whichever has waited longest
+ * with busy channels counting their wait ACTIVE_WEIGHT times.  ties go
+ * in -f order, so a quiet band is swept just like round robin */
+{
+	int i, k, best = -1;
+	uint64_t score, best_score = 0, wait;
+	struct scan_channel *ch;
+	for (k=1; k < s->freq_len; k++) {
+		i = (s->freq_now + k) % s->freq_len;
+		ch = &s->chans[i];
+		wait = now - ch->visited_us;
+		if (ch->priority && wait >= (uint64_t)ch->priority * 1000) {
+			score = UINT64_MAX / 2 + wait;
+		} else if (ch->active_us && now - ch->active_us < ACTIVE_HOLD_US) {
+			score = wait * ACTIVE_WEIGHT;
+		} else {
+			score = wait;}
+		if (best < 0 || score > best_score) {
+			best = i;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
+static uint64_t scan_deadline(struct controller_state *s)
+/* when the next priority channel falls due, 0 for never */
+{
+	int i;
+	uint64_t due, first = 0;
+	for (i=0; i < s->freq_len; i++) {
+		if (!s->chans[i].priority || i == s->freq_now) {
+			continue;}
+		due = s->chans[i].visited_us + (uint64_t)s->chans[i].priority * 1000;
+		if (!first || due < first) {
+			first = due;}
+	}
+	return first;
+}
+
+static int hop_wait(struct controller_state *s, int *heard)
+/* 1 when the demodulator asked to leave the channel, 0 when a priority
+ * channel is due first */
+{
+	uint64_t due, now;
+	struct timespec ts;
+	struct timeval tp;
+	int r = 0, asked;
+	/* the channelizer never leaves its center, nothing falls due */
+	due = 0;
+	if (!channelizer.enabled && s->freq_len > 1) {
+		due = scan_deadline(s);}
+	pthread_mutex_lock(&s->hop_m);
+	if (due) {
+		now = stats_now_us();
+		due = due > now ? due - now : 0;
+		gettimeofday(&tp, NULL);
+		due += (uint64_t)tp.tv_usec;
+		ts.tv_sec = tp.tv_sec + (time_t)(due / 1000000);
+		ts.tv_nsec = (long)(due % 1000000) * 1000;
+	}
+	while (!do_exit && r != ETIMEDOUT) {
+		if (s->hop_asked && s->hop_from == ring_load(&dongle.epoch)) {
+			break;}
+		s->hop_asked = 0;
+		if (due) {
+			r = pthread_cond_timedwait(&s->hop, &s->hop_m, &ts);
+		} else {
+			pthread_cond_wait(&s->hop, &s->hop_m);}
+	}
+	asked = s->hop_asked && s->hop_from == ring_load(&dongle.epoch);
+	*heard = s->hop_heard;
+	s->hop_asked = 0;
+	pthread_mutex_unlock(&s->hop_m);
+	return asked;
+}
+
 static void *controller_thread_fn(void *arg)
 {
 	// thoughts for multiple dongles
 	// might be no good using a controller thread if retune/rate blocks
-	int i;
+	int i, heard;
+	uint32_t hops[FREQUENCIES_LIMIT];
+	uint64_t now;
 	struct controller_state *s = arg;
 
+	verbose_rt_thread("controller", 0);
 	if (s->wb_mode) {
 		for (i=0; i < s->freq_len; i++) {
 			s->freqs[i] += 16000;}
 	}
 
 	/* set up primary channel */
-	optimal_settings(s->freqs[0], demod.rate_in);
+	if (channelizer.enabled) {
+		channel_settings();
+	} else {
+		optimal_settings(s->freqs[0], demod.rate_in);}
 	if (dongle.direct_sampling) {
 		verbose_direct_sampling(dongle.dev, dongle.direct_sampling);}
 	if (dongle.offset_tuning) {
@@ -900,7 +1166,11 @@ static void *controller_thread_fn(void *arg)
 
 	/* Set the frequency */
 	verbose_set_frequency(dongle.dev, dongle.freq);
-	fprintf(stderr, "Oversampling input by: %ix.\n", demod.downsample);
+	if (channelizer.enabled) {
+		fprintf(stderr, "Channelizer: %i channels, %i bins of %u Hz.\n",
+			channelizer.count, channelizer.fft_size, channelizer.spacing);
+	} else {
+		fprintf(stderr, "Oversampling input by: %ix.\n", demod.downsample);}
 	fprintf(stderr, "Oversampling output by: %ix.\n", demod.post_downsample);
 	fprintf(stderr, "Buffer size: %0.2fms\n",
 		1000 * 0.5 * (float)ACTUAL_BUF_LENGTH / (float)dongle.rate);
@@ -909,15 +1179,38 @@ static void *controller_thread_fn(void *arg)
 	verbose_set_sample_rate(dongle.dev, dongle.rate);
 	fprintf(stderr, "Output at %u Hz.\n", demod.rate_in/demod.post_downsample);
 
+	if (!channelizer.enabled && s->freq_len > 1) {
+		for (i=0; i < s->freq_len; i++) {
+			optimal_settings(s->freqs[i], demod.rate_in);
+			hops[i] = dongle.freq;
+		}
+		optimal_settings(s->freqs[s->freq_now], demod.rate_in);
+		verbose_fast_hop(dongle.dev, hops, s->freq_len);
+	}
+
 	while (!do_exit) {
-		safe_cond_wait(&s->hop, &s->hop_m);
-		if (s->freq_len <= 1) {
+		if (!hop_wait(s, &heard)) {
+			/* a priority channel is due, busy if it got a look */
+			heard = ring_load(&demod.epoch) == dongle.epoch &&
+				ring_load(&demod.squelch_heard);}
+		if (do_exit || channelizer.enabled || s->freq_len <= 1) {
 			continue;}
-		/* hacky hopping */
-		s->freq_now = (s->freq_now + 1) % s->freq_len;
+		now = stats_now_us();
+		if (heard) {
+			s->chans[s->freq_now].active_us = now;}
+		s->chans[s->freq_now].visited_us = now;
+		s->freq_now = scan_next(s, now);
 		optimal_settings(s->freqs[s->freq_now], demod.rate_in);
+		/* whatever is read from here on is stale until it settles */
+		pthread_mutex_lock(&dongle.retune_lock);
+		ring_store(&dongle.epoch, dongle.epoch + 1);
+		dongle.settle_ns = UINT64_MAX;
+		pthread_mutex_unlock(&dongle.retune_lock);
 		rtlsdr_set_center_freq(dongle.dev, dongle.freq);
-		dongle.mute = BUFFER_DUMP;
+		pthread_mutex_lock(&dongle.retune_lock);
+		dongle.settle_ns = stats_now_us() * 1000ULL + SETTLE_GUARD_NS;
+		pthread_mutex_unlock(&dongle.retune_lock);
+		stats_add(&stat_hops, 1);
 	}
 	return 0;
 }
@@ -959,7 +1252,12 @@ void dongle_init(struct dongle_state *s)
 {
 	s->rate = DEFAULT_SAMPLE_RATE;
 	s->gain = AUTO_GAIN; // tenths of a dB
-	s->mute = 0;
+	pthread_mutex_init(&s->retune_lock, NULL);
+	s->epoch = 0;
+	s->settle_ns = 0;
+	stream_clock_init(&s->clock);
+	s->seen_epoch = 0;
+	s->settled = 0;
 	s->direct_sampling = 0;
 	s->offset_tuning = 0;
 	s->demod_target = &demod;
@@ -973,46 +1271,61 @@ void demod_init(struct demod_state *s)
 	s->conseq_squelch = 10;
 	s->terminate_on_squelch = 0;
 	s->squelch_hits = 11;
+	s->squelch_early = 0;
+	s->squelch_heard = 0;
+	s->epoch = 0;
 	s->downsample_passes = 0;
 	s->comp_fir_size = 0;
 	s->prev_index = 0;
 	s->post_downsample = 1;  // once this works, default = 4
-	s->custom_atan = 0;
+	s->custom_atan = RTLSDR_DSP_DISC_STD;
 	s->deemph = 0;
 	s->rate_out2 = -1;  // flag for disabled
 	s->mode_demod = &fm_demod;
-	s->pre_j = s->pre_r = s->now_r = s->now_j = 0;
-	s->prev_lpr_index = 0;
+	s->pre_iq[0] = s->pre_iq[1] = 0;
+	s->now_r = s->now_j = 0;
 	s->deemph_a = 0;
-	s->now_lpr = 0;
+	s->deemph_avg = 0;
+	s->resample = NULL;
 	s->dc_block = 0;
 	s->dc_avg = 0;
-	pthread_rwlock_init(&s->rw, NULL);
-	pthread_cond_init(&s->ready, NULL);
-	pthread_mutex_init(&s->ready_m, NULL);
+	if (ring_init(&s->input, MAXIMUM_BUF_LENGTH) < 0) {
+		fprintf(stderr, "Failed to allocate demod ring.\n");
+		exit(1);
+	}
+	s->lowpassed = NULL;
+	s->result = s->result_spare;
 	s->output_target = &output;
 }
 
 void demod_cleanup(struct demod_state *s)
 {
-	pthread_rwlock_destroy(&s->rw);
-	pthread_cond_destroy(&s->ready);
-	pthread_mutex_destroy(&s->ready_m);
+	ring_cleanup(&s->input);
+	rtlsdr_dsp_resampler_destroy(s->resample);
 }
 
 void output_init(struct output_state *s)
 {
 	s->rate = DEFAULT_SAMPLE_RATE;
-	pthread_rwlock_init(&s->rw, NULL);
-	pthread_cond_init(&s->ready, NULL);
-	pthread_mutex_init(&s->ready_m, NULL);
+	if (ring_init(&s->results, MAXIMUM_BUF_LENGTH) < 0) {
+		fprintf(stderr, "Failed to allocate output ring.\n");
+		exit(1);
+	}
 }
 
 void output_cleanup(struct output_state *s)
 {
-	pthread_rwlock_destroy(&s->rw);
-	pthread_cond_destroy(&s->ready);
-	pthread_mutex_destroy(&s->ready_m);
+	ring_cleanup(&s->results);
+}
+
+void ring_report(char *name, struct block_ring *r, int rate)
+{
+	fprintf(stderr, "%s: %u blocks dropped, %u/%i blocks deep at most",
+		name, r->overruns, r->high_water, RING_BLOCKS);
+	if (rate > 0) {
+		fprintf(stderr, " (%0.1fms)", 1000.0 * (double)r->high_water
+			* (double)r->block_len / (double)rate);}
+	fprintf(stderr, "\n");
 }
 
 void controller_init(struct controller_state *s)
@@ -1021,6 +1334,8 @@ void controller_init(struct controller_state *s)
 	s->freq_len = 0;
 	s->edge = 0;
 	s->wb_mode = 0;
+	s->hop_asked = 0;
+	memset(s->chans, 0, sizeof(s->chans));
 	pthread_cond_init(&s->hop, NULL);
 	pthread_mutex_init(&s->hop_m, NULL);
 }
@@ -1031,6 +1346,164 @@ void controller_cleanup(struct controller_state *s)
 	pthread_mutex_destroy(&s->hop_m);
 }
 
+int channelizer_init(struct channelizer_state *c)
+/* after the demod template is final, one demod_state per -f */
+{
+	int i, m, b;
+	uint32_t fmin, fmax, span;
+	double x, h, sum, delta, theta;
+	struct channel_state *ch;
+	struct demod_state *d;
+	if (controller.freq_len > CHANNELS_LIMIT) {
+		fprintf(stderr, "Too many channels, maximum %i.\n", CHANNELS_LIMIT);
+		return -1;
+	}
+	if (strcmp(output.filename, "-") == 0) {
+		fprintf(stderr, "Channel mode needs a filename.\n");
+		return -1;
+	}
+	fmin = fmax = controller.freqs[0];
+	for (i=1; i<controller.freq_len; i++) {
+		if (controller.freqs[i] < fmin) {
+			fmin = controller.freqs[i];}
+		if (controller.freqs[i] > fmax) {
+			fmax = controller.freqs[i];}
+	}
+	span = fmax - fmin;
+	/* bins pass +-0.75 of their spacing, so a channel can sit
+	 * anywhere between two bins and keep its full -s width */
+	c->spacing = 2 * (uint32_t)demod.rate_in;
+	c->center = fmin + span/2;
+	/* stay clear of the rolloff at the band edges */
+	for (m=8; (double)m*c->spacing*0.75 < (double)span + 2.0*c->spacing
+		|| m*c->spacing < 900001; m*=2) {}
+	if ((double)m * c->spacing > 3200000.0) {
+		fprintf(stderr, "Channels span %u Hz, too wide for -s %i.\n",
+			span, demod.rate_in / demod.post_downsample);
+		return -1;
+	}
+	c->fft_size = m;
+	c->hop = m / 2;
+	c->taps = m * CHANNEL_TAPS;
+	c->rate = (uint32_t)m * c->spacing;
+	c->count = controller.freq_len;
+	c->proto = malloc(2 * c->taps * sizeof(float));
+	c->window = calloc(2 * (c->taps + 4*c->hop + MAXIMUM_BUF_LENGTH/2), sizeof(float));
+	c->acc = malloc(2 * m * sizeof(float));
+	c->twiddle = malloc(m * sizeof(float));
+	c->bitrev = malloc(m * sizeof(int));
+	if (!c->proto || !c->window || !c->acc || !c->twiddle || !c->bitrev) {
+		fprintf(stderr, "Failed to allocate channelizer.\n");
+		return -1;
+	}
+	/* blackman windowed sinc, cutoff at one bin spacing */
+	sum = 0.0;
+	for (i=0; i<c->taps; i++) {
+		x = (double)i - (double)(c->taps - 1) / 2.0;
+		h = 2.0 / m;
+		if (x != 0.0) {
+			h = sin(2.0 * M_PI * x / m) / (M_PI * x);}
+		h *= 0.42 - 0.5 * cos(2.0 * M_PI * i / (c->taps - 1))
+			+ 0.08 * cos(4.0 * M_PI * i / (c->taps - 1));
+		c->proto[2*i] = (float)h;
+		sum += h;
+	}
+	for (i=0; i<c->taps; i++) {
+		c->proto[2*i] = (float)(c->proto[2*i] * CHANNEL_GAIN / sum);
+		c->proto[2*i+1] = c->proto[2*i];
+	}
+	for (i=0; i<m/2; i++) {
+		c->twiddle[2*i]   = (float)cos(2.0 * M_PI * i / m);
+		c->twiddle[2*i+1] = (float)-sin(2.0 * M_PI * i / m);
+	}
+	for (i=0; i<m; i++) {
+		c->bitrev[i] = 0;
+		for (b=1; b<m; b<<=1) {
+			c->bitrev[i] = (c->bitrev[i] << 1) | ((i & b) ? 1 : 0);}
+	}
+	/* history starts zeroed, the first frame lands after one hop */
+	c->fill = 2 * (c->taps - c->hop);
+	/* each channel runs the normal chain at 4x its output rate */
+	demod.downsample = 4;
+	if (demod.downsample_passes) {
+		demod.downsample_passes = 2;}
+	demod.output_scale = (int)((1<<15) / (128 * CHANNEL_GAIN * demod.downsample));
+	if (demod.output_scale < 1 || demod.mode_demod == &fm_demod) {
+		demod.output_scale = 1;}
+	demod.terminate_on_squelch = 0;
+	for (i=0; i<c->count; i++) {
+		ch = &c->chans[i];
+		ch->freq = controller.freqs[i];
+		delta = ((double)ch->freq - (double)c->center) / c->spacing;
+		b = (int)floor(delta + 0.5);
+		delta -= b;  /* in bins, the output rate is two bins */
+		ch->bin = ((b % m) + m) % m;
+		theta = -2.0 * M_PI * b / m;
+		ch->rot_r = (float)cos(theta);
+		ch->rot_j = (float)sin(theta);
+		theta = -M_PI * b - M_PI * delta;
+		ch->step_r = (float)cos(theta);
+		ch->step_j = (float)sin(theta);
+		d = malloc(sizeof(struct demod_state));
+		if (!d) {
+			fprintf(stderr, "Failed to allocate channel %u.\n", ch->freq);
+			return -1;
+		}
+		memcpy(d, &demod, sizeof(struct demod_state));
+		d->resample = NULL;
+		if (d->rate_out2 > 0 &&
+		    !(d->resample = rtlsdr_dsp_resampler_create(d->rate_out, d->rate_out2))) {
+			fprintf(stderr, "Failed to allocate channel %u.\n", ch->freq);
+			return -1;
+		}
+		if (ring_init(&d->input, 2 * (MAXIMUM_BUF_LENGTH/2 / c->hop + 4)) < 0) {
+			fprintf(stderr, "Failed to allocate channel %u.\n", ch->freq);
+			return -1;
+		}
+		ch->demod = d;
+		if (strstr(output.filename, "%u") && strchr(output.filename, '%') == strrchr(output.filename, '%')) {
+			snprintf(ch->filename, sizeof(ch->filename), output.filename, ch->freq);
+		} else {
+			snprintf(ch->filename, sizeof(ch->filename), "%s.%u", output.filename, ch->freq);}
+		ch->file = fopen(ch->filename, "wb");
+		if (!ch->file) {
+			fprintf(stderr, "Failed to open %s\n", ch->filename);
+			return -1;
+		}
+	}
+	if (c->workers > c->count) {
+		c->workers = c->count;}
+	if (c->workers > CHANNEL_WORKERS_LIMIT) {
+		c->workers = CHANNEL_WORKERS_LIMIT;}
+	if (c->workers < 1) {
+		c->workers = 1;}
+	c->batch = 0;
+	pthread_cond_init(&c->batch_ready, NULL);
+	pthread_mutex_init(&c->batch_m, NULL);
+	return 0;
+}
+
+void channelizer_cleanup(struct channelizer_state *c)
+{
+	int i;
+	char name[64];
+	for (i=0; i<c->count; i++) {
+		snprintf(name, sizeof(name), "Channel %u", c->chans[i].freq);
+		ring_report(name, &c->chans[i].demod->input, 0);
+		fclose(c->chans[i].file);
+		ring_cleanup(&c->chans[i].demod->input);
+		rtlsdr_dsp_resampler_destroy(c->chans[i].demod->resample);
+		free(c->chans[i].demod);
+	}
+	free(c->proto);
+	free(c->window);
+	free(c->acc);
+	free(c->twiddle);
+	free(c->bitrev);
+	pthread_cond_destroy(&c->batch_ready);
+	pthread_mutex_destroy(&c->batch_m);
+}
+
 void sanity_checks(void)
 {
 	if (controller.freq_len == 0) {
@@ -1043,7 +1516,7 @@ void sanity_checks(void)
 		exit(1);
 	}
 
-	if (controller.freq_len > 1 && demod.squelch_level == 0) {
+	if (controller.freq_len > 1 && demod.squelch_level == 0 && !channelizer.enabled) {
 		fprintf(stderr, "Please specify a squelch level.  Required for scanning multiple frequencies.\n");
 		exit(1);
 	}
@@ -1055,16 +1528,19 @@ int main(int argc, char **argv)
 #ifndef _WIN32
 	struct sigaction sigact;
 #endif
-	int r, opt;
+	int i, r, opt;
 	int dev_given = 0;
 	int custom_ppm = 0;
     int enable_biastee = 0;
+	int async_queue = 0;
+	double latency_ms = 0;
+	char *stats_spec = NULL;
 	dongle_init(&dongle);
 	demod_init(&demod);
 	output_init(&output);
 	controller_init(&controller);
 
-	while ((opt = getopt(argc, argv, "d:f:g:s:b:l:o:t:r:p:E:F:A:M:hT")) != -1) {
+	while ((opt = getopt(argc, argv, "d:f:P:g:s:b:l:o:t:r:p:E:F:A:M:q:w:L:X:Y:hT")) != -1) {
 		switch (opt) {
 		case 'd':
 			dongle.dev_index = verbose_device_search(optarg);
@@ -1081,6 +1557,18 @@ int main(int argc, char **argv)
 				controller.freq_len++;
 			}
 			break;
+		case 'P':
+			if (controller.freq_len >= FREQUENCIES_LIMIT) {
+				break;}
+			controller.chans[controller.freq_len].priority = PRIORITY_MS;
+			if (strchr(optarg, ',')) {
+				controller.chans[controller.freq_len].priority =
+					atoi(strchr(optarg, ',') + 1);
+				*strchr(optarg, ',') = '\0';
+			}
+			controller.freqs[controller.freq_len] = (uint32_t)atofs(optarg);
+			controller.freq_len++;
+			break;
 		case 'g':
 			dongle.gain = (int)(atof(optarg) * 10);
 			break;
@@ -1125,6 +1613,8 @@ int main(int argc, char **argv)
 				dongle.direct_sampling = 2;}
 			if (strcmp("offset",  optarg) == 0) {
 				dongle.offset_tuning = 1;}
+			if (strcmp("chan",  optarg) == 0) {
+				channelizer.enabled = 1;}
 			break;
 		case 'F':
 			demod.downsample_passes = 1;  /* truthy placeholder */
@@ -1132,12 +1622,11 @@ int main(int argc, char **argv)
 			break;
 		case 'A':
 			if (strcmp("std",  optarg) == 0) {
-				demod.custom_atan = 0;}
+				demod.custom_atan = RTLSDR_DSP_DISC_STD;}
 			if (strcmp("fast", optarg) == 0) {
-				demod.custom_atan = 1;}
+				demod.custom_atan = RTLSDR_DSP_DISC_FAST;}
 			if (strcmp("lut",  optarg) == 0) {
-				atan_lut_init();
-				demod.custom_atan = 2;}
+				demod.custom_atan = RTLSDR_DSP_DISC_LUT;}
 			break;
 		case 'M':
 			if (strcmp("fm",  optarg) == 0) {
@@ -1156,7 +1645,7 @@ int main(int argc, char **argv)
 				demod.rate_in = 170000;
 				demod.rate_out = 170000;
 				demod.rate_out2 = 32000;
-				demod.custom_atan = 1;
+				demod.custom_atan = RTLSDR_DSP_DISC_FAST;
 				//demod.post_downsample = 4;
 				demod.deemph = 1;
 				demod.squelch_level = 0;}
@@ -1164,6 +1653,22 @@ int main(int argc, char **argv)
 		case 'T':
 			enable_biastee = 1;
 			break;
+		case 'q':
+			async_queue = atoi(optarg);
+			break;
+		case 'L':
+			latency_ms = atof(optarg);
+			break;
+		case 'w':
+			channelizer.workers = atoi(optarg);
+			break;
+		case 'X':
+			stats_spec = optarg;
+			break;
+		case 'Y':
+			if (rt_parse(optarg, rt_stages) < 0) {
+				exit(1);}
+			break;
 		case 'h':
 		default:
 			usage();
@@ -1198,6 +1703,7 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	verbose_rt_lock();
 	r = rtlsdr_open(&dongle.dev, (uint32_t)dongle.dev_index);
 	if (r < 0) {
 		fprintf(stderr, "Failed to open rtlsdr device #%d.\n", dongle.dev_index);
@@ -1219,6 +1725,15 @@ int main(int argc, char **argv)
 		demod.deemph_a = (int)round(1.0/((1.0-exp(-1.0/(demod.rate_out * 75e-6)))));
 	}
 
+	if (!channelizer.enabled && demod.rate_out2 > 0 &&
+	    !(demod.resample = rtlsdr_dsp_resampler_create(demod.rate_out, demod.rate_out2))) {
+		fprintf(stderr, "Failed to set up resampling to %i Hz.\n", demod.rate_out2);
+		exit(1);
+	}
+
+	if (channelizer.enabled && channelizer_init(&channelizer) < 0) {
+		exit(1);}
+
 	/* Set the tuner gain */
 	if (dongle.gain == AUTO_GAIN) {
 		verbose_auto_gain(dongle.dev);
@@ -1233,7 +1748,9 @@ int main(int argc, char **argv)
 
 	verbose_ppm_set(dongle.dev, dongle.ppm_error);
 
-	if (strcmp(output.filename, "-") == 0) { /* Write samples to stdout */
+	if (channelizer.enabled) {
+		output.file = NULL;
+	} else if (strcmp(output.filename, "-") == 0) { /* Write samples to stdout */
 		output.file = stdout;
 #ifdef _WIN32
 		_setmode(_fileno(output.file), _O_BINARY);
@@ -1250,11 +1767,39 @@ int main(int argc, char **argv)
 
 	/* Reset endpoint before we start reading from it (mandatory) */
 	verbose_reset_buffer(dongle.dev);
+	verbose_async_queue(dongle.dev, async_queue);
+	verbose_latency_target(dongle.dev, latency_ms);
+
+	if (stats_spec) {
+		demod.input.depth_stat = &stat_in_depth;
+		demod.input.drop_stat = &stat_in_drops;
+		output.results.depth_stat = &stat_out_depth;
+		output.results.drop_stat = &stat_out_drops;
+		stats_register(&stat_in_depth);
+		stats_register(&stat_in_drops);
+		stats_register(&stat_out_depth);
+		stats_register(&stat_out_drops);
+		stats_register(&stat_dsp);
+		stats_register(&stat_hops);
+		stats_register(&stat_stale);
+		stats_device(dongle.dev);
+		if (stats_start(stats_spec) < 0) {
+			fprintf(stderr, "Failed to start the stats, continuing without\n");}
+	}
 
 	pthread_create(&controller.thread, NULL, controller_thread_fn, (void *)(&controller));
 	usleep(100000);
-	pthread_create(&output.thread, NULL, output_thread_fn, (void *)(&output));
-	pthread_create(&demod.thread, NULL, demod_thread_fn, (void *)(&demod));
+	if (channelizer.enabled) {
+		for (i=0; i<channelizer.workers; i++) {
+			channelizer.worker[i].index = i;
+			pthread_create(&channelizer.worker[i].thread, NULL, chan_worker_fn,
+				(void *)(&channelizer.worker[i]));
+		}
+		pthread_create(&demod.thread, NULL, channelizer_thread_fn, (void *)(&channelizer));
+	} else {
+		pthread_create(&output.thread, NULL, output_thread_fn, (void *)(&output));
+		pthread_create(&demod.thread, NULL, demod_thread_fn, (void *)(&demod));
+	}
 	pthread_create(&dongle.thread, NULL, dongle_thread_fn, (void *)(&dongle));
 
 	while (!do_exit) {
@@ -1268,21 +1813,37 @@ int main(int argc, char **argv)
 
 	rtlsdr_cancel_async(dongle.dev);
 	pthread_join(dongle.thread, NULL);
-	safe_cond_signal(&demod.ready, &demod.ready_m);
+	ring_wake(&demod.input);
 	pthread_join(demod.thread, NULL);
-	safe_cond_signal(&output.ready, &output.ready_m);
-	pthread_join(output.thread, NULL);
+	if (channelizer.enabled) {
+		pthread_mutex_lock(&channelizer.batch_m);
+		pthread_cond_broadcast(&channelizer.batch_ready);
+		pthread_mutex_unlock(&channelizer.batch_m);
+		for (i=0; i<channelizer.workers; i++) {
+			pthread_join(channelizer.worker[i].thread, NULL);}
+	} else {
+		ring_wake(&output.results);
+		pthread_join(output.thread, NULL);
+	}
 	safe_cond_signal(&controller.hop, &controller.hop_m);
 	pthread_join(controller.thread, NULL);
 
+	/* worst case latency is the deepest block either ring held */
+	ring_report("Dongle to demod", &demod.input, 2 * (int)dongle.rate);
+	if (channelizer.enabled) {
+		channelizer_cleanup(&channelizer);
+	} else {
+		ring_report("Demod to output", &output.results, 0);}
+
 	//dongle_cleanup(&dongle);
 	demod_cleanup(&demod);
 	output_cleanup(&output);
 	controller_cleanup(&controller);
 
-	if (output.file != stdout) {
+	if (output.file && output.file != stdout) {
 		fclose(output.file);}
 
+	stats_stop();
 	rtlsdr_close(dongle.dev);
 	return r >= 0 ? r : -r;
 }
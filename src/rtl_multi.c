@@ -0,0 +1,684 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ * Copyright (C) 2012 by Steve Markgraf <steve@steve-m.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* records several dongles at once, each one streams from its own
+ * thread (optionally pinned) and every output sample n is the same
+ * moment on the host clock for all of them.  the dongles still run
+ * off their own crystals, so they drift apart by their ppm difference
+ * unless they share a clock. */
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#else
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include "getopt/getopt.h"
+#define STDOUT_FILENO 1
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#include "rtl-sdr.h"
+#include "convenience/convenience.h"
+
+#define DEFAULT_SAMPLE_RATE		2048000
+#define DEFAULT_BUF_LENGTH		(16 * 16384)
+#define MINIMAL_BUF_LENGTH		512
+#define MAXIMAL_BUF_LENGTH		(256 * 16384)
+#define DEFAULT_RING_BUFFERS		32
+#define MAX_DEVICES			16
+#define INTERLEAVE_CHUNK		16384
+/* transfers per device to settle the time of its sample 0 */
+#define ALIGN_BUFFERS			16
+/* what a sample nobody received reads as */
+#define GAP_FILL			127
+
+struct stream {
+	rtlsdr_dev_t *dev;
+	int index;
+	int gain;                /* tenths of a dB, 0 for auto */
+	int ppm;
+	pthread_t thread;
+	unsigned char *ring;
+	uint64_t ring_len;       /* bytes */
+	uint64_t head;           /* bytes in, under multi.lock */
+	uint64_t tail;           /* bytes out, under multi.lock */
+	/* only touched from the stream's own callback */
+	int started;             /* transfers seen while aligning */
+	uint64_t zero_ns;        /* host time of stream sample 0 */
+	uint64_t first_ns;       /* host time of the first transfer */
+	uint64_t first_index;
+	uint64_t last_ns;
+	uint64_t last_index;
+	uint64_t offset;         /* stream sample index of output sample 0 */
+	uint64_t next;           /* output sample the ring head stands for */
+	uint64_t filled;         /* samples written as GAP_FILL */
+	uint64_t dropped;        /* samples that found the ring full */
+	uint32_t xfer_errors;    /* failed transfers, filled like any other gap */
+	/* writer side */
+	uint64_t written;        /* samples */
+	int fd;
+	char filename[1024];
+};
+
+struct multi {
+	struct stream streams[MAX_DEVICES];
+	int count;
+	uint32_t rate;
+	uint32_t buf_len;
+	int interleave;
+	uint64_t samples;        /* per device, 0 for no limit */
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	int started;             /* streams done with ALIGN_BUFFERS */
+	int aligned;
+	uint64_t start_ns;       /* host time of output sample 0 */
+	pthread_t writer;
+	int done;
+	int fd;                  /* interleaved output */
+	unsigned char *scratch;
+};
+
+static volatile int do_exit = 0;
+static struct multi multi;
+
+/* the threads -Y can place */
+static const char *rt_stages[] = {"usb", "writer", NULL};
+
+void usage(void)
+{
+	fprintf(stderr,
+		"rtl_multi, a synchronized I/Q recorder for several RTL2832 receivers\n\n"
+		"Usage:\t -f frequency_to_tune_to [Hz]\n"
+		"\t[-d device indexes or serials, comma separated (default: all)]\n"
+		"\t[-s samplerate (default: 2048000 Hz)]\n"
+		"\t[-g gain, one for all or one per device (default: 0 for auto)]\n"
+		"\t[-p ppm_error, one for all or one per device (default: 0)]\n"
+		"\t[-b output_block_size (default: 16 * 16384)]\n"
+		"\t[-B transfers buffered per device (default: 32)]\n"
+		"\t[-n number of samples to read per device (default: 0, infinite)]\n"
+		"\t[-I interleave the devices sample by sample into one file]\n"
+		"\t[-Y scheduling (default: off)]\n"
+		"\t    stage=[cpu[-cpu]][:fifo_priority],... and lock to mlock\n"
+		"\t    stages: usb (one thread per device, a cpu range spreads\n"
+		"\t    them one cpu each), writer\n"
+		"\tfilename (writes filename.index, or expands a %%u in filename,\n"
+		"\t          -I takes a single file and a '-' dumps to stdout)\n\n"
+		"Output sample n of every device was taken at the same host time,\n"
+		"to within the usb timing jitter.  Lost samples read as 127.\n\n");
+	exit(1);
+}
+
+static void multi_cancel(void)
+{
+	int i;
+	do_exit = 1;
+	for (i = 0; i < multi.count; i++)
+		if (multi.streams[i].dev)
+			rtlsdr_cancel_async(multi.streams[i].dev);
+}
+
+#ifdef _WIN32
+BOOL WINAPI
+sighandler(int signum)
+{
+	if (CTRL_C_EVENT == signum) {
+		fprintf(stderr, "Signal caught, exiting!\n");
+		multi_cancel();
+		return TRUE;
+	}
+	return FALSE;
+}
+#else
+static void sighandler(int signum)
+{
+	signal(SIGPIPE, SIG_IGN);
+	fprintf(stderr, "Signal caught, exiting!\n");
+	multi_cancel();
+}
+#endif
+
+static int parse_list(char *s, int *out, int max, double scale)
+/* comma separated numbers, returns how many */
+{
+	int n = 0;
+	char *tok;
+	for (tok = strtok(s, ","); tok && n < max; tok = strtok(NULL, ","))
+		out[n++] = (int)(atof(tok) * scale);
+	return n;
+}
+
+static uint64_t samples_ns(uint64_t n)
+{
+	return n * 1000000000ULL / multi.rate;
+}
+
+static void multi_align(void)
+/* with multi.lock held, once every stream has settled.  output
+ * starts two transfers after the newest sample any of them has
+ * delivered, so none of them has gone past it yet */
+{
+	struct stream *s;
+	uint64_t t, start = 0;
+	int i;
+	for (i = 0; i < multi.count; i++) {
+		s = &multi.streams[i];
+		t = s->zero_ns + samples_ns(s->last_index);
+		if (t > start)
+			start = t;
+	}
+	start += samples_ns(multi.buf_len);
+	for (i = 0; i < multi.count; i++) {
+		s = &multi.streams[i];
+		s->offset = ((start - s->zero_ns) * multi.rate + 500000000ULL) / 1000000000ULL;
+		s->next = 0;
+	}
+	multi.start_ns = start;
+	multi.aligned = 1;
+}
+
+static void ring_put(struct stream *s, uint64_t at, const unsigned char *buf, uint64_t len)
+/* len bytes at byte position at, a NULL buf fills */
+{
+	uint64_t pos = at % s->ring_len;
+	uint64_t first = len < s->ring_len - pos ? len : s->ring_len - pos;
+	if (buf) {
+		memcpy(s->ring + pos, buf, first);
+		memcpy(s->ring, buf + first, len - first);
+	} else {
+		memset(s->ring + pos, GAP_FILL, first);
+		memset(s->ring, GAP_FILL, len - first);
+	}
+}
+
+static void stream_put(struct stream *s, const unsigned char *buf, uint64_t pos, uint64_t n)
+/* n samples for output position pos.  a gap in front is filled so the
+ * output stays on the shared time base, what doesn't fit in the ring
+ * is dropped and becomes a gap in turn */
+{
+	uint64_t room, gap, k, head;
+	pthread_mutex_lock(&multi.lock);
+	room = (s->ring_len - (s->head - s->tail)) / 2;
+	head = s->head;
+	pthread_mutex_unlock(&multi.lock);
+
+	if (pos < s->next) {
+		if (s->next - pos >= n)
+			return;
+		buf += 2 * (s->next - pos);
+		n -= s->next - pos;
+		pos = s->next;
+	}
+	gap = pos - s->next;
+	if (gap > room)
+		gap = room;
+	ring_put(s, head, NULL, 2 * gap);
+	head += 2 * gap;
+	s->next += gap;
+	s->filled += gap;
+	room -= gap;
+	k = 0;
+	if (s->next == pos) {
+		k = n < room ? n : room;
+		ring_put(s, head, buf, 2 * k);
+		head += 2 * k;
+		s->next += k;
+	}
+	s->dropped += n - k;
+
+	pthread_mutex_lock(&multi.lock);
+	s->head = head;
+	pthread_cond_signal(&multi.ready);
+	pthread_mutex_unlock(&multi.lock);
+}
+
+static void rtlsdr_callback(unsigned char *buf, uint32_t len,
+			    const rtlsdr_buffer_info_t *info, void *ctx)
+{
+	struct stream *s = ctx;
+	uint64_t n = len / 2;
+	uint64_t index = info->sample_index;
+	uint64_t skip, t;
+	int aligned;
+
+	if (do_exit)
+		return;
+	pthread_mutex_lock(&multi.lock);
+	s->last_ns = info->timestamp_ns;
+	s->last_index = index + n;
+	if (s->started < ALIGN_BUFFERS) {
+		/* a transfer completes some time after its last sample, never
+		 * before, the earliest looking one is closest to the truth */
+		t = info->timestamp_ns - samples_ns(index + n);
+		if (!s->started) {
+			s->first_ns = info->timestamp_ns;
+			s->first_index = index + n;
+		}
+		if (!s->started || t < s->zero_ns)
+			s->zero_ns = t;
+		if (++s->started == ALIGN_BUFFERS && ++multi.started == multi.count)
+			multi_align();
+	}
+	aligned = multi.aligned;
+	pthread_mutex_unlock(&multi.lock);
+	if (!aligned)
+		return;
+
+	/* failed transfers leave a gap in the index, stream_put() fills it
+	 * so this device keeps its place against the others */
+	if (info->flags & RTLSDR_BUF_XFER_ERROR)
+		s->xfer_errors += info->xfer_errors;
+	if (index + n <= s->offset)
+		return;
+	if (index < s->offset) {
+		skip = s->offset - index;
+		buf += 2 * skip;
+		n -= skip;
+		index = s->offset;
+	}
+	stream_put(s, buf, index - s->offset, n);
+}
+
+static int write_full(int fd, const unsigned char *buf, uint64_t len)
+{
+	int r;
+	while (len) {
+#ifdef _WIN32
+		r = _write(fd, buf, (unsigned int)len);
+#else
+		r = (int)write(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+#endif
+		if (r <= 0)
+			return -1;
+		buf += r;
+		len -= (uint64_t)r;
+	}
+	return 0;
+}
+
+static uint64_t stream_limit(struct stream *s, uint64_t n)
+{
+	if (multi.samples && s->written + n > multi.samples)
+		return multi.samples - s->written;
+	return n;
+}
+
+static int write_streams(uint64_t *avail)
+/* one file per device, returns samples written or -1 */
+{
+	struct stream *s;
+	uint64_t n, pos, first;
+	int i, total = 0;
+	for (i = 0; i < multi.count; i++) {
+		s = &multi.streams[i];
+		n = stream_limit(s, avail[i]);
+		if (!n)
+			continue;
+		pos = s->tail % s->ring_len;
+		first = 2 * n < s->ring_len - pos ? 2 * n : s->ring_len - pos;
+		if (write_full(s->fd, s->ring + pos, first) < 0 ||
+		    write_full(s->fd, s->ring, 2 * n - first) < 0)
+			return -1;
+		s->written += n;
+		total += (int)n;
+		pthread_mutex_lock(&multi.lock);
+		s->tail += 2 * n;
+		pthread_mutex_unlock(&multi.lock);
+	}
+	return total;
+}
+
+static int write_interleaved(uint64_t *avail)
+/* device 0 I/Q, device 1 I/Q, ... for every sample */
+{
+	struct stream *s;
+	uint64_t n = INTERLEAVE_CHUNK, pos, j;
+	unsigned char *out;
+	int i;
+	for (i = 0; i < multi.count; i++)
+		if (avail[i] < n)
+			n = avail[i];
+	n = stream_limit(&multi.streams[0], n);
+	if (!n)
+		return 0;
+	for (i = 0; i < multi.count; i++) {
+		s = &multi.streams[i];
+		out = multi.scratch + 2 * i;
+		pos = s->tail % s->ring_len;
+		for (j = 0; j < n; j++) {
+			out[0] = s->ring[pos];
+			out[1] = s->ring[pos + 1];
+			out += 2 * multi.count;
+			pos += 2;
+			if (pos == s->ring_len)
+				pos = 0;
+		}
+	}
+	if (write_full(multi.fd, multi.scratch, 2 * n * (uint64_t)multi.count) < 0)
+		return -1;
+	pthread_mutex_lock(&multi.lock);
+	for (i = 0; i < multi.count; i++) {
+		multi.streams[i].written += n;
+		multi.streams[i].tail += 2 * n;
+	}
+	pthread_mutex_unlock(&multi.lock);
+	return (int)n;
+}
+
+static void *writer_thread_fn(void *arg)
+{
+	uint64_t avail[MAX_DEVICES];
+	int i, r, done, full;
+	(void)arg;
+	verbose_rt_thread("writer", 0);
+	while (1) {
+		pthread_mutex_lock(&multi.lock);
+		for (i = 0; i < multi.count; i++)
+			avail[i] = (multi.streams[i].head - multi.streams[i].tail) / 2;
+		done = multi.done;
+		pthread_mutex_unlock(&multi.lock);
+
+		r = multi.interleave ? write_interleaved(avail) : write_streams(avail);
+		if (r < 0) {
+			fprintf(stderr, "Short write, samples lost, exiting!\n");
+			multi_cancel();
+			break;
+		}
+		full = multi.samples != 0;
+		for (i = 0; i < multi.count; i++)
+			full = full && multi.streams[i].written >= multi.samples;
+		if (full) {
+			multi_cancel();
+			break;
+		}
+		if (r)
+			continue;
+		if (done)
+			break;
+		pthread_mutex_lock(&multi.lock);
+		if (!multi.done)
+			pthread_cond_wait(&multi.ready, &multi.lock);
+		pthread_mutex_unlock(&multi.lock);
+	}
+	return NULL;
+}
+
+static void *stream_thread_fn(void *arg)
+/* the thread that calls read_async runs the usb events of that dongle */
+{
+	struct stream *s = arg;
+	int r;
+	verbose_rt_thread("usb", (int)(s - multi.streams));
+	r = rtlsdr_read_async_ex(s->dev, rtlsdr_callback, s, 0, multi.buf_len);
+	if (!do_exit) {
+		fprintf(stderr, "Device %d: library error %d, stopping all.\n", s->index, r);
+		multi_cancel();
+	}
+	return NULL;
+}
+
+static int open_output(char *name)
+{
+	int fd;
+	if (strcmp(name, "-") == 0) {
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		return STDOUT_FILENO;
+	}
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if (fd < 0)
+		fprintf(stderr, "Failed to open %s\n", name);
+	return fd;
+}
+
+static int stream_open(struct stream *s, uint32_t frequency, int ring_buffers)
+{
+	int r;
+	r = rtlsdr_open(&s->dev, (uint32_t)s->index);
+	if (r < 0) {
+		fprintf(stderr, "Failed to open rtlsdr device #%d.\n", s->index);
+		s->dev = NULL;
+		return r;
+	}
+	fprintf(stderr, "Device %d:\n", s->index);
+	verbose_set_sample_rate(s->dev, multi.rate);
+	verbose_set_frequency(s->dev, frequency);
+	if (s->gain == 0) {
+		verbose_auto_gain(s->dev);
+	} else {
+		s->gain = nearest_gain(s->dev, s->gain);
+		verbose_gain_set(s->dev, s->gain);
+	}
+	verbose_ppm_set(s->dev, s->ppm);
+	verbose_reset_buffer(s->dev);
+	s->ring_len = (uint64_t)ring_buffers * multi.buf_len;
+	s->ring = malloc(s->ring_len);
+	if (!s->ring)
+		return -1;
+	return 0;
+}
+
+static void stream_report(struct stream *s)
+{
+	double secs = (double)(s->last_ns - s->first_ns) * 1e-9;
+	double ppm = 0.0;
+	if (secs > 0.0)
+		ppm = ((double)(s->last_index - s->first_index) / secs / multi.rate - 1.0) * 1e6;
+	fprintf(stderr, "Device %d: %llu samples, %llu filled, %llu dropped, "
+		"%u transfer errors, %+.1f ppm against the host clock\n",
+		s->index, (unsigned long long)s->written,
+		(unsigned long long)s->filled, (unsigned long long)s->dropped,
+		s->xfer_errors, ppm);
+}
+
+int main(int argc, char **argv)
+{
+#ifndef _WIN32
+	struct sigaction sigact;
+#endif
+	struct stream *s;
+	char *filename = NULL;
+	char *devices = NULL;
+	char *tok;
+	int gains[MAX_DEVICES], ppms[MAX_DEVICES];
+	int gain_count = 0, ppm_count = 0;
+	int ring_buffers = DEFAULT_RING_BUFFERS;
+	int i, r = 0, opt, count;
+	uint32_t frequency = 100000000;
+
+	multi.rate = DEFAULT_SAMPLE_RATE;
+	multi.buf_len = DEFAULT_BUF_LENGTH;
+	multi.fd = -1;
+
+	while ((opt = getopt(argc, argv, "d:f:g:s:b:n:p:B:Y:I")) != -1) {
+		switch (opt) {
+		case 'd':
+			devices = optarg;
+			break;
+		case 'f':
+			frequency = (uint32_t)atofs(optarg);
+			break;
+		case 'g':
+			gain_count = parse_list(optarg, gains, MAX_DEVICES, 10.0);
+			break;
+		case 's':
+			multi.rate = (uint32_t)atofs(optarg);
+			break;
+		case 'p':
+			ppm_count = parse_list(optarg, ppms, MAX_DEVICES, 1.0);
+			break;
+		case 'b':
+			multi.buf_len = (uint32_t)atof(optarg);
+			break;
+		case 'n':
+			multi.samples = (uint64_t)atof(optarg);
+			break;
+		case 'B':
+			ring_buffers = atoi(optarg);
+			break;
+		case 'I':
+			multi.interleave = 1;
+			break;
+		case 'Y':
+			if (rt_parse(optarg, rt_stages) < 0)
+				exit(1);
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (argc <= optind)
+		usage();
+	filename = argv[optind];
+
+	if (multi.buf_len < MINIMAL_BUF_LENGTH ||
+	    multi.buf_len > MAXIMAL_BUF_LENGTH) {
+		fprintf(stderr, "Output block size wrong value, falling back to default\n");
+		multi.buf_len = DEFAULT_BUF_LENGTH;
+	}
+	multi.buf_len &= ~1u;
+	if (ring_buffers < 2) {
+		fprintf(stderr, "Need at least 2 buffers per device, using %d\n", DEFAULT_RING_BUFFERS);
+		ring_buffers = DEFAULT_RING_BUFFERS;
+	}
+
+	if (devices) {
+		for (tok = strtok(devices, ","); tok; tok = strtok(NULL, ",")) {
+			if (multi.count == MAX_DEVICES) {
+				fprintf(stderr, "At most %d devices.\n", MAX_DEVICES);
+				exit(1);
+			}
+			multi.streams[multi.count++].index = verbose_device_search(tok);
+		}
+	} else {
+		count = (int)rtlsdr_get_device_count();
+		if (count > MAX_DEVICES)
+			count = MAX_DEVICES;
+		for (i = 0; i < count; i++)
+			multi.streams[multi.count++].index = i;
+	}
+	if (!multi.count) {
+		fprintf(stderr, "No supported devices found.\n");
+		exit(1);
+	}
+	for (i = 0; i < multi.count; i++) {
+		s = &multi.streams[i];
+		if (s->index < 0)
+			exit(1);
+		s->gain = gain_count ? gains[i < gain_count ? i : gain_count - 1] : 0;
+		s->ppm = ppm_count ? ppms[i < ppm_count ? i : ppm_count - 1] : 0;
+		s->fd = -1;
+	}
+	if (!multi.interleave && strcmp(filename, "-") == 0) {
+		fprintf(stderr, "One file per device, stdout needs -I.\n");
+		exit(1);
+	}
+	verbose_rt_lock();
+
+#ifndef _WIN32
+	sigact.sa_handler = sighandler;
+	sigemptyset(&sigact.sa_mask);
+	sigact.sa_flags = 0;
+	sigaction(SIGINT, &sigact, NULL);
+	sigaction(SIGTERM, &sigact, NULL);
+	sigaction(SIGQUIT, &sigact, NULL);
+	sigaction(SIGPIPE, &sigact, NULL);
+#else
+	SetConsoleCtrlHandler( (PHANDLER_ROUTINE) sighandler, TRUE );
+#endif
+
+	pthread_mutex_init(&multi.lock, NULL);
+	pthread_cond_init(&multi.ready, NULL);
+
+	for (i = 0; i < multi.count; i++) {
+		s = &multi.streams[i];
+		if (stream_open(s, frequency, ring_buffers) < 0) {
+			r = -1;
+			goto out;
+		}
+		if (multi.interleave)
+			continue;
+		/* a single % that is a %u names the files */
+		if (strstr(filename, "%u") && strchr(filename, '%') == strrchr(filename, '%'))
+			snprintf(s->filename, sizeof(s->filename), filename, (unsigned)s->index);
+		else
+			snprintf(s->filename, sizeof(s->filename), "%s.%d", filename, s->index);
+		s->fd = open_output(s->filename);
+		if (s->fd < 0) {
+			r = -1;
+			goto out;
+		}
+	}
+	if (multi.interleave) {
+		multi.fd = open_output(filename);
+		multi.scratch = malloc(2 * INTERLEAVE_CHUNK * (size_t)multi.count);
+		if (multi.fd < 0 || !multi.scratch) {
+			r = -1;
+			goto out;
+		}
+	}
+
+	pthread_create(&multi.writer, NULL, writer_thread_fn, NULL);
+	fprintf(stderr, "Reading samples from %d devices...\n", multi.count);
+	for (i = 0; i < multi.count; i++)
+		pthread_create(&multi.streams[i].thread, NULL, stream_thread_fn, &multi.streams[i]);
+	for (i = 0; i < multi.count; i++)
+		pthread_join(multi.streams[i].thread, NULL);
+
+	pthread_mutex_lock(&multi.lock);
+	multi.done = 1;
+	pthread_cond_signal(&multi.ready);
+	pthread_mutex_unlock(&multi.lock);
+	pthread_join(multi.writer, NULL);
+
+	if (multi.aligned)
+		fprintf(stderr, "\nSample 0 of every output at %.6f s on the monotonic clock.\n",
+			(double)multi.start_ns * 1e-9);
+	for (i = 0; i < multi.count; i++)
+		stream_report(&multi.streams[i]);
+
+out:
+	for (i = 0; i < multi.count; i++) {
+		s = &multi.streams[i];
+		if (s->dev)
+			rtlsdr_close(s->dev);
+		if (s->fd >= 0)
+			close(s->fd);
+		free(s->ring);
+	}
+	if (multi.fd >= 0 && multi.fd != STDOUT_FILENO)
+		close(multi.fd);
+	free(multi.scratch);
+	return r >= 0 ? r : -r;
+}
@@ -23,17 +23,15 @@
  * rtl_power: general purpose FFT integrator
  * -f low_freq:high_freq:max_bin_size
  * -i seconds
- * outputs CSV
+ * outputs CSV, or binary records with -o
  * time, low, high, step, db, db, db ...
  * db optional?  raw output might be better for noise correction
  * todo:
- *	threading
  *	randomized hopping
  *	noise correction
  *	continuous IIR
  *	general astronomy usefulness
  *	multiple dongles
- *	multiple FFT workers
  *	check edge cropping for off-by-one and rounding errors
  *	1.8MS/s for hiding xtal harmonics
  */
@@ -64,7 +62,9 @@
 #include <libusb.h>
 
 #include "rtl-sdr.h"
+#include "rtl-sdr_dsp.h"
 #include "convenience/convenience.h"
+#include "convenience/stats.h"
 
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 
@@ -75,15 +75,33 @@
 #define MAXIMUM_RATE			2800000
 #define MINIMUM_RATE			1000000
 
+/* soft-float ARM is better off with fix_fft */
+#if defined(__arm__) && !defined(__ARM_FP)
+#define DEFAULT_FFT			"fixed"
+#else
+#define DEFAULT_FFT			"float"
+#endif
+
 static volatile int do_exit = 0;
 static rtlsdr_dev_t *dev = NULL;
 FILE *file;
 
-int16_t* Sinewave;
-double* power_table;
-int N_WAVE, LOG2_N_WAVE;
-int next_power;
-int16_t *fft_buf;
+static struct stats_metric stat_retune = STATS_METRIC("rtl_power_retune_seconds",
+	"Time from retuning to the first usable sample", STATS_HIST);
+static struct stats_metric stat_fft = STATS_METRIC("rtl_power_fft_seconds",
+	"Processing time per hop", STATS_HIST);
+static struct stats_metric stat_hops = STATS_METRIC("rtl_power_hops_total",
+	"Hops captured", STATS_COUNTER);
+static struct stats_metric stat_sweeps = STATS_METRIC("rtl_power_sweeps_total",
+	"Passes over the whole frequency range", STATS_COUNTER);
+static struct stats_metric stat_short = STATS_METRIC("rtl_power_short_reads_total",
+	"Hops read with samples missing", STATS_COUNTER);
+static struct stats_metric stat_restarts = STATS_METRIC("rtl_power_hop_restarts_total",
+	"Async hops captured again after a lost transfer", STATS_COUNTER);
+
+/* the threads -Y can place */
+static const char *rt_stages[] = {"usb", "fft", NULL};
+
 int *window_coefs;
 
 struct tuning_state
@@ -97,14 +115,21 @@ struct tuning_state
 	int downsample;
 	int downsample_passes;  /* for the recursive filter */
 	double crop;
-	//pthread_rwlock_t avg_lock;
-	//pthread_mutex_t avg_mutex;
 	/* having the iq buffer here is wasteful, but will avoid contention */
 	uint8_t *buf8;
 	int buf_len;
 	//int *comp_fir;
-	//pthread_rwlock_t buf_lock;
-	//pthread_mutex_t buf_mutex;
+	/* buf8 hand-off, avg is only ever touched by the owning worker */
+	pthread_mutex_t buf_mutex;
+	pthread_cond_t buf_cond;
+	int buf_full;
+	/* the integrated row, crop_bins long in frequency order */
+	double *level;
+	int level_samples;
+	int fresh;  /* level holds a row not written yet */
+	int rows;
+	uint64_t flushed_ns;
+	int own_lo, own_hi;  /* the level bins no nearer hop covers */
 };
 
 /* 3000 is enough for 3GHz b/w worst case */
@@ -112,9 +137,32 @@ struct tuning_state
 struct tuning_state tunes[MAX_TUNES];
 int tune_count = 0;
 
+struct fft_worker
+/* owns every fft_threads'th tune, starting at index */
+{
+	pthread_t thread;
+	int index;
+	int16_t *fft_buf;
+	rtlsdr_dsp_fft_t *plan;
+	int64_t *pwr;
+};
+
+#define MAX_FFT_THREADS	64
+struct fft_worker workers[MAX_FFT_THREADS];
+int fft_threads = 1;
+static volatile int workers_exit = 0;
+char *fft_backend = DEFAULT_FFT;
+
 int boxcar = 1;
 int comp_fir_size = 0;
 int peak_hold = 0;
+int smoothing = 0;
+double smooth_tau = 0.0;  /* seconds */
+
+/* from the first logged bin to the fft bin it reads, with the 180 degree
+ * translation, the dc nuke and the crop worked out once */
+int *bin_map;
+int crop_first, crop_bins;
 
 void usage(void)
 {
@@ -125,15 +173,25 @@ void usage(void)
 		"\t (bin size is a maximum, smaller more convenient bins\n"
 		"\t  will be used.  valid range 1Hz - 2.8MHz)\n"
 		"\t[-i integration_interval (default: 10 seconds)]\n"
-		"\t (buggy if a full sweep takes longer than the interval)\n"
+		"\t (a sweep that takes longer is written in parts,\n"
+		"\t  the hops done so far every interval)\n"
 		"\t[-1 enables single-shot mode (default: off)]\n"
 		"\t[-e exit_timer (default: off/0)]\n"
-		//"\t[-s avg/iir smoothing (default: avg)]\n"
-		//"\t[-t threads (default: 1)]\n"
+		"\t[-s avg|iir[,time] smoothing (default: avg)]\n"
+		"\t (iir is an exponential average of the intervals,\n"
+		"\t  time is its time constant, default 10 intervals)\n"
+		"\t[-t fft_threads (default: 1)]\n"
+		"\t (hops are spread over the workers, the dongle is read\n"
+		"\t  while they process the previous hops)\n"
 		"\t[-d device_index (default: 0)]\n"
 		"\t[-g tuner_gain (default: automatic)]\n"
 		"\t[-p ppm_error (default: 0)]\n"
 		"\t[-T enable bias-T on GPIO PIN 0 (works for rtl-sdr.com v3 dongles)]\n"
+		"\t[-o output format: csv, sweep, f32, i16 (default: csv)]\n"
+		"\t (sweep is csv with one row per run of hops, where\n"
+		"\t  hops overlap only the one nearer its center counts)\n"
+		"\t (f32 and i16 are binary, appended to an existing file\n"
+		"\t  with the same scan and indexed in filename.idx)\n"
 		"\tfilename (a '-' dumps samples to stdout)\n"
 		"\t (omitting the filename also uses stdout)\n"
 		"\n"
@@ -144,6 +202,8 @@ void usage(void)
 		"\t[-c crop_percent (default: 0%%, recommended: 20%%-50%%)]\n"
 		"\t (discards data at the edges, 100%% discards everything)\n"
 		"\t (has no effect for bins larger than 1MHz)\n"
+		"\t[-A fixed/float choose FFT math (default: " DEFAULT_FFT ")]\n"
+		"\t (fixed only needs integer math, for boards without an FPU)\n"
 		"\t[-F fir_size (default: disabled)]\n"
 		"\t (enables low-leakage downsample filter,\n"
 		"\t  fir_size can be 0 or 9.  0 has bad roll off,\n"
@@ -151,6 +211,15 @@ void usage(void)
 		"\t[-P enables peak hold (default: off)]\n"
 		"\t[-D enable direct sampling (default: off)]\n"
 		"\t[-O enable offset tuning (default: off)]\n"
+		"\t[-a async scan (default: off)]\n"
+		"\t (streams without pausing between hops and only drops\n"
+		"\t  samples captured before the tuner settled)\n"
+		"\t[-X stats (default: off)]\n"
+		"\t (tcp:[addr:]port serves counters to prometheus,\n"
+		"\t  filename[,seconds] rewrites a file with them, - for stderr)\n"
+		"\t[-Y scheduling (default: off)]\n"
+		"\t (stage=[cpu[-cpu]][:fifo_priority],... and lock to mlock,\n"
+		"\t  stages are usb and fft, a cpu range spreads the fft threads)\n"
 		"\n"
 		"CSV FFT output columns:\n"
 		"\tdate, time, Hz low, Hz high, Hz step, samples, dbm, dbm, ...\n\n"
@@ -205,23 +274,6 @@ static void sighandler(int signum)
 #define safe_cond_signal(n, m) pthread_mutex_lock(m); pthread_cond_signal(n); pthread_mutex_unlock(m)
 #define safe_cond_wait(n, m) pthread_mutex_lock(m); pthread_cond_wait(n, m); pthread_mutex_unlock(m)
 
-/* {length, coef, coef, coef}  and scaled by 2^15
-   for now, only length 9, optimal way to get +85% bandwidth */
-#define CIC_TABLE_MAX 10
-int cic_9_tables[][10] = {
-	{0,},
-	{9, -156,  -97, 2798, -15489, 61019, -15489, 2798,  -97, -156},
-	{9, -128, -568, 5593, -24125, 74126, -24125, 5593, -568, -128},
-	{9, -129, -639, 6187, -26281, 77511, -26281, 6187, -639, -129},
-	{9, -122, -612, 6082, -26353, 77818, -26353, 6082, -612, -122},
-	{9, -120, -602, 6015, -26269, 77757, -26269, 6015, -602, -120},
-	{9, -120, -582, 5951, -26128, 77542, -26128, 5951, -582, -120},
-	{9, -119, -580, 5931, -26094, 77505, -26094, 5931, -580, -119},
-	{9, -119, -578, 5921, -26077, 77484, -26077, 5921, -578, -119},
-	{9, -119, -577, 5917, -26067, 77473, -26067, 5917, -577, -119},
-	{9, -199, -362, 5303, -25505, 77489, -25505, 5303, -362, -199},
-};
-
 #if defined(_MSC_VER) && (_MSC_VER < 1800)
 double log2(double n)
 {
@@ -229,175 +281,6 @@ double log2(double n)
 }
 #endif
 
-/* FFT based on fix_fft.c by Roberts, Slaney and Bouras
-   http://www.jjj.de/fft/fftpage.html
-   16 bit ints for everything
-   -32768..+32768 maps to -1.0..+1.0
-*/
-
-void sine_table(int size)
-{
-	int i;
-	double d;
-	LOG2_N_WAVE = size;
-	N_WAVE = 1 << LOG2_N_WAVE;
-	Sinewave = malloc(sizeof(int16_t) * N_WAVE*3/4);
-	power_table = malloc(sizeof(double) * N_WAVE);
-	for (i=0; i<N_WAVE*3/4; i++)
-	{
-		d = (double)i * 2.0 * M_PI / N_WAVE;
-		Sinewave[i] = (int)round(32767*sin(d));
-		//printf("%i\n", Sinewave[i]);
-	}
-}
-
-static inline int16_t FIX_MPY(int16_t a, int16_t b)
-/* fixed point multiply and scale */
-{
-	int c = ((int)a * (int)b) >> 14;
-	b = c & 0x01;
-	return (c >> 1) + b;
-}
-
-int fix_fft(int16_t iq[], int m)
-/* interleaved iq[], 0 <= n < 2**m, changes in place */
-{
-	int mr, nn, i, j, l, k, istep, n, shift;
-	int16_t qr, qi, tr, ti, wr, wi;
-	n = 1 << m;
-	if (n > N_WAVE)
-		{return -1;}
-	mr = 0;
-	nn = n - 1;
-	/* decimation in time - re-order data */
-	for (m=1; m<=nn; ++m) {
-		l = n;
-		do
-			{l >>= 1;}
-		while (mr+l > nn);
-		mr = (mr & (l-1)) + l;
-		if (mr <= m)
-			{continue;}
-		// real = 2*m, imag = 2*m+1
-		tr = iq[2*m];
-		iq[2*m] = iq[2*mr];
-		iq[2*mr] = tr;
-		ti = iq[2*m+1];
-		iq[2*m+1] = iq[2*mr+1];
-		iq[2*mr+1] = ti;
-	}
-	l = 1;
-	k = LOG2_N_WAVE-1;
-	while (l < n) {
-		shift = 1;
-		istep = l << 1;
-		for (m=0; m<l; ++m) {
-			j = m << k;
-			wr =  Sinewave[j+N_WAVE/4];
-			wi = -Sinewave[j];
-			if (shift) {
-				wr >>= 1; wi >>= 1;}
-			for (i=m; i<n; i+=istep) {
-				j = i + l;
-				tr = FIX_MPY(wr,iq[2*j]) - FIX_MPY(wi,iq[2*j+1]);
-				ti = FIX_MPY(wr,iq[2*j+1]) + FIX_MPY(wi,iq[2*j]);
-				qr = iq[2*i];
-				qi = iq[2*i+1];
-				if (shift) {
-					qr >>= 1; qi >>= 1;}
-				iq[2*j] = qr - tr;
-				iq[2*j+1] = qi - ti;
-				iq[2*i] = qr + tr;
-				iq[2*i+1] = qi + ti;
-			}
-		}
-		--k;
-		l = istep;
-	}
-	return 0;
-}
-
-double rectangle(int i, int length)
-{
-	return 1.0;
-}
-
-double hamming(int i, int length)
-{
-	double a, b, w, N1;
-	a = 25.0/46.0;
-	b = 21.0/46.0;
-	N1 = (double)(length-1);
-	w = a - b*cos(2*i*M_PI/N1);
-	return w;
-}
-
-double blackman(int i, int length)
-{
-	double a0, a1, a2, w, N1;
-	a0 = 7938.0/18608.0;
-	a1 = 9240.0/18608.0;
-	a2 = 1430.0/18608.0;
-	N1 = (double)(length-1);
-	w = a0 - a1*cos(2*i*M_PI/N1) + a2*cos(4*i*M_PI/N1);
-	return w;
-}
-
-double blackman_harris(int i, int length)
-{
-	double a0, a1, a2, a3, w, N1;
-	a0 = 0.35875;
-	a1 = 0.48829;
-	a2 = 0.14128;
-	a3 = 0.01168;
-	N1 = (double)(length-1);
-	w = a0 - a1*cos(2*i*M_PI/N1) + a2*cos(4*i*M_PI/N1) - a3*cos(6*i*M_PI/N1);
-	return w;
-}
-
-double hann_poisson(int i, int length)
-{
-	double a, N1, w;
-	a = 2.0;
-	N1 = (double)(length-1);
-	w = 0.5 * (1 - cos(2*M_PI*i/N1)) * \
-	    pow(M_E, (-a*(double)abs((int)(N1-1-2*i)))/N1);
-	return w;
-}
-
-double youssef(int i, int length)
-/* really a blackman-harris-poisson window, but that is a mouthful */
-{
-	double a, a0, a1, a2, a3, w, N1;
-	a0 = 0.35875;
-	a1 = 0.48829;
-	a2 = 0.14128;
-	a3 = 0.01168;
-	N1 = (double)(length-1);
-	w = a0 - a1*cos(2*i*M_PI/N1) + a2*cos(4*i*M_PI/N1) - a3*cos(6*i*M_PI/N1);
-	a = 0.0025;
-	w *= pow(M_E, (-a*(double)abs((int)(N1-1-2*i)))/N1);
-	return w;
-}
-
-double kaiser(int i, int length)
-// todo, become more smart
-{
-	return 1.0;
-}
-
-double bartlett(int i, int length)
-{
-	double N1, L, w;
-	L = (double)length;
-	N1 = L - 1;
-	w = (i - N1/2) / (L/2);
-	if (w < 0) {
-		w = -w;}
-	w = 1 - w;
-	return w;
-}
-
 void rms_power(struct tuning_state *ts)
 /* for bins between 1MHz and 2MHz */
 {
@@ -525,6 +408,9 @@ void frequency_range(char *arg, double crop)
 			exit(1);
 		}
 		ts->buf_len = buf_len;
+		ts->buf_full = 0;
+		pthread_mutex_init(&ts->buf_mutex, NULL);
+		pthread_cond_init(&ts->buf_cond, NULL);
 	}
 	/* report */
 	fprintf(stderr, "Number of frequency hops: %i\n", tune_count);
@@ -542,225 +428,793 @@ void retune(rtlsdr_dev_t *d, int freq)
 {
 	uint8_t dump[BUFFER_DUMP];
 	int n_read;
+	uint64_t t = stats_now_us();
 	rtlsdr_set_center_freq(d, (uint32_t)freq);
 	/* wait for settling and flush buffer */
 	usleep(5000);
 	rtlsdr_read_sync(d, &dump, BUFFER_DUMP, &n_read);
 	if (n_read != BUFFER_DUMP) {
 		fprintf(stderr, "Error: bad retune.\n");}
+	stats_time(&stat_retune, stats_now_us() - t);
 }
 
-void fifth_order(int16_t *data, int length)
-/* for half of interleaved data */
+void fft_tune(struct tuning_state *ts, struct fft_worker *wk)
+/* everything after the read, runs on the owning worker */
+{
+	int j, j2, offset, bin_e, bin_len, buf_len, ds, ds_p;
+	int32_t w;
+	int16_t *fft_buf = wk->fft_buf;
+	int64_t *pwr = wk->pwr;
+	bin_e = ts->bin_e;
+	bin_len = 1 << bin_e;
+	buf_len = ts->buf_len;
+	/* rms */
+	if (bin_len == 1) {
+		rms_power(ts);
+		return;
+	}
+	/* prep for fft */
+	rtlsdr_dsp_convert(ts->buf8, fft_buf, (uint32_t)buf_len, 0);
+	ds = ts->downsample;
+	ds_p = ts->downsample_passes;
+	if (boxcar && ds > 1) {
+		j=2, j2=0;
+		while (j < buf_len) {
+			fft_buf[j2]   += fft_buf[j];
+			fft_buf[j2+1] += fft_buf[j+1];
+			fft_buf[j] = 0;
+			fft_buf[j+1] = 0;
+			j += 2;
+			if (j % (ds*2) == 0) {
+				j2 += 2;}
+		}
+	} else if (ds_p) {  /* recursive */
+		for (j=0; j < ds_p; j++) {
+			rtlsdr_dsp_fifth_order(fft_buf, buf_len >> j, NULL);
+		}
+		/* droop compensation */
+		if (comp_fir_size == 9 && ds_p <= RTLSDR_DSP_CIC_MAX) {
+			rtlsdr_dsp_cic_droop(fft_buf, buf_len >> j, ds_p, NULL);
+		}
+	}
+	rtlsdr_dsp_remove_dc(fft_buf, buf_len / ds);
+	/* window function and fft */
+	for (offset=0; offset<(buf_len/ds); offset+=(2*bin_len)) {
+		// todo, let rect skip this
+		for (j=0; j<bin_len; j++) {
+			w =  (int32_t)fft_buf[offset+j*2];
+			w *= (int32_t)(window_coefs[j]);
+			//w /= (int32_t)(ds);
+			fft_buf[offset+j*2]   = (int16_t)w;
+			w =  (int32_t)fft_buf[offset+j*2+1];
+			w *= (int32_t)(window_coefs[j]);
+			//w /= (int32_t)(ds);
+			fft_buf[offset+j*2+1] = (int16_t)w;
+		}
+		rtlsdr_dsp_fft_power(wk->plan, fft_buf+offset, pwr);
+		if (!peak_hold) {
+			for (j=0; j<bin_len; j++) {
+				ts->avg[j] += pwr[j];
+			}
+		} else {
+			for (j=0; j<bin_len; j++) {
+				ts->avg[j] = MAX(pwr[j], ts->avg[j]);
+			}
+		}
+		ts->samples += ds;
+	}
+}
+
+static void *fft_thread_fn(void *arg)
+{
+	struct fft_worker *w = arg;
+	struct tuning_state *ts;
+	int i = w->index;
+	uint64_t t;
+	verbose_rt_thread("fft", w->index);
+	while (!workers_exit) {
+		ts = &tunes[i];
+		pthread_mutex_lock(&ts->buf_mutex);
+		while (!ts->buf_full && !workers_exit) {
+			pthread_cond_wait(&ts->buf_cond, &ts->buf_mutex);}
+		pthread_mutex_unlock(&ts->buf_mutex);
+		if (workers_exit) {
+			break;}
+		t = stats_now_us();
+		fft_tune(ts, w);
+		stats_time(&stat_fft, stats_now_us() - t);
+		pthread_mutex_lock(&ts->buf_mutex);
+		ts->buf_full = 0;
+		pthread_cond_broadcast(&ts->buf_cond);
+		pthread_mutex_unlock(&ts->buf_mutex);
+		i += fft_threads;
+		if (i >= tune_count) {
+			i = w->index;}
+	}
+	return 0;
+}
+
+void workers_init(void)
 {
 	int i;
-	int a, b, c, d, e, f;
-	a = data[0];
-	b = data[2];
-	c = data[4];
-	d = data[6];
-	e = data[8];
-	f = data[10];
-	/* a downsample should improve resolution, so don't fully shift */
-	/* ease in instead of being stateful */
-	data[0] = ((a+b)*10 + (c+d)*5 + d + f) >> 4;
-	data[2] = ((b+c)*10 + (a+d)*5 + e + f) >> 4;
-	data[4] = (a + (b+e)*5 + (c+d)*10 + f) >> 4;
-	for (i=12; i<length; i+=4) {
-		a = c;
-		b = d;
-		c = e;
-		d = f;
-		e = data[i-2];
-		f = data[i];
-		data[i/2] = (a + (b+e)*5 + (c+d)*10 + f) >> 4;
-	}
-}
-
-void remove_dc(int16_t *data, int length)
-/* works on interleaved data */
+	struct fft_worker *w;
+	if (fft_threads > tune_count) {
+		fft_threads = tune_count;}
+	if (fft_threads > MAX_FFT_THREADS) {
+		fft_threads = MAX_FFT_THREADS;}
+	if (fft_threads < 1) {
+		fft_threads = 1;}
+	for (i=0; i<fft_threads; i++) {
+		w = &workers[i];
+		w->index = i;
+		w->fft_buf = malloc(tunes[0].buf_len * sizeof(int16_t));
+		w->pwr = malloc((1 << tunes[0].bin_e) * sizeof(int64_t));
+		w->plan = rtlsdr_dsp_fft_plan(fft_backend, tunes[0].bin_e);
+		if (!w->fft_buf || !w->pwr || !w->plan) {
+			fprintf(stderr, "Error: malloc.\n");
+			exit(1);
+		}
+		pthread_create(&w->thread, NULL, fft_thread_fn, (void *)w);
+	}
+}
+
+void workers_cleanup(void)
 {
 	int i;
-	int16_t ave;
-	long sum = 0L;
-	for (i=0; i < length; i+=2) {
-		sum += data[i];
+	struct tuning_state *ts;
+	for (i=0; i<tune_count; i++) {
+		ts = &tunes[i];
+		pthread_mutex_lock(&ts->buf_mutex);
+		workers_exit = 1;
+		pthread_cond_broadcast(&ts->buf_cond);
+		pthread_mutex_unlock(&ts->buf_mutex);
+	}
+	for (i=0; i<fft_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		rtlsdr_dsp_fft_destroy(workers[i].plan);
+		free(workers[i].fft_buf);
+		free(workers[i].pwr);
 	}
-	ave = (int16_t)(sum / (long)(length));
-	if (ave == 0) {
+}
+
+void wait_for_buf(struct tuning_state *ts)
+/* blocks until the owning worker is done with buf8 and avg */
+{
+	pthread_mutex_lock(&ts->buf_mutex);
+	while (ts->buf_full) {
+		pthread_cond_wait(&ts->buf_cond, &ts->buf_mutex);}
+	pthread_mutex_unlock(&ts->buf_mutex);
+}
+
+void workers_drain(void)
+{
+	int i;
+	for (i=0; i<tune_count; i++) {
+		wait_for_buf(&tunes[i]);}
+}
+
+int scanner(struct tuning_state *ts)
+/* the reader, retunes and hands the hop to its worker.
+ * returns -1 when the scan has to stop */
+{
+	int f, n_read, buf_len;
+	if (do_exit >= 2)
+		{return -1;}
+	buf_len = ts->buf_len;
+	f = (int)rtlsdr_get_center_freq(dev);
+	if (f != ts->freq) {
+		retune(dev, ts->freq);}
+	wait_for_buf(ts);
+	if (rtlsdr_read_sync(dev, ts->buf8, buf_len, &n_read) < 0) {
+		fprintf(stderr, "Error: sync read failed.\n");
+		do_exit = 2;
+		return -1;
+	}
+	if (n_read != buf_len) {
+		fprintf(stderr, "Error: dropped samples.\n");
+		stats_add(&stat_short, 1);
+	}
+	pthread_mutex_lock(&ts->buf_mutex);
+	ts->buf_full = 1;
+	pthread_cond_broadcast(&ts->buf_cond);
+	pthread_mutex_unlock(&ts->buf_mutex);
+	stats_add(&stat_hops, 1);
+	return 0;
+}
+
+/* async scan, the dongle streams continuously and the callback copies
+ * each hop's samples once the tuner has settled */
+
+#define ASYNC_BUF_MIN		(4 * 1024)
+#define SETTLE_GUARD_NS		200000ULL
+
+struct async_scan
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	int running;
+	int rate;
+	int buf_len;
+	/* when the samples were captured, for the settle point */
+	struct stream_clock clock;
+	uint64_t next_index;
+	/* the hop being captured, NULL while retuning.  samples captured
+	 * before settle_ns still belong to the previous tuning */
+	struct tuning_state *ts;
+	uint64_t settle_ns;
+	uint64_t start_index;
+	int fill;
+	/* statistics */
+	uint64_t discarded;
+	uint64_t restarts;
+	uint64_t retunes;
+	uint64_t settle_total_ns;
+};
+
+struct async_scan scan;
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+static void async_callback(unsigned char *buf, uint32_t len,
+			   const rtlsdr_buffer_info_t *info, void *ctx)
+{
+	struct tuning_state *ts;
+	uint64_t index, skip;
+	uint32_t n;
+	int want;
+	if (do_exit >= 2) {
+		rtlsdr_cancel_async(dev);
 		return;}
-	for (i=0; i < length; i+=2) {
-		data[i] -= ave;
+	n = len / 2;
+	index = info->sample_index;
+	pthread_mutex_lock(&scan.lock);
+	if (stream_clock_update(&scan.clock, info, n, (uint32_t)scan.rate)) {
+		pthread_cond_broadcast(&scan.ready);}
+	ts = scan.ts;
+	if (!ts) {
+		goto done;}
+	if (index != scan.next_index && scan.fill) {
+		/* a lost transfer, the hop has to be contiguous */
+		scan.discarded += scan.fill / 2;
+		scan.restarts++;
+		stats_add(&stat_restarts, 1);
+		scan.fill = 0;
+	}
+	if (!scan.start_index) {
+		/* first buffer of this epoch, find the first settled sample */
+		scan.start_index = stream_clock_index(&scan.clock, scan.settle_ns, (uint32_t)scan.rate);}
+	skip = 0;
+	if (scan.start_index > index) {
+		skip = scan.start_index - index;}
+	if (skip >= n) {
+		scan.discarded += n;
+		goto done;}
+	scan.discarded += skip;
+	want = ts->buf_len - scan.fill;
+	if ((int)(len - skip * 2) < want) {
+		want = (int)(len - skip * 2);}
+	memcpy(ts->buf8 + scan.fill, buf + skip * 2, want);
+	scan.fill += want;
+	if (scan.fill >= ts->buf_len) {
+		scan.ts = NULL;
+		pthread_cond_broadcast(&scan.ready);
 	}
+done:
+	scan.next_index = index + n;
+	pthread_mutex_unlock(&scan.lock);
+}
+
+static void *async_thread_fn(void *arg)
+{
+	int r;
+	verbose_rt_thread("usb", 0);
+	r = rtlsdr_read_async_ex(dev, async_callback, NULL, 0, scan.buf_len);
+	/* an error, a lost dongle or the end of a replay */
+	if (!do_exit) {
+		fprintf(stderr, "Error: async read ended (%d).\n", r);
+		do_exit = 2;
+	}
+	pthread_mutex_lock(&scan.lock);
+	scan.running = 0;
+	pthread_cond_broadcast(&scan.ready);
+	pthread_mutex_unlock(&scan.lock);
+	return 0;
+}
+
+void async_init(void)
+{
+	pthread_mutex_init(&scan.lock, NULL);
+	pthread_cond_init(&scan.ready, NULL);
+	scan.rate = tunes[0].rate;
+	stream_clock_init(&scan.clock);
+	/* a few transfers per hop, so little of the hop is spent waiting
+	 * for the transfer that straddles the settle point */
+	scan.buf_len = (tunes[0].buf_len / 4) & ~511;
+	if (scan.buf_len < ASYNC_BUF_MIN) {
+		scan.buf_len = ASYNC_BUF_MIN;}
+	scan.running = 1;
+	pthread_create(&scan.thread, NULL, async_thread_fn, NULL);
+	pthread_mutex_lock(&scan.lock);
+	while (!scan.clock.synced && scan.running && do_exit < 2) {
+		pthread_cond_wait(&scan.ready, &scan.lock);}
+	pthread_mutex_unlock(&scan.lock);
 }
 
-void generic_fir(int16_t *data, int length, int *fir)
-/* Okay, not at all generic.  Assumes length 9, fix that eventually. */
+void async_cleanup(void)
 {
-	int d, temp, sum;
-	int hist[9] = {0,};
-	/* cheat on the beginning, let it go unfiltered */
-	for (d=0; d<18; d+=2) {
-		hist[d/2] = data[d];
+	rtlsdr_cancel_async(dev);
+	pthread_join(scan.thread, NULL);
+	if (scan.retunes) {
+		fprintf(stderr, "Async scan: %llu retunes, %.1f us to settle, "
+			"%llu samples discarded, %llu hops restarted\n",
+			(unsigned long long)scan.retunes,
+			(double)scan.settle_total_ns / (double)scan.retunes / 1000.0,
+			(unsigned long long)scan.discarded,
+			(unsigned long long)scan.restarts);
 	}
-	for (d=18; d<length; d+=2) {
-		temp = data[d];
-		sum = 0;
-		sum += (hist[0] + hist[8]) * fir[1];
-		sum += (hist[1] + hist[7]) * fir[2];
-		sum += (hist[2] + hist[6]) * fir[3];
-		sum += (hist[3] + hist[5]) * fir[4];
-		sum +=            hist[4]  * fir[5];
-		data[d] = (int16_t)(sum >> 15) ;
-		hist[0] = hist[1];
-		hist[1] = hist[2];
-		hist[2] = hist[3];
-		hist[3] = hist[4];
-		hist[4] = hist[5];
-		hist[5] = hist[6];
-		hist[6] = hist[7];
-		hist[7] = hist[8];
-		hist[8] = temp;
+	pthread_cond_destroy(&scan.ready);
+	pthread_mutex_destroy(&scan.lock);
+}
+
+int async_scanner(struct tuning_state *ts)
+/* retunes and waits for the callback to fill the hop, the stream
+ * keeps running so the next hop is captured while this one is in fft.
+ * returns -1 when the scan has to stop */
+{
+	int f;
+	uint64_t t;
+	if (do_exit >= 2 || !scan.running)
+		{return -1;}
+	wait_for_buf(ts);
+	t = monotonic_ns();
+	f = (int)rtlsdr_get_center_freq(dev);
+	if (f != ts->freq) {
+		/* the tuner only returns once the pll reports lock */
+		rtlsdr_set_center_freq(dev, (uint32_t)ts->freq);}
+	pthread_mutex_lock(&scan.lock);
+	scan.settle_ns = monotonic_ns();
+	if (f != ts->freq) {
+		scan.retunes++;
+		scan.settle_total_ns += scan.settle_ns - t;
+		stats_time(&stat_retune, (scan.settle_ns - t) / 1000);
 	}
+	scan.settle_ns += SETTLE_GUARD_NS;
+	scan.start_index = 0;
+	scan.fill = 0;
+	scan.ts = ts;
+	while (scan.ts && scan.running && do_exit < 2) {
+		pthread_cond_wait(&scan.ready, &scan.lock);}
+	scan.ts = NULL;
+	pthread_mutex_unlock(&scan.lock);
+	if (scan.fill < ts->buf_len)
+		{return -1;}
+	pthread_mutex_lock(&ts->buf_mutex);
+	ts->buf_full = 1;
+	pthread_cond_broadcast(&ts->buf_cond);
+	pthread_mutex_unlock(&ts->buf_mutex);
+	stats_add(&stat_hops, 1);
+	return 0;
+}
+
+static void bin_span(struct tuning_state *ts, int *i1, int *i2)
+/* the bins left after cropping */
+{
+	int len = 1 << ts->bin_e;
+	*i1 = 0 + (int)((double)len * ts->crop * 0.5);
+	*i2 = (len-1) - (int)((double)len * ts->crop * 0.5);
 }
 
-void downsample_iq(int16_t *data, int length)
+static int bin_bw2(struct tuning_state *ts)
+/* half the width of the cropped span */
 {
-	fifth_order(data, length);
-	//remove_dc(data, length);
-	fifth_order(data+1, length-1);
-	//remove_dc(data+1, length-1);
+	int len, bin_count;
+	len = 1 << ts->bin_e;
+	bin_count = (int)((double)len * (1.0 - ts->crop));
+	return (int)(((double)ts->rate * (double)bin_count) / (len * 2 * ts->downsample));
 }
 
-long real_conj(int16_t real, int16_t imag)
-/* real(n * conj(n)) */
+static double bin_step(struct tuning_state *ts)
 {
-	return ((long)real*(long)real + (long)imag*(long)imag);
+	return (double)ts->rate / (double)((1 << ts->bin_e) * ts->downsample);
 }
 
-void scanner(void)
+static double bin_freq(struct tuning_state *ts, int k)
+/* center of logged bin k */
 {
-	int i, j, j2, f, n_read, offset, bin_e, bin_len, buf_len, ds, ds_p;
-	int32_t w;
+	int len = 1 << ts->bin_e;
+	return (double)ts->freq + (double)(crop_first + k - len/2) * bin_step(ts);
+}
+
+static int bin_index(struct tuning_state *ts, double f)
+/* the first logged bin centered at or above f */
+{
+	int len = 1 << ts->bin_e;
+	double k = ceil((f - (double)ts->freq) / bin_step(ts)) + len/2 - crop_first;
+	if (k < 0) {
+		return 0;}
+	if (k > crop_bins) {
+		return crop_bins;}
+	return (int)k;
+}
+
+void bin_plan(void)
+/* after frequency_range(), every tune shares the fft size and crop.
+ * where hops overlap a bin belongs to the hop whose center is nearer,
+ * the boundary is halfway between the two centers */
+{
+	int i, j, k, i2, len;
 	struct tuning_state *ts;
-	bin_e = tunes[0].bin_e;
-	bin_len = 1 << bin_e;
-	buf_len = tunes[0].buf_len;
+	len = 1 << tunes[0].bin_e;
+	bin_span(&tunes[0], &crop_first, &i2);
+	crop_bins = i2 - crop_first + 1;
+	free(bin_map);
+	bin_map = malloc(crop_bins * sizeof(int));
+	for (k=0; k<crop_bins; k++) {
+		/* FFT is translated by 180 degrees */
+		j = (crop_first + k + len/2) % len;
+		/* nuke DC component (not effective for all windows) */
+		if (j == 0 && len > 1) {
+			j = 1;}
+		bin_map[k] = j;
+	}
 	for (i=0; i<tune_count; i++) {
-		if (do_exit >= 2)
-			{return;}
 		ts = &tunes[i];
-		f = (int)rtlsdr_get_center_freq(dev);
-		if (f != ts->freq) {
-			retune(dev, ts->freq);}
-		rtlsdr_read_sync(dev, ts->buf8, buf_len, &n_read);
-		if (n_read != buf_len) {
-			fprintf(stderr, "Error: dropped samples.\n");}
-		/* rms */
-		if (bin_len == 1) {
-			rms_power(ts);
+		ts->level = calloc(crop_bins, sizeof(double));
+		if (!ts->level) {
+			fprintf(stderr, "Error: malloc.\n");
+			exit(1);
+		}
+		ts->fresh = 0;
+		ts->rows = 0;
+		ts->own_lo = 0;
+		ts->own_hi = crop_bins;
+		if (i > 0) {
+			ts->own_lo = bin_index(ts, ((double)tunes[i-1].freq + ts->freq) / 2.0);}
+		if (i < tune_count - 1) {
+			ts->own_hi = bin_index(ts, ((double)ts->freq + tunes[i+1].freq) / 2.0);}
+	}
+}
+
+static void reset_bins(struct tuning_state *ts)
+{
+	int i;
+	for (i=0; i<(1 << ts->bin_e); i++) {
+		ts->avg[i] = 0L;
+	}
+	ts->samples = 0;
+}
+
+void integrate(struct tuning_state *ts, uint64_t now)
+/* moves what the workers summed into level and starts the next block.
+ * with -s iir the blocks are folded into an exponential average, weighed
+ * by how long this hop has been integrating */
+{
+	int k;
+	double v, alpha = 1.0;
+	if (smoothing && ts->rows) {
+		alpha = 1.0 - exp(-(double)(now - ts->flushed_ns) / 1e9 / smooth_tau);}
+	for (k=0; k<crop_bins; k++) {
+		// something seems off with the dbm math
+		v  = (double)ts->avg[bin_map[k]];
+		v /= (double)ts->rate;
+		v /= (double)ts->samples;
+		if (alpha < 1.0) {
+			v = ts->level[k] + alpha * (v - ts->level[k]);}
+		ts->level[k] = v;
+	}
+	ts->level_samples = ts->samples;
+	ts->fresh = 1;
+	ts->rows++;
+	ts->flushed_ns = now;
+	reset_bins(ts);
+}
+
+static double power_dbm(struct tuning_state *ts, int k)
+{
+	return 10 * log10(ts->level[k]);
+}
+
+void csv_dbm(struct tuning_state *ts)
+{
+	int k, bw2;
+	/* Hz low, Hz high, Hz step, samples, dbm, dbm, ... */
+	bw2 = bin_bw2(ts);
+	fprintf(file, "%i, %i, %.2f, %i, ", ts->freq - bw2, ts->freq + bw2,
+		bin_step(ts), ts->level_samples);
+	for (k=0; k<crop_bins; k++) {
+		fprintf(file, "%.2f, ", power_dbm(ts, k));
+	}
+	fprintf(file, "%.2f\n", power_dbm(ts, crop_bins-1));
+}
+
+void sweep_dbm(char *t_str)
+/* one row per run of neighbouring hops written together, each hop giving
+ * only the bins it owns so none is logged twice.  the hops step by a
+ * whole number of Hz, so bins can sit a fraction of a step off the row's
+ * grid past a hop boundary */
+{
+	int i, j, k, n, samples;
+	double step;
+	struct tuning_state *ts;
+	for (i=0; i<tune_count; i=j) {
+		for (j=i; j<tune_count && tunes[j].fresh; j++) {;}
+		if (j == i) {
+			j++;
 			continue;
 		}
-		/* prep for fft */
-		for (j=0; j<buf_len; j++) {
-			fft_buf[j] = (int16_t)ts->buf8[j] - 127;
+		n = 0;
+		samples = tunes[i].level_samples;
+		for (k=i; k<j; k++) {
+			n += tunes[k].own_hi - tunes[k].own_lo;
+			if (tunes[k].level_samples < samples) {
+				samples = tunes[k].level_samples;}
 		}
-		ds = ts->downsample;
-		ds_p = ts->downsample_passes;
-		if (boxcar && ds > 1) {
-			j=2, j2=0;
-			while (j < buf_len) {
-				fft_buf[j2]   += fft_buf[j];
-				fft_buf[j2+1] += fft_buf[j+1];
-				fft_buf[j] = 0;
-				fft_buf[j+1] = 0;
-				j += 2;
-				if (j % (ds*2) == 0) {
-					j2 += 2;}
-			}
-		} else if (ds_p) {  /* recursive */
-			for (j=0; j < ds_p; j++) {
-				downsample_iq(fft_buf, buf_len >> j);
-			}
-			/* droop compensation */
-			if (comp_fir_size == 9 && ds_p <= CIC_TABLE_MAX) {
-				generic_fir(fft_buf, buf_len >> j, cic_9_tables[ds_p]);
-				generic_fir(fft_buf+1, (buf_len >> j)-1, cic_9_tables[ds_p]);
-			}
+		if (!n) {
+			continue;}
+		/* time, Hz low, Hz high, Hz step, samples, dbm, dbm, ... */
+		step = bin_step(&tunes[i]);
+		fprintf(file, "%s, %i, %i, %.2f, %i", t_str,
+			(int)round(bin_freq(&tunes[i], tunes[i].own_lo) - step / 2),
+			(int)round(bin_freq(&tunes[j-1], tunes[j-1].own_hi - 1) + step / 2),
+			step, samples);
+		for (; i<j; i++) {
+			ts = &tunes[i];
+			for (k=ts->own_lo; k<ts->own_hi; k++) {
+				fprintf(file, ", %.2f", power_dbm(ts, k));}
 		}
-		remove_dc(fft_buf, buf_len / ds);
-		remove_dc(fft_buf+1, (buf_len / ds) - 1);
-		/* window function and fft */
-		for (offset=0; offset<(buf_len/ds); offset+=(2*bin_len)) {
-			// todo, let rect skip this
-			for (j=0; j<bin_len; j++) {
-				w =  (int32_t)fft_buf[offset+j*2];
-				w *= (int32_t)(window_coefs[j]);
-				//w /= (int32_t)(ds);
-				fft_buf[offset+j*2]   = (int16_t)w;
-				w =  (int32_t)fft_buf[offset+j*2+1];
-				w *= (int32_t)(window_coefs[j]);
-				//w /= (int32_t)(ds);
-				fft_buf[offset+j*2+1] = (int16_t)w;
-			}
-			fix_fft(fft_buf+offset, bin_e);
-			if (!peak_hold) {
-				for (j=0; j<bin_len; j++) {
-					ts->avg[j] += real_conj(fft_buf[offset+j*2], fft_buf[offset+j*2+1]);
-				}
-			} else {
-				for (j=0; j<bin_len; j++) {
-					ts->avg[j] = MAX(real_conj(fft_buf[offset+j*2], fft_buf[offset+j*2+1]), ts->avg[j]);
-				}
-			}
-			ts->samples += ds;
+		fprintf(file, "\n");
+	}
+}
+
+/* binary output, a header with the frequency plan followed by fixed size
+ * records, one per integration.  everything is in host byte order.
+ * <filename>.idx gets a (time, offset) pair per record so a viewer can
+ * seek without reading the whole file */
+
+#define OUT_CSV			0
+#define OUT_F32			1
+#define OUT_I16			2
+#define OUT_SWEEP		3
+
+#define BINARY_MAGIC		"RTLPOWER"
+#define BINARY_VERSION		1
+
+struct binary_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_len;   /* this header and the tune table */
+	uint32_t record_len;
+	uint32_t format;       /* OUT_F32 dB, or OUT_I16 hundredths of a dB */
+	uint32_t tune_count;
+	uint32_t bins;         /* per tune, after cropping */
+	uint32_t fft_len;
+	uint32_t interval;     /* seconds */
+	uint32_t peak_hold;
+	uint32_t smoothing;    /* 0 block average, 1 exponential */
+	double crop;
+	char window[32];
+};
+
+struct binary_tune
+{
+	double hz_step;
+	uint32_t hz_low;
+	uint32_t hz_high;
+};
+
+/* record: int64 unix time, uint32 samples[tune_count], padding to 8,
+ * then tune_count rows of bins, padding to 8 */
+
+struct binary_output
+{
+	int format;
+	struct binary_header header;
+	struct binary_tune *tunes;
+	FILE *index;
+	uint64_t offset;
+	uint8_t *record;
+	int rows_at;
+};
+
+struct binary_output binary;
+
+#define PAD8(n) (((n) + 7) & ~7)
+
+static void binary_plan(int format, char *window, int interval)
+{
+	struct binary_header *h = &binary.header;
+	struct tuning_state *ts;
+	int i, bw2, elem;
+	memset(h, 0, sizeof(struct binary_header));
+	memcpy(h->magic, BINARY_MAGIC, 8);
+	h->version = BINARY_VERSION;
+	h->format = (uint32_t)format;
+	h->tune_count = (uint32_t)tune_count;
+	h->bins = (uint32_t)crop_bins;
+	h->fft_len = 1 << tunes[0].bin_e;
+	h->interval = (uint32_t)interval;
+	h->peak_hold = (uint32_t)peak_hold;
+	h->smoothing = (uint32_t)smoothing;
+	h->crop = tunes[0].crop;
+	strncpy(h->window, window, sizeof(h->window) - 1);
+	binary.tunes = calloc(tune_count, sizeof(struct binary_tune));
+	for (i=0; i<tune_count; i++) {
+		ts = &tunes[i];
+		bw2 = bin_bw2(ts);
+		binary.tunes[i].hz_step = bin_step(ts);
+		binary.tunes[i].hz_low = (uint32_t)(ts->freq - bw2);
+		binary.tunes[i].hz_high = (uint32_t)(ts->freq + bw2);
+	}
+	h->header_len = sizeof(struct binary_header) + tune_count * sizeof(struct binary_tune);
+	elem = format == OUT_F32 ? sizeof(float) : sizeof(int16_t);
+	binary.rows_at = PAD8(8 + 4 * tune_count);
+	h->record_len = PAD8(binary.rows_at + tune_count * h->bins * elem);
+	binary.record = calloc(1, h->record_len);
+	binary.format = format;
+}
+
+static int binary_matches(FILE *f)
+/* an existing file can only be appended to with the same plan */
+{
+	struct binary_header *h = &binary.header;
+	uint8_t *old;
+	int r = 0;
+	old = malloc(h->header_len);
+	if (fread(old, 1, h->header_len, f) == h->header_len &&
+	    !memcmp(old, h, sizeof(struct binary_header)) &&
+	    !memcmp(old + sizeof(struct binary_header), binary.tunes,
+		    tune_count * sizeof(struct binary_tune))) {
+		r = 1;}
+	free(old);
+	return r;
+}
+
+FILE *binary_open(char *filename, int format, char *window, int interval)
+{
+	FILE *f;
+	char *index_name;
+	long size = 0;
+	int fresh = 0;
+	binary_plan(format, window, interval);
+	if (strcmp(filename, "-") == 0) {
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		fwrite(&binary.header, sizeof(struct binary_header), 1, stdout);
+		fwrite(binary.tunes, sizeof(struct binary_tune), tune_count, stdout);
+		return stdout;
+	}
+	f = fopen(filename, "rb");
+	if (f) {
+		fseek(f, 0, SEEK_END);
+		size = ftell(f);
+		rewind(f);
+		if (size && !binary_matches(f)) {
+			fprintf(stderr, "%s holds a different scan, not appending.\n", filename);
+			exit(1);
 		}
+		fclose(f);
+		if (size && (size - binary.header.header_len) % binary.header.record_len) {
+			fprintf(stderr, "%s ends with a partial record, not appending.\n", filename);
+			exit(1);
+		}
+	}
+	f = fopen(filename, "ab");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s\n", filename);
+		exit(1);
+	}
+	if (!size) {
+		fwrite(&binary.header, sizeof(struct binary_header), 1, f);
+		fwrite(binary.tunes, sizeof(struct binary_tune), tune_count, f);
+		size = binary.header.header_len;
+		fresh = 1;
 	}
+	binary.offset = (uint64_t)size;
+	index_name = malloc(strlen(filename) + 5);
+	sprintf(index_name, "%s.idx", filename);
+	/* a fresh recording must not inherit the entries of an old one */
+	binary.index = fopen(index_name, fresh ? "wb" : "ab");
+	if (!binary.index) {
+		fprintf(stderr, "Failed to open %s\n", index_name);
+		exit(1);
+	}
+	free(index_name);
+	return f;
 }
 
-void csv_dbm(struct tuning_state *ts)
+void binary_close(void)
 {
-	int i, len, ds, i1, i2, bw2, bin_count;
-	long tmp;
+	if (binary.index) {
+		fclose(binary.index);}
+	free(binary.record);
+	free(binary.tunes);
+}
+
+void binary_dbm(time_t time_now)
+/* every tune goes in the record, the ones not integrated since the last
+ * one with 0 samples and no level */
+{
+	struct binary_header *h = &binary.header;
+	struct tuning_state *ts;
+	int64_t t = (int64_t)time_now;
+	uint32_t samples;
+	float *f32;
+	int16_t *i16;
 	double dbm;
-	len = 1 << ts->bin_e;
-	ds = ts->downsample;
-	/* fix FFT stuff quirks */
-	if (ts->bin_e > 0) {
-		/* nuke DC component (not effective for all windows) */
-		ts->avg[0] = ts->avg[1];
-		/* FFT is translated by 180 degrees */
-		for (i=0; i<len/2; i++) {
-			tmp = ts->avg[i];
-			ts->avg[i] = ts->avg[i+len/2];
-			ts->avg[i+len/2] = tmp;
+	int i, k;
+	memcpy(binary.record, &t, 8);
+	for (i=0; i<tune_count; i++) {
+		ts = &tunes[i];
+		samples = ts->fresh ? (uint32_t)ts->level_samples : 0;
+		memcpy(binary.record + 8 + 4*i, &samples, 4);
+		f32 = (float *)(binary.record + binary.rows_at) + i * h->bins;
+		i16 = (int16_t *)(binary.record + binary.rows_at) + i * h->bins;
+		for (k=0; k<crop_bins; k++) {
+			dbm = ts->fresh ? power_dbm(ts, k) : NAN;
+			if (binary.format == OUT_F32) {
+				f32[k] = (float)dbm;
+				continue;
+			}
+			/* -inf and nan end up at the bottom of the scale */
+			if (!(dbm >= -327.67)) {
+				dbm = -327.68;}
+			if (dbm > 327.67) {
+				dbm = 327.67;}
+			i16[k] = (int16_t)lrint(dbm * 100.0);
 		}
 	}
-	/* Hz low, Hz high, Hz step, samples, dbm, dbm, ... */
-	bin_count = (int)((double)len * (1.0 - ts->crop));
-	bw2 = (int)(((double)ts->rate * (double)bin_count) / (len * 2 * ds));
-	fprintf(file, "%i, %i, %.2f, %i, ", ts->freq - bw2, ts->freq + bw2,
-		(double)ts->rate / (double)(len*ds), ts->samples);
-	// something seems off with the dbm math
-	i1 = 0 + (int)((double)len * ts->crop * 0.5);
-	i2 = (len-1) - (int)((double)len * ts->crop * 0.5);
-	for (i=i1; i<=i2; i++) {
-		dbm  = (double)ts->avg[i];
-		dbm /= (double)ts->rate;
-		dbm /= (double)ts->samples;
-		dbm  = 10 * log10(dbm);
-		fprintf(file, "%.2f, ", dbm);
-	}
-	dbm = (double)ts->avg[i2] / ((double)ts->rate * (double)ts->samples);
-	if (ts->bin_e == 0) {
-		dbm = ((double)ts->avg[0] / \
-		((double)ts->rate * (double)ts->samples));}
-	dbm  = 10 * log10(dbm);
-	fprintf(file, "%.2f\n", dbm);
-	for (i=0; i<len; i++) {
-		ts->avg[i] = 0L;
+	fwrite(binary.record, h->record_len, 1, file);
+	if (binary.index) {
+		/* the record is out before the entry that points at it */
+		fflush(file);
+		fwrite(&t, 8, 1, binary.index);
+		fwrite(&binary.offset, 8, 1, binary.index);
+		fflush(binary.index);
 	}
-	ts->samples = 0;
+	binary.offset += h->record_len;
+}
+
+#define OUT_BINARY(f)	((f) == OUT_F32 || (f) == OUT_I16)
+
+void write_rows(time_t time_now, int out_format)
+/* integrates every hop read since the last rows and writes them */
+{
+	char t_str[50];
+	struct tm *cal_time;
+	uint64_t now;
+	int i;
+	workers_drain();
+	now = monotonic_ns();
+	for (i=0; i<tune_count; i++) {
+		if (tunes[i].samples) {
+			integrate(&tunes[i], now);}
+	}
+	cal_time = localtime(&time_now);
+	strftime(t_str, 50, "%Y-%m-%d, %H:%M:%S", cal_time);
+	if (OUT_BINARY(out_format)) {
+		binary_dbm(time_now);
+	} else if (out_format == OUT_SWEEP) {
+		sweep_dbm(t_str);
+	} else {
+		// time, Hz low, Hz high, Hz step, samples, dbm, dbm, ...
+		for (i=0; i<tune_count; i++) {
+			if (!tunes[i].fresh) {
+				continue;}
+			fprintf(file, "%s, ", t_str);
+			csv_dbm(&tunes[i]);
+		}
+	}
+	fflush(file);
+	for (i=0; i<tune_count; i++) {
+		tunes[i].fresh = 0;}
 }
 
 int main(int argc, char **argv)
@@ -776,23 +1230,25 @@ int main(int argc, char **argv)
 	int dev_given = 0;
 	int ppm_error = 0;
 	int interval = 10;
-	int fft_threads = 1;
-	int smoothing = 0;
 	int single = 0;
 	int direct_sampling = 0;
 	int offset_tuning = 0;
 	int enable_biastee = 0;
+	int async_mode = 0;
+	char *stats_spec = NULL;
 	double crop = 0.0;
+	uint32_t *hops;
 	char *freq_optarg;
 	time_t next_tick;
 	time_t time_now;
 	time_t exit_time = 0;
-	char t_str[50];
-	struct tm *cal_time;
-	double (*window_fn)(int, int) = rectangle;
+	time_t sweep_start, sweep_secs = 0;
+	double *window;
+	char *window_name = "rectangle";
+	int out_format = OUT_CSV;
 	freq_optarg = "";
 
-	while ((opt = getopt(argc, argv, "f:i:s:t:d:g:p:e:w:c:F:1PDOhT")) != -1) {
+	while ((opt = getopt(argc, argv, "f:i:s:t:d:g:p:e:w:c:A:F:o:X:Y:1PDOahT")) != -1) {
 		switch (opt) {
 		case 'f': // lower:upper:bin_size
 			freq_optarg = strdup(optarg);
@@ -817,26 +1273,19 @@ int main(int argc, char **argv)
 		case 's':
 			if (strcmp("avg",  optarg) == 0) {
 				smoothing = 0;}
-			if (strcmp("iir",  optarg) == 0) {
-				smoothing = 1;}
+			else if (strncmp("iir",  optarg, 3) == 0 &&
+				 (optarg[3] == '\0' || optarg[3] == ',')) {
+				smoothing = 1;
+				if (optarg[3] == ',') {
+					smooth_tau = atoft(optarg + 4);}
+			} else {
+				fprintf(stderr, "Unknown smoothing: %s\n", optarg);
+				exit(1);
+			}
 			break;
 		case 'w':
-			if (strcmp("rectangle",  optarg) == 0) {
-				window_fn = rectangle;}
-			if (strcmp("hamming",  optarg) == 0) {
-				window_fn = hamming;}
-			if (strcmp("blackman",  optarg) == 0) {
-				window_fn = blackman;}
-			if (strcmp("blackman-harris",  optarg) == 0) {
-				window_fn = blackman_harris;}
-			if (strcmp("hann-poisson",  optarg) == 0) {
-				window_fn = hann_poisson;}
-			if (strcmp("youssef",  optarg) == 0) {
-				window_fn = youssef;}
-			if (strcmp("kaiser",  optarg) == 0) {
-				window_fn = kaiser;}
-			if (strcmp("bartlett",  optarg) == 0) {
-				window_fn = bartlett;}
+			if (rtlsdr_dsp_window(optarg, NULL, 0) == 0) {
+				window_name = optarg;}
 			break;
 		case 't':
 			fft_threads = atoi(optarg);
@@ -856,10 +1305,41 @@ int main(int argc, char **argv)
 		case 'O':
 			offset_tuning = 1;
 			break;
+		case 'a':
+			async_mode = 1;
+			break;
+		case 'X':
+			stats_spec = optarg;
+			break;
+		case 'Y':
+			if (rt_parse(optarg, rt_stages) < 0) {
+				exit(1);}
+			break;
+		case 'A':
+			fft_backend = optarg;
+			if (rtlsdr_dsp_fft_backend(optarg) < 0) {
+				fprintf(stderr, "Unknown FFT backend: %s\n", optarg);
+				exit(1);
+			}
+			break;
 		case 'F':
 			boxcar = 0;
 			comp_fir_size = atoi(optarg);
 			break;
+		case 'o':
+			if (strcmp("csv",  optarg) == 0) {
+				out_format = OUT_CSV;}
+			else if (strcmp("f32",  optarg) == 0) {
+				out_format = OUT_F32;}
+			else if (strcmp("i16",  optarg) == 0) {
+				out_format = OUT_I16;}
+			else if (strcmp("sweep",  optarg) == 0) {
+				out_format = OUT_SWEEP;}
+			else {
+				fprintf(stderr, "Unknown output format: %s\n", optarg);
+				exit(1);
+			}
+			break;
 		case 'T':
 			enable_biastee = 1;
 			break;
@@ -885,6 +1365,8 @@ int main(int argc, char **argv)
 	if (tune_count == 0) {
 		usage();}
 
+	bin_plan();
+
 	if (argc <= optind) {
 		filename = "-";
 	} else {
@@ -896,6 +1378,12 @@ int main(int argc, char **argv)
 
 	fprintf(stderr, "Reporting every %i seconds\n", interval);
 
+	if (smoothing) {
+		if (smooth_tau <= 0.0) {
+			smooth_tau = 10.0 * interval;}
+		fprintf(stderr, "Exponential average over %.0f seconds\n", smooth_tau);
+	}
+
 	if (!dev_given) {
 		dev_index = verbose_device_search("0");
 	}
@@ -904,6 +1392,7 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	verbose_rt_lock();
 	r = rtlsdr_open(&dev, (uint32_t)dev_index);
 	if (r < 0) {
 		fprintf(stderr, "Failed to open rtlsdr device #%d.\n", dev_index);
@@ -943,7 +1432,9 @@ int main(int argc, char **argv)
 	if (enable_biastee)
 		fprintf(stderr, "activated bias-T on GPIO PIN 0\n");
 
-	if (strcmp(filename, "-") == 0) { /* Write log to stdout */
+	if (OUT_BINARY(out_format)) {
+		file = binary_open(filename, out_format, window_name, interval);
+	} else if (strcmp(filename, "-") == 0) { /* Write log to stdout */
 		file = stdout;
 #ifdef _WIN32
 		// Is this necessary?  Output is ascii.
@@ -962,35 +1453,72 @@ int main(int argc, char **argv)
 
 	/* actually do stuff */
 	rtlsdr_set_sample_rate(dev, (uint32_t)tunes[0].rate);
-	sine_table(tunes[0].bin_e);
+	hops = malloc(tune_count * sizeof(uint32_t));
+	for (i=0; i<tune_count; i++) {
+		hops[i] = (uint32_t)tunes[i].freq;}
+	verbose_fast_hop(dev, hops, tune_count);
+	free(hops);
 	next_tick = time(NULL) + interval;
 	if (exit_time) {
 		exit_time = time(NULL) + exit_time;}
-	fft_buf = malloc(tunes[0].buf_len * sizeof(int16_t));
 	length = 1 << tunes[0].bin_e;
 	window_coefs = malloc(length * sizeof(int));
+	window = malloc(length * sizeof(double));
+	rtlsdr_dsp_window(window_name, window, length);
 	for (i=0; i<length; i++) {
-		window_coefs[i] = (int)(256*window_fn(i, length));
+		window_coefs[i] = (int)(256*window[i]);
+	}
+	free(window);
+	workers_init();
+	fprintf(stderr, "FFT threads: %i (%s)\n", fft_threads, fft_backend);
+	if (stats_spec) {
+		stats_register(&stat_sweeps);
+		stats_register(&stat_hops);
+		stats_register(&stat_retune);
+		stats_register(&stat_fft);
+		stats_register(&stat_short);
+		stats_register(&stat_restarts);
+		stats_device(dev);
+		if (stats_start(stats_spec) < 0) {
+			fprintf(stderr, "Failed to start the stats, continuing without\n");}
 	}
-	while (!do_exit) {
-		scanner();
+	/* the sync scan reads in this thread, async_init() starts its own */
+	if (async_mode) {
+		async_init();
+	} else {
+		verbose_rt_thread("usb", 0);}
+	/* a cancelled scan still finishes its pass */
+	sweep_start = time(NULL);
+	i = 0;
+	while (!do_exit || i) {
+		if (async_mode) {
+			r = async_scanner(&tunes[i]);
+		} else {
+			r = scanner(&tunes[i]);}
+		if (r < 0) {
+			r = 0;
+			break;
+		}
 		time_now = time(NULL);
+		if (++i == tune_count) {
+			i = 0;
+			stats_add(&stat_sweeps, 1);
+			sweep_secs = time_now - sweep_start;
+			sweep_start = time_now;
+		}
 		if (time_now < next_tick) {
 			continue;}
-		// time, Hz low, Hz high, Hz step, samples, dbm, dbm, ...
-		cal_time = localtime(&time_now);
-		strftime(t_str, 50, "%Y-%m-%d, %H:%M:%S", cal_time);
-		for (i=0; i<tune_count; i++) {
-			fprintf(file, "%s, ", t_str);
-			csv_dbm(&tunes[i]);
-		}
-		fflush(file);
+		/* rows wait for the end of the pass, unless passes take longer
+		 * than the interval.  then the hops done are written in time */
+		if (i && (single || MAX(sweep_secs, time_now - sweep_start) < interval)) {
+			continue;}
+		write_rows(time_now, out_format);
 		while (time(NULL) >= next_tick) {
 			next_tick += interval;}
-		if (single) {
-			do_exit = 1;}
-		if (exit_time && time(NULL) >= exit_time) {
-			do_exit = 1;}
+		if (single || (exit_time && time(NULL) >= exit_time)) {
+			do_exit = 1;
+			break;
+		}
 	}
 
 	/* clean up */
@@ -1002,9 +1530,14 @@ int main(int argc, char **argv)
 
 	if (file != stdout) {
 		fclose(file);}
+	if (OUT_BINARY(out_format)) {
+		binary_close();}
 
+	if (async_mode) {
+		async_cleanup();}
+	workers_cleanup();
+	stats_stop();
 	rtlsdr_close(dev);
-	free(fft_buf);
 	free(window_coefs);
 	//for (i=0; i<tune_count; i++) {
 	//	free(tunes[i].avg);
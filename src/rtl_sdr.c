@@ -23,14 +23,32 @@
 #include <stdlib.h>
 #include <math.h>
 #include <pthread.h>
+#include <time.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #ifndef _WIN32
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #else
 #include <windows.h>
 #include <io.h>
 #include <fcntl.h>
 #include "getopt/getopt.h"
+#define STDOUT_FILENO 1
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#ifndef O_DIRECT
+#define O_DIRECT 0
 #endif
 
 #include "rtl-sdr.h"
@@ -40,33 +58,93 @@
 #define DEFAULT_BUF_LENGTH		(16 * 16384)
 #define MINIMAL_BUF_LENGTH		512
 #define MAXIMAL_BUF_LENGTH		(256 * 16384)
+#define DEFAULT_RING_BUFFERS		64
+#define WRITE_BATCH			16
+#define WRITE_ALIGN			4096
 
 #define DBFS_MIN (-480)
 
-// Look Up Table in 10*dBFS
-static int dbfs_lut[256][256];
-
-static void dbfs_lut_init(void){
-	int i, q;
-	for(i = 0 ; i < 256 ; i++){
-		int centered_i = i - 158;
-		int centered_i_squared = centered_i * centered_i;
-		for(q = 0 ; q < 256 ; q++){
-			int centered_q = q - 128;
-			int mag = centered_i_squared + (centered_q * centered_q);
-			int dbfs = DBFS_MIN; // if mag is 0
-			if(mag > 0){
-				dbfs = 100 * logf((float)mag / 16384.0); // 0dBFS => <||I||=128, ||Q||=0> or <||I||=0, ||Q||=128> ; ||I|| & ||Q|| = 128 => 3dBFS
-			}
-			dbfs_lut[i][q] = dbfs;
+/* the I channel of these dongles sits off center */
+#define I_CENTER 158
+#define Q_CENTER 128
+
+static int mag_to_dbfs(int mag){
+	if(mag <= 0){
+		return DBFS_MIN;
+	}
+	// 0dBFS => <||I||=128, ||Q||=0> or <||I||=0, ||Q||=128> ; ||I|| & ||Q|| = 128 => 3dBFS
+	return (int)(100 * logf((float)mag / 16384.0f));
+}
+
+/* largest (i-158)^2 + (q-128)^2 over n I/Q pairs */
+static int block_peak(const unsigned char *p, int n){
+	int k, i, q, mag, peak = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i center = _mm_set_epi16(Q_CENTER, I_CENTER, Q_CENTER, I_CENTER,
+		Q_CENTER, I_CENTER, Q_CENTER, I_CENTER);
+	__m128i vpeak = zero;
+	int lanes[4];
+	for(k = 0 ; k + 8 <= n ; k += 8, p += 16){
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		__m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(v, zero), center);
+		__m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(v, zero), center);
+		/* madd squares and sums each i,q pair into one 32 bit lane */
+		__m128i mlo = _mm_madd_epi16(lo, lo);
+		__m128i mhi = _mm_madd_epi16(hi, hi);
+		__m128i gt = _mm_cmpgt_epi32(mlo, vpeak);
+		vpeak = _mm_or_si128(_mm_and_si128(gt, mlo), _mm_andnot_si128(gt, vpeak));
+		gt = _mm_cmpgt_epi32(mhi, vpeak);
+		vpeak = _mm_or_si128(_mm_and_si128(gt, mhi), _mm_andnot_si128(gt, vpeak));
+	}
+	_mm_storeu_si128((__m128i *)lanes, vpeak);
+	for(i = 0 ; i < 4 ; i++){
+		if(lanes[i] > peak){
+			peak = lanes[i];
 		}
 	}
+#elif defined(__ARM_NEON)
+	const uint8x8_t ci = vdup_n_u8(I_CENTER);
+	const uint8x8_t cq = vdup_n_u8(Q_CENTER);
+	int32x4_t vpeak = vdupq_n_s32(0);
+	int lanes[4];
+	for(k = 0 ; k + 8 <= n ; k += 8, p += 16){
+		uint8x8x2_t v = vld2_u8(p);
+		int16x8_t di = vreinterpretq_s16_u16(vsubl_u8(v.val[0], ci));
+		int16x8_t dq = vreinterpretq_s16_u16(vsubl_u8(v.val[1], cq));
+		int32x4_t mlo = vmull_s16(vget_low_s16(di), vget_low_s16(di));
+		int32x4_t mhi = vmull_s16(vget_high_s16(di), vget_high_s16(di));
+		mlo = vmlal_s16(mlo, vget_low_s16(dq), vget_low_s16(dq));
+		mhi = vmlal_s16(mhi, vget_high_s16(dq), vget_high_s16(dq));
+		vpeak = vmaxq_s32(vpeak, vmaxq_s32(mlo, mhi));
+	}
+	vst1q_s32(lanes, vpeak);
+	for(i = 0 ; i < 4 ; i++){
+		if(lanes[i] > peak){
+			peak = lanes[i];
+		}
+	}
+#else
+	k = 0;
+#endif
+	for( ; k < n ; k++){
+		i = *p++ - I_CENTER;
+		q = *p++ - Q_CENTER;
+		mag = i * i + q * q;
+		if(mag > peak){
+			peak = mag;
+		}
+	}
+	return peak;
 }
 
 static int do_exit = 0;
 static uint64_t bytes_to_read = 0;
 static rtlsdr_dev_t *dev = NULL;
 
+/* the threads -Y can place */
+static const char *rt_stages[] = {"usb", "writer", NULL};
+
 void usage(void)
 {
 	fprintf(stderr,
@@ -78,8 +156,21 @@ void usage(void)
 		"\t[-p ppm_error (default: 0)]\n"
 		"\t[-b output_block_size (default: 16 * 16384)]\n"
 		"\t[-n number of samples to read (default: 0, infinite)]\n"
+		"\t[-B buffers queued between usb and disk (default: 64)]\n"
+		"\t[-r rotate the output file every size bytes (files get a .0000 suffix)]\n"
+		"\t[-R rotate the output file every time of samples (e.g. 30s, 10m, 1h)]\n"
+		"\t[-O write with O_DIRECT, bypassing the page cache (Linux only)]\n"
+		"\t[-o output format: raw, sigmf (default: raw)]\n"
+		"\t (sigmf writes filename.sigmf-data, a .sigmf-meta with the gain\n"
+		"\t  changes and lost samples, and a .sigmf-idx of power per chunk)\n"
+		"\t[-q queue depth between usb and the callback (default: 0, off)]\n"
+		"\t[-L latency_ms, size the usb transfers to hold at most this (default: off)]\n"
+		"\t (-b then only caps their size)\n"
 		"\t[-S force sync output (default: async)]\n"
 		"\t[-D enable direct sampling (default: off)]\n"
+		"\t[-Y scheduling (default: off)]\n"
+		"\t    stage=[cpu[-cpu]][:fifo_priority],... and lock to mlock\n"
+		"\t    stages: usb, writer\n"
 		"\tfilename (a '-' dumps samples to stdout)\n\n");
 	exit(1);
 }
@@ -112,7 +203,7 @@ static int current_gain = 0; // in tenth of dB
 static uint32_t samp_rate = DEFAULT_SAMPLE_RATE;
 static int max_samples = 0;
 static int sample_index = 0;
-static int max_dbfs = DBFS_MIN;
+static int max_mag = 0;
 #include <sys/eventfd.h>
 int max_event = -1;
 int delta_gain = 0;
@@ -122,6 +213,8 @@ int gain_count = 0;
 int gains[100];
 int gain_index = 1;
 
+static void annotate_gain(int gain);
+
 static void initialize_gains(void){
 	int i;
 	gain_count = rtlsdr_get_tuner_gains(dev, NULL);
@@ -186,6 +279,7 @@ static void *set_new_gain_thread(void *unused){
 				current_gain =  gains[new_gain_index];
 				// fprintf(stderr, "%s: target_dbfs = %d, gain_index:%d=>%d (gains:%d=>%d) ; ", __func__,  target_dbfs, gain_index, new_gain_index, gains[gain_index], gains[new_gain_index]);
 				verbose_gain_set(dev, current_gain);
+				annotate_gain(current_gain);
 				gain_index = new_gain_index;
 			}
 		}
@@ -200,12 +294,656 @@ static void max_thread_init(void){
 }
 
 
-static void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
+/* SigMF output, name.sigmf-data holds the samples as they are, the
+ * metadata in name.sigmf-meta is rewritten as annotations come in, and
+ * name.sigmf-idx is a coarse power index for finding events without
+ * reading the data.  the index is a header followed by one fixed size
+ * entry per IDX_CHUNK samples, the last one may be short, everything in
+ * host byte order so it can be mapped as it is. */
+
+#define IDX_MAGIC		"RTLSDIDX"
+#define IDX_VERSION		1
+#define IDX_CHUNK		65536
+#define IDX_DROP		0x01  /* samples were lost inside this entry */
+#define IDX_GAIN		0x02  /* the gain changed inside this entry */
+#define IDX_AUTO_GAIN		(-32768)  /* the tuner ran its own agc */
+#define META_SECS		10  /* most seconds of samples between rewrites */
+
+struct idx_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_len;
+	uint32_t entry_len;
+	uint32_t chunk;          /* samples per entry */
+	uint32_t sample_rate;
+	uint32_t frequency;
+	uint64_t global_index;   /* of the first sample of this file */
+};
+
+struct idx_entry {
+	uint32_t samples;        /* IDX_CHUNK but for the last one */
+	uint16_t flags;          /* IDX_* */
+	int16_t gain;            /* at the end, tenths of a dB or IDX_AUTO_GAIN */
+	float mean_dbfs;
+	float peak_dbfs;
+};
+
+#define ANN_GAIN		0
+#define ANN_DROP		1
+
+struct annotation {
+	uint64_t sample;         /* over all files, like writer.pushed */
+	int kind;                /* ANN_* */
+	int value;               /* the gain, or samples lost, 0 if unknown */
+};
+
+struct sigmf {
+	int on;
+	uint32_t rate;
+	uint32_t frequency;
+	const char *hw;
+	double start_time;       /* unix time of the first sample */
+	struct annotation *ann;  /* under the writer lock */
+	unsigned int ann_len;
+	unsigned int ann_size;
+	unsigned int ann_idx;    /* the first one the index has not passed */
+	unsigned int ann_meta;   /* ann_len when the metadata was written */
+	uint64_t meta_at;        /* written then */
+	FILE *idx;
+	struct idx_entry entry;  /* being summed */
+	uint64_t energy;
+	int peak;
+	int gain;
+};
+
+/* Writer stage: the usb callback only copies into a ring of transfer
+ * sized buffers, a thread drains it to disk in large batched writes. */
+struct writer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t space;    /* a slot was freed, for readers that wait */
+	unsigned char **bufs;
+	uint32_t *lens;
+	unsigned int count;
+	unsigned int head;       /* next slot to fill, under lock */
+	unsigned int tail;       /* next slot to write, under lock */
+	unsigned int high_water;
+	unsigned int dropped;
+	int done;
+	int fd;
+	int direct;              /* asked for O_DIRECT */
+	int fd_direct;           /* fd currently opened with it */
+	char *filename;          /* without .sigmf-data for sigmf */
+	uint64_t rotate_bytes;   /* 0 for a single file */
+	uint64_t file_bytes;
+	unsigned int file_index;
+	uint64_t pushed;         /* samples into the ring, under lock */
+	uint64_t written;        /* samples out to disk, over all files */
+	uint64_t file_start;     /* written when this file was opened */
+	struct sigmf sigmf;
+};
+
+static struct writer writer;
+
+static unsigned char *aligned_buf(size_t len)
+{
+#ifdef _WIN32
+	return _aligned_malloc(len, WRITE_ALIGN);
+#else
+	void *p = NULL;
+	if (posix_memalign(&p, WRITE_ALIGN, len))
+		return NULL;
+	return p;
+#endif
+}
+
+static void aligned_free(void *p)
+{
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+static void file_name(struct writer *w, char *name, size_t len, const char *ext)
+{
+	if (w->rotate_bytes)
+		snprintf(name, len, "%s.%04u%s", w->filename, w->file_index, ext);
+	else
+		snprintf(name, len, "%s%s", w->filename, ext);
+}
+
+static double wall_time(void)
+{
+#ifndef _WIN32
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+	return (double)time(NULL);
+#endif
+}
+
+/* sum of (i-158)^2 + (q-128)^2 over n I/Q pairs */
+static uint64_t block_energy(const unsigned char *p, int n)
+{
+	uint64_t sum = 0;
+	int k, i, q;
+	for (k = 0; k < n; k++) {
+		i = *p++ - I_CENTER;
+		q = *p++ - Q_CENTER;
+		sum += (uint32_t)(i * i + q * q);
+	}
+	return sum;
+}
+
+static float power_dbfs(double mag)
+{
+	double db = DBFS_MIN / 10.0;
+	if (mag > 0)
+		db = 10 * log10(mag / 16384.0);
+	return (float)(db < DBFS_MIN / 10.0 ? DBFS_MIN / 10.0 : db);
+}
+
+static void annotate_locked(struct writer *w, int kind, int value)
+/* at the next sample into the ring, lost samples add up in one place */
+{
+	struct sigmf *m = &w->sigmf;
+	struct annotation *a;
+	if (!m->on)
+		return;
+	if (kind == ANN_DROP && m->ann_len) {
+		a = &m->ann[m->ann_len - 1];
+		if (a->kind == ANN_DROP && a->sample == w->pushed) {
+			a->value += value;
+			return;
+		}
+	}
+	if (m->ann_len == m->ann_size) {
+		a = realloc(m->ann, (m->ann_size * 2 + 16) * sizeof(struct annotation));
+		if (!a)
+			return;
+		m->ann = a;
+		m->ann_size = m->ann_size * 2 + 16;
+	}
+	a = &m->ann[m->ann_len++];
+	a->sample = w->pushed;
+	a->kind = kind;
+	a->value = value;
+}
+
+static void writer_annotate(struct writer *w, int kind, int value)
+{
+	pthread_mutex_lock(&w->lock);
+	annotate_locked(w, kind, value);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static int sigmf_write_meta(struct writer *w, int last)
+/* the annotations up to what is on disk, all of them for the last time */
+{
+	struct sigmf *m = &w->sigmf;
+	struct annotation *ann;
+	char name[1024], tmp[1040], when[64];
+	unsigned int i, n = 0;
+	double t;
+	time_t secs;
+	FILE *f;
+
+	pthread_mutex_lock(&w->lock);
+	ann = malloc((m->ann_len + 1) * sizeof(struct annotation));
+	for (i = 0; ann && i < m->ann_len; i++) {
+		if (!last && m->ann[i].sample >= w->written)
+			break;
+		ann[n++] = m->ann[i];
+	}
+	m->ann_meta = i;
+	pthread_mutex_unlock(&w->lock);
+	m->meta_at = w->written;
+
+	file_name(w, name, sizeof(name), ".sigmf-meta");
+	snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+	f = fopen(tmp, "w");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s\n", tmp);
+		free(ann);
+		return -1;
+	}
+	fprintf(f, "{\n  \"global\": {\n");
+	fprintf(f, "    \"core:datatype\": \"cu8\",\n");
+	fprintf(f, "    \"core:sample_rate\": %u,\n", m->rate);
+	if (m->hw && *m->hw) {
+		fprintf(f, "    \"core:hw\": ");
+		json_string(f, m->hw);
+		fprintf(f, ",\n");
+	}
+	fprintf(f, "    \"core:recorder\": \"rtl_sdr\",\n");
+	fprintf(f, "    \"core:version\": \"1.0.0\"\n  },\n");
+	fprintf(f, "  \"captures\": [\n    {\n");
+	fprintf(f, "      \"core:sample_start\": 0,\n");
+	fprintf(f, "      \"core:global_index\": %llu,\n", (unsigned long long)w->file_start);
+	if (m->start_time > 0) {
+		t = m->start_time + (double)w->file_start / m->rate;
+		secs = (time_t)t;
+		strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", gmtime(&secs));
+		fprintf(f, "      \"core:datetime\": \"%s.%06dZ\",\n", when,
+			(int)((t - (double)secs) * 1e6));
+	}
+	fprintf(f, "      \"core:frequency\": %u\n    }\n  ],\n", m->frequency);
+	fprintf(f, "  \"annotations\": [");
+	for (i = 0; i < n; i++) {
+		fprintf(f, "%s\n    {\"core:sample_start\": %llu, ", i ? "," : "",
+			(unsigned long long)(ann[i].sample < w->written ?
+			ann[i].sample - w->file_start : w->written - w->file_start));
+		if (ann[i].kind == ANN_GAIN && ann[i].value == IDX_AUTO_GAIN)
+			fprintf(f, "\"core:label\": \"gain\", \"core:comment\": \"tuner agc\"}");
+		else if (ann[i].kind == ANN_GAIN)
+			fprintf(f, "\"core:label\": \"gain\", \"core:comment\": \"tuner gain %.1f dB\"}",
+				ann[i].value / 10.0);
+		else if (ann[i].value)
+			fprintf(f, "\"core:label\": \"drop\", \"core:comment\": \"%i samples lost\"}",
+				ann[i].value);
+		else
+			fprintf(f, "\"core:label\": \"drop\", \"core:comment\": \"samples lost\"}");
+	}
+	fprintf(f, "%s]\n}\n", n ? "\n  " : "");
+	free(ann);
+	if (fclose(f) != 0 || rename(tmp, name) != 0) {
+		fprintf(stderr, "Failed to write %s\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+static int sigmf_open(struct writer *w)
+{
+	struct sigmf *m = &w->sigmf;
+	struct idx_header h;
+	char name[1024];
+
+	file_name(w, name, sizeof(name), ".sigmf-idx");
+	m->idx = fopen(name, "wb");
+	if (!m->idx) {
+		fprintf(stderr, "Failed to open %s\n", name);
+		return -1;
+	}
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, IDX_MAGIC, 8);
+	h.version = IDX_VERSION;
+	h.header_len = sizeof(struct idx_header);
+	h.entry_len = sizeof(struct idx_entry);
+	h.chunk = IDX_CHUNK;
+	h.sample_rate = m->rate;
+	h.frequency = m->frequency;
+	h.global_index = w->file_start;
+	fwrite(&h, sizeof(h), 1, m->idx);
+	memset(&m->entry, 0, sizeof(m->entry));
+	m->energy = 0;
+	m->peak = 0;
+	return sigmf_write_meta(w, 0);
+}
+
+static void sigmf_entry(struct writer *w, uint64_t end)
+/* close the entry that ends at sample end */
+{
+	struct sigmf *m = &w->sigmf;
+	struct annotation *a;
+
+	pthread_mutex_lock(&w->lock);
+	for (; m->ann_idx < m->ann_len && m->ann[m->ann_idx].sample < end; m->ann_idx++) {
+		a = &m->ann[m->ann_idx];
+		if (a->kind == ANN_DROP) {
+			m->entry.flags |= IDX_DROP;
+			continue;
+		}
+		/* the gain set at the start is no change */
+		if (a->sample > 0 && a->value != m->gain)
+			m->entry.flags |= IDX_GAIN;
+		m->gain = a->value;
+	}
+	pthread_mutex_unlock(&w->lock);
+	m->entry.gain = (int16_t)m->gain;
+	m->entry.mean_dbfs = power_dbfs((double)m->energy / m->entry.samples);
+	m->entry.peak_dbfs = power_dbfs(m->peak);
+	fwrite(&m->entry, sizeof(m->entry), 1, m->idx);
+	memset(&m->entry, 0, sizeof(m->entry));
+	m->energy = 0;
+	m->peak = 0;
+}
+
+static void sigmf_feed(struct writer *w, const unsigned char *buf, uint32_t len)
+/* a buffer that went to disk, before written counts it */
+{
+	struct sigmf *m = &w->sigmf;
+	uint64_t at = w->written;
+	int n = (int)(len / 2), chunk, peak;
+	while (n > 0) {
+		chunk = IDX_CHUNK - (int)m->entry.samples;
+		if (chunk > n)
+			chunk = n;
+		m->energy += block_energy(buf, chunk);
+		peak = block_peak(buf, chunk);
+		if (peak > m->peak)
+			m->peak = peak;
+		m->entry.samples += chunk;
+		at += chunk;
+		buf += 2 * chunk;
+		n -= chunk;
+		if (m->entry.samples == IDX_CHUNK)
+			sigmf_entry(w, at);
+	}
+}
+
+static void sigmf_close(struct writer *w, int last)
+{
+	struct sigmf *m = &w->sigmf;
+	unsigned int keep;
+	if (!m->idx)
+		return;
+	if (m->entry.samples)
+		sigmf_entry(w, w->written);
+	fclose(m->idx);
+	m->idx = NULL;
+	sigmf_write_meta(w, last);
+	/* what the index passed is done with, the rest goes to the next file */
+	pthread_mutex_lock(&w->lock);
+	keep = m->ann_len - m->ann_idx;
+	memmove(m->ann, m->ann + m->ann_idx, keep * sizeof(struct annotation));
+	m->ann_len = keep;
+	m->ann_idx = m->ann_meta = 0;
+	pthread_mutex_unlock(&w->lock);
+}
+
+static int writer_open(struct writer *w)
+{
+	char name[1024];
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_BINARY;
+
+	if (strcmp(w->filename, "-") == 0) {
+		w->fd = STDOUT_FILENO;
+		w->fd_direct = 0;
+		return 0;
+	}
+	file_name(w, name, sizeof(name), w->sigmf.on ? ".sigmf-data" : "");
+	w->fd = open(name, flags | (w->direct ? O_DIRECT : 0), 0666);
+	if (w->fd < 0 && w->direct && errno == EINVAL) {
+		fprintf(stderr, "O_DIRECT not supported for %s, using buffered writes\n", name);
+		w->direct = 0;
+		w->fd = open(name, flags, 0666);
+	}
+	if (w->fd < 0) {
+		fprintf(stderr, "Failed to open %s\n", name);
+		return -1;
+	}
+	w->fd_direct = w->direct;
+	w->file_bytes = 0;
+	w->file_start = w->written;
+	if (w->sigmf.on)
+		return sigmf_open(w);
+	return 0;
+}
+
+static void writer_close(struct writer *w)
+{
+	if (w->fd >= 0 && w->fd != STDOUT_FILENO)
+		close(w->fd);
+	w->fd = -1;
+}
+
+static void writer_buffered(struct writer *w)
+/* O_DIRECT only takes block multiples, fall back for the odd tail */
+{
+#ifndef _WIN32
+	int flags = fcntl(w->fd, F_GETFL);
+	if (flags >= 0)
+		fcntl(w->fd, F_SETFL, flags & ~O_DIRECT);
+#endif
+	w->fd_direct = 0;
+}
+
+static int write_all(int fd, unsigned char **bufs, uint32_t *lens, int n)
+{
+#ifdef _WIN32
+	int i, r;
+	uint32_t off;
+	for (i = 0; i < n; i++) {
+		for (off = 0; off < lens[i]; off += r) {
+			r = _write(fd, bufs[i] + off, lens[i] - off);
+			if (r <= 0)
+				return -1;
+		}
+	}
+	return 0;
+#else
+	struct iovec iov[WRITE_BATCH];
+	int i, first = 0;
+	ssize_t r;
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = lens[i];
+	}
+	while (first < n) {
+		r = writev(fd, &iov[first], n - first);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		/* skip what went out, a buffer may be partially written */
+		while (first < n && r > 0) {
+			if ((size_t)r < iov[first].iov_len) {
+				iov[first].iov_base = (char *)iov[first].iov_base + r;
+				iov[first].iov_len -= r;
+				break;
+			}
+			r -= iov[first].iov_len;
+			first++;
+		}
+	}
+	return 0;
+#endif
+}
+
+static void *writer_thread_fn(void *arg)
+{
+	struct writer *w = arg;
+	unsigned char *bufs[WRITE_BATCH];
+	uint32_t lens[WRITE_BATCH];
+	uint64_t batch_bytes;
+	int i, n;
+
+	verbose_rt_thread("writer", 0);
+	while (1) {
+		pthread_mutex_lock(&w->lock);
+		while (w->head == w->tail && !w->done)
+			pthread_cond_wait(&w->ready, &w->lock);
+		if (w->head == w->tail) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		n = (int)(w->head - w->tail);
+		pthread_mutex_unlock(&w->lock);
+
+		/* the filled slots are ours until tail moves past them */
+		if (n > WRITE_BATCH)
+			n = WRITE_BATCH;
+		batch_bytes = 0;
+		for (i = 0; i < n; i++) {
+			bufs[i] = w->bufs[(w->tail + i) % w->count];
+			lens[i] = w->lens[(w->tail + i) % w->count];
+			/* never cross a rotation, the next file starts with the next block */
+			if (i && w->rotate_bytes &&
+			    w->file_bytes + batch_bytes + lens[i] > w->rotate_bytes)
+				break;
+			if (w->fd_direct && lens[i] % WRITE_ALIGN)
+				writer_buffered(w);
+			batch_bytes += lens[i];
+		}
+		n = i;
+
+		if (write_all(w->fd, bufs, lens, n) < 0) {
+			fprintf(stderr, "Short write, samples lost, exiting!\n");
+			do_exit = 1;
+			rtlsdr_cancel_async(dev);
+			pthread_mutex_lock(&w->lock);
+			w->tail = w->head;
+			w->done = 1;
+			pthread_cond_signal(&w->space);
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		w->file_bytes += batch_bytes;
+		for (i = 0; i < n; i++) {
+			if (w->sigmf.on)
+				sigmf_feed(w, bufs[i], lens[i]);
+			w->written += lens[i] / 2;
+		}
+		if (w->sigmf.on) {
+			fflush(w->sigmf.idx);
+			pthread_mutex_lock(&w->lock);
+			i = w->sigmf.ann_meta < w->sigmf.ann_len;
+			pthread_mutex_unlock(&w->lock);
+			if (i && w->written - w->sigmf.meta_at >= (uint64_t)w->sigmf.rate * META_SECS)
+				sigmf_write_meta(w, 0);
+		}
+
+		pthread_mutex_lock(&w->lock);
+		w->tail += n;
+		pthread_cond_signal(&w->space);
+		pthread_mutex_unlock(&w->lock);
+
+		if (w->rotate_bytes && w->file_bytes >= w->rotate_bytes) {
+			sigmf_close(w, 0);
+			writer_close(w);
+			w->file_index++;
+			if (writer_open(w) < 0) {
+				do_exit = 1;
+				rtlsdr_cancel_async(dev);
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+static int writer_init(struct writer *w, unsigned int count, uint32_t buf_len)
+{
+	unsigned int i;
+	w->count = count;
+	w->head = w->tail = 0;
+	w->bufs = calloc(count, sizeof(unsigned char *));
+	w->lens = calloc(count, sizeof(uint32_t));
+	if (!w->bufs || !w->lens)
+		return -1;
+	/* aligned to the page so O_DIRECT can take them as they are */
+	buf_len = (buf_len + WRITE_ALIGN - 1) & ~(WRITE_ALIGN - 1);
+	for (i = 0; i < count; i++) {
+		w->bufs[i] = aligned_buf(buf_len);
+		if (!w->bufs[i])
+			return -1;
+	}
+	if (writer_open(w) < 0)
+		return -1;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->ready, NULL);
+	pthread_cond_init(&w->space, NULL);
+	pthread_create(&w->thread, NULL, writer_thread_fn, w);
+	return 0;
+}
+
+static void writer_push(struct writer *w, unsigned char *buf, uint32_t len, int wait)
+/* the async callback can't stall the usb events and drops on a full
+ * ring, a sync reader waits for the writer instead */
 {
+	unsigned int slot, depth;
+	pthread_mutex_lock(&w->lock);
+	while (wait && !w->done && w->head - w->tail == w->count)
+		pthread_cond_wait(&w->space, &w->lock);
+	if (w->done || w->head - w->tail == w->count) {
+		if (!w->done && !w->dropped)
+			fprintf(stderr, "Writer ring full, samples lost!\n");
+		if (!w->done)
+			annotate_locked(w, ANN_DROP, (int)(len / 2));
+		w->dropped += !w->done;
+		pthread_mutex_unlock(&w->lock);
+		return;
+	}
+	slot = w->head % w->count;
+	pthread_mutex_unlock(&w->lock);
+
+	/* an unpublished slot is only touched here, copy without the lock */
+	memcpy(w->bufs[slot], buf, len);
+	w->lens[slot] = len;
+
+	pthread_mutex_lock(&w->lock);
+	if (!w->pushed && w->sigmf.on)
+		w->sigmf.start_time = wall_time() - (double)(len / 2) / w->sigmf.rate;
+	w->head++;
+	w->pushed += len / 2;
+	depth = w->head - w->tail;
+	if (depth > w->high_water)
+		w->high_water = depth;
+	pthread_cond_signal(&w->ready);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void writer_cleanup(struct writer *w)
+/* flushes whatever is still queued */
+{
+	unsigned int i;
+	pthread_mutex_lock(&w->lock);
+	w->done = 1;
+	pthread_cond_signal(&w->ready);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	sigmf_close(w, 1);
+	writer_close(w);
+	fprintf(stderr, "Writer ring: high water %u of %u buffers, %u dropped\n",
+		w->high_water, w->count, w->dropped);
+	for (i = 0; i < w->count; i++)
+		aligned_free(w->bufs[i]);
+	free(w->bufs);
+	free(w->lens);
+	free(w->sigmf.ann);
+}
+
+static void annotate_gain(int gain)
+{
+	writer_annotate(&writer, ANN_GAIN, gain);
+}
+
+static uint64_t next_sample = 0;
+
+static void rtlsdr_callback(unsigned char *buf, uint32_t len,
+			    const rtlsdr_buffer_info_t *info, void *ctx)
+{
+	uint64_t lost;
 	if (ctx) {
 		if (do_exit)
 			return;
 
+		/* queued buffers the library dropped still count in sample_index,
+		 * lost transfers only show as a flag */
+		lost = info->sample_index > next_sample ? info->sample_index - next_sample : 0;
+		if (lost || (info->flags & (RTLSDR_BUF_DISCONTINUITY | RTLSDR_BUF_XFER_ERROR)))
+			writer_annotate((struct writer *)ctx, ANN_DROP, (int)lost);
+		next_sample = info->sample_index + len / 2;
+
 		if ((bytes_to_read > 0) && (bytes_to_read < (uint64_t)len)) {
 			len = bytes_to_read;
 			do_exit = 1;
@@ -214,34 +952,30 @@ static void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
 		if(target_dbfs < 0) {
 			/* Compute MAX for sample_rate / MAX_HZ IQ samples */
 			int n = len / 2;
-			while(n--){
-				unsigned char *p = buf;
-				unsigned char i, q;
-				int level;
-				if(sample_index > 0){
-					sample_index--;
-				}else{
+			const unsigned char *p = buf;
+			while(n > 0){
+				int chunk, peak;
+				if(sample_index == 0){
+					int max_dbfs = mag_to_dbfs(max_mag);
 					delta_gain = target_dbfs - max_dbfs;
 					update_gain_pid(delta_gain);
 					signal_event(max_event);
 					// fprintf(stderr, "%s: target_dbfs=%d, max_dbfs=%d, delta=%d" "\n", __func__, target_dbfs, max_dbfs, delta_gain);
-					
-					sample_index = max_samples - 1;
-					max_dbfs = DBFS_MIN;
+
+					sample_index = max_samples;
+					max_mag = 0;
 				}
-				i = *p++;
-				q = *p++;
-				level = dbfs_lut[i][q];
-				if(level > max_dbfs){
-					max_dbfs = level;
+				chunk = n < sample_index ? n : sample_index;
+				peak = block_peak(p, chunk);
+				if(peak > max_mag){
+					max_mag = peak;
 				}
-
+				sample_index -= chunk;
+				p += 2 * chunk;
+				n -= chunk;
 			}
 		}
-		if (fwrite(buf, 1, len, (FILE*)ctx) != len) {
-			fprintf(stderr, "Short write, samples lost, exiting!\n");
-			rtlsdr_cancel_async(dev);
-		}
+		writer_push((struct writer *)ctx, buf, len, 0);
 
 		if (bytes_to_read > 0)
 			bytes_to_read -= (uint64_t)len;
@@ -257,17 +991,21 @@ int main(int argc, char **argv)
 	int n_read;
 	int r, opt;
 	int gain = 0;
+	int start_gain = IDX_AUTO_GAIN;
 	int ppm_error = 0;
 	int direct_sampling = 0;
 	int sync_mode = 0;
-	FILE *file;
+	int ring_buffers = DEFAULT_RING_BUFFERS;
+	int async_queue = 0;
+	double latency_ms = 0;
+	double rotate_secs = 0;
 	uint8_t *buffer;
 	int dev_index = 0;
 	int dev_given = 0;
 	uint32_t frequency = 100000000;
 	uint32_t out_block_size = DEFAULT_BUF_LENGTH;
 
-	while ((opt = getopt(argc, argv, "d:f:g:s:b:n:p:SD")) != -1) {
+	while ((opt = getopt(argc, argv, "d:f:g:s:b:n:p:B:r:R:q:L:Y:o:OSD")) != -1) {
 		switch (opt) {
 		case 'd':
 			dev_index = verbose_device_search(optarg);
@@ -291,12 +1029,46 @@ int main(int argc, char **argv)
 		case 'n':
 			bytes_to_read = (uint64_t)atof(optarg) * 2;
 			break;
+		case 'B':
+			ring_buffers = atoi(optarg);
+			break;
+		case 'r':
+			writer.rotate_bytes = (uint64_t)atofs(optarg);
+			break;
+		case 'R':
+			rotate_secs = atoft(optarg);
+			break;
+		case 'O':
+			if (!O_DIRECT)
+				fprintf(stderr, "O_DIRECT not available, ignoring -O\n");
+			writer.direct = O_DIRECT != 0;
+			break;
+		case 'o':
+			if (strcmp("raw", optarg) == 0)
+				writer.sigmf.on = 0;
+			else if (strcmp("sigmf", optarg) == 0)
+				writer.sigmf.on = 1;
+			else {
+				fprintf(stderr, "Unknown output format: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'q':
+			async_queue = atoi(optarg);
+			break;
+		case 'L':
+			latency_ms = atof(optarg);
+			break;
 		case 'S':
 			sync_mode = 1;
 			break;
 		case 'D':
 			direct_sampling = 1;
 			break;
+		case 'Y':
+			if (rt_parse(optarg, rt_stages) < 0)
+				exit(1);
+			break;
 		default:
 			usage();
 			break;
@@ -309,6 +1081,19 @@ int main(int argc, char **argv)
 		filename = argv[optind];
 	}
 
+	if (writer.sigmf.on) {
+		if (strcmp(filename, "-") == 0) {
+			fprintf(stderr, "SigMF output needs a filename\n");
+			exit(1);
+		}
+		/* the name of the recording, not of one of its files */
+		filename = strdup(filename);
+		r = (int)strlen(filename);
+		if (r > 11 && (strcmp(filename + r - 11, ".sigmf-data") == 0 ||
+			       strcmp(filename + r - 11, ".sigmf-meta") == 0))
+			filename[r - 11] = '\0';
+	}
+
 	if(out_block_size < MINIMAL_BUF_LENGTH ||
 	   out_block_size > MAXIMAL_BUF_LENGTH ){
 		fprintf(stderr,
@@ -320,6 +1105,11 @@ int main(int argc, char **argv)
 		out_block_size = DEFAULT_BUF_LENGTH;
 	}
 
+	if (ring_buffers < 2) {
+		fprintf(stderr, "Need at least 2 ring buffers, using %d\n", DEFAULT_RING_BUFFERS);
+		ring_buffers = DEFAULT_RING_BUFFERS;
+	}
+
 	buffer = malloc(out_block_size * sizeof(uint8_t));
 
 	if (!dev_given) {
@@ -330,6 +1120,7 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	verbose_rt_lock();
 	r = rtlsdr_open(&dev, (uint32_t)dev_index);
 	if (r < 0) {
 		fprintf(stderr, "Failed to open rtlsdr device #%d.\n", dev_index);
@@ -365,37 +1156,54 @@ int main(int argc, char **argv)
 			/* Enable manual gain */
 			gain = nearest_gain(dev, gain);
 			verbose_gain_set(dev, gain);
+			start_gain = gain;
 		}else{
 			/* Enable manual AGC */
 			/* target is in tenth of dBFS */
 			initialize_gains();
 			current_gain = gains[gain_index];
 			verbose_gain_set(dev, current_gain);
+			start_gain = current_gain;
 			target_dbfs = gain;
 			max_samples = samp_rate / MAX_HZ;
 			sample_index = max_samples;
-			dbfs_lut_init();
 			max_thread_init();
 		}
 	}
 
 	verbose_ppm_set(dev, ppm_error);
 
+	if (rotate_secs > 0) {
+		/* counted in samples, so the cut lands exactly and nothing is lost */
+		uint64_t bytes = (uint64_t)(rotate_secs * samp_rate) * 2;
+		if (!writer.rotate_bytes || bytes < writer.rotate_bytes)
+			writer.rotate_bytes = bytes;
+	}
+	writer.filename = filename;
+	writer.sigmf.rate = rtlsdr_get_sample_rate(dev);
+	writer.sigmf.frequency = rtlsdr_get_center_freq(dev);
+	writer.sigmf.hw = rtlsdr_get_device_name((uint32_t)dev_index);
 	if(strcmp(filename, "-") == 0) { /* Write samples to stdout */
-		file = stdout;
 #ifdef _WIN32
-		_setmode(_fileno(stdin), _O_BINARY);
+		_setmode(_fileno(stdout), _O_BINARY);
 #endif
-	} else {
-		file = fopen(filename, "wb");
-		if (!file) {
-			fprintf(stderr, "Failed to open %s\n", filename);
-			goto out;
-		}
+		writer.rotate_bytes = 0;
+		writer.direct = 0;
+	}
+	if (writer_init(&writer, (unsigned int)ring_buffers, out_block_size) < 0) {
+		fprintf(stderr, "Failed to start the writer\n");
+		goto out;
 	}
+	writer_annotate(&writer, ANN_GAIN, start_gain);
 
 	/* Reset endpoint before we start reading from it (mandatory) */
 	verbose_reset_buffer(dev);
+	if (!sync_mode) {
+		verbose_async_queue(dev, async_queue);
+		verbose_latency_target(dev, latency_ms);
+	}
+	/* after the writer and gain threads, which would inherit it */
+	verbose_rt_thread("usb", 0);
 
 	if (sync_mode) {
 		fprintf(stderr, "Reading samples in sync mode...\n");
@@ -411,10 +1219,7 @@ int main(int argc, char **argv)
 				do_exit = 1;
 			}
 
-			if (fwrite(buffer, 1, n_read, file) != (size_t)n_read) {
-				fprintf(stderr, "Short write, samples lost, exiting!\n");
-				break;
-			}
+			writer_push(&writer, buffer, (uint32_t)n_read, 1);
 
 			if ((uint32_t)n_read < out_block_size) {
 				fprintf(stderr, "Short read, samples lost, exiting!\n");
@@ -426,8 +1231,8 @@ int main(int argc, char **argv)
 		}
 	} else {
 		fprintf(stderr, "Reading samples in async mode...\n");
-		r = rtlsdr_read_async(dev, rtlsdr_callback, (void *)file,
-				      0, out_block_size);
+		r = rtlsdr_read_async_ex(dev, rtlsdr_callback, (void *)&writer,
+					 0, out_block_size);
 	}
 
 	if (do_exit)
@@ -435,8 +1240,7 @@ int main(int argc, char **argv)
 	else
 		fprintf(stderr, "\nLibrary error %d, exiting...\n", r);
 
-	if (file != stdout)
-		fclose(file);
+	writer_cleanup(&writer);
 
 	rtlsdr_close(dev);
 	free (buffer);
@@ -33,16 +33,22 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #else
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include "getopt/getopt.h"
+#define usleep(x) Sleep(x/1000)
+#define _USE_MATH_DEFINES
 #endif
 
+#include <math.h>
 #include <pthread.h>
 
 #include "rtl-sdr.h"
+#include "rtl-sdr_dsp.h"
 #include "convenience/convenience.h"
+#include "convenience/stats.h"
 
 #ifdef _WIN32
 #pragma comment(lib, "ws2_32.lib")
@@ -51,6 +57,7 @@ typedef int socklen_t;
 
 #else
 #define closesocket close
+#define SD_BOTH SHUT_RDWR
 #define SOCKADDR struct sockaddr
 #define SOCKET int
 #define SOCKET_ERROR -1
@@ -59,21 +66,78 @@ typedef int socklen_t;
 #define DEFAULT_PORT_STR "1234"
 #define DEFAULT_SAMPLE_RATE_HZ 2048000
 #define DEFAULT_MAX_NUM_BUFFERS 500
+#define SEND_BATCH 16
+#define MAX_CLIENTS 16
+
+#define SLOW_DROP 0  /* skip the oldest buffers of a lagging client */
+#define SLOW_KICK 1  /* disconnect a lagging client */
+
+/* Transport extension, classic clients never see it.
+ * A client may send, whether or not it controls the dongle:
+ *   0x40  param = decimation log2 (bits 0-7) | format << 8
+ *   0x41  param = frequency offset in Hz (signed), shifted down to 0 Hz
+ * The stream then switches at a block boundary, starting with a
+ * transport_info_t header.  Samples are frequency shifted, decimated by
+ * the CIC/droop filters from rtl_fm and packed in the requested format:
+ *   0  8 bit offset binary I/Q, the classic layout
+ *   1  16 bit signed little endian I/Q, full scale is 128 << decimation
+ *   2  4 bit offset binary, I in the high nibble and Q in the low one */
+#define XPORT_U8  0
+#define XPORT_S16 1
+#define XPORT_U4  2
+#define XPORT_MAX_DECIM 6
+#define NCO_BITS 10
+#define NCO_SIZE (1 << NCO_BITS)
+
+static int16_t nco_table[NCO_SIZE];
 
-static SOCKET s;
-
-static pthread_t tcp_worker_thread;
-static pthread_t command_thread;
 static pthread_cond_t exit_cond;
 static pthread_mutex_t exit_cond_lock;
 
 static pthread_mutex_t ll_mutex;
 static pthread_cond_t cond;
 
-struct llist {
+struct transport {
+	int active;           /* anything but the classic stream */
+	int header;           /* transport_info_t still to be sent */
+	int format;
+	int decim;
+	int32_t offset;
+	uint32_t phase;
+	int16_t *work;
+	size_t work_size;
+	unsigned char *out;
+	size_t out_size;
+	int16_t lp_hist[XPORT_MAX_DECIM][10];
+	int16_t droop_hist[18];
+};
+
+struct client {
+	SOCKET s;
+	pthread_t tcp_worker_thread;
+	pthread_t command_thread;
+	int used;
+	volatile int dead;    /* either worker hit an error, both will exit */
+	int controller;       /* the only client allowed to send commands */
+	int policy;
+	unsigned int cursor;  /* next pool buffer to send, under ll_mutex */
+	unsigned int dropped;
+	/* transport asked for by the client, under ll_mutex */
+	int xport_format;
+	int xport_decim;
+	int32_t xport_offset;
+	unsigned int xport_gen;
+	unsigned int xp_gen;
+	struct transport xp;  /* owned by tcp_worker */
+	char host[NI_MAXHOST];
+	char port[NI_MAXSERV];
+};
+
+struct pool_buf {
 	char *data;
 	size_t len;
-	struct llist *next;
+	size_t size;
+	int refs;  /* senders still reading from data */
 };
 
 typedef struct { /* structure size must be multiple of 2 bytes */
@@ -82,15 +146,53 @@ typedef struct { /* structure size must be multiple of 2 bytes */
 	uint32_t tuner_gain_count;
 } dongle_info_t;
 
+typedef struct { /* network byte order, like dongle_info_t */
+	char magic[4];
+	uint32_t format;
+	uint32_t decimation;  /* log2 */
+	uint32_t sample_rate; /* after decimation */
+	int32_t offset;
+} transport_info_t;
+
 static rtlsdr_dev_t *dev = NULL;
 
 static int enable_biastee = 0;
 static int global_numq = 0;
-static struct llist *ll_buffers = 0;
 static int llbuf_num = DEFAULT_MAX_NUM_BUFFERS;
 
+/* fixed ring of reusable buffers shared by all clients, under ll_mutex
+ * each client reads it through its own cursor, at most llbuf_num behind */
+static struct pool_buf *pool = NULL;
+static unsigned int pool_size = 0;
+static unsigned int pool_head = 0;  /* next buffer to fill */
+static unsigned int pool_busy = 0;   /* transfers lost to a busy buffer */
+
+static struct client clients[MAX_CLIENTS];
+static int max_clients = 1;
+static int slow_policy = SLOW_DROP;
+
 static volatile int do_exit = 0;
 
+static struct stats_metric stat_depth = STATS_METRIC("rtl_tcp_queue_depth",
+	"Buffers the slowest client is behind", STATS_GAUGE);
+static struct stats_metric stat_dropped = STATS_METRIC("rtl_tcp_dropped_total",
+	"Buffers skipped for slow clients", STATS_COUNTER);
+static struct stats_metric stat_kicked = STATS_METRIC("rtl_tcp_kicked_total",
+	"Slow clients disconnected", STATS_COUNTER);
+static struct stats_metric stat_busy = STATS_METRIC("rtl_tcp_pool_busy_total",
+	"Dongle buffers lost to a pool buffer still being sent", STATS_COUNTER);
+static struct stats_metric stat_clients = STATS_METRIC("rtl_tcp_clients",
+	"Connected clients", STATS_GAUGE);
+static struct stats_metric stat_accepted = STATS_METRIC("rtl_tcp_accepted_total",
+	"Clients accepted", STATS_COUNTER);
+static struct stats_metric stat_sent = STATS_METRIC("rtl_tcp_sent_bytes_total",
+	"Bytes sent to all clients", STATS_COUNTER);
+static struct stats_metric stat_convert = STATS_METRIC("rtl_tcp_convert_seconds",
+	"Time to convert a batch for a client with a negotiated transport", STATS_HIST);
+
+/* the threads -Y can place */
+static const char *rt_stages[] = {"usb", "tcp", "command", NULL};
+
 
 void usage(void)
 {
@@ -101,11 +203,22 @@ void usage(void)
 	printf("\t[-g gain (default: 0 for auto)]\n");
 	printf("\t[-s samplerate in Hz (default: %d Hz)]\n", DEFAULT_SAMPLE_RATE_HZ);
 	printf("\t[-b number of buffers (default: 15, set by library)]\n");
-	printf("\t[-n max number of linked list buffers to keep (default: %d)]\n", DEFAULT_MAX_NUM_BUFFERS);
+	printf("\t[-n max number of buffers to queue per client (default: %d, at least 1)]\n", DEFAULT_MAX_NUM_BUFFERS);
+	printf("\t[-c max number of clients sharing the dongle (default: 1)]\n");
+	printf("\t    the first client controls the dongle, later ones only receive\n");
+	printf("\t[-k disconnect slow receive-only clients instead of dropping buffers]\n");
 	printf("\t[-d device index (default: 0)]\n");
 	printf("\t[-P ppm_error (default: 0)]\n");
 	printf("\t[-T enable bias-T on GPIO PIN 0 (works for rtl-sdr.com v3 dongles)]\n");
 	printf("\t[-D enable direct sampling (default: off)]\n");
+	printf("\t[-q queue depth between usb and the callback (default: 0, off)]\n");
+	printf("\t[-L latency_ms, size the usb transfers to hold at most this (default: off)]\n");
+	printf("\t[-X stats (default: off)]\n");
+	printf("\t    tcp:[addr:]port serves counters to prometheus\n");
+	printf("\t    filename[,seconds] rewrites a file with them, - for stderr\n");
+	printf("\t[-Y scheduling (default: off)]\n");
+	printf("\t    stage=[cpu[-cpu]][:fifo_priority],... and lock to mlock\n");
+	printf("\t    stages: usb, tcp, command (per client)\n");
 	exit(1);
 }
 
@@ -152,107 +265,431 @@ static void sighandler(int signum)
 }
 #endif
 
-void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
+static int pool_init(unsigned int size)
 {
-	if(!do_exit) {
-		struct llist *rpt = (struct llist*)malloc(sizeof(struct llist));
-		rpt->data = (char*)malloc(len);
-		memcpy(rpt->data, buf, len);
-		rpt->len = len;
-		rpt->next = NULL;
+	llbuf_num = (int)size;
+	/* spare room for the batches clients are sending from, see below */
+	size += SEND_BATCH + 1;
+	/* buffers are allocated on first use and then recycled */
+	pool = calloc(size, sizeof(struct pool_buf));
+	if (!pool)
+		return -1;
+	pool_size = size;
+	pool_head = 0;
+	return 0;
+}
 
-		pthread_mutex_lock(&ll_mutex);
+static void pool_reset(void)
+{
+	unsigned int i;
+	pthread_mutex_lock(&ll_mutex);
+	for (i = 0; i < pool_size; i++)
+		pool[i].refs = 0;
+	pool_head = 0;
+	pthread_mutex_unlock(&ll_mutex);
+}
 
-		if (ll_buffers == NULL) {
-			ll_buffers = rpt;
-		} else {
-			struct llist *cur = ll_buffers;
-			int num_queued = 0;
+static void pool_free(void)
+{
+	unsigned int i;
+	for (i = 0; i < pool_size; i++)
+		free(pool[i].data);
+	free(pool);
+	pool = NULL;
+	pool_size = 0;
+}
 
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
-			}
+static void nco_init(void)
+{
+	int i;
+	for (i = 0; i < NCO_SIZE; i++)
+		nco_table[i] = (int16_t)floor(sin(2.0 * M_PI * i / NCO_SIZE) * 16384.0 + 0.5);
+}
 
-			if(llbuf_num && llbuf_num == num_queued-2){
-				struct llist *curelem;
+static unsigned char clamp_u8(int v, int max)
+{
+	if (v < 0)
+		return 0;
+	if (v > max)
+		return (unsigned char)max;
+	return (unsigned char)v;
+}
 
-				free(ll_buffers->data);
-				curelem = ll_buffers->next;
-				free(ll_buffers);
-				ll_buffers = curelem;
-			}
+static void transport_apply(struct client *c)
+/* take the settings the client asked for, caller holds ll_mutex */
+{
+	struct transport *t = &c->xp;
+	t->format = c->xport_format;
+	t->decim = c->xport_decim;
+	t->offset = c->xport_offset;
+	t->active = t->format != XPORT_U8 || t->decim || t->offset;
+	t->header = 1;
+	t->phase = 0;
+	memset(t->lp_hist, 0, sizeof(t->lp_hist));
+	memset(t->droop_hist, 0, sizeof(t->droop_hist));
+	c->xp_gen = c->xport_gen;
+}
 
-			cur->next = rpt;
+static size_t transport_header(struct transport *t, unsigned char *out)
+{
+	transport_info_t info;
+	memcpy(info.magic, "RTLX", 4);
+	info.format = htonl(t->format);
+	info.decimation = htonl(t->decim);
+	info.sample_rate = htonl(rtlsdr_get_sample_rate(dev) >> t->decim);
+	info.offset = (int32_t)htonl((uint32_t)t->offset);
+	memcpy(out, &info, sizeof(info));
+	t->header = 0;
+	return sizeof(info);
+}
 
-			if (num_queued > global_numq)
-				printf("ll+, now %d\n", num_queued);
-			else if (num_queued < global_numq)
-				printf("ll-, now %d\n", num_queued);
+static size_t transport_convert(struct transport *t, struct pool_buf *b, unsigned char *out)
+/* shift, decimate and pack one buffer, returns the bytes written to out */
+{
+	int i, len, re, im, idx;
+	uint32_t rate, step;
+	int16_t *w = t->work;
+	unsigned char *in = (unsigned char *)b->data;
+
+	len = (int)b->len & ~1;
+	for (i = 0; i < len; i++)
+		w[i] = (int16_t)in[i] - 127;
+
+	if (t->offset) {
+		rate = rtlsdr_get_sample_rate(dev);
+		step = rate ? (uint32_t)((int64_t)-t->offset * 4294967296LL / rate) : 0;
+		for (i = 0; i < len; i += 2) {
+			idx = t->phase >> (32 - NCO_BITS);
+			re = w[i] * nco_table[(idx + NCO_SIZE/4) & (NCO_SIZE-1)]
+			   - w[i+1] * nco_table[idx];
+			im = w[i] * nco_table[idx]
+			   + w[i+1] * nco_table[(idx + NCO_SIZE/4) & (NCO_SIZE-1)];
+			w[i]   = (int16_t)(re >> 14);
+			w[i+1] = (int16_t)(im >> 14);
+			t->phase += step;
+		}
+	}
 
-			global_numq = num_queued;
+	if (t->decim) {
+		for (i = 0; i < t->decim; i++)
+			rtlsdr_dsp_fifth_order(w, len >> i, t->lp_hist[i]);
+		len >>= t->decim;
+		rtlsdr_dsp_cic_droop(w, len, t->decim, t->droop_hist);
+	}
+
+	switch (t->format) {
+	case XPORT_S16:
+		for (i = 0; i < len; i++) {
+			out[2*i]   = (unsigned char)(w[i] & 0xff);
+			out[2*i+1] = (unsigned char)((uint16_t)w[i] >> 8);
 		}
-		pthread_cond_signal(&cond);
-		pthread_mutex_unlock(&ll_mutex);
+		return (size_t)len * 2;
+	case XPORT_U4:
+		for (i = 0; i < len; i += 2)
+			out[i/2] = (unsigned char)(clamp_u8((w[i]   >> (t->decim + 4)) + 8, 15) << 4
+			                         | clamp_u8((w[i+1] >> (t->decim + 4)) + 8, 15));
+		return (size_t)len / 2;
+	default:
+		for (i = 0; i < len; i++)
+			out[i] = clamp_u8((w[i] >> t->decim) + 127, 255);
+		return (size_t)len;
+	}
+}
+
+static int transport_command(struct client *c, unsigned char cmd, uint32_t param)
+{
+	int format, decim;
+	pthread_mutex_lock(&ll_mutex);
+	if (cmd == 0x40) {
+		decim = (int)(param & 0xff);
+		format = (int)((param >> 8) & 0xff);
+		if (decim > XPORT_MAX_DECIM || format > XPORT_U4) {
+			pthread_mutex_unlock(&ll_mutex);
+			printf("unsupported transport, decimation %d format %d\n", decim, format);
+			return -1;
+		}
+		printf("set transport decimation %d format %d\n", 1 << decim, format);
+		c->xport_decim = decim;
+		c->xport_format = format;
+	} else {
+		printf("set transport offset %d\n", (int32_t)param);
+		c->xport_offset = (int32_t)param;
 	}
+	c->xport_gen++;
+	pthread_mutex_unlock(&ll_mutex);
+	return 0;
+}
+
+static void client_bye(struct client *c)
+{
+	pthread_mutex_lock(&ll_mutex);
+	c->dead = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&ll_mutex);
+}
+
+void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
+{
+	struct pool_buf *b;
+	struct client *c;
+	int i, lag, num_queued, busy;
+
+	if(do_exit)
+		return;
+
+	pthread_mutex_lock(&ll_mutex);
+	/* make room in every cursor that would fall off the ring */
+	num_queued = 0;
+	for (i = 0; i < max_clients; i++) {
+		c = &clients[i];
+		if (!c->used || c->dead)
+			continue;
+		lag = (int)(pool_head - c->cursor);
+		if (lag >= llbuf_num) {
+			if (c->policy == SLOW_KICK) {
+				printf("client %s %s too slow, disconnecting\n", c->host, c->port);
+				stats_add(&stat_kicked, 1);
+				c->dead = 1;
+				continue;
+			}
+			c->cursor++;
+			c->dropped++;
+			stats_add(&stat_dropped, 1);
+			lag--;
+		}
+		if (lag > num_queued)
+			num_queued = lag;
+	}
+	/* a cursor trails at most llbuf_num buffers and a sender holds at most
+	 * SEND_BATCH behind its cursor, so this is only a safety net */
+	b = &pool[pool_head % pool_size];
+	busy = b->refs;
+	pthread_mutex_unlock(&ll_mutex);
+
+	if (busy) {
+		pool_busy++;
+		stats_add(&stat_busy, 1);
+		return;
+	}
+
+	/* nobody else touches an unpublished slot, copy without the lock */
+	if (b->size < len) {
+		free(b->data);
+		b->data = malloc(len);
+		b->size = b->data ? len : 0;
+		if (!b->data)
+			return;
+	}
+	memcpy(b->data, buf, len);
+	b->len = len;
+
+	pthread_mutex_lock(&ll_mutex);
+	pool_head++;
+
+	if (num_queued > global_numq)
+		printf("ll+, now %d\n", num_queued);
+	else if (num_queued < global_numq)
+		printf("ll-, now %d\n", num_queued);
+
+	global_numq = num_queued;
+	stats_set(&stat_depth, num_queued);
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&ll_mutex);
+}
+
+static int transport_reserve(struct transport *t, struct pool_buf **batch, int n)
+/* size the scratch buffers for a batch, the output is at most 2 bytes a byte */
+{
+	int i;
+	size_t len = 0, in = 0;
+	for (i = 0; i < n; i++) {
+		len += batch[i]->len;
+		if (batch[i]->len > in)
+			in = batch[i]->len;
+	}
+	len = len * 2 + sizeof(transport_info_t);
+	if (t->work_size < in) {
+		free(t->work);
+		t->work = malloc(in * sizeof(int16_t));
+		t->work_size = t->work ? in : 0;
+	}
+	if (t->out_size < len) {
+		free(t->out);
+		t->out = malloc(len);
+		t->out_size = t->out ? len : 0;
+	}
+	return (t->work && t->out) ? 0 : -1;
 }
 
 static void *tcp_worker(void *arg)
 {
-	struct llist *curelem,*prev;
-	int bytesleft,bytessent, index;
+	struct client *c = arg;
+	struct transport *t = &c->xp;
+	SOCKET s = c->s;
+	struct pool_buf *batch[SEND_BATCH];
+#ifdef _WIN32
+	WSABUF iov[SEND_BATCH+1];
+	DWORD sent;
+#else
+	struct iovec iov[SEND_BATCH+1];
+#endif
+	int bytessent, n, i, first, niov, nref;
+	size_t len, hlen;
+	uint64_t t0;
 	struct timeval tv= {1,0};
 	struct timespec ts;
 	struct timeval tp;
 	fd_set writefds;
 	int r = 0;
 
+	verbose_rt_thread("tcp", (int)(c - clients));
 	while(1) {
-		if(do_exit)
+		if(do_exit || c->dead)
 			pthread_exit(0);
 
 		pthread_mutex_lock(&ll_mutex);
 		gettimeofday(&tp, NULL);
 		ts.tv_sec  = tp.tv_sec+5;
 		ts.tv_nsec = tp.tv_usec * 1000;
-		r = pthread_cond_timedwait(&cond, &ll_mutex, &ts);
+		r = 0;
+		while (pool_head == c->cursor && r != ETIMEDOUT && !do_exit && !c->dead)
+			r = pthread_cond_timedwait(&cond, &ll_mutex, &ts);
 		if(r == ETIMEDOUT) {
 			pthread_mutex_unlock(&ll_mutex);
 			printf("worker cond timeout\n");
-			sighandler(0);
+			client_bye(c);
 			pthread_exit(NULL);
 		}
-
-		curelem = ll_buffers;
-		ll_buffers = 0;
+		if (do_exit || c->dead) {
+			pthread_mutex_unlock(&ll_mutex);
+			pthread_exit(NULL);
+		}
+		if (c->xp_gen != c->xport_gen)
+			transport_apply(c);
+
+		/* take up to SEND_BATCH buffers, they stay referenced until sent */
+		n = (int)(pool_head - c->cursor);
+		if (n > SEND_BATCH)
+			n = SEND_BATCH;
+		for (i = 0; i < n; i++) {
+			batch[i] = &pool[(c->cursor + i) % pool_size];
+			batch[i]->refs++;
+		}
+		c->cursor += n;
 		pthread_mutex_unlock(&ll_mutex);
+		nref = n;
+
+		niov = 0;
+		if (t->active) {
+			/* converted into our own buffer, the pool can have them back */
+			if (transport_reserve(t, batch, n) < 0) {
+				printf("worker out of memory\n");
+				n = 0;
+			}
+			t0 = stats_now_us();
+			len = t->header ? transport_header(t, t->out) : 0;
+			for (i = 0; i < n; i++)
+				len += transport_convert(t, batch[i], t->out + len);
+			if (n)
+				stats_time(&stat_convert, stats_now_us() - t0);
+			pthread_mutex_lock(&ll_mutex);
+			for (i = 0; i < nref; i++)
+				batch[i]->refs--;
+			pthread_mutex_unlock(&ll_mutex);
+			nref = 0;
+			if (n == 0) {
+				client_bye(c);
+				pthread_exit(NULL);
+			}
+#ifdef _WIN32
+			iov[0].buf = (char *)t->out;
+			iov[0].len = (ULONG)len;
+#else
+			iov[0].iov_base = t->out;
+			iov[0].iov_len = len;
+#endif
+			niov = 1;
+		} else {
+			if (t->header) {
+				/* back to the classic stream, still acknowledged */
+				if (transport_reserve(t, batch, 0) == 0)
+					hlen = transport_header(t, t->out);
+				else
+					hlen = 0;
+#ifdef _WIN32
+				iov[0].buf = (char *)t->out;
+				iov[0].len = (ULONG)hlen;
+#else
+				iov[0].iov_base = t->out;
+				iov[0].iov_len = hlen;
+#endif
+				niov = hlen ? 1 : 0;
+			}
+			for (i = 0; i < n; i++, niov++) {
+#ifdef _WIN32
+				iov[niov].buf = batch[i]->data;
+				iov[niov].len = (ULONG)batch[i]->len;
+#else
+				iov[niov].iov_base = batch[i]->data;
+				iov[niov].iov_len = batch[i]->len;
+#endif
+			}
+		}
 
-		while(curelem != 0) {
-			bytesleft = curelem->len;
-			index = 0;
+		first = 0;
+		while(first < niov) {
+			FD_ZERO(&writefds);
+			FD_SET(s, &writefds);
+			tv.tv_sec = 1;
+			tv.tv_usec = 0;
 			bytessent = 0;
-			while(bytesleft > 0) {
-				FD_ZERO(&writefds);
-				FD_SET(s, &writefds);
-				tv.tv_sec = 1;
-				tv.tv_usec = 0;
-				r = select(s+1, NULL, &writefds, NULL, &tv);
-				if(r) {
-					bytessent = send(s,  &curelem->data[index], bytesleft, 0);
-					bytesleft -= bytessent;
-					index += bytessent;
+			r = select(s+1, NULL, &writefds, NULL, &tv);
+			if(r) {
+#ifdef _WIN32
+				if (WSASend(s, &iov[first], niov - first, &sent, 0, NULL, NULL) == SOCKET_ERROR)
+					bytessent = SOCKET_ERROR;
+				else
+					bytessent = (int)sent;
+#else
+				bytessent = writev(s, &iov[first], niov - first);
+#endif
+			}
+			if(bytessent == SOCKET_ERROR || do_exit || c->dead) {
+				printf("worker socket bye\n");
+				pthread_mutex_lock(&ll_mutex);
+				for (i = 0; i < nref; i++)
+					batch[i]->refs--;
+				pthread_mutex_unlock(&ll_mutex);
+				client_bye(c);
+				pthread_exit(NULL);
+			}
+			if (bytessent > 0)
+				stats_add(&stat_sent, bytessent);
+			/* skip what went out, a buffer may be partially sent */
+			while (first < niov && bytessent > 0) {
+#ifdef _WIN32
+				if ((ULONG)bytessent < iov[first].len) {
+					iov[first].buf += bytessent;
+					iov[first].len -= bytessent;
+					break;
 				}
-				if(bytessent == SOCKET_ERROR || do_exit) {
-						printf("worker socket bye\n");
-						sighandler(0);
-						pthread_exit(NULL);
+				bytessent -= iov[first].len;
+#else
+				if ((size_t)bytessent < iov[first].iov_len) {
+					iov[first].iov_base = (char *)iov[first].iov_base + bytessent;
+					iov[first].iov_len -= bytessent;
+					break;
 				}
+				bytessent -= iov[first].iov_len;
+#endif
+				first++;
 			}
-			prev = curelem;
-			curelem = curelem->next;
-			free(prev->data);
-			free(prev);
 		}
+
+		pthread_mutex_lock(&ll_mutex);
+		for (i = 0; i < nref; i++)
+			batch[i]->refs--;
+		pthread_mutex_unlock(&ll_mutex);
 	}
 }
 
@@ -287,6 +724,8 @@ struct command{
 #endif
 static void *command_worker(void *arg)
 {
+	struct client *c = arg;
+	SOCKET s = c->s;
 	int left, received = 0;
 	fd_set readfds;
 	struct command cmd={0, 0};
@@ -294,6 +733,7 @@ static void *command_worker(void *arg)
 	int r = 0;
 	uint32_t tmp;
 
+	verbose_rt_thread("command", (int)(c - clients));
 	while(1) {
 		left=sizeof(cmd);
 		while(left >0) {
@@ -304,14 +744,28 @@ static void *command_worker(void *arg)
 			r = select(s+1, &readfds, NULL, NULL, &tv);
 			if(r) {
 				received = recv(s, (char*)&cmd+(sizeof(cmd)-left), left, 0);
-				left -= received;
+				if (received == 0)  /* peer closed */
+					received = SOCKET_ERROR;
+				if (received > 0)
+					left -= received;
 			}
-			if(received == SOCKET_ERROR || do_exit) {
+			if(received == SOCKET_ERROR || do_exit || c->dead) {
 				printf("comm recv bye\n");
-				sighandler(0);
+				client_bye(c);
 				pthread_exit(NULL);
 			}
 		}
+		/* transport settings are per client, anybody may change their own */
+		if (cmd.cmd == 0x40 || cmd.cmd == 0x41) {
+			transport_command(c, cmd.cmd, ntohl(cmd.param));
+			cmd.cmd = 0xff;
+			continue;
+		}
+		if (!c->controller) {
+			printf("ignoring command 0x%02x from receive-only client\n", cmd.cmd);
+			cmd.cmd = 0xff;
+			continue;
+		}
 		switch(cmd.cmd) {
 		case 0x01:
 			printf("set freq %d\n", ntohl(cmd.param));
@@ -377,6 +831,98 @@ static void *command_worker(void *arg)
 	}
 }
 
+static pthread_t dongle_thread;
+static volatile int streaming = 0;
+static uint32_t buf_num = 0;
+
+static void *dongle_thread_fn(void *arg)
+{
+	int r;
+	verbose_rt_thread("usb", 0);
+	r = rtlsdr_read_async(dev, rtlsdr_callback, NULL, buf_num, 0);
+	/* the dongle went away under the clients */
+	if (streaming && !do_exit) {
+		printf("read_async returned %d\n", r);
+		for (r = 0; r < max_clients; r++)
+			if (clients[r].used)
+				client_bye(&clients[r]);
+	}
+	return 0;
+}
+
+static void stream_stop(void)
+{
+	if (!streaming)
+		return;
+	streaming = 0;
+	rtlsdr_cancel_async(dev);
+	pthread_join(dongle_thread, NULL);
+	pool_reset();
+	global_numq = 0;
+	if (pool_busy)
+		printf("dropped %u transfers on busy buffers\n", pool_busy);
+	pool_busy = 0;
+}
+
+static int client_reap(int force)
+/* join clients whose workers are gone, returns how many are left */
+{
+	int i, n = 0;
+	void *status;
+	struct client *c;
+	for (i = 0; i < max_clients; i++) {
+		c = &clients[i];
+		if (!c->used)
+			continue;
+		if (force)
+			client_bye(c);
+		if (!c->dead) {
+			n++;
+			continue;
+		}
+		/* a kicked client can sit in a blocking send, and its command
+		 * thread in recv, neither would see dead before the peer moves */
+		shutdown(c->s, SD_BOTH);
+		pthread_join(c->tcp_worker_thread, &status);
+		pthread_join(c->command_thread, &status);
+		closesocket(c->s);
+		free(c->xp.work);
+		free(c->xp.out);
+		printf("client %s %s gone", c->host, c->port);
+		if (c->dropped)
+			printf(", dropped %u buffers", c->dropped);
+		printf("\n");
+		pthread_mutex_lock(&ll_mutex);
+		c->used = 0;
+		pthread_mutex_unlock(&ll_mutex);
+	}
+	return n;
+}
+
+static struct client *client_add(SOCKET sock)
+{
+	int i, have_controller = 0;
+	struct client *c = NULL;
+	for (i = 0; i < max_clients; i++) {
+		if (clients[i].used)
+			have_controller |= clients[i].controller;
+		else if (!c)
+			c = &clients[i];
+	}
+	if (!c)
+		return NULL;
+	/* the callback walks the clients under ll_mutex */
+	pthread_mutex_lock(&ll_mutex);
+	memset(c, 0, sizeof(struct client));
+	c->s = sock;
+	c->controller = !have_controller;
+	c->policy = c->controller ? SLOW_DROP : slow_policy;
+	c->cursor = pool_head;
+	c->used = 1;
+	pthread_mutex_unlock(&ll_mutex);
+	return c;
+}
+
 int main(int argc, char **argv)
 {
 	int r, opt, i;
@@ -389,21 +935,22 @@ int main(int argc, char **argv)
 	struct addrinfo  hints = { 0 };
 	char hostinfo[NI_MAXHOST];
 	char portinfo[NI_MAXSERV];
-	char remhostinfo[NI_MAXHOST];
-	char remportinfo[NI_MAXSERV];
 	int aiErr;
-	uint32_t buf_num = 0;
 	int dev_index = 0;
 	int dev_given = 0;
 	int gain = 0;
 	int ppm_error = 0;
 	int direct_sampling = 0;
-	struct llist *curelem,*prev;
+	int async_queue = 0;
+	double latency_ms = 0;
+	char *stats_spec = NULL;
 	pthread_attr_t attr;
-	void *status;
 	struct timeval tv = {1,0};
 	struct linger ling = {1,0};
 	SOCKET listensocket = 0;
+	SOCKET s;
+	struct client *c;
+	int nclients;
 	socklen_t rlen;
 	fd_set readfds;
 	u_long blockmode = 1;
@@ -415,7 +962,7 @@ int main(int argc, char **argv)
 	struct sigaction sigact, sigign;
 #endif
 
-	while ((opt = getopt(argc, argv, "a:p:f:g:s:b:n:d:P:TD")) != -1) {
+	while ((opt = getopt(argc, argv, "a:p:f:g:s:b:n:c:d:P:q:L:X:Y:kTD")) != -1) {
 		switch (opt) {
 		case 'd':
 			dev_index = verbose_device_search(optarg);
@@ -441,6 +988,34 @@ int main(int argc, char **argv)
 			break;
 		case 'n':
 			llbuf_num = atoi(optarg);
+			/* the ring is allocated up front, so 0 can't mean unlimited */
+			if (llbuf_num < 1) {
+				fprintf(stderr, "Buffers to queue must be at least 1\n");
+				exit(1);
+			}
+			break;
+		case 'c':
+			max_clients = atoi(optarg);
+			if (max_clients < 1 || max_clients > MAX_CLIENTS) {
+				fprintf(stderr, "Clients must be between 1 and %d\n", MAX_CLIENTS);
+				exit(1);
+			}
+			break;
+		case 'k':
+			slow_policy = SLOW_KICK;
+			break;
+		case 'q':
+			async_queue = atoi(optarg);
+			break;
+		case 'L':
+			latency_ms = atof(optarg);
+			break;
+		case 'X':
+			stats_spec = optarg;
+			break;
+		case 'Y':
+			if (rt_parse(optarg, rt_stages) < 0)
+				exit(1);
 			break;
 		case 'P':
 			ppm_error = atoi(optarg);
@@ -468,6 +1043,7 @@ int main(int argc, char **argv)
 	    exit(1);
 	}
 
+	verbose_rt_lock();
 	rtlsdr_open(&dev, (uint32_t)dev_index);
 	if (NULL == dev) {
 	fprintf(stderr, "Failed to open rtlsdr device #%d.\n", dev_index);
@@ -529,6 +1105,9 @@ int main(int argc, char **argv)
 	if (enable_biastee)
 		fprintf(stderr, "activated bias-T on GPIO PIN 0\n");
 
+	verbose_async_queue(dev, async_queue);
+	verbose_latency_target(dev, latency_ms);
+
 	/* Reset endpoint before we start reading from it (mandatory) */
 	r = rtlsdr_reset_buffer(dev);
 	if (r < 0)
@@ -540,6 +1119,26 @@ int main(int argc, char **argv)
 	pthread_cond_init(&cond, NULL);
 	pthread_cond_init(&exit_cond, NULL);
 
+	if (pool_init((unsigned int)llbuf_num) < 0) {
+		fprintf(stderr, "Failed to allocate buffer pool.\n");
+		exit(1);
+	}
+	nco_init();
+
+	if (stats_spec) {
+		stats_register(&stat_clients);
+		stats_register(&stat_accepted);
+		stats_register(&stat_depth);
+		stats_register(&stat_dropped);
+		stats_register(&stat_kicked);
+		stats_register(&stat_busy);
+		stats_register(&stat_sent);
+		stats_register(&stat_convert);
+		stats_device(dev);
+		if (stats_start(stats_spec) < 0)
+			fprintf(stderr, "Failed to start the stats, continuing without\n");
+	}
+
 	hints.ai_flags  = AI_PASSIVE; /* Server mode. */
 	hints.ai_family = PF_UNSPEC;  /* IPv4 or IPv6. */
 	hints.ai_socktype = SOCK_STREAM;
@@ -584,36 +1183,61 @@ int main(int argc, char **argv)
 	r = fcntl(listensocket, F_SETFL, r | O_NONBLOCK);
 #endif
 
-	while(1) {
-		printf("listening...\n");
-		printf("Use the device argument 'rtl_tcp=%s:%s' in OsmoSDR "
-		       "(gr-osmosdr) source\n"
-		       "to receive samples in GRC and control "
-		       "rtl_tcp parameters (frequency, gain, ...).\n",
-		       hostinfo, portinfo);
-		listen(listensocket,1);
-
-		while(1) {
-			FD_ZERO(&readfds);
-			FD_SET(listensocket, &readfds);
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-			r = select(listensocket+1, &readfds, NULL, NULL, &tv);
-			if(do_exit) {
-				goto out;
-			} else if(r) {
-				rlen = sizeof(remote);
-				s = accept(listensocket,(struct sockaddr *)&remote, &rlen);
-				break;
-			}
+	printf("listening...\n");
+	printf("Use the device argument 'rtl_tcp=%s:%s' in OsmoSDR "
+	       "(gr-osmosdr) source\n"
+	       "to receive samples in GRC and control "
+	       "rtl_tcp parameters (frequency, gain, ...).\n",
+	       hostinfo, portinfo);
+	listen(listensocket, max_clients);
+
+	while(!do_exit) {
+		nclients = client_reap(0);
+		stats_set(&stat_clients, nclients);
+		/* the stream runs while anybody is listening */
+		if (!nclients && streaming) {
+			stream_stop();
+			printf("all threads dead..\n");
+			printf("listening...\n");
+		}
+		if (nclients >= max_clients) {
+			usleep(100000);
+			continue;
 		}
 
+		FD_ZERO(&readfds);
+		FD_SET(listensocket, &readfds);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		r = select(listensocket+1, &readfds, NULL, NULL, &tv);
+		if(do_exit || r <= 0)
+			continue;
+		rlen = sizeof(remote);
+		s = accept(listensocket,(struct sockaddr *)&remote, &rlen);
+		if (s == SOCKET_ERROR)
+			continue;
+
+#ifdef _WIN32
+		blockmode = 0;
+		ioctlsocket(s, FIONBIO, &blockmode);
+#else
+		r = fcntl(s, F_GETFL, 0);
+		fcntl(s, F_SETFL, r & ~O_NONBLOCK);
+#endif
 		setsockopt(s, SOL_SOCKET, SO_LINGER, (char *)&ling, sizeof(ling));
 
+		c = client_add(s);
+		if (!c) {
+			closesocket(s);
+			continue;
+		}
 		getnameinfo((struct sockaddr *)&remote, rlen,
-			    remhostinfo, NI_MAXHOST,
-			    remportinfo, NI_MAXSERV, NI_NUMERICSERV);
-		printf("client accepted! %s %s\n", remhostinfo, remportinfo);
+			    c->host, NI_MAXHOST,
+			    c->port, NI_MAXSERV, NI_NUMERICSERV);
+		printf("client accepted! %s %s%s\n", c->host, c->port,
+		       c->controller ? "" : " (receive only)");
+		stats_add(&stat_accepted, 1);
+		stats_set(&stat_clients, nclients + 1);
 
 		memset(&dongle_info, 0, sizeof(dongle_info));
 		memcpy(&dongle_info.magic, "RTL0", 4);
@@ -632,36 +1256,23 @@ int main(int argc, char **argv)
 
 		pthread_attr_init(&attr);
 		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-		r = pthread_create(&tcp_worker_thread, &attr, tcp_worker, NULL);
-		r = pthread_create(&command_thread, &attr, command_worker, NULL);
+		r = pthread_create(&c->tcp_worker_thread, &attr, tcp_worker, c);
+		r = pthread_create(&c->command_thread, &attr, command_worker, c);
 		pthread_attr_destroy(&attr);
 
-		r = rtlsdr_read_async(dev, rtlsdr_callback, NULL, buf_num, 0);
-
-		pthread_join(tcp_worker_thread, &status);
-		pthread_join(command_thread, &status);
-
-		closesocket(s);
-
-		printf("all threads dead..\n");
-		curelem = ll_buffers;
-		ll_buffers = 0;
-
-		while(curelem != 0) {
-			prev = curelem;
-			curelem = curelem->next;
-			free(prev->data);
-			free(prev);
+		if (!streaming) {
+			streaming = 1;
+			r = pthread_create(&dongle_thread, NULL, dongle_thread_fn, NULL);
 		}
-
-		do_exit = 0;
-		global_numq = 0;
 	}
 
-out:
+	client_reap(1);
+	stream_stop();
+
+	stats_stop();
 	rtlsdr_close(dev);
+	pool_free();
 	closesocket(listensocket);
-	closesocket(s);
 #ifdef _WIN32
 	WSACleanup();
 #endif
@@ -77,6 +77,9 @@ static enum {
 static int do_exit = 0;
 static rtlsdr_dev_t *dev = NULL;
 
+/* the threads -Y can place */
+static const char *rt_stages[] = {"usb", NULL};
+
 static uint32_t samp_rate = DEFAULT_SAMPLE_RATE;
 
 static uint32_t total_samples = 0;
@@ -96,7 +99,10 @@ void usage(void)
 		"\t[-p[seconds] enable PPM error measurement (default: 10 seconds)]\n"
 #endif
 		"\t[-b output_block_size (default: 16 * 16384)]\n"
-		"\t[-S force sync output (default: async)]\n");
+		"\t[-q queue depth between usb and the callback (default: 0, off)]\n"
+		"\t[-S force sync output (default: async)]\n"
+		"\t[-Y scheduling (default: off)]\n"
+		"\t    usb=[cpu][:fifo_priority] and lock to mlock, comma separated\n");
 	exit(1);
 }
 
@@ -309,14 +315,16 @@ int main(int argc, char **argv)
 #endif
 	int n_read, r, opt, i;
 	int sync_mode = 0;
+	int async_queue = 0;
 	uint8_t *buffer;
+	rtlsdr_stream_stats_t stats;
 	int dev_index = 0;
 	int dev_given = 0;
 	uint32_t out_block_size = DEFAULT_BUF_LENGTH;
 	int count;
 	int gains[100];
 
-	while ((opt = getopt(argc, argv, "d:s:b:tp::Sh")) != -1) {
+	while ((opt = getopt(argc, argv, "d:s:b:tp::q:Y:Sh")) != -1) {
 		switch (opt) {
 		case 'd':
 			dev_index = verbose_device_search(optarg);
@@ -336,9 +344,16 @@ int main(int argc, char **argv)
 			if (optarg)
 				ppm_duration = atoi(optarg);
 			break;
+		case 'q':
+			async_queue = atoi(optarg);
+			break;
 		case 'S':
 			sync_mode = 1;
 			break;
+		case 'Y':
+			if (rt_parse(optarg, rt_stages) < 0) {
+				exit(1);}
+			break;
 		case 'h':
 		default:
 			usage();
@@ -367,6 +382,7 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	verbose_rt_lock();
 	r = rtlsdr_open(&dev, (uint32_t)dev_index);
 	if (r < 0) {
 		fprintf(stderr, "Failed to open rtlsdr device #%d.\n", dev_index);
@@ -408,6 +424,8 @@ int main(int argc, char **argv)
 
 	/* Reset endpoint before we start reading from it (mandatory) */
 	verbose_reset_buffer(dev);
+	if (!sync_mode)
+		verbose_async_queue(dev, async_queue);
 
 	if ((test_mode == PPM_BENCHMARK) && !sync_mode) {
 		fprintf(stderr, "Reporting PPM error measurement every %u seconds...\n", ppm_duration);
@@ -421,6 +439,7 @@ int main(int argc, char **argv)
 				"further output, everything is fine.\n\n");
 	}
 
+	verbose_rt_thread("usb", 0);
 	if (sync_mode) {
 		fprintf(stderr, "Reading samples in sync mode...\n");
 		fprintf(stderr, "(Samples are being lost but not reported.)\n");
@@ -450,6 +469,17 @@ int main(int argc, char **argv)
 	else
 		fprintf(stderr, "\nLibrary error %d, exiting...\n", r);
 
+	if (!sync_mode && rtlsdr_get_stream_stats(dev, &stats) == 0)
+		fprintf(stderr, "Transfers: %llu buffers, %llu failed, %llu discontinuities, %llu short\n",
+			(unsigned long long)stats.buffers,
+			(unsigned long long)stats.xfer_errors,
+			(unsigned long long)stats.discontinuities,
+			(unsigned long long)stats.short_xfers);
+	if (async_queue > 0)
+		fprintf(stderr, "Queue: %llu buffers dropped, high water %u of %i\n",
+			(unsigned long long)stats.queue_drops,
+			stats.queue_high_water, async_queue);
+
 exit:
 	rtlsdr_close(dev);
 	free (buffer);
@@ -24,6 +24,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "rtlsdr_i2c.h"
@@ -253,14 +254,11 @@ static void shadow_store(struct r82xx_priv *priv, uint8_t reg, const uint8_t *va
 	memcpy(&priv->regs[r], val, len);
 }
 
-static int r82xx_write(struct r82xx_priv *priv, uint8_t reg, const uint8_t *val,
-		       unsigned int len)
+static int r82xx_xfer(struct r82xx_priv *priv, uint8_t reg, const uint8_t *val,
+		      unsigned int len)
 {
 	int rc, size, pos = 0;
 
-	/* Store the shadow registers */
-	shadow_store(priv, reg, val, len);
-
 	do {
 		if (len > priv->cfg->max_i2c_msg_len - 1)
 			size = priv->cfg->max_i2c_msg_len - 1;
@@ -290,6 +288,68 @@ static int r82xx_write(struct r82xx_priv *priv, uint8_t reg, const uint8_t *val,
 	return 0;
 }
 
+static int r82xx_batch_store(struct r82xx_priv *priv, uint8_t reg,
+			     const uint8_t *val, unsigned int len)
+/* only shadow registers can wait, returns 0 for anything else */
+{
+	int r = reg - REG_SHADOW_START;
+	unsigned int i;
+
+	if (r < 0 || r + len > NUM_REGS)
+		return 0;
+
+	for (i = 0; i < len; i++) {
+		if (priv->regs[r + i] == val[i])
+			continue;
+		priv->regs[r + i] = val[i];
+		priv->dirty |= 1u << (r + i);
+	}
+
+	return 1;
+}
+
+static int r82xx_batch_flush(struct r82xx_priv *priv)
+/* one burst per run of adjacent changed registers */
+{
+	uint32_t dirty = priv->dirty;
+	int rc, first, last;
+
+	priv->dirty = 0;
+	for (first = 0; first < NUM_REGS; first = last + 1) {
+		last = first;
+		if (!(dirty & (1u << first)))
+			continue;
+		while (last + 1 < NUM_REGS && (dirty & (1u << (last + 1))))
+			last++;
+		rc = r82xx_xfer(priv, first + REG_SHADOW_START,
+				&priv->regs[first], last - first + 1);
+		if (rc < 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+static int r82xx_write(struct r82xx_priv *priv, uint8_t reg, const uint8_t *val,
+		       unsigned int len)
+{
+	int rc;
+
+	if (priv->batch) {
+		if (r82xx_batch_store(priv, reg, val, len))
+			return 0;
+		/* keep the order with what is already waiting */
+		rc = r82xx_batch_flush(priv);
+		if (rc < 0)
+			return rc;
+	}
+
+	/* Store the shadow registers */
+	shadow_store(priv, reg, val, len);
+
+	return r82xx_xfer(priv, reg, val, len);
+}
+
 static int r82xx_write_reg(struct r82xx_priv *priv, uint8_t reg, uint8_t val)
 {
 	return r82xx_write(priv, reg, &val, 1);
@@ -331,6 +391,13 @@ static int r82xx_read(struct r82xx_priv *priv, uint8_t reg, uint8_t *val, int le
 	int rc, i;
 	uint8_t *p = &priv->buf[1];
 
+	/* the chip has to see the batched writes first */
+	if (priv->batch) {
+		rc = r82xx_batch_flush(priv);
+		if (rc < 0)
+			return rc;
+	}
+
 	priv->buf[0] = reg;
 
 	rc = rtlsdr_i2c_write_fn(priv->rtl_dev, priv->cfg->i2c_addr, priv->buf, 1);
@@ -570,6 +637,102 @@ static int r82xx_set_pll(struct r82xx_priv *priv, uint32_t freq)
 	return rc;
 }
 
+/*
+ * fast hop: tunes that locked are remembered and replayed as register values
+ */
+
+static const struct {
+	uint8_t reg;
+	uint8_t mask;
+} r82xx_hop_regs[R82XX_HOP_REGS] = {
+	{ 0x08, 0x3f }, { 0x09, 0x3f }, { 0x10, 0xfb }, { 0x12, 0xe8 },
+	{ 0x14, 0xff }, { 0x15, 0xff }, { 0x16, 0xff }, { 0x17, 0x08 },
+	{ 0x1a, 0xcf }, { 0x1b, 0xff },
+};
+
+static struct r82xx_hop *r82xx_hop_find(struct r82xx_priv *priv, uint32_t lo_freq)
+{
+	struct r82xx_hop *hop;
+	unsigned int i;
+
+	for (i = 0; i < priv->hop_count; i++) {
+		hop = &priv->hops[i];
+		if (hop->lo_freq == lo_freq && hop->xtal == priv->cfg->xtal &&
+		    hop->xtal_cap_sel == priv->xtal_cap_sel)
+			return hop;
+	}
+
+	return NULL;
+}
+
+static void r82xx_hop_store(struct r82xx_priv *priv, struct r82xx_hop *hop,
+			    uint32_t lo_freq)
+/* hop is a stale entry for the same tune or NULL for the next slot */
+{
+	int i;
+
+	if (!priv->hop_count)
+		return;
+	if (!hop)
+		hop = &priv->hops[priv->hop_next++ % priv->hop_count];
+
+	hop->lo_freq = lo_freq;
+	hop->xtal = priv->cfg->xtal;
+	hop->xtal_cap_sel = priv->xtal_cap_sel;
+	for (i = 0; i < R82XX_HOP_REGS; i++)
+		hop->val[i] = priv->regs[r82xx_hop_regs[i].reg - REG_SHADOW_START];
+}
+
+static int r82xx_hop_apply(struct r82xx_priv *priv, const struct r82xx_hop *hop)
+/* same end state and lock check as r82xx_set_mux() + r82xx_set_pll() */
+{
+	int rc, i;
+	uint8_t val, data[3];
+
+	for (i = 0; i < R82XX_HOP_REGS; i++) {
+		val = hop->val[i];
+		/* pll autotune = 128kHz until it has locked */
+		if (r82xx_hop_regs[i].reg == 0x1a)
+			val &= ~0x0c;
+		rc = r82xx_write_reg_mask(priv, r82xx_hop_regs[i].reg, val,
+					  r82xx_hop_regs[i].mask);
+		if (rc < 0)
+			return rc;
+	}
+
+	rc = r82xx_read(priv, 0x00, data, sizeof(data));
+	if (rc < 0)
+		return rc;
+
+	priv->has_lock = (data[2] & 0x40) != 0;
+	if (!priv->has_lock)
+		return 0;
+
+	/* set pll autotune = 8kHz */
+	return r82xx_write_reg_mask(priv, 0x1a, 0x08, 0x08);
+}
+
+int r82xx_set_fast_hop(struct r82xx_priv *priv, int on, unsigned int hops)
+{
+	free(priv->hops);
+	priv->hops = NULL;
+	priv->hop_count = 0;
+	priv->hop_next = 0;
+	priv->fast_hop = on;
+
+	if (!on || !hops)
+		return 0;
+
+	priv->hops = calloc(hops, sizeof(struct r82xx_hop));
+	if (!priv->hops) {
+		priv->fast_hop = 0;
+		return -1;
+	}
+	priv->hop_count = hops;
+
+	return 0;
+}
+
 static int r82xx_sysfreq_sel(struct r82xx_priv *priv, uint32_t freq,
 			     enum r82xx_tuner_type type,
 			     uint32_t delsys)
@@ -1101,8 +1264,9 @@ int r82xx_set_bandwidth(struct r82xx_priv *priv, int bw, uint32_t rate)
 
 int r82xx_set_freq(struct r82xx_priv *priv, uint32_t freq)
 {
-	int rc = -1;
+	int rc = -1, rc2;
 	int is_rtlsdr_blog_v4;
+	struct r82xx_hop *hop;
 	uint32_t upconvert_freq;
 	uint32_t lo_freq;
 	uint8_t air_cable1_in;
@@ -1120,13 +1284,31 @@ int r82xx_set_freq(struct r82xx_priv *priv, uint32_t freq)
 
 	lo_freq = upconvert_freq + priv->int_freq;
 
-	rc = r82xx_set_mux(priv, lo_freq);
-	if (rc < 0)
-		goto err;
+	/* in fast hop mode registers only go out if they change, in bursts */
+	if (priv->fast_hop) {
+		priv->batch = 1;
+		priv->dirty = 0;
+	}
 
-	rc = r82xx_set_pll(priv, lo_freq);
-	if (rc < 0 || !priv->has_lock)
-		goto err;
+	hop = r82xx_hop_find(priv, lo_freq);
+	if (hop) {
+		rc = r82xx_hop_apply(priv, hop);
+		if (rc < 0)
+			goto err;
+	}
+
+	/* never tuned here, or the old values didn't lock this time */
+	if (!hop || !priv->has_lock) {
+		rc = r82xx_set_mux(priv, lo_freq);
+		if (rc < 0)
+			goto err;
+
+		rc = r82xx_set_pll(priv, lo_freq);
+		if (rc < 0 || !priv->has_lock)
+			goto err;
+
+		r82xx_hop_store(priv, hop, lo_freq);
+	}
 
 	if (is_rtlsdr_blog_v4) {
 		/* determine if notch filters should be on or off notches are turned OFF
@@ -1136,7 +1318,7 @@ int r82xx_set_freq(struct r82xx_priv *priv, uint32_t freq)
 		rc = r82xx_write_reg_mask(priv, 0x17, open_d, 0x08);
 
 		if (rc < 0)
-			return rc;
+			goto err;
 
 		/* select tuner band based on frequency and only switch if there is a band change
 		 *(to avoid excessive register writes when tuning rapidly)
@@ -1151,6 +1333,12 @@ int r82xx_set_freq(struct r82xx_priv *priv, uint32_t freq)
 			cable_2_in = (band == HF) ? 0x08 : 0x00;
 			rc = r82xx_write_reg_mask(priv, 0x06, cable_2_in, 0x08);
 
+			if (rc < 0)
+				goto err;
+
+			/* the input switch goes out before the gpio changes */
+			rc = r82xx_batch_flush(priv);
+
 			if (rc < 0)
 				goto err;
 
@@ -1191,6 +1379,12 @@ int r82xx_set_freq(struct r82xx_priv *priv, uint32_t freq)
 	}
 
 err:
+	if (priv->batch) {
+		rc2 = r82xx_batch_flush(priv);
+		priv->batch = 0;
+		if (rc >= 0)
+			rc = rc2;
+	}
 	if (rc < 0)
 		fprintf(stderr, "%s: failed=%d\n", __FUNCTION__, rc);
 	return rc;